@@ -873,6 +873,7 @@ int option_state_allocate (ptr, file, line)
 		memset (*ptr, 0, size);
 		(*ptr) -> universe_count = universe_count;
 		(*ptr) -> refcnt = 1;
+		option_state_touch (*ptr);
 		rc_register (file, line,
 			     ptr, *ptr, (*ptr) -> refcnt, 0, RC_MISC);
 		return 1;
@@ -944,6 +945,9 @@ int option_state_dereference (ptr, file, line)
 #endif
 	}
 
+	/* Drop anything parsed but never looked at. */
+	forget_pending_options (options);
+
 	/* Loop through the per-universe state. */
 	for (i = 0; i < options -> universe_count; i++)
 		if (options -> universes [i] &&
@@ -1116,6 +1120,8 @@ int packet_dereference (ptr, file, line)
 
 	if (packet -> options)
 		option_state_dereference (&packet -> options, file, line);
+	if (packet -> memo)
+		expr_memo_free (&packet -> memo);
 	if (packet -> interface)
 		interface_dereference (&packet -> interface, MDL);
 	if (packet -> shared_network)
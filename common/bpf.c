@@ -198,6 +198,57 @@ struct bpf_insn dhcp_bpf_filter [] = {
 	BPF_STMT (BPF_RET + BPF_K, 0),
 };
 
+/*
+ * Stricter version of the above, used by the server when the
+ * strict-packet-filter parameter is set.   Besides the port, the packet
+ * must be long enough to hold the fixed BOOTP header, must be a
+ * BOOTREQUEST and must have a sane hardware address length; everything
+ * else is dropped in the kernel instead of by do_packet() and
+ * validate_packet().
+ */
+struct bpf_insn dhcp_bpf_strict_filter [] = {
+	/* Make sure this is an IP packet... */
+	BPF_STMT (BPF_LD + BPF_H + BPF_ABS, 12),
+	BPF_JUMP (BPF_JMP + BPF_JEQ + BPF_K, ETHERTYPE_IP, 0, 14),
+
+	/* Make sure it's a UDP packet... */
+	BPF_STMT (BPF_LD + BPF_B + BPF_ABS, 23),
+	BPF_JUMP (BPF_JMP + BPF_JEQ + BPF_K, IPPROTO_UDP, 0, 12),
+
+	/* Make sure this isn't a fragment... */
+	BPF_STMT(BPF_LD + BPF_H + BPF_ABS, 20),
+	BPF_JUMP(BPF_JMP + BPF_JSET + BPF_K, 0x1fff, 10, 0),
+
+	/* Get the IP header length... */
+	BPF_STMT (BPF_LDX + BPF_B + BPF_MSH, 14),
+
+	/* Make sure it's to the right port... */
+	BPF_STMT (BPF_LD + BPF_H + BPF_IND, 16),
+	BPF_JUMP (BPF_JMP + BPF_JEQ + BPF_K, 67, 0, 7),             /* patch */
+
+	/* Make sure the UDP payload holds a whole BOOTP header... */
+	BPF_STMT (BPF_LD + BPF_H + BPF_IND, 18),
+	BPF_JUMP (BPF_JMP + BPF_JGE + BPF_K,
+		  8 + DHCP_FIXED_NON_UDP, 0, 5),
+
+	/* ...that it's a request... */
+	BPF_STMT (BPF_LD + BPF_B + BPF_IND, 22),
+	BPF_JUMP (BPF_JMP + BPF_JEQ + BPF_K, BOOTREQUEST, 0, 3),
+
+	/* ...and that the hardware address fits in chaddr. */
+	BPF_STMT (BPF_LD + BPF_B + BPF_IND, 24),
+	BPF_JUMP (BPF_JMP + BPF_JGT + BPF_K, 16, 1, 0),
+
+	/* If we passed all the tests, ask for the whole packet. */
+	BPF_STMT (BPF_RET + BPF_K, (u_int)-1),
+
+	/* Otherwise, drop it. */
+	BPF_STMT (BPF_RET + BPF_K, 0),
+};
+
+int dhcp_bpf_strict_filter_len =
+	sizeof dhcp_bpf_strict_filter / sizeof (struct bpf_insn);
+
 #if defined(RELAY_PORT)
 /*
  * For relay port extension
@@ -343,7 +394,11 @@ void if_register_receive (info)
 		p.bf_insns = bpf_fddi_filter;
 	} else
 #endif /* DEC_FDDI */
-	p.bf_insns = dhcp_bpf_filter;
+	if (strict_packet_filter) {
+		p.bf_len = dhcp_bpf_strict_filter_len;
+		p.bf_insns = dhcp_bpf_strict_filter;
+	} else
+		p.bf_insns = dhcp_bpf_filter;
 
         /* Patch the server port into the BPF  program...
 	   XXX changes to filter program may require changes
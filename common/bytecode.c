@@ -0,0 +1,648 @@
+/* bytecode.c
+
+   Flat code for boolean expressions, so that class matching doesn't have
+   to walk (and allocate its way through) the expression tree. */
+
+/*
+ * Copyright (c) 2018 by Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND ISC DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS.  IN NO EVENT SHALL ISC BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+ * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *   Internet Systems Consortium, Inc.
+ *   950 Charter Street
+ *   Redwood City, CA 94063
+ *   <info@isc.org>
+ *   https://www.isc.org/
+ *
+ */
+
+/*! \file common/bytecode.c
+ *
+ * \page bytecode expression bytecode
+ *
+ * evaluate_boolean_expression() and friends in tree.c walk the expression
+ * tree recursively, and most data valued nodes allocate a buffer for their
+ * result, so even a simple "match if substring (option vendor-class-
+ * identifier, 0, 4) = "MSFT"" costs several allocations per class per
+ * packet.
+ *
+ * expression_compile() turns a boolean expression into a short array of
+ * instructions for a small stack machine.  The stack holds views of data
+ * rather than copies: an option's value points into its option cache,
+ * substring and suffix just move the view, and so on, so that running the
+ * program needs no allocation unless an option's value has to be computed
+ * from an expression.  Option codes are looked up once when the program
+ * is built, and subexpressions that only involve constants are evaluated
+ * at that time and replaced with their result.
+ *
+ * Only the operators that are commonly used in match statements are
+ * supported; an expression that uses any other operator is left alone
+ * and is evaluated by walking the tree as before.  The results are the
+ * same either way, with one exception: extract-int8 of an empty string is
+ * NULL here, where the tree walker reads a byte past its end.
+ */
+
+#include "dhcpd.h"
+
+enum expr_vm_op {
+	VM_PUSH,		/* Push consts [a]. */
+	VM_OPTION,		/* Push the value of option a in universe p. */
+	VM_EXISTS,		/* Push whether option a in universe p is set. */
+	VM_HARDWARE,		/* Push the client's hardware type and address. */
+	VM_PACKET,		/* Push b bytes of the raw packet from a. */
+	VM_SUBSTRING,		/* Replace top by b of its bytes from a. */
+	VM_SUFFIX,		/* Replace top by its last a bytes. */
+	VM_EXTRACT_INT8,	/* Replace top by the integer it begins with. */
+	VM_EXTRACT_INT16,
+	VM_EXTRACT_INT32,
+	VM_EQUAL,		/* Replace the top two by their equality. */
+	VM_NOT_EQUAL,
+	VM_NOT,			/* Replace top by its negation. */
+	VM_AND,			/* Unless top is true, set it NULL and jump
+				   to a; otherwise pop it. */
+	VM_OR,			/* If top is true, jump to a. */
+	VM_OR_END,		/* Replace the top two by their disjunction. */
+	VM_KNOWN,		/* Push whether the client has a host decl. */
+	VM_STATIC,		/* Push whether the lease is static. */
+	VM_CHECK		/* Push whether the packet is in collection p. */
+};
+
+/* Kinds of value on the stack. */
+#define VM_NULL		0
+#define VM_BOOLEAN	1
+#define VM_NUMERIC	2
+#define VM_DATA		3
+
+struct expr_cell {
+	int kind;
+	unsigned long num;
+	const unsigned char *data;
+	unsigned len;
+};
+
+struct expr_insn {
+	enum expr_vm_op op;
+	unsigned long a, b;
+	void *p;
+};
+
+struct expr_program {
+	unsigned count;
+	unsigned depth;
+	struct expr_insn *code;
+	struct expr_cell *consts;
+};
+
+/* Limits on what we are willing to compile. */
+#define VM_MAX_CODE	128
+#define VM_MAX_CONSTS	64
+#define VM_MAX_STACK	16
+
+/* Options whose values have to be evaluated get a buffer; this is how
+   many of those a single run can hold on to before giving up and leaving
+   the expression to the tree walker. */
+#define VM_MAX_TEMPS	4
+
+struct expr_compiler {
+	struct expr_insn code [VM_MAX_CODE];
+	struct expr_cell consts [VM_MAX_CONSTS];
+	unsigned count;
+	unsigned nconsts;
+	unsigned sp;
+	unsigned depth;
+};
+
+struct expr_vm {
+	struct packet *packet;
+	struct lease *lease;
+	struct client_state *client_state;
+	struct option_state *in_options;
+	struct option_state *cfg_options;
+	struct binding_scope **scope;
+	struct data_string temps [VM_MAX_TEMPS];
+	unsigned ntemps;
+	unsigned char hwbuf [1 + sizeof (((struct dhcp_packet *)0) -> chaddr)];
+};
+
+/* Run the instructions from start up to end.   Returns the new stack
+   pointer, or -1 if the program can't be finished without help. */
+
+static int expr_vm_exec (struct expr_insn *code, struct expr_cell *consts,
+			 unsigned start, unsigned end, struct expr_vm *vm,
+			 struct expr_cell *stack, int sp)
+{
+	struct expr_insn *insn;
+	struct expr_cell *top, *left;
+	struct option_cache *oc;
+	struct universe *universe;
+	struct data_string *ds;
+	struct packet *packet = vm -> packet;
+	unsigned pc, len;
+	int equal;
+
+	for (pc = start; pc < end; pc++) {
+		insn = &code [pc];
+		top = sp > 0 ? &stack [sp - 1] : NULL;
+
+		switch (insn -> op) {
+		      case VM_PUSH:
+			stack [sp++] = consts [insn -> a];
+			break;
+
+		      case VM_OPTION:
+		      case VM_EXISTS:
+			top = &stack [sp++];
+			memset (top, 0, sizeof *top);
+			universe = insn -> p;
+			oc = NULL;
+			if (vm -> in_options && universe -> lookup_func)
+				oc = ((*universe -> lookup_func)
+				      (universe, vm -> in_options, insn -> a));
+			if (insn -> op == VM_EXISTS) {
+				/* Finding the option is enough; its value
+				   isn't needed. */
+				top -> kind = VM_BOOLEAN;
+				top -> num = oc != NULL;
+			} else if (oc && oc -> data.data != NULL) {
+				top -> kind = VM_DATA;
+				top -> data = oc -> data.data;
+				top -> len = oc -> data.len;
+			} else if (oc && oc -> expression) {
+				if (vm -> ntemps == VM_MAX_TEMPS)
+					return -1;
+				ds = &vm -> temps [vm -> ntemps];
+				memset (ds, 0, sizeof *ds);
+				if (evaluate_data_expression
+				    (ds, packet, vm -> lease,
+				     vm -> client_state, vm -> in_options,
+				     vm -> cfg_options, vm -> scope,
+				     oc -> expression, MDL)) {
+					vm -> ntemps++;
+					top -> kind = VM_DATA;
+					top -> data = ds -> data;
+					top -> len = ds -> len;
+				}
+			}
+			break;
+
+		      case VM_HARDWARE:
+			top = &stack [sp++];
+			memset (top, 0, sizeof *top);
+			if (vm -> client_state) {
+				top -> kind = VM_DATA;
+				top -> data = vm -> client_state -> interface ->
+					hw_address.hbuf;
+				top -> len = vm -> client_state -> interface ->
+					hw_address.hlen;
+			} else if (packet != NULL && packet -> raw != NULL) {
+				if (packet -> raw -> hlen >
+				    sizeof (packet -> raw -> chaddr)) {
+					log_error ("data: hardware: invalid "
+						   "hlen (%d)\n",
+						   packet -> raw -> hlen);
+					break;
+				}
+				vm -> hwbuf [0] = packet -> raw -> htype;
+				memcpy (&vm -> hwbuf [1], packet -> raw -> chaddr,
+					packet -> raw -> hlen);
+				top -> kind = VM_DATA;
+				top -> data = vm -> hwbuf;
+				top -> len = packet -> raw -> hlen + 1;
+			} else if (vm -> lease != NULL) {
+				top -> kind = VM_DATA;
+				top -> data = vm -> lease -> hardware_addr.hbuf;
+				top -> len = vm -> lease -> hardware_addr.hlen;
+			} else
+				log_error ("data: hardware: no raw packet or "
+					   "lease is available");
+			break;
+
+		      case VM_PACKET:
+			top = &stack [sp++];
+			memset (top, 0, sizeof *top);
+			if (!packet || !packet -> raw) {
+				log_error ("data: packet: raw packet not "
+					   "available");
+				break;
+			}
+			if (insn -> a < packet -> packet_length) {
+				len = packet -> packet_length - insn -> a;
+				if (len > insn -> b)
+					len = insn -> b;
+				top -> kind = VM_DATA;
+				top -> data = ((unsigned char *)packet -> raw) +
+					insn -> a;
+				top -> len = len;
+			}
+			break;
+
+		      case VM_SUBSTRING:
+			if (top -> kind != VM_DATA)
+				break;
+			if (top -> len > insn -> a) {
+				top -> data += insn -> a;
+				top -> len -= insn -> a;
+				if (top -> len > insn -> b)
+					top -> len = insn -> b;
+			} else {
+				top -> data = NULL;
+				top -> len = 0;
+			}
+			break;
+
+		      case VM_SUFFIX:
+			if (top -> kind != VM_DATA)
+				break;
+			if (top -> len > insn -> a) {
+				top -> data += top -> len - insn -> a;
+				top -> len = insn -> a;
+			}
+			break;
+
+		      case VM_EXTRACT_INT8:
+		      case VM_EXTRACT_INT16:
+		      case VM_EXTRACT_INT32:
+			if (top -> kind != VM_DATA)
+				break;
+			len = (insn -> op == VM_EXTRACT_INT8 ? 1 :
+			       insn -> op == VM_EXTRACT_INT16 ? 2 : 4);
+			if (top -> len < len) {
+				top -> kind = VM_NULL;
+				break;
+			}
+			if (len == 1)
+				top -> num = top -> data [0];
+			else if (len == 2)
+				top -> num = getUShort (top -> data);
+			else
+				top -> num = getULong (top -> data);
+			top -> kind = VM_NUMERIC;
+			break;
+
+		      case VM_EQUAL:
+		      case VM_NOT_EQUAL:
+			left = &stack [sp - 2];
+			if (left -> kind != VM_NULL && top -> kind != VM_NULL) {
+				if (left -> kind != top -> kind)
+					equal = 0;
+				else if (top -> kind == VM_DATA)
+					equal = (left -> len == top -> len &&
+						 (top -> len == 0 ||
+						  !memcmp (left -> data,
+							   top -> data,
+							   top -> len)));
+				else
+					equal = left -> num == top -> num;
+			} else
+				equal = (left -> kind == VM_NULL &&
+					 top -> kind == VM_NULL);
+			sp--;
+			left -> kind = VM_BOOLEAN;
+			left -> num = (insn -> op == VM_EQUAL) ? equal : !equal;
+			break;
+
+		      case VM_NOT:
+			if (top -> kind != VM_NULL)
+				top -> num = !top -> num;
+			break;
+
+		      case VM_AND:
+			if (top -> kind == VM_NULL || !top -> num) {
+				top -> kind = VM_NULL;
+				pc = insn -> a - 1;
+			} else
+				sp--;
+			break;
+
+		      case VM_OR:
+			if (top -> kind != VM_NULL && top -> num)
+				pc = insn -> a - 1;
+			break;
+
+		      case VM_OR_END:
+			left = &stack [sp - 2];
+			if (top -> kind != VM_NULL) {
+				left -> kind = VM_BOOLEAN;
+				left -> num = top -> num;
+			} else if (left -> kind != VM_NULL)
+				left -> num = 0;
+			sp--;
+			break;
+
+		      case VM_KNOWN:
+			top = &stack [sp++];
+			memset (top, 0, sizeof *top);
+			if (packet) {
+				top -> kind = VM_BOOLEAN;
+				top -> num = packet -> known;
+			}
+			break;
+
+		      case VM_STATIC:
+			top = &stack [sp++];
+			memset (top, 0, sizeof *top);
+			top -> kind = VM_BOOLEAN;
+			top -> num = (vm -> lease &&
+				      (vm -> lease -> flags & STATIC_LEASE));
+			break;
+
+		      case VM_CHECK:
+			top = &stack [sp++];
+			memset (top, 0, sizeof *top);
+			top -> kind = VM_BOOLEAN;
+			top -> num = check_collection (packet, vm -> lease,
+						       insn -> p);
+			break;
+		}
+	}
+	return sp;
+}
+
+static int emit (struct expr_compiler *c, enum expr_vm_op op,
+		 unsigned long a, unsigned long b, void *p, int effect)
+{
+	struct expr_insn *insn;
+
+	if (c -> count == VM_MAX_CODE)
+		return 0;
+	c -> sp += effect;
+	if (c -> sp > VM_MAX_STACK)
+		return 0;
+	if (c -> sp > c -> depth)
+		c -> depth = c -> sp;
+
+	insn = &c -> code [c -> count++];
+	insn -> op = op;
+	insn -> a = a;
+	insn -> b = b;
+	insn -> p = p;
+	return 1;
+}
+
+static int emit_const (struct expr_compiler *c, struct expr_cell *cell)
+{
+	if (c -> nconsts == VM_MAX_CONSTS)
+		return 0;
+	c -> consts [c -> nconsts] = *cell;
+	return emit (c, VM_PUSH, c -> nconsts++, 0, NULL, 1);
+}
+
+static int const_int (struct expression *expr, unsigned long *value)
+{
+	if (expr -> op != expr_const_int)
+		return 0;
+	*value = expr -> data.const_int;
+	return 1;
+}
+
+/* Compile expr, setting *constp if its value doesn't depend on the
+   packet.   Returns zero if expr uses an operator we can't handle. */
+
+static int compile_node (struct expr_compiler *c, struct expression *expr,
+			 int *constp)
+{
+	struct expr_cell cell, stack [VM_MAX_STACK];
+	struct expr_vm vm;
+	unsigned start = c -> count, nconsts = c -> nconsts, sp = c -> sp;
+	unsigned long a, b;
+	unsigned jump;
+	int c0 = 0, c1 = 0;
+	int fold = 1;
+
+	*constp = 0;
+	memset (&cell, 0, sizeof cell);
+
+	switch (expr -> op) {
+	      case expr_const_data:
+		cell.kind = VM_DATA;
+		cell.data = expr -> data.const_data.data;
+		cell.len = expr -> data.const_data.len;
+		*constp = 1;
+		return emit_const (c, &cell);
+
+	      case expr_const_int:
+		cell.kind = VM_NUMERIC;
+		cell.num = expr -> data.const_int;
+		*constp = 1;
+		return emit_const (c, &cell);
+
+	      case expr_option:
+		return emit (c, VM_OPTION, expr -> data.option -> code, 0,
+			     expr -> data.option -> universe, 1);
+
+	      case expr_exists:
+		return emit (c, VM_EXISTS, expr -> data.exists -> code, 0,
+			     expr -> data.exists -> universe, 1);
+
+	      case expr_hardware:
+		return emit (c, VM_HARDWARE, 0, 0, NULL, 1);
+
+	      case expr_packet:
+		if (!const_int (expr -> data.packet.offset, &a) ||
+		    !const_int (expr -> data.packet.len, &b))
+			return 0;
+		return emit (c, VM_PACKET, a, b, NULL, 1);
+
+	      case expr_known:
+		return emit (c, VM_KNOWN, 0, 0, NULL, 1);
+
+	      case expr_static:
+		return emit (c, VM_STATIC, 0, 0, NULL, 1);
+
+	      case expr_check:
+		return emit (c, VM_CHECK, 0, 0, expr -> data.check, 1);
+
+	      case expr_substring:
+		if (!is_data_expression (expr -> data.substring.expr) ||
+		    !const_int (expr -> data.substring.offset, &a) ||
+		    !const_int (expr -> data.substring.len, &b) ||
+		    !compile_node (c, expr -> data.substring.expr, &c0) ||
+		    !emit (c, VM_SUBSTRING, a, b, NULL, 0))
+			return 0;
+		break;
+
+	      case expr_suffix:
+		if (!is_data_expression (expr -> data.suffix.expr) ||
+		    !const_int (expr -> data.suffix.len, &a) ||
+		    !compile_node (c, expr -> data.suffix.expr, &c0) ||
+		    !emit (c, VM_SUFFIX, a, 0, NULL, 0))
+			return 0;
+		break;
+
+	      case expr_extract_int8:
+	      case expr_extract_int16:
+	      case expr_extract_int32:
+		if (!is_data_expression (expr -> data.extract_int) ||
+		    !compile_node (c, expr -> data.extract_int, &c0) ||
+		    !emit (c, (expr -> op == expr_extract_int8
+			       ? VM_EXTRACT_INT8
+			       : expr -> op == expr_extract_int16
+			       ? VM_EXTRACT_INT16 : VM_EXTRACT_INT32),
+			   0, 0, NULL, 0))
+			return 0;
+		break;
+
+	      case expr_equal:
+	      case expr_not_equal:
+		if (!compile_node (c, expr -> data.equal [0], &c0) ||
+		    !compile_node (c, expr -> data.equal [1], &c1) ||
+		    !emit (c, (expr -> op == expr_equal
+			       ? VM_EQUAL : VM_NOT_EQUAL), 0, 0, NULL, -1))
+			return 0;
+		fold = c0 && c1;
+		break;
+
+	      case expr_not:
+		if (!is_boolean_expression (expr -> data.not) ||
+		    !compile_node (c, expr -> data.not, &c0) ||
+		    !emit (c, VM_NOT, 0, 0, NULL, 0))
+			return 0;
+		break;
+
+	      case expr_and:
+	      case expr_or:
+		if (!is_boolean_expression (expr -> data.and [0]) ||
+		    !is_boolean_expression (expr -> data.and [1]) ||
+		    !compile_node (c, expr -> data.and [0], &c0))
+			return 0;
+		jump = c -> count;
+		if (expr -> op == expr_and) {
+			if (!emit (c, VM_AND, 0, 0, NULL, -1) ||
+			    !compile_node (c, expr -> data.and [1], &c1))
+				return 0;
+		} else {
+			if (!emit (c, VM_OR, 0, 0, NULL, 0) ||
+			    !compile_node (c, expr -> data.and [1], &c1) ||
+			    !emit (c, VM_OR_END, 0, 0, NULL, -1))
+				return 0;
+		}
+		/* Either way the jump skips the rest of the expression. */
+		c -> code [jump].a = c -> count;
+		fold = c0 && c1;
+		break;
+
+	      default:
+		return 0;
+	}
+
+	if (!fold || !c0)
+		return 1;
+
+	/* Everything below us is constant, so work out the value now and
+	   replace the code for it by a constant. */
+	memset (&vm, 0, sizeof vm);
+	if (expr_vm_exec (c -> code, c -> consts, start, c -> count,
+			  &vm, stack, 0) != 1)
+		return 1;
+	c -> count = start;
+	c -> nconsts = nconsts;
+	c -> sp = sp;
+	*constp = 1;
+	return emit_const (c, &stack [0]);
+}
+
+/*!
+ * \brief Compile a boolean expression for faster evaluation
+ *
+ * If every operator in the expression is supported, a program is built
+ * and attached to it, and evaluate_boolean_expression() will run that
+ * instead of walking the tree.  Otherwise the expression is unchanged.
+ *
+ * \param expr the expression; it must not change after this is called
+ */
+void expression_compile (struct expression *expr)
+{
+	struct expr_compiler *c;
+	struct expr_program *program;
+	int constp;
+	char *p;
+
+	if (expr == NULL || expr -> program != NULL ||
+	    !is_boolean_expression (expr))
+		return;
+
+	c = dmalloc (sizeof *c, MDL);
+	if (c == NULL)
+		return;
+
+	if (compile_node (c, expr, &constp)) {
+		program = dmalloc (sizeof *program +
+				   c -> count * sizeof *program -> code +
+				   c -> nconsts * sizeof *program -> consts,
+				   MDL);
+		if (program != NULL) {
+			p = (char *)(program + 1);
+			program -> count = c -> count;
+			program -> depth = c -> depth;
+			program -> code = (struct expr_insn *)p;
+			memcpy (program -> code, c -> code,
+				c -> count * sizeof *program -> code);
+			p += c -> count * sizeof *program -> code;
+			program -> consts = (struct expr_cell *)p;
+			memcpy (program -> consts, c -> consts,
+				c -> nconsts * sizeof *program -> consts);
+			expr -> program = program;
+		}
+	}
+	dfree (c, MDL);
+}
+
+/*!
+ * \brief Run a compiled boolean expression
+ *
+ * The arguments are those of evaluate_boolean_expression().
+ *
+ * \return 1 if the expression has a value, which is stored in *result;
+ *         0 if it is NULL; or -1 if the tree has to be walked after all
+ */
+int expression_program_run (struct expr_program *program, int *result,
+			    struct packet *packet, struct lease *lease,
+			    struct client_state *client_state,
+			    struct option_state *in_options,
+			    struct option_state *cfg_options,
+			    struct binding_scope **scope)
+{
+	struct expr_cell stack [VM_MAX_STACK];
+	struct expr_vm vm;
+	unsigned i;
+	int sp, status;
+
+	vm.packet = packet;
+	vm.lease = lease;
+	vm.client_state = client_state;
+	vm.in_options = in_options;
+	vm.cfg_options = cfg_options;
+	vm.scope = scope;
+	vm.ntemps = 0;
+
+	sp = expr_vm_exec (program -> code, program -> consts,
+			   0, program -> count, &vm, stack, 0);
+	if (sp < 0)
+		status = -1;
+	else if (stack [0].kind == VM_NULL)
+		status = 0;
+	else {
+		*result = stack [0].num;
+		status = 1;
+	}
+
+	for (i = 0; i < vm.ntemps; i++)
+		data_string_forget (&vm.temps [i], MDL);
+	return status;
+}
+
+void expression_program_free (struct expr_program **program)
+{
+	dfree (*program, MDL);
+	*program = NULL;
+}
@@ -48,6 +48,11 @@ omapi_object_type_t *dhcp_type_subnet;
 omapi_object_type_t *dhcp_type_control;
 dhcp_control_object_t *dhcp_control_object;
 
+/* Lets the server answer for values that only it keeps, such as its
+   statistics, when they are asked for through the control object. */
+isc_result_t (*dhcp_control_get_value_hook) (omapi_data_string_t *,
+					     omapi_value_t **);
+
 void dhcp_common_objects_setup ()
 {
 	isc_result_t status;
@@ -181,6 +186,7 @@ isc_result_t dhcp_group_set_value  (omapi_object_t *h,
 				return DHCP_R_BADPARSE;
 			}
 			end_parse (&parse);
+			discard_scope_templates ();
 			return ISC_R_SUCCESS;
 		} else
 			return DHCP_R_INVALIDARG;
@@ -481,6 +487,12 @@ isc_result_t dhcp_control_get_value (omapi_object_t *h, omapi_object_t *id,
 		return omapi_make_int_value (value,
 					     name, (int)control -> state, MDL);
 
+	if (dhcp_control_get_value_hook) {
+		status = (*dhcp_control_get_value_hook) (name, value);
+		if (status != ISC_R_NOTFOUND)
+			return status;
+	}
+
 	/* Try to find some inner object that can take the value. */
 	if (h -> inner && h -> inner -> type -> get_value) {
 		status = ((*(h -> inner -> type -> get_value))
@@ -1167,6 +1167,8 @@ intern(char *atom, enum dhcp_token dfv) {
 				return MAX_RESPONSE_DELAY;
 			if (!strcasecmp (atom + 3, "-unacked-updates"))
 				return MAX_UNACKED_UPDATES;
+			if (!strcasecmp (atom + 3, "-batched-updates"))
+				return MAX_BATCHED_UPDATES;
 		}
 		if (!strncasecmp (atom + 1, "in-", 3)) {
 			if (!strcasecmp (atom + 4, "balance"))
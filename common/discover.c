@@ -42,6 +42,7 @@
 struct interface_info *interfaces, *dummy_interfaces, *fallback_interface;
 int interfaces_invalidated;
 int quiet_interface_discovery;
+int strict_packet_filter;
 u_int16_t local_port;
 u_int16_t remote_port;
 u_int16_t relay_port = 0;
@@ -1083,29 +1084,21 @@ void reinitialize_interfaces ()
 	interfaces_invalidated = 1;
 }
 
-isc_result_t got_one (h)
-	omapi_object_t *h;
+/* Read one packet from an interface, and check that it is at least long
+   enough to hold a BOOTP header.   On success, *ip is the interface the
+   packet arrived on, which may differ from the one it was read from when
+   the interface index is taken from IP_PKTINFO. */
+
+static isc_result_t receive_one (struct interface_info **ip,
+				 unsigned char *buf, unsigned size,
+				 unsigned *len, struct sockaddr_in *from,
+				 struct hardware *hfrom)
 {
-	struct sockaddr_in from;
-	struct hardware hfrom;
-	struct iaddr ifrom;
 	int result;
-	union {
-		unsigned char packbuf [4095]; /* Packet input buffer.
-					 	 Must be as large as largest
-						 possible MTU. */
-		struct dhcp_packet packet;
-	} u;
-	struct interface_info *ip;
 
-	if (h -> type != dhcp_type_interface)
-		return DHCP_R_INVALIDARG;
-	ip = (struct interface_info *)h;
-
-      again:
 	if ((result =
-	     receive_packet (ip, u.packbuf, sizeof u, &from, &hfrom)) < 0) {
-		log_error ("receive_packet failed on %s: %m", ip -> name);
+	     receive_packet (*ip, buf, size, from, hfrom)) < 0) {
+		log_error ("receive_packet failed on %s: %m", (*ip) -> name);
 		return ISC_R_UNEXPECTED;
 	}
 	if (result == 0)
@@ -1128,25 +1121,382 @@ isc_result_t got_one (h)
 		/* We retrieve the ifindex from the unused hfrom variable */
 		unsigned int ifindex;
 
-		memcpy(&ifindex, hfrom.hbuf, sizeof (ifindex));
+		memcpy(&ifindex, hfrom->hbuf, sizeof (ifindex));
 
 		/*
 		 * Seek forward from the first interface to find the matching
 		 * source interface by interface index.
 		 */
-		ip = interfaces;
-		while ((ip != NULL) && (if_nametoindex(ip->name) != ifindex))
-			ip = ip->next;
-		if (ip == NULL)
+		*ip = interfaces;
+		while ((*ip != NULL) && (if_nametoindex((*ip)->name) != ifindex))
+			*ip = (*ip)->next;
+		if (*ip == NULL)
 			return ISC_R_NOTFOUND;
 	}
 #endif
 
+	*len = (unsigned)result;
+	return ISC_R_SUCCESS;
+}
+
+/* Receive queueing.
+
+   Normally each packet is handed to the server as soon as it is read.
+   When the server falls behind, as it does when every client on a large
+   network comes back after a power failure at once, the packets it cares
+   most about - renewals from clients that already have a lease, which are
+   cheap to answer and keep working clients working - wait in the socket
+   buffer behind a flood of DISCOVERs, and are dropped with them when it
+   overflows.
+
+   If rx_queue_length is set, got_one() instead reads everything that is
+   waiting (up to that many packets) into per-interface queues, one for
+   each priority, looking only at the fixed header and the message type
+   option to choose the queue.  It then processes a batch of packets from
+   the queues, taking up to rx_queue_weights[] packets from each in turn so
+   that the lower priorities are slowed but not starved, and schedules
+   itself to carry on after the dispatcher has had a look at the other
+   sockets.  When a queue is full, either the new packet is dropped or, by
+   default, the oldest packet of a lower priority makes room for it. */
+
+int rx_queue_length;
+int rx_queue_drop_policy = RXQ_DROP_LOWEST;
+struct rx_queue_stats rx_queue_stats;
+
+static int rx_queue_weights [RXQ_CLASSES] = { 8, 4, 1 };
+
+static const char *rx_queue_class_names [RXQ_CLASSES] = {
+	"high", "normal", "low"
+};
+
+static int rx_queue_classify (const struct dhcp_packet *packet, unsigned len)
+{
+	const unsigned char *opt, *end;
+	int type = 0;
+
+	if (packet -> op != BOOTREQUEST ||
+	    len < DHCP_FIXED_NON_UDP + 4 ||
+	    memcmp (packet -> options, DHCP_OPTIONS_COOKIE, 4))
+		return RXQ_LOW;
+
+	opt = &packet -> options [4];
+	end = (const unsigned char *)packet + len;
+	while (opt < end && *opt != DHO_END) {
+		if (*opt == DHO_PAD) {
+			opt++;
+			continue;
+		}
+		if (opt + 2 > end || opt + 2 + opt [1] > end)
+			break;
+		if (*opt == DHO_DHCP_MESSAGE_TYPE && opt [1] == 1) {
+			type = opt [2];
+			break;
+		}
+		opt += 2 + opt [1];
+	}
+
+	switch (type) {
+	      case DHCPREQUEST:
+		/* RENEWING and REBINDING clients fill in ciaddr. */
+		if (packet -> ciaddr.s_addr != 0)
+			return RXQ_HIGH;
+		return RXQ_NORMAL;
+
+	      case DHCPRELEASE:
+	      case DHCPDECLINE:
+		return RXQ_HIGH;
+
+	      case DHCPINFORM:
+	      case DHCPLEASEQUERY:
+		return RXQ_NORMAL;
+
+	      default:
+		return RXQ_LOW;
+	}
+}
+
+/* Is there more to read on this interface without blocking? */
+static int rx_queue_readable (struct interface_info *ip)
+{
+	struct timeval t0;
+	fd_set r;
+
+	if (ip -> rbuf_offset != ip -> rbuf_len)
+		return 1;
+	if (ip -> rfdesc < 0 || ip -> rfdesc >= FD_SETSIZE)
+		return 0;
+
+	FD_ZERO (&r);
+	FD_SET (ip -> rfdesc, &r);
+	t0.tv_sec = t0.tv_usec = 0;
+	return select (ip -> rfdesc + 1, &r, NULL, NULL, &t0) > 0;
+}
+
+static struct rx_entry *rx_entry_get (struct rx_queue *q)
+{
+	struct rx_entry *e;
+
+	if (q -> free) {
+		e = q -> free;
+		q -> free = e -> next;
+		e -> next = NULL;
+		return e;
+	}
+
+	/* One more than the queue length, so that a packet can be read
+	   and looked at even when the queue is full. */
+	if (q -> allocated > (unsigned)rx_queue_length)
+		return NULL;
+	e = dmalloc (sizeof *e, MDL);
+	if (e)
+		q -> allocated++;
+	return e;
+}
+
+static void rx_entry_put (struct rx_queue *q, struct rx_entry *e)
+{
+	if (e -> ip)
+		interface_dereference (&e -> ip, MDL);
+	e -> next = q -> free;
+	q -> free = e;
+}
+
+static void rx_enqueue (struct rx_queue *q, int class, struct rx_entry *e)
+{
+	e -> next = NULL;
+	if (q -> tail [class])
+		q -> tail [class] -> next = e;
+	else
+		q -> head [class] = e;
+	q -> tail [class] = e;
+	q -> count++;
+	rx_queue_stats.depth++;
+	rx_queue_stats.queued [class]++;
+	if (q -> count > rx_queue_stats.high_water)
+		rx_queue_stats.high_water = q -> count;
+}
+
+static struct rx_entry *rx_dequeue (struct rx_queue *q, int class)
+{
+	struct rx_entry *e;
+
+	e = q -> head [class];
+	if (e) {
+		q -> head [class] = e -> next;
+		if (q -> head [class] == NULL)
+			q -> tail [class] = NULL;
+		e -> next = NULL;
+		q -> count--;
+		rx_queue_stats.depth--;
+	}
+	return e;
+}
+
+/* Queue a packet, making room for it according to the drop policy if
+   the queue is full.  Returns zero if the packet was dropped. */
+
+static int rx_queue_admit (struct rx_queue *q, int class, struct rx_entry *e)
+{
+	struct rx_entry *victim;
+	int c;
+
+	if (q -> count >= (unsigned)rx_queue_length) {
+		victim = NULL;
+		if (rx_queue_drop_policy == RXQ_DROP_LOWEST) {
+			for (c = RXQ_CLASSES - 1; c > class; c--) {
+				if (q -> head [c]) {
+					victim = rx_dequeue (q, c);
+					break;
+				}
+			}
+		}
+		if (victim == NULL) {
+			rx_queue_stats.dropped [class]++;
+			rx_entry_put (q, e);
+			return 0;
+		}
+		rx_queue_stats.dropped [c]++;
+		rx_entry_put (q, victim);
+	}
+	rx_enqueue (q, class, e);
+	return 1;
+}
+
+static void rx_queue_service (void *vip)
+{
+	struct interface_info *ip = vip;
+	struct rx_queue *q = ip -> rx_queue;
+	struct rx_entry *e;
+	struct iaddr ifrom;
+	int budget, class, n;
+	struct timeval tv;
+
+	if (q == NULL)
+		return;
+
+	budget = RXQ_SERVICE_BATCH;
+	while (budget > 0 && q -> count > 0) {
+		for (class = 0; class < RXQ_CLASSES && budget > 0; class++) {
+			for (n = 0; n < rx_queue_weights [class] &&
+				    budget > 0; n++) {
+				e = rx_dequeue (q, class);
+				if (e == NULL)
+					break;
+				budget--;
+
+				if (bootp_packet_handler) {
+					ifrom.len = 4;
+					memcpy (ifrom.iabuf,
+						&e -> from.sin_addr, ifrom.len);
+					(*bootp_packet_handler)
+						(e -> ip, &e -> u.packet,
+						 e -> len, e -> from.sin_port,
+						 ifrom, &e -> hfrom);
+				}
+				rx_entry_put (q, e);
+			}
+		}
+	}
+
+	/* Come back for the rest once the dispatcher has had a chance to
+	   look at everything else. */
+	if (q -> count > 0) {
+		tv.tv_sec = cur_tv.tv_sec;
+		tv.tv_usec = cur_tv.tv_usec;
+		add_timeout (&tv, rx_queue_service, ip,
+			     (tvref_t)interface_reference,
+			     (tvunref_t)interface_dereference);
+	}
+}
+
+static isc_result_t got_one_queued (struct interface_info *ip)
+{
+	struct rx_queue *q;
+	struct rx_entry *e;
+	struct interface_info *rip;
+	isc_result_t status;
+	int n;
+
+	if (ip -> rx_queue == NULL) {
+		ip -> rx_queue = dmalloc (sizeof *q, MDL);
+		if (ip -> rx_queue == NULL) {
+			log_error ("No memory for receive queue on %s.",
+				   ip -> name);
+			return ISC_R_NOMEMORY;
+		}
+	}
+	q = ip -> rx_queue;
+
+	status = ISC_R_SUCCESS;
+	for (n = 0; n < rx_queue_length; n++) {
+		if (n > 0 && !rx_queue_readable (ip))
+			break;
+		if ((e = rx_entry_get (q)) == NULL) {
+			status = ISC_R_NOMEMORY;
+			break;
+		}
+
+		rip = ip;
+		status = receive_one (&rip, e -> u.packbuf, sizeof e -> u,
+				      &e -> len, &e -> from, &e -> hfrom);
+		if (status != ISC_R_SUCCESS) {
+			rx_entry_put (q, e);
+			break;
+		}
+		interface_reference (&e -> ip, rip, MDL);
+
+		rx_queue_admit (q, rx_queue_classify (&e -> u.packet,
+						      e -> len), e);
+	}
+
+	rx_queue_service (ip);
+	return status;
+}
+
+static void rx_queue_free (struct interface_info *ip)
+{
+	struct rx_queue *q = ip -> rx_queue;
+	struct rx_entry *e;
+	int class;
+
+	if (q == NULL)
+		return;
+	ip -> rx_queue = NULL;
+
+	for (class = 0; class < RXQ_CLASSES; class++) {
+		while ((e = rx_dequeue (q, class)) != NULL)
+			rx_entry_put (q, e);
+	}
+	while ((e = q -> free) != NULL) {
+		q -> free = e -> next;
+		dfree (e, MDL);
+	}
+	dfree (q, MDL);
+}
+
+isc_result_t rx_queue_get_value (omapi_data_string_t *name,
+				 omapi_value_t **value)
+{
+	char buf [64];
+	int class;
+
+	if (!omapi_ds_strcmp (name, "rx-queue-depth"))
+		return omapi_make_uint_value (value, name,
+					      rx_queue_stats.depth, MDL);
+	if (!omapi_ds_strcmp (name, "rx-queue-high-water"))
+		return omapi_make_uint_value (value, name,
+					      rx_queue_stats.high_water, MDL);
+
+	for (class = 0; class < RXQ_CLASSES; class++) {
+		snprintf (buf, sizeof buf, "rx-queue-%s-queued",
+			  rx_queue_class_names [class]);
+		if (!omapi_ds_strcmp (name, buf))
+			return omapi_make_uint_value
+				(value, name, rx_queue_stats.queued [class],
+				 MDL);
+		snprintf (buf, sizeof buf, "rx-queue-%s-dropped",
+			  rx_queue_class_names [class]);
+		if (!omapi_ds_strcmp (name, buf))
+			return omapi_make_uint_value
+				(value, name, rx_queue_stats.dropped [class],
+				 MDL);
+	}
+	return ISC_R_NOTFOUND;
+}
+
+isc_result_t got_one (h)
+	omapi_object_t *h;
+{
+	struct sockaddr_in from;
+	struct hardware hfrom;
+	struct iaddr ifrom;
+	unsigned len;
+	isc_result_t status;
+	union {
+		unsigned char packbuf [4095]; /* Packet input buffer.
+					 	 Must be as large as largest
+						 possible MTU. */
+		struct dhcp_packet packet;
+	} u;
+	struct interface_info *ip;
+
+	if (h -> type != dhcp_type_interface)
+		return DHCP_R_INVALIDARG;
+	ip = (struct interface_info *)h;
+
+	if (rx_queue_length > 0)
+		return got_one_queued (ip);
+
+      again:
+	status = receive_one (&ip, u.packbuf, sizeof u, &len, &from, &hfrom);
+	if (status != ISC_R_SUCCESS)
+		return status;
+
 	if (bootp_packet_handler) {
 		ifrom.len = 4;
 		memcpy (ifrom.iabuf, &from.sin_addr, ifrom.len);
 
-		(*bootp_packet_handler) (ip, &u.packet, (unsigned)result,
+		(*bootp_packet_handler) (ip, &u.packet, len,
 					 from.sin_port, ifrom, &hfrom);
 	}
 
@@ -1279,6 +1629,7 @@ isc_result_t dhcp_interface_destroy (omapi_object_t *h,
 		dfree (interface -> rbuf, file, line);
 		interface -> rbuf = (unsigned char *)0;
 	}
+	rx_queue_free (interface);
 	if (interface -> client)
 		interface -> client = (struct client_state *)0;
 
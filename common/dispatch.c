@@ -290,10 +290,16 @@ void add_timeout (when, where, what, ref, unref)
 	/* 
 	 * This is necessary for the tracing code but we put it
 	 * here in case we want to compare timing information
-	 * for some reason, like debugging.
+	 * for some reason, like debugging.  It is the time the timer
+	 * will actually go off, so the microseconds of the interval
+	 * are added to those of the current time.
 	 */
 	q->when.tv_sec  = cur_tv.tv_sec + sec;
-	q->when.tv_usec = usec;
+	q->when.tv_usec = cur_tv.tv_usec + usec;
+	if (q->when.tv_usec >= USEC_MAX) {
+		q->when.tv_sec++;
+		q->when.tv_usec -= USEC_MAX;
+	}
 
 #if defined (TRACING)
 	if (trace_playback()) {
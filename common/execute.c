@@ -32,6 +32,13 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 
+static int switch_index_find (struct executable_statement **,
+			      struct packet *, struct lease *,
+			      struct client_state *, struct option_state *,
+			      struct option_state *, struct binding_scope **,
+			      struct executable_statement *);
+static void switch_index_free (struct switch_index **);
+
 int execute_statements (result, packet, lease, client_state,
 			in_options, out_options, scope, statements,
 			on_star)
@@ -132,11 +139,16 @@ int execute_statements (result, packet, lease, client_state,
 #if defined (DEBUG_EXPRESSIONS)
 			log_debug ("exec: switch");
 #endif
-			status = (find_matching_case
-				  (&e, packet, lease, client_state,
-				   in_options, out_options, scope,
-				   r->data.s_switch.expr,
-				   r->data.s_switch.statements));
+			if (r->data.s_switch.index)
+				status = (switch_index_find
+					  (&e, packet, lease, client_state,
+					   in_options, out_options, scope, r));
+			else
+				status = (find_matching_case
+					  (&e, packet, lease, client_state,
+					   in_options, out_options, scope,
+					   r->data.s_switch.expr,
+					   r->data.s_switch.statements));
 #if defined (DEBUG_EXPRESSIONS)
 			log_debug ("exec: switch: case %lx", (unsigned long)e);
 #endif
@@ -350,28 +362,18 @@ int execute_statements (result, packet, lease, client_state,
 				break;
 			    }
 			}
-			binding = find_binding(*scope, r->data.set.name);
+			binding = find_interned_binding(*scope,
+							r->data.set.name);
 #if defined (DEBUG_EXPRESSIONS)
 			log_debug("exec: set %s", r->data.set.name);
 #else
 			POST(status);
 #endif
 			if (binding == NULL) {
-				binding = dmalloc(sizeof(*binding), MDL);
+				binding = new_binding(r->data.set.name, MDL);
 				if (binding != NULL) {
-				    memset(binding, 0, sizeof(*binding));
-				    binding->name =
-					    dmalloc(strlen
-						    (r->data.set.name) + 1,
-						    MDL);
-				    if (binding->name != NULL) {
-					strcpy(binding->name, r->data.set.name);
 					binding->next = (*scope)->bindings;
 					(*scope)->bindings = binding;
-				    } else {
-					dfree(binding, MDL);
-					binding = NULL;
-				    }
 				}
 			}
 			if (binding != NULL) {
@@ -413,7 +415,8 @@ int execute_statements (result, packet, lease, client_state,
 		      case unset_statement:
 			if (!scope || !*scope)
 				break;
-			binding = find_binding (*scope, r->data.unset);
+			binding = find_interned_binding (*scope,
+							 r->data.unset);
 			if (binding) {
 				if (binding->value)
 					binding_value_dereference
@@ -440,25 +443,9 @@ int execute_statements (result, packet, lease, client_state,
 
 		      next_let:
 			if (ns) {
-				binding = dmalloc(sizeof(*binding), MDL);
-				if (!binding) {
-				   blb:
+				binding = new_binding(e->data.let.name, MDL);
+				if (!binding)
 				    binding_scope_dereference(&ns, MDL);
-				} else {
-				    memset(binding, 0, sizeof(*binding));
-				    binding->name =
-					    dmalloc(strlen
-						    (e->data.let.name + 1),
-						    MDL);
-				    if (binding->name)
-					strcpy(binding->name,
-					       e->data.let.name);
-				    else {
-					dfree(binding, MDL);
-					binding = NULL;
-					goto blb;
-				    }
-				}
 			} else
 				binding = NULL;
 
@@ -618,6 +605,303 @@ void execute_statements_in_scope (result, packet,
 			    out_options, scope, group->statements, on_star);
 }
 
+/* Most scopes contain nothing but option statements, and running them
+   for every reply only ever has the same effect on the outgoing option
+   state.   The first time a chain of scopes is executed through
+   execute_statements_in_scope_cached(), its option statements are
+   flattened, outer scope first, into a template from which the ones
+   that a later supersede in the same chain would overwrite are dropped;
+   later replies just replay the template.   Chains with any other kind
+   of statement are remembered as such and executed normally.   All the
+   templates are thrown away by discard_scope_templates() whenever a
+   scope's statements may have changed. */
+
+#define SCOPE_TEMPLATE_BUCKETS 251
+
+struct scope_template_op {
+	enum statement_op op;
+	struct option_cache *oc;
+};
+
+struct scope_template {
+	struct scope_template *next;
+	struct group *group;
+	struct group *limiting_group;
+	int constant;
+	int count, max;
+	struct scope_template_op *ops;
+};
+
+struct scope_template_stats scope_template_stats;
+
+static struct scope_template **scope_templates;
+static u_int32_t scope_template_generation;
+static u_int32_t scope_template_built;
+
+static void scope_template_free (struct scope_template *template)
+{
+	int i;
+
+	for (i = 0; i < template -> count; i++)
+		option_cache_dereference (&template -> ops [i].oc, MDL);
+	if (template -> ops)
+		dfree (template -> ops, MDL);
+	group_dereference (&template -> group, MDL);
+	if (template -> limiting_group)
+		group_dereference (&template -> limiting_group, MDL);
+	dfree (template, MDL);
+}
+
+void discard_scope_templates ()
+{
+	scope_template_generation++;
+}
+
+static void scope_templates_flush ()
+{
+	struct scope_template *template;
+	int i;
+
+	for (i = 0; i < SCOPE_TEMPLATE_BUCKETS; i++) {
+		while ((template = scope_templates [i]) != NULL) {
+			scope_templates [i] = template -> next;
+			scope_template_free (template);
+		}
+	}
+	scope_template_built = scope_template_generation;
+}
+
+/* Append the option statements in a list to a template; returns zero
+   if the list holds anything else. */
+
+static int scope_template_flatten (struct scope_template *template,
+				   struct executable_statement *statements)
+{
+	struct executable_statement *r;
+	struct scope_template_op *ops;
+
+	for (r = statements; r; r = r -> next) {
+		switch (r -> op) {
+		      case statements_statement:
+			if (!scope_template_flatten (template,
+						     r -> data.statements))
+				return 0;
+			break;
+
+		      case supersede_option_statement:
+		      case send_option_statement:
+		      case default_option_statement:
+		      case append_option_statement:
+		      case prepend_option_statement:
+			if (!r -> data.option || !r -> data.option -> option)
+				return 0;
+			if (template -> count == template -> max) {
+				ops = dmalloc ((template -> max + 16) *
+					       sizeof *ops, MDL);
+				if (!ops)
+					return 0;
+				if (template -> ops) {
+					memcpy (ops, template -> ops,
+						template -> count *
+						sizeof *ops);
+					dfree (template -> ops, MDL);
+				}
+				template -> ops = ops;
+				template -> max += 16;
+			}
+			ops = &template -> ops [template -> count++];
+			ops -> op = r -> op;
+			option_cache_reference (&ops -> oc,
+						r -> data.option, MDL);
+			break;
+
+		      default:
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Walk a chain the way execute_statements_in_scope() does. */
+
+static int scope_template_collect (struct scope_template *template,
+				   struct group *group,
+				   struct group *limiting_group)
+{
+	struct group *limit;
+
+	if (!group)
+		return 1;
+	for (limit = limiting_group; limit; limit = limit -> next)
+		if (group == limit)
+			return 1;
+
+	if (group -> next &&
+	    !scope_template_collect (template, group -> next, limiting_group))
+		return 0;
+	return scope_template_flatten (template, group -> statements);
+}
+
+static int scope_template_same_option (struct option_cache *a,
+				       struct option_cache *b)
+{
+	return (a -> option -> universe == b -> option -> universe &&
+		a -> option -> code == b -> option -> code);
+}
+
+static struct scope_template *scope_template_build (struct group *group,
+						    struct group *limiting_group)
+{
+	struct scope_template *template;
+	int i, j, n;
+
+	template = dmalloc (sizeof *template, MDL);
+	if (!template)
+		return NULL;
+	group_reference (&template -> group, group, MDL);
+	if (limiting_group)
+		group_reference (&template -> limiting_group,
+				 limiting_group, MDL);
+
+	template -> constant = scope_template_collect (template, group,
+						       limiting_group);
+
+	/* An option statement followed by a supersede of the same option
+	   has no effect, so leave it out.   Go backwards so that each
+	   statement is only compared with the ones that are kept. */
+	if (template -> constant) {
+		n = template -> count;
+		for (i = template -> count - 1; i >= 0; i--) {
+			for (j = n; j < template -> count; j++) {
+				if ((template -> ops [j].op ==
+				     supersede_option_statement ||
+				     template -> ops [j].op ==
+				     send_option_statement) &&
+				    scope_template_same_option
+					(template -> ops [i].oc,
+					 template -> ops [j].oc))
+					break;
+			}
+			if (j < template -> count) {
+				option_cache_dereference
+					(&template -> ops [i].oc, MDL);
+				continue;
+			}
+			if (--n != i) {
+				template -> ops [n] = template -> ops [i];
+				template -> ops [i].oc = NULL;
+			}
+		}
+		memmove (template -> ops, &template -> ops [n],
+			 (template -> count - n) * sizeof *template -> ops);
+		template -> count -= n;
+	} else {
+		for (i = 0; i < template -> count; i++)
+			option_cache_dereference (&template -> ops [i].oc,
+						  MDL);
+		template -> count = 0;
+	}
+
+	return template;
+}
+
+/* Like execute_statements_in_scope(), but chains that contain nothing but
+   option statements are executed from a template. */
+
+void execute_statements_in_scope_cached (result, packet,
+					 lease, client_state, in_options,
+					 out_options, scope, group,
+					 limiting_group, on_star)
+	struct binding_value **result;
+	struct packet *packet;
+	struct lease *lease;
+	struct client_state *client_state;
+	struct option_state *in_options;
+	struct option_state *out_options;
+	struct binding_scope **scope;
+	struct group *group;
+	struct group *limiting_group;
+	struct on_star *on_star;
+{
+	struct scope_template *template;
+	unsigned bucket;
+	int i;
+
+	if (!group)
+		return;
+
+	if (!scope_templates) {
+		scope_templates = dmalloc (SCOPE_TEMPLATE_BUCKETS *
+					   sizeof *scope_templates, MDL);
+		if (!scope_templates) {
+			execute_statements_in_scope (result, packet, lease,
+						     client_state, in_options,
+						     out_options, scope,
+						     group, limiting_group,
+						     on_star);
+			return;
+		}
+		scope_template_built = scope_template_generation;
+	} else if (scope_template_built != scope_template_generation)
+		scope_templates_flush ();
+
+	bucket = (unsigned)(((unsigned long)group ^
+			     (unsigned long)limiting_group) /
+			    sizeof (struct group)) % SCOPE_TEMPLATE_BUCKETS;
+	for (template = scope_templates [bucket]; template;
+	     template = template -> next)
+		if (template -> group == group &&
+		    template -> limiting_group == limiting_group)
+			break;
+
+	if (!template) {
+		scope_template_stats.misses++;
+		template = scope_template_build (group, limiting_group);
+		if (!template) {
+			execute_statements_in_scope (result, packet, lease,
+						     client_state, in_options,
+						     out_options, scope,
+						     group, limiting_group,
+						     on_star);
+			return;
+		}
+		template -> next = scope_templates [bucket];
+		scope_templates [bucket] = template;
+	} else
+		scope_template_stats.hits++;
+
+	if (!template -> constant) {
+		scope_template_stats.fallbacks++;
+		execute_statements_in_scope (result, packet, lease,
+					     client_state, in_options,
+					     out_options, scope, group,
+					     limiting_group, on_star);
+		return;
+	}
+
+	for (i = 0; i < template -> count; i++)
+		set_option (template -> ops [i].oc -> option -> universe,
+			    out_options, template -> ops [i].oc,
+			    template -> ops [i].op);
+}
+
+isc_result_t scope_template_get_value (omapi_data_string_t *name,
+				       omapi_value_t **value)
+{
+	if (!omapi_ds_strcmp (name, "scope-template-hits"))
+		return omapi_make_uint_value (value, name,
+					      scope_template_stats.hits, MDL);
+	if (!omapi_ds_strcmp (name, "scope-template-misses"))
+		return omapi_make_uint_value (value, name,
+					      scope_template_stats.misses,
+					      MDL);
+	if (!omapi_ds_strcmp (name, "scope-template-fallbacks"))
+		return omapi_make_uint_value (value, name,
+					      scope_template_stats.fallbacks,
+					      MDL);
+	return ISC_R_NOTFOUND;
+}
+
 /* Dereference or free any subexpressions of a statement being freed. */
 
 int executable_statement_dereference (ptr, file, line)
@@ -676,6 +960,8 @@ int executable_statement_dereference (ptr, file, line)
 		if ((*ptr) -> data.s_switch.expr)
 			expression_dereference (&(*ptr) -> data.s_switch.expr,
 						file, line);
+		if ((*ptr) -> data.s_switch.index)
+			switch_index_free (&(*ptr) -> data.s_switch.index);
 		break;
 
 	      case case_statement:
@@ -709,18 +995,11 @@ int executable_statement_dereference (ptr, file, line)
 		break;
 
 	      case set_statement:
-		if ((*ptr)->data.set.name)
-			dfree ((*ptr)->data.set.name, file, line);
 		if ((*ptr)->data.set.expr)
 			expression_dereference (&(*ptr) -> data.set.expr,
 						file, line);
 		break;
 
-	      case unset_statement:
-		if ((*ptr)->data.unset)
-			dfree ((*ptr)->data.unset, file, line);
-		break;
-
 	      case execute_statement:
 		if ((*ptr)->data.execute.command)
 			dfree ((*ptr)->data.execute.command, file, line);
@@ -1188,3 +1467,532 @@ int executable_statement_foreach (struct executable_statement *stmt,
 	}
 	return ok;
 }
+
+/* Many of the conditions in a configuration can be decided once and for
+   all when it is read: tests of literals against each other, or an "and"
+   or "or" one side of which is such a test.   executable_statement_optimize()
+   replaces an if statement whose condition is decided by the branch that
+   would be taken, a switch on a constant by the case it selects, and
+   drops statements that can never be reached.   Data and numeric
+   subexpressions made of literals only are replaced by their values, and
+   a switch whose case values are all constant gets a hash table of them
+   so that its case is found with one lookup. */
+
+struct switch_index {
+	struct hash_table *cases;	/* Case values to case statements. */
+	struct data_string *values;	/* The keys of the table. */
+	unsigned long *numbers;
+	int count;
+	struct executable_statement *empty;	/* The case for "", if any. */
+	struct executable_statement *deflt;	/* The default, if any. */
+};
+
+/* Put pointers to the operands of an operator that can be worked out
+   when the configuration is read, if its operands can, in kids, and
+   return how many there are; return -1 for anything else. */
+
+static int expression_operands (struct expression *expr,
+				struct expression ***kids)
+{
+	switch (expr -> op) {
+	      case expr_const_data:
+	      case expr_const_int:
+		return 0;
+
+	      case expr_equal:
+	      case expr_not_equal:
+		kids [0] = &expr -> data.equal [0];
+		kids [1] = &expr -> data.equal [1];
+		return 2;
+
+	      case expr_and:
+		kids [0] = &expr -> data.and [0];
+		kids [1] = &expr -> data.and [1];
+		return 2;
+
+	      case expr_or:
+		kids [0] = &expr -> data.or [0];
+		kids [1] = &expr -> data.or [1];
+		return 2;
+
+	      case expr_not:
+		kids [0] = &expr -> data.not;
+		return 1;
+
+	      case expr_substring:
+		kids [0] = &expr -> data.substring.expr;
+		kids [1] = &expr -> data.substring.offset;
+		kids [2] = &expr -> data.substring.len;
+		return 3;
+
+	      case expr_suffix:
+		kids [0] = &expr -> data.suffix.expr;
+		kids [1] = &expr -> data.suffix.len;
+		return 2;
+
+	      case expr_lcase:
+		kids [0] = &expr -> data.lcase;
+		return 1;
+
+	      case expr_ucase:
+		kids [0] = &expr -> data.ucase;
+		return 1;
+
+	      case expr_concat:
+		kids [0] = &expr -> data.concat [0];
+		kids [1] = &expr -> data.concat [1];
+		return 2;
+
+	      case expr_pick_first_value:
+		kids [0] = &expr -> data.pick_first_value.car;
+		kids [1] = &expr -> data.pick_first_value.cdr;
+		return 2;
+
+	      case expr_extract_int8:
+	      case expr_extract_int16:
+	      case expr_extract_int32:
+		kids [0] = &expr -> data.extract_int;
+		return 1;
+
+	      case expr_encode_int8:
+	      case expr_encode_int16:
+	      case expr_encode_int32:
+		kids [0] = &expr -> data.encode_int;
+		return 1;
+
+	      case expr_reverse:
+		kids [0] = &expr -> data.reverse.width;
+		kids [1] = &expr -> data.reverse.buffer;
+		return 2;
+
+	      case expr_binary_to_ascii:
+		kids [0] = &expr -> data.b2a.base;
+		kids [1] = &expr -> data.b2a.width;
+		kids [2] = &expr -> data.b2a.separator;
+		kids [3] = &expr -> data.b2a.buffer;
+		return 4;
+
+	      case expr_add:
+	      case expr_subtract:
+	      case expr_multiply:
+	      case expr_divide:
+	      case expr_remainder:
+	      case expr_binary_and:
+	      case expr_binary_or:
+	      case expr_binary_xor:
+		kids [0] = &expr -> data.and [0];
+		kids [1] = &expr -> data.and [1];
+		return 2;
+
+	      default:
+		return -1;
+	}
+}
+
+/* Is the value of the expression the same whatever the packet, lease
+   and scope? */
+
+static int expression_constant (struct expression *expr)
+{
+	struct expression **kids [4];
+	int i, n;
+
+	n = expression_operands (expr, kids);
+	if (n < 0)
+		return 0;
+	for (i = 0; i < n; i++)
+		if (*kids [i] && !expression_constant (*kids [i]))
+			return 0;
+	return 1;
+}
+
+/* Make *expr refer to with, which may be part of *expr. */
+
+static void expression_replace (struct expression **expr,
+				struct expression *with)
+{
+	struct expression *keep = (struct expression *)0;
+
+	expression_reference (&keep, with, MDL);
+	expression_dereference (expr, MDL);
+	expression_reference (expr, keep, MDL);
+	expression_dereference (&keep, MDL);
+}
+
+/* Replace the data and numeric subexpressions of an expression that are
+   made of literals only by their values. */
+
+static void expression_fold (struct expression **expr)
+{
+	struct expression **kids [4];
+	struct expression *value = (struct expression *)0;
+	struct data_string data;
+	unsigned long number;
+	int i, n;
+
+	n = expression_operands (*expr, kids);
+	if (n <= 0)
+		return;
+
+	if (expression_constant (*expr)) {
+		memset (&data, 0, sizeof data);
+		if (is_data_expression (*expr) &&
+		    evaluate_data_expression (&data, NULL, NULL, NULL, NULL,
+					      NULL, NULL, *expr, MDL)) {
+			make_const_data (&value, data.data, data.len, 0, 1,
+					 MDL);
+			data_string_forget (&data, MDL);
+		} else if (is_numeric_expression (*expr) &&
+			   evaluate_numeric_expression (&number, NULL, NULL,
+							NULL, NULL, NULL,
+							NULL, *expr))
+			make_const_int (&value, number);
+		if (value) {
+			expression_replace (expr, value);
+			expression_dereference (&value, MDL);
+			return;
+		}
+	}
+
+	for (i = 0; i < n; i++)
+		if (*kids [i])
+			expression_fold (kids [i]);
+}
+
+/* Work out what an if condition will always come to, if it can be: 1
+   for true, 0 for false or no value, which if treats the same way, and
+   -1 if it depends on the packet.   Along the way, an "and" or "or" one
+   side of which is decided is replaced by its other side where that
+   can't change whether it is true; only constants are ever dropped. */
+
+static int condition_fold (struct expression **expr)
+{
+	int left, right, rc;
+
+	switch ((*expr) -> op) {
+	      case expr_and:
+		/* The right side isn't looked at unless the left is true. */
+		left = condition_fold (&(*expr) -> data.and [0]);
+		if (left == 0)
+			return 0;
+		right = condition_fold (&(*expr) -> data.and [1]);
+		if (left == 1) {
+			expression_replace (expr, (*expr) -> data.and [1]);
+			return right;
+		}
+		if (right == 1) {
+			expression_replace (expr, (*expr) -> data.and [0]);
+			return left;
+		}
+		return -1;
+
+	      case expr_or:
+		/* Nor is it if the left is true. */
+		left = condition_fold (&(*expr) -> data.or [0]);
+		if (left == 1)
+			return 1;
+		right = condition_fold (&(*expr) -> data.or [1]);
+		if (left == 0) {
+			expression_replace (expr, (*expr) -> data.or [1]);
+			return right;
+		}
+		if (right == 0) {
+			expression_replace (expr, (*expr) -> data.or [0]);
+			return left;
+		}
+		return -1;
+
+	      default:
+		if (!expression_constant (*expr)) {
+			expression_fold (expr);
+			return -1;
+		}
+		if (!evaluate_boolean_expression (&rc, NULL, NULL, NULL, NULL,
+						  NULL, NULL, *expr))
+			return 0;
+		return rc ? 1 : 0;
+	}
+}
+
+/* Index the cases of a switch statement, if all of their values are
+   constant.   The index points into the switch's statements, which it
+   doesn't outlive. */
+
+static void switch_index_build (struct executable_statement *stmt)
+{
+	struct executable_statement *s, *found;
+	struct switch_index *index;
+	const void *key;
+	unsigned len;
+	int count, numeric;
+
+	if (stmt -> data.s_switch.index)
+		return;
+
+	count = 0;
+	for (s = stmt -> data.s_switch.statements; s; s = s -> next) {
+		if (s -> op != case_statement)
+			continue;
+		if (!s -> data.c_case || !expression_constant (s -> data.c_case))
+			return;
+		count++;
+	}
+	numeric = !is_data_expression (stmt -> data.s_switch.expr);
+
+	index = dmalloc (sizeof *index, MDL);
+	if (!index)
+		return;
+	if (count) {
+		if (numeric)
+			index -> numbers = dmalloc (count *
+						    sizeof *index -> numbers,
+						    MDL);
+		else
+			index -> values = dmalloc (count *
+						   sizeof *index -> values,
+						   MDL);
+	}
+	if ((count && !index -> numbers && !index -> values) ||
+	    !new_hash (&index -> cases, 0, 0, 0, do_string_hash, MDL)) {
+		switch_index_free (&index);
+		return;
+	}
+
+	/* Like find_matching_case(), the first case with a value wins,
+	   and a case whose value can't be worked out never matches. */
+	for (s = stmt -> data.s_switch.statements; s; s = s -> next) {
+		if (s -> op == default_statement) {
+			if (!index -> deflt)
+				index -> deflt = s;
+			continue;
+		}
+		if (s -> op != case_statement)
+			continue;
+
+		if (numeric) {
+			if (!evaluate_numeric_expression
+			    (&index -> numbers [index -> count], NULL, NULL,
+			     NULL, NULL, NULL, NULL, s -> data.c_case))
+				continue;
+			key = &index -> numbers [index -> count++];
+			len = sizeof index -> numbers [0];
+		} else {
+			if (!evaluate_data_expression
+			    (&index -> values [index -> count], NULL, NULL,
+			     NULL, NULL, NULL, NULL, s -> data.c_case, MDL))
+				continue;
+			key = index -> values [index -> count].data;
+			len = index -> values [index -> count++].len;
+			if (!len) {
+				if (!index -> empty)
+					index -> empty = s;
+				continue;
+			}
+		}
+
+		found = (struct executable_statement *)0;
+		if (!hash_lookup ((hashed_object_t **)&found, index -> cases,
+				  key, len, MDL))
+			add_hash (index -> cases, key, len,
+				  (hashed_object_t *)s, MDL);
+	}
+
+	stmt -> data.s_switch.index = index;
+}
+
+static void switch_index_free (struct switch_index **index)
+{
+	int i;
+
+	if ((*index) -> cases)
+		free_hash_table (&(*index) -> cases, MDL);
+	if ((*index) -> values) {
+		for (i = 0; i < (*index) -> count; i++)
+			data_string_forget (&(*index) -> values [i], MDL);
+		dfree ((*index) -> values, MDL);
+	}
+	if ((*index) -> numbers)
+		dfree ((*index) -> numbers, MDL);
+	dfree (*index, MDL);
+	*index = (struct switch_index *)0;
+}
+
+/* find_matching_case() for a switch statement with an index. */
+
+static int switch_index_find (struct executable_statement **ep,
+			      struct packet *packet, struct lease *lease,
+			      struct client_state *client_state,
+			      struct option_state *in_options,
+			      struct option_state *out_options,
+			      struct binding_scope **scope,
+			      struct executable_statement *stmt)
+{
+	struct switch_index *index = stmt -> data.s_switch.index;
+	struct executable_statement *s = (struct executable_statement *)0;
+	struct data_string ds;
+	unsigned long n;
+
+	if (is_data_expression (stmt -> data.s_switch.expr)) {
+		memset (&ds, 0, sizeof ds);
+		if (evaluate_data_expression (&ds, packet, lease, client_state,
+					      in_options, out_options, scope,
+					      stmt -> data.s_switch.expr,
+					      MDL)) {
+			if (!ds.len)
+				s = index -> empty;
+			else
+				hash_lookup ((hashed_object_t **)&s,
+					     index -> cases, ds.data, ds.len,
+					     MDL);
+			data_string_forget (&ds, MDL);
+		}
+	} else if (evaluate_numeric_expression (&n, packet, lease,
+						client_state, in_options,
+						out_options, scope,
+						stmt -> data.s_switch.expr))
+		hash_lookup ((hashed_object_t **)&s, index -> cases,
+			     &n, sizeof n, MDL);
+
+	if (!s)
+		s = index -> deflt;
+	if (!s || !s -> next)
+		return 0;
+	executable_statement_reference (ep, s -> next, MDL);
+	return 1;
+}
+
+/* Replace the statement at *sp by the statements in with, wrapped so
+   that a break among them still only ends them, or just drop it if with
+   is null. */
+
+static void statement_replace (struct executable_statement **sp,
+			       struct executable_statement *with)
+{
+	struct executable_statement *old = (struct executable_statement *)0;
+	struct executable_statement *ns = (struct executable_statement *)0;
+
+	if (with) {
+		if (!executable_statement_allocate (&ns, MDL))
+			return;
+		ns -> op = statements_statement;
+		executable_statement_reference (&ns -> data.statements,
+						with, MDL);
+	}
+
+	executable_statement_reference (&old, *sp, MDL);
+	executable_statement_dereference (sp, MDL);
+	if (ns) {
+		if (old -> next)
+			executable_statement_reference (&ns -> next,
+							old -> next, MDL);
+		executable_statement_reference (sp, ns, MDL);
+		executable_statement_dereference (&ns, MDL);
+	} else if (old -> next)
+		executable_statement_reference (sp, old -> next, MDL);
+	executable_statement_dereference (&old, MDL);
+}
+
+static void statements_optimize (struct executable_statement **list,
+				 int in_switch)
+{
+	struct executable_statement **sp, *r, *e;
+	int reachable, decided;
+
+	/* The body of a switch is only entered at a case or default. */
+	reachable = !in_switch;
+
+	sp = list;
+	while (*sp) {
+		r = *sp;
+		if (in_switch && (r -> op == case_statement ||
+				  r -> op == default_statement)) {
+			if (r -> op == case_statement && r -> data.c_case)
+				expression_fold (&r -> data.c_case);
+			reachable = 1;
+			sp = &r -> next;
+			continue;
+		}
+		if (!reachable) {
+			statement_replace (sp, NULL);
+			continue;
+		}
+
+		/* A statement that is replaced is looked at again in its
+		   new form. */
+		switch (r -> op) {
+		      case if_statement:
+			decided = condition_fold (&r -> data.ie.expr);
+			if (r -> data.ie.tc)
+				statements_optimize (&r -> data.ie.tc, 0);
+			if (r -> data.ie.fc)
+				statements_optimize (&r -> data.ie.fc, 0);
+			if (decided >= 0) {
+				statement_replace (sp, (decided
+							? r -> data.ie.tc
+							: r -> data.ie.fc));
+				continue;
+			}
+			break;
+
+		      case switch_statement:
+			expression_fold (&r -> data.s_switch.expr);
+			if (r -> data.s_switch.statements)
+				statements_optimize
+					(&r -> data.s_switch.statements, 1);
+			switch_index_build (r);
+			if (r -> data.s_switch.index &&
+			    expression_constant (r -> data.s_switch.expr)) {
+				e = (struct executable_statement *)0;
+				switch_index_find (&e, NULL, NULL, NULL, NULL,
+						   NULL, NULL, r);
+				statement_replace (sp, e);
+				if (e)
+					executable_statement_dereference
+						(&e, MDL);
+				continue;
+			}
+			break;
+
+		      case statements_statement:
+			if (r -> data.statements)
+				statements_optimize (&r -> data.statements, 0);
+			if (!r -> data.statements) {
+				statement_replace (sp, NULL);
+				continue;
+			}
+			break;
+
+		      case on_statement:
+			if (r -> data.on.statements)
+				statements_optimize (&r -> data.on.statements,
+						     0);
+			break;
+
+		      case let_statement:
+			if (r -> data.let.statements)
+				statements_optimize (&r -> data.let.statements,
+						     0);
+			break;
+
+		      case break_statement:
+			/* Nothing after a break is reached, up to the next
+			   case in a switch. */
+			reachable = 0;
+			break;
+
+		      default:
+			break;
+		}
+		sp = &r -> next;
+	}
+}
+
+/* Optimize a list of statements read from the configuration; see above.
+   What the statements do is unchanged, and so is the order in which any
+   expression that looks at the packet is evaluated. */
+
+void executable_statement_optimize (struct executable_statement **statements)
+{
+	if (statements && *statements)
+		statements_optimize (statements, 0);
+}
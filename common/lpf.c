@@ -177,6 +177,9 @@ void if_deregister_send (info)
 extern struct sock_filter dhcp_bpf_filter [];
 extern int dhcp_bpf_filter_len;
 
+extern struct sock_filter dhcp_bpf_strict_filter [];
+extern int dhcp_bpf_strict_filter_len;
+
 #if defined(RELAY_PORT)
 extern struct sock_filter dhcp_bpf_relay_filter [];
 extern int dhcp_bpf_relay_filter_len;
@@ -258,6 +261,12 @@ static void lpf_gen_filter_setup (info)
 	p.len = dhcp_bpf_filter_len;
 	p.filter = dhcp_bpf_filter;
 
+	/* The server may ask for junk to be dropped in the kernel. */
+	if (strict_packet_filter) {
+		p.len = dhcp_bpf_strict_filter_len;
+		p.filter = dhcp_bpf_strict_filter;
+	}
+
         /* Patch the server port into the LPF  program...
 	   XXX changes to filter program may require changes
 	   to the insn number(s) used below! XXX */
@@ -274,6 +283,7 @@ static void lpf_gen_filter_setup (info)
 	}
 #endif
 	dhcp_bpf_filter [8].k = ntohs (local_port);
+	dhcp_bpf_strict_filter [8].k = ntohs (local_port);
 
 	if (setsockopt (info -> rfdesc, SOL_SOCKET, SO_ATTACH_FILTER, &p,
 			sizeof p) < 0) {
@@ -446,6 +456,12 @@ ssize_t receive_packet (interface, buf, len, from, hfrom)
 
 			csum_ready = ((aux->tp_status & TP_STATUS_CSUMNOTREADY)
 				      ? 0 : 1);
+#ifdef TP_STATUS_CSUM_VALID
+			/* The NIC has already verified the checksum, so
+			 * there's no need to do it again. */
+			if (aux->tp_status & TP_STATUS_CSUM_VALID)
+				csum_ready = 0;
+#endif
 		}
 	}
 
@@ -111,8 +111,207 @@ int parse_options (packet)
 	return 1;
 }
 
+/* Add one option found in a parsed buffer to the option state, either
+ * as a new option cache or by merging it with an option of the same code
+ * that is already there.
+ */
+static int
+apply_option_entry(struct universe *universe, struct option_state *options,
+		   struct buffer *bp, unsigned offset, unsigned len,
+		   unsigned code)
+{
+	struct option_cache *op = NULL, *nop = NULL;
+
+	op = lookup_option(universe, options, code);
+	if (op == NULL) {
+		/* If we don't have an option create one */
+		if (save_option_buffer(universe, options, bp,
+				       bp->data + offset, len,
+				       code, 1) == 0) {
+			log_error("parse_option_buffer: "
+				  "save_option_buffer failed");
+			return (0);
+		}
+	} else if (universe->concat_duplicates) {
+		/* If we do have an option either concat with
+		   what is there ...*/
+		struct data_string new;
+		memset(&new, 0, sizeof new);
+		if (!buffer_allocate(&new.buffer, op->data.len + len,
+				     MDL)) {
+			log_error("parse_option_buffer: No memory.");
+			return (0);
+		}
+		/* Copy old option to new data object. */
+		memcpy(new.buffer->data, op->data.data,
+		       op->data.len);
+		/* Concat new option behind old. */
+		memcpy(new.buffer->data + op->data.len,
+		       bp->data + offset, len);
+		new.len = op->data.len + len;
+		new.data = new.buffer->data;
+		/* Save new concat'd object. */
+		data_string_forget(&op->data, MDL);
+		data_string_copy(&op->data, &new, MDL);
+		data_string_forget(&new, MDL);
+	} else  {
+		/* ... or we must append this statement onto the
+		 * end of the list.
+		 */
+		while (op->next != NULL)
+			op = op->next;
+
+		if (!option_cache_allocate(&nop, MDL)) {
+			log_error("parse_option_buffer: No memory.");
+			return (0);
+		}
+
+		option_reference(&nop->option, op->option, MDL);
+
+		nop->data.buffer = NULL;
+		buffer_reference(&nop->data.buffer, bp, MDL);
+		nop->data.data = bp->data + offset;
+		nop->data.len = len;
+
+		option_cache_reference(&op->next, nop, MDL);
+		option_cache_dereference(&nop, MDL);
+	}
+
+	return (1);
+}
+
+#define OPTION_INDEX_MAYBE(ix, code) \
+	((ix)->filter[((code) & 0xff) >> 3] & (1 << ((code) & 7)))
+
+static void
+free_option_index(struct option_index **ixp)
+{
+	struct option_index *ix = *ixp;
+
+	*ixp = ix->next;
+	buffer_dereference(&ix->buffer, MDL);
+	dfree(ix, MDL);
+}
+
+/* Turn pending entries from parsed buffers into option caches.   If
+ * universe is NULL every pending entry is converted, otherwise only those
+ * for that universe, and if code_only is set, only those for that code.
+ * Entries are applied in the order in which they were parsed, so
+ * duplicates are concatenated or chained exactly as they would have been
+ * had the buffer been decoded eagerly.
+ */
+static void
+materialize_pending(struct universe *universe, struct option_state *options,
+		    int code_only, unsigned code)
+{
+	struct option_index *pending, **ixp, *ix;
+	struct option_index_entry *ent;
+	u_int32_t generation;
+	unsigned i, len;
+
+	/* Detach the pending list while we work so that the lookups and
+	   saves done on our behalf don't come back here.   The options
+	   don't really change, so neither does their generation. */
+	pending = options->pending;
+	options->pending = NULL;
+	generation = options->generation;
+
+	for (ix = pending; ix != NULL; ix = ix->next) {
+		if ((universe != NULL && ix->universe != universe) ||
+		    (code_only && !OPTION_INDEX_MAYBE(ix, code)))
+			continue;
+		for (i = 0; i < ix->count && ix->remaining > 0; i++) {
+			ent = &ix->entries[i];
+			if (ent->length == OPTION_INDEX_CONSUMED ||
+			    (code_only && ent->code != code))
+				continue;
+			len = ent->length;
+			ent->length = OPTION_INDEX_CONSUMED;
+			ix->remaining--;
+			(void) apply_option_entry(ix->universe, options,
+						  ix->buffer, ent->offset,
+						  len, ent->code);
+		}
+	}
+
+	for (ixp = &pending; *ixp != NULL; ) {
+		if ((*ixp)->remaining == 0)
+			free_option_index(ixp);
+		else
+			ixp = &(*ixp)->next;
+	}
+	options->pending = pending;
+	options->generation = generation;
+}
+
+/* Forget any pending entries for the given code, e.g. because the option
+ * is being replaced or deleted.
+ */
+static void
+discard_pending(struct universe *universe, struct option_state *options,
+		unsigned code)
+{
+	struct option_index **ixp, *ix;
+	unsigned i;
+
+	for (ixp = &options->pending; (ix = *ixp) != NULL; ) {
+		if (ix->universe == universe && OPTION_INDEX_MAYBE(ix, code)) {
+			for (i = 0; i < ix->count; i++) {
+				if (ix->entries[i].code == code &&
+				    ix->entries[i].length !=
+				    OPTION_INDEX_CONSUMED) {
+					ix->entries[i].length =
+						OPTION_INDEX_CONSUMED;
+					ix->remaining--;
+				}
+			}
+		}
+		if (ix->remaining == 0)
+			free_option_index(ixp);
+		else
+			ixp = &ix->next;
+	}
+}
+
+/* Build option caches for everything still pending in the given universe
+ * (or in all universes if universe is NULL).   Code that walks an option
+ * state's per-universe tables directly must call this first.
+ */
+void materialize_options (struct universe *universe,
+			  struct option_state *options)
+{
+	if (options != NULL && options->pending != NULL)
+		materialize_pending(universe, options, 0, 0);
+}
+
+/* Give an option state a new generation, so that values computed from
+ * what it held before (see evaluate_data_expression()) aren't used again.
+ * Generations are drawn from one counter so that they are never reused,
+ * even by a new option state at the same address.
+ */
+void option_state_touch (struct option_state *options)
+{
+	static u_int32_t generation;
+
+	options->generation = ++generation;
+}
+
+/* Release the pending entries of an option state that is going away. */
+void forget_pending_options (struct option_state *options)
+{
+	while (options->pending != NULL)
+		free_option_index(&options->pending);
+}
+
 /* Parse options out of the specified buffer, storing addresses of option
  * values in packet->options.
+ *
+ * The buffer is copied once, and the location of each option within the
+ * copy is recorded in an option_index attached to the option state.   For
+ * universes whose option state layout knows about these (hashed and
+ * linked), option caches are only created when an option is actually
+ * looked up or its space is walked; the common DISCOVER or REQUEST has a
+ * dozen or more options, most of which the server never examines.
  */
 int parse_option_buffer (options, buffer, length, universe)
 	struct option_state *options;
@@ -122,17 +321,18 @@ int parse_option_buffer (options, buffer, length, universe)
 {
 	unsigned len, offset;
 	unsigned code;
-	struct option_cache *op = NULL, *nop = NULL;
+	unsigned count, i;
 	struct buffer *bp = (struct buffer *)0;
-	struct option *option = NULL;
-	char *reason = "general failure";
-
-	if (!buffer_allocate (&bp, length, MDL)) {
-		log_error ("no memory for option buffer.");
-		return 0;
-	}
-	memcpy (bp -> data, buffer, length);
-
+	struct option_index *ix, **ixp;
+	struct option_index_entry *ent;
+	struct option *option = NULL, *eopt = NULL;
+	unsigned bad_code = 0;
+	char *reason = NULL;
+
+	/* Validate the buffer and count the options in it.   If the buffer
+	   turns out to be malformed, the options preceding the bad one are
+	   still recorded; parse_options() relies on this. */
+	count = 0;
 	for (offset = 0;
 	     (offset + universe->tag_size) <= length &&
 	     (code = universe->get_tag(buffer + offset)) != universe->end; ) {
@@ -146,7 +346,8 @@ int parse_option_buffer (options, buffer, length, universe)
 		if ((offset + universe->length_size) > length) {
 			reason = "code tag at end of buffer - missing "
 				 "length field";
-			goto bogus;
+			bad_code = code;
+			break;
 		}
 
 		/* All other fields (except PAD and END handled above)
@@ -172,22 +373,54 @@ int parse_option_buffer (options, buffer, length, universe)
 
 		offset += universe->length_size;
 
-		option_code_hash_lookup(&option, universe->code_hash, &code,
-					0, MDL);
-
 		/* If the length is outrageous, the options are bad. */
 		if (offset + len > length) {
-			/* Avoid reference count overflow */
-			option_dereference(&option, MDL);
+			option_code_hash_lookup(&option, universe->code_hash,
+						&code, 0, MDL);
 			reason = "option length exceeds option buffer length";
-		      bogus:
-			log_error("parse_option_buffer: malformed option "
-				  "%s.%s (code %u): %s.", universe->name,
-				  option ? option->name : "<unknown>",
-				  code, reason);
+			bad_code = code;
+			break;
+		}
+
+		count++;
+		offset += len;
+	}
+
+	if (count > 0) {
+		if (!buffer_allocate (&bp, length, MDL)) {
+			log_error ("no memory for option buffer.");
+			if (option != NULL)
+				option_dereference(&option, MDL);
+			return 0;
+		}
+		memcpy (bp -> data, buffer, length);
+
+		ix = dmalloc(sizeof *ix + (count - 1) * sizeof *ent, MDL);
+		if (ix == NULL) {
+			log_error ("no memory for option index.");
 			buffer_dereference (&bp, MDL);
+			if (option != NULL)
+				option_dereference(&option, MDL);
 			return 0;
 		}
+		memset(ix, 0, sizeof *ix);
+		ix->universe = universe;
+		buffer_reference(&ix->buffer, bp, MDL);
+	} else
+		ix = NULL;
+
+	for (offset = 0, i = 0; i < count; ) {
+		code = universe->get_tag(buffer + offset);
+		offset += universe->tag_size;
+		if (code == DHO_PAD)
+			continue;
+
+		if (universe->get_length != NULL)
+			len = universe->get_length(buffer + offset);
+		else
+			len = length - universe->tag_size;
+		offset += universe->length_size;
+		i++;
 
 		/* If the option contains an encapsulation, parse it.  In
 		   any case keep the raw data as well.  (Previous to 4.4.0
@@ -195,87 +428,65 @@ int parse_option_buffer (options, buffer, length, universe)
 		   wasn't an encapsulation (by far the most common case), or
 		   the option wasn't entirely an encapsulation
 		*/
-
-		if (option &&
-		    (option->format[0] == 'e' || option->format[0] == 'E')) {
-			(void) parse_encapsulated_suboptions(options, option,
+		option_code_hash_lookup(&eopt, universe->code_hash, &code,
+					0, MDL);
+		if (eopt &&
+		    (eopt->format[0] == 'e' || eopt->format[0] == 'E')) {
+			(void) parse_encapsulated_suboptions(options, eopt,
 							     bp->data + offset,
 							     len,
 							     universe, NULL);
 		}
+		if (eopt != NULL)
+			option_dereference(&eopt, MDL);
 
 		if (universe == &dhcp_universe && code == DHO_HOST_NAME &&
 		    len == 0) {
 			/* non-compliant clients can send it
 			 * we'll just drop it and go on */
 			log_debug ("Ignoring empty DHO_HOST_NAME option");
-			option_dereference(&option, MDL);
 			offset += len;
 			continue;
 		}
 
-		op = lookup_option(universe, options, code);
-		if (op == NULL) {
-			/* If we don't have an option create one */
-			if (save_option_buffer(universe, options, bp,
-					       bp->data + offset, len,
-					       code, 1) == 0) {
-				log_error("parse_option_buffer: "
-					  "save_option_buffer failed");
-				buffer_dereference(&bp, MDL);
-				return (0);
-			}
-		} else if (universe->concat_duplicates) {
-			/* If we do have an option either concat with
-			   what is there ...*/
-			struct data_string new;
-			memset(&new, 0, sizeof new);
-			if (!buffer_allocate(&new.buffer, op->data.len + len,
-					     MDL)) {
-				log_error("parse_option_buffer: No memory.");
-				buffer_dereference(&bp, MDL);
-				return (0);
-			}
-			/* Copy old option to new data object. */
-			memcpy(new.buffer->data, op->data.data,
-			       op->data.len);
-			/* Concat new option behind old. */
-			memcpy(new.buffer->data + op->data.len,
-			       bp->data + offset, len);
-			new.len = op->data.len + len;
-			new.data = new.buffer->data;
-			/* Save new concat'd object. */
-			data_string_forget(&op->data, MDL);
-			data_string_copy(&op->data, &new, MDL);
-			data_string_forget(&new, MDL);
-		} else  {
-			/* ... or we must append this statement onto the
-			 * end of the list.
-			 */
-			while (op->next != NULL)
-				op = op->next;
+		ent = &ix->entries[ix->count++];
+		ent->code = code;
+		ent->offset = offset;
+		ent->length = len;
+		ix->filter[(code & 0xff) >> 3] |= 1 << (code & 7);
+		ix->remaining++;
 
-			if (!option_cache_allocate(&nop, MDL)) {
-				log_error("parse_option_buffer: No memory.");
-				buffer_dereference(&bp, MDL);
-				return (0);
-			}
-
-			option_reference(&nop->option, op->option, MDL);
-
-			nop->data.buffer = NULL;
-			buffer_reference(&nop->data.buffer, bp, MDL);
-			nop->data.data = bp->data + offset;
-			nop->data.len = len;
+		offset += len;
+	}
 
-			option_cache_reference(&op->next, nop, MDL);
-			option_cache_dereference(&nop, MDL);
-		}
+	if (ix != NULL) {
+		if (ix->remaining > 0) {
+			for (ixp = &options->pending; *ixp != NULL;
+			     ixp = &(*ixp)->next)
+				;
+			*ixp = ix;
+			option_state_touch(options);
+
+			/* Only the hashed and linked layouts look at pending
+			   entries; anything else gets its option caches now. */
+			if (universe->lookup_func != lookup_hashed_option &&
+			    universe->lookup_func != lookup_linked_option)
+				materialize_pending(universe, options, 0, 0);
+		} else
+			free_option_index(&ix);
+		buffer_dereference (&bp, MDL);
+	}
 
-		option_dereference(&option, MDL);
-		offset += len;
+	if (reason != NULL) {
+		log_error("parse_option_buffer: malformed option "
+			  "%s.%s (code %u): %s.", universe->name,
+			  option ? option->name : "<unknown>",
+			  bad_code, reason);
+		if (option != NULL)
+			option_dereference(&option, MDL);
+		return 0;
 	}
-	buffer_dereference (&bp, MDL);
+
 	return (1);
 }
 
@@ -541,7 +752,8 @@ cons_options(struct packet *inpacket, struct dhcp_packet *outpacket,
 #define PRIORITY_COUNT 300
 	unsigned priority_list[PRIORITY_COUNT];
 	int priority_len;
-	unsigned char buffer[4096], agentopts[1024];
+	unsigned char agentopts[1024];
+	unsigned char file[DHCP_FILE_LEN], sname[DHCP_SNAME_LEN];
 	unsigned index = 0;
 	unsigned mb_size = 0, mb_max = 0;
 	unsigned option_size = 0, agent_size = 0;
@@ -551,10 +763,12 @@ cons_options(struct packet *inpacket, struct dhcp_packet *outpacket,
 	struct data_string ds;
 	pair pp, *hash;
 	int overload_used = 0;
-	int of1 = 0, of2 = 0;
 
 	memset(&ds, 0, sizeof ds);
 
+	/* The option tables are walked directly below. */
+	materialize_options(NULL, cfg_options);
+
 	/*
 	 * If there's a Maximum Message Size option in the incoming packet
 	 * and no alternate maximum message size has been specified, or
@@ -617,12 +831,12 @@ cons_options(struct packet *inpacket, struct dhcp_packet *outpacket,
 	if (client_state == NULL) {
 		priority_list[0] = DHO_DHCP_AGENT_OPTIONS;
 		priority_len = 1;
-		agent_size = store_options(NULL, agentopts, 0,
-					   sizeof(agentopts),
+		agent_size = store_options(NULL, agentopts, sizeof(agentopts),
+					   NULL, 0, NULL, 0,
 					   inpacket, lease, client_state,
 					   in_options, cfg_options, scope,
 					   priority_list, priority_len,
-					   0, 0, 0, NULL);
+					   0, NULL);
 
 		mb_size += agent_size;
 		if (mb_size > DHCP_MAX_OPTION_LEN)
@@ -630,24 +844,14 @@ cons_options(struct packet *inpacket, struct dhcp_packet *outpacket,
 	}
 
 	/*
-	 * Set offsets for buffer data to be copied into filename
-	 * and servername fields
+	 * Leave room at the end of the options field for the relay
+	 * agent options.
 	 */
 	if (mb_size > agent_size)
 		mb_max = mb_size - agent_size;
 	else
 		mb_max = mb_size;
 
-	if (overload_avail & 1) {
-		of1 = mb_max;
-		mb_max += DHCP_FILE_LEN;
-	}
-
-	if (overload_avail & 2) {
-		of2 = mb_max;
-		mb_max += DHCP_SNAME_LEN;
-	}
-
 	/*
 	 * Preload the option priority list with protocol-mandatory options.
 	 * This effectively gives these options the highest priority.
@@ -804,15 +1008,26 @@ cons_options(struct packet *inpacket, struct dhcp_packet *outpacket,
 	}
 
 	/* Put the cookie up front... */
-	memcpy(buffer, DHCP_OPTIONS_COOKIE, 4);
+	memcpy(outpacket->options, DHCP_OPTIONS_COOKIE, 4);
 	index += 4;
 
-	/* Copy the options into the big buffer... */
-	option_size = store_options(&overload_used, buffer, index, mb_max,
+	/*
+	 * Store the options straight into the packet.  What overflows
+	 * into the filename and servername fields is put aside until we
+	 * know the fields were used, since the caller may have put
+	 * something there.
+	 */
+	option_size = store_options(&overload_used,
+				    &outpacket->options[index],
+				    mb_max - index,
+				    (overload_avail & 1) ? file : NULL,
+				    sizeof(file),
+				    (overload_avail & 2) ? sname : NULL,
+				    sizeof(sname),
 				    inpacket, lease, client_state,
 				    in_options, cfg_options, scope,
 				    priority_list, priority_len,
-				    of1, of2, terminate, vuname);
+				    terminate, vuname);
 
 	/* If store_options() failed */
 	if (option_size == 0)
@@ -829,21 +1044,22 @@ cons_options(struct packet *inpacket, struct dhcp_packet *outpacket,
 		if (mb_size - agent_size - index < 3)
 			return 0;
 
-		buffer[index++] = DHO_DHCP_OPTION_OVERLOAD;
-		buffer[index++] = 1;
-		buffer[index++] = overload_used;
+		outpacket->options[index++] = DHO_DHCP_OPTION_OVERLOAD;
+		outpacket->options[index++] = 1;
+		outpacket->options[index++] = overload_used;
 
 		if (overload_used & 1)
-			memcpy(outpacket->file, &buffer[of1], DHCP_FILE_LEN);
+			memcpy(outpacket->file, file, DHCP_FILE_LEN);
 
 		if (overload_used & 2)
-			memcpy(outpacket->sname, &buffer[of2], DHCP_SNAME_LEN);
+			memcpy(outpacket->sname, sname, DHCP_SNAME_LEN);
 	}
 
 	/* Now copy in preserved agent options, if any */
 	if (agent_size) {
 		if (mb_size - index >= agent_size) {
-			memcpy(&buffer[index], agentopts, agent_size);
+			memcpy(&outpacket->options[index], agentopts,
+			       agent_size);
 			index += agent_size;
 		} else
 			log_error("Unable to store relay agent information "
@@ -852,10 +1068,7 @@ cons_options(struct packet *inpacket, struct dhcp_packet *outpacket,
 
 	/* Tack a DHO_END option onto the packet if we need to. */
 	if (index < mb_size)
-		buffer[index++] = DHO_END;
-
-	/* Copy main buffer into the options buffer of the packet */
-	memcpy(outpacket->options, buffer, index);
+		outpacket->options[index++] = DHO_END;
 
 	/* Figure out the length. */
 	length = DHCP_FIXED_NON_UDP + index;
@@ -1057,6 +1270,9 @@ store_options6(char *buf, int buflen,
 	bufpos = 0;
 	vsio_wanted = 0;
 
+	/* The option tables are walked directly below. */
+	materialize_options(NULL, opt_state);
+
 	/*
 	 * Find the option code for the VSIO universe.
 	 */
@@ -1219,102 +1435,105 @@ store_options6(char *buf, int buflen,
 	return bufpos;
 }
 
+/*
+ * Copy len bytes, starting offset bytes in, of the concatenation of two
+ * data strings; used to write an option whose value is followed by an
+ * encapsulated space without first joining the two.
+ */
+static void
+copy_option_data(unsigned char *dst, struct data_string *first,
+		 struct data_string *second, unsigned offset, unsigned len)
+{
+	unsigned n;
+
+	if (offset < first->len) {
+		n = first->len - offset;
+		if (n > len)
+			n = len;
+		memcpy(dst, first->data + offset, n);
+		dst += n;
+		len -= n;
+		offset = 0;
+	} else
+		offset -= first->len;
+
+	if (len)
+		memcpy(dst, second->data + offset, len);
+}
+
 /*
  * Store all the requested options into the requested buffer.
+ *
+ * Options go into buffer first.  If file and/or sname are not NULL,
+ * options that don't fit are stored there instead (overloaded), and the
+ * bits for the fields that were used are set in *ocount; those fields are
+ * then padded and terminated.  Each option is evaluated once and written
+ * straight into place, split into several hunks where it is too long or
+ * has to cross from one field into the next.
+ *
+ * Returns the number of bytes stored in buffer.
+ *
  * XXX: ought to be static
  */
 int
 store_options(int *ocount,
-	      unsigned char *buffer, unsigned index, unsigned buflen,
+	      unsigned char *buffer, unsigned buflen,
+	      unsigned char *file, unsigned filelen,
+	      unsigned char *sname, unsigned snamelen,
 	      struct packet *packet, struct lease *lease,
 	      struct client_state *client_state,
 	      struct option_state *in_options,
 	      struct option_state *cfg_options,
 	      struct binding_scope **scope,
 	      unsigned *priority_list, int priority_len,
-	      unsigned first_cutoff, int second_cutoff, int terminate,
-	      const char *vuname)
+	      int terminate, const char *vuname)
 {
 	int bufix = 0, six = 0, tix = 0;
 	int i;
 	int ix;
-	int tto;
-	int bufend, sbufend;
+	int mask, routers;
+	unsigned char seen[256 / 8];
 	struct data_string od;
 	struct option_cache *oc;
 	struct option *option = NULL;
 	unsigned code;
 
-	/*
-	 * These arguments are relative to the start of the buffer, so
-	 * reduce them by the current buffer index, and advance the
-	 * buffer pointer to where we're going to start writing.
-	 */
-	buffer = &buffer[index];
-	buflen -= index;
-	if (first_cutoff)
-		first_cutoff -= index;
-	if (second_cutoff)
-		second_cutoff -= index;
-
-	/* Calculate the start and end of each section of the buffer */
-	bufend = sbufend = buflen;
-	if (first_cutoff) {
-	    if (first_cutoff >= buflen)
-		log_fatal("%s:%d:store_options: Invalid first cutoff.", MDL);
-	    bufend = first_cutoff;
-
-	    if (second_cutoff) {
-	        if (second_cutoff >= buflen)
-		    log_fatal("%s:%d:store_options: Invalid second cutoff.",
-			      MDL);
-	        sbufend = second_cutoff;
-	    }
-	} else if (second_cutoff) {
-	    if (second_cutoff >= buflen)
-		log_fatal("%s:%d:store_options: Invalid second cutoff.", MDL);
-	    bufend = second_cutoff;
-	}
-
 	memset (&od, 0, sizeof od);
 
-	/* Eliminate duplicate options from the parameter request list.
-	 * Enforce RFC-mandated ordering of options that are present.
+	/* Eliminate duplicate options from the parameter request list,
+	 * keeping the first of each.
 	 */
-	for (i = 0; i < priority_len; i++) {
-		/* Eliminate duplicates. */
-		tto = 0;
-		for (ix = i + 1; ix < priority_len + tto; ix++) {
-			if (tto)
-				priority_list [ix - tto] =
-					priority_list [ix];
-			if (priority_list [i] == priority_list [ix]) {
-				tto++;
-				priority_len--;
-			}
+	memset(seen, 0, sizeof(seen));
+	mask = routers = -1;
+	for (i = ix = 0; i < priority_len; i++) {
+		code = priority_list[i];
+		if (code < 256) {
+			if (seen[code / 8] & (1 << (code % 8)))
+				continue;
+			seen[code / 8] |= 1 << (code % 8);
 		}
+		if (code == DHO_SUBNET_MASK)
+			mask = ix;
+		else if (code == DHO_ROUTERS)
+			routers = ix;
+		priority_list[ix++] = code;
+	}
+	priority_len = ix;
 
-		/* Enforce ordering of SUBNET_MASK options, according to
-		 * RFC2132 Section 3.3:
-		 *
-		 *   If both the subnet mask and the router option are
-		 *   specified in a DHCP reply, the subnet mask option MUST
-		 *   be first.
-		 *
-		 * This guidance does not specify what to do if the client
-		 * PRL explicitly requests the options out of order, it is
-		 * a general statement.
-		 */
-		if (priority_list[i] == DHO_SUBNET_MASK) {
-			for (ix = i - 1 ; ix >= 0 ; ix--) {
-				if (priority_list[ix] == DHO_ROUTERS) {
-                                        /* swap */
-					priority_list[ix] = DHO_SUBNET_MASK;
-					priority_list[i] = DHO_ROUTERS;
-					break;
-				}
-			}
-		}
+	/* Enforce ordering of SUBNET_MASK options, according to
+	 * RFC2132 Section 3.3:
+	 *
+	 *   If both the subnet mask and the router option are
+	 *   specified in a DHCP reply, the subnet mask option MUST
+	 *   be first.
+	 *
+	 * This guidance does not specify what to do if the client
+	 * PRL explicitly requests the options out of order, it is
+	 * a general statement.
+	 */
+	if (routers >= 0 && mask > routers) {
+		priority_list[routers] = DHO_SUBNET_MASK;
+		priority_list[mask] = DHO_ROUTERS;
 	}
 
 	/* Copy out the options in the order that they appear in the
@@ -1328,6 +1547,7 @@ store_options(int *ocount,
 	    int have_encapsulation = 0;
 	    struct data_string encapsulation;
 	    int splitup;
+	    int tto;
 
 	    memset (&encapsulation, 0, sizeof encapsulation);
 	    have_encapsulation = 0;
@@ -1444,39 +1664,14 @@ store_options(int *ocount,
 		}
 	    }
 
-	    /* We should now have a constant length for the option. */
+	    /* We should now have a constant length for the option.  Any
+	     * encapsulated options follow the value; they are copied
+	     * from where they are rather than joined to it first.
+	     */
 	    length = od.len;
-	    if (have_encapsulation) {
+	    if (have_encapsulation)
 		    length += encapsulation.len;
 
-		    /* od.len can be nonzero if we got here without an
-		     * oc (cache lookup failed), but did have an encapsulated
-		     * simple encapsulation space.
-		     */
-		    if (!od.len) {
-			    data_string_copy (&od, &encapsulation, MDL);
-			    data_string_forget (&encapsulation, MDL);
-		    } else {
-			    struct buffer *bp = (struct buffer *)0;
-			    if (!buffer_allocate (&bp, length, MDL)) {
-				    option_cache_dereference (&oc, MDL);
-				    data_string_forget (&od, MDL);
-				    data_string_forget (&encapsulation, MDL);
-				    continue;
-			    }
-			    memcpy (&bp -> data [0], od.data, od.len);
-			    memcpy (&bp -> data [od.len], encapsulation.data,
-				    encapsulation.len);
-			    data_string_forget (&od, MDL);
-			    data_string_forget (&encapsulation, MDL);
-			    od.data = &bp -> data [0];
-			    buffer_reference (&od.buffer, bp, MDL);
-			    buffer_dereference (&bp, MDL);
-			    od.len = length;
-			    od.terminated = 0;
-		    }
-	    }
-
 	    /* Do we add a NUL? */
 	    if (terminate && option && format_has_text(option->format)) {
 		    length++;
@@ -1509,43 +1704,50 @@ store_options(int *ocount,
 		    /* Try to fit it in the options buffer. */
 		    if (!splitup &&
 			((!six && !tix && (i == priority_len - 1) &&
-			  (bufix + 2 + length < bufend)) ||
-			 (bufix + 5 + length < bufend))) {
+			  (bufix + 2 + length < buflen)) ||
+			 (bufix + 5 + length < buflen))) {
 			base = buffer;
 			pix = &bufix;
-		    /* Try to fit it in the second buffer. */
-		    } else if (!splitup && first_cutoff &&
-			       (first_cutoff + six + 3 + length < sbufend)) {
-			base = &buffer[first_cutoff];
+		    /* Try to fit it in the file field. */
+		    } else if (!splitup && file &&
+			       (six + 3 + length < filelen)) {
+			base = file;
 			pix = &six;
-		    /* Try to fit it in the third buffer. */
-		    } else if (!splitup && second_cutoff &&
-			       (second_cutoff + tix + 3 + length < buflen)) {
-			base = &buffer[second_cutoff];
+		    /* Try to fit it in the sname field. */
+		    } else if (!splitup && sname &&
+			       (tix + 3 + length < snamelen)) {
+			base = sname;
 			pix = &tix;
 		    /* Split the option up into the remaining space. */
 		    } else {
 			splitup = 1;
 
 			/* Use any remaining options space. */
-			if (bufix + 6 < bufend) {
-			    incr = bufend - bufix - 5;
+			if (bufix + 6 < buflen) {
+			    incr = buflen - bufix - 5;
 			    base = buffer;
 			    pix = &bufix;
-			/* Use any remaining first_cutoff space. */
-			} else if (first_cutoff &&
-				   (first_cutoff + six + 4 < sbufend)) {
-			    incr = sbufend - (first_cutoff + six) - 3;
-			    base = &buffer[first_cutoff];
+			/* Use any remaining file space. */
+			} else if (file && (six + 4 < filelen)) {
+			    incr = filelen - six - 3;
+			    base = file;
 			    pix = &six;
-			/* Use any remaining second_cutoff space. */
-			} else if (second_cutoff &&
-				   (second_cutoff + tix + 4 < buflen)) {
-			    incr = buflen - (second_cutoff + tix) - 3;
-			    base = &buffer[second_cutoff];
+			/* Use any remaining sname space. */
+			} else if (sname && (tix + 4 < snamelen)) {
+			    incr = snamelen - tix - 3;
+			    base = sname;
 			    pix = &tix;
-			/* Give up, roll back this option. */
+			/* Give up, roll back this option.  Clear what
+			   was stored of it, since the caller may send
+			   the buffer past the end of the options. */
 			} else {
+			    memset (buffer + optstart, 0, bufix - optstart);
+			    if (file)
+				memset (file + soptstart, 0,
+					six - soptstart);
+			    if (sname)
+				memset (sname + toptstart, 0,
+					tix - toptstart);
 			    bufix = optstart;
 			    six = soptstart;
 			    tix = toptstart;
@@ -1563,49 +1765,49 @@ store_options(int *ocount,
 		    base [*pix + 1] = (unsigned char)incr;
 		    if (tto && incr == length) {
 			    if (incr > 1)
-				memcpy (base + *pix + 2,
-					od.data + ix, (unsigned)(incr - 1));
+				copy_option_data (base + *pix + 2,
+						  &od, &encapsulation, ix,
+						  incr - 1);
 			    base [*pix + 2 + incr - 1] = 0;
 		    } else {
-			    memcpy (base + *pix + 2,
-				    od.data + ix, (unsigned)incr);
+			    copy_option_data (base + *pix + 2,
+					      &od, &encapsulation, ix, incr);
 		    }
 		    length -= incr;
 		    ix += incr;
 		    *pix += 2 + incr;
 	    }
 	    data_string_forget (&od, MDL);
+	    data_string_forget (&encapsulation, MDL);
 	}
 
 	if (option != NULL)
 	    option_dereference(&option, MDL);
 
 	/* If we can overload, and we have, then PAD and END those spaces. */
-	if (first_cutoff && six) {
-	    if ((first_cutoff + six + 1) < sbufend)
-		memset (&buffer[first_cutoff + six + 1], DHO_PAD,
-			sbufend - (first_cutoff + six + 1));
-	    else if (first_cutoff + six >= sbufend)
+	if (file && six) {
+	    if (six + 1 < filelen)
+		memset (&file[six + 1], DHO_PAD, filelen - (six + 1));
+	    else if (six >= filelen)
 		log_fatal("Second buffer overflow in overloaded options.");
 
-	    buffer[first_cutoff + six] = DHO_END;
+	    file[six] = DHO_END;
 	    if (ocount != NULL)
 	    	*ocount |= 1; /* So that caller knows there's data there. */
 	}
 
-	if (second_cutoff && tix) {
-	    if (second_cutoff + tix + 1 < buflen) {
-		memset (&buffer[second_cutoff + tix + 1], DHO_PAD,
-			buflen - (second_cutoff + tix + 1));
-	    } else if (second_cutoff + tix >= buflen)
+	if (sname && tix) {
+	    if (tix + 1 < snamelen)
+		memset (&sname[tix + 1], DHO_PAD, snamelen - (tix + 1));
+	    else if (tix >= snamelen)
 		log_fatal("Third buffer overflow in overloaded options.");
 
-	    buffer[second_cutoff + tix] = DHO_END;
+	    sname[tix] = DHO_END;
 	    if (ocount != NULL)
 	    	*ocount |= 2; /* So that caller knows there's data there. */
 	}
 
-	if ((six || tix) && (bufix + 3 > bufend))
+	if ((six || tix) && (bufix + 3 > buflen))
 	    log_fatal("Not enough space for option overload option.");
 
 	return bufix;
@@ -2439,6 +2641,9 @@ struct option_cache *lookup_hashed_option (universe, options, code)
 	pair bptr;
 	pair *hash;
 
+	if (options -> pending)
+		materialize_pending (universe, options, 1, code);
+
 	/* Make sure there's a hash table. */
 	if (universe -> index >= options -> universe_count ||
 	    !(options -> universes [universe -> index]))
@@ -2676,6 +2881,7 @@ build_server_oro(struct data_string *server_oro,
 	 * Count the number of options, so we can allocate enough memory.
 	 * We want to mention sub-options too, so check all universes.
 	 */
+	materialize_options(NULL, options);
 	num_opts = 0;
 	option_space_foreach(NULL, NULL, NULL, NULL, options,
 			     NULL, &dhcpv6_universe, (void *)&num_opts,
@@ -2733,9 +2939,10 @@ void
 save_option(struct universe *universe, struct option_state *options,
 	    struct option_cache *oc)
 {
-	if (universe->save_func)
+	if (universe->save_func) {
 		(*universe->save_func)(universe, options, oc, ISC_FALSE);
-	else
+		option_state_touch(options);
+	} else
 		log_error("can't store options in %s space.", universe->name);
 }
 
@@ -2744,9 +2951,10 @@ void
 also_save_option(struct universe *universe, struct option_state *options,
 		 struct option_cache *oc)
 {
-	if (universe->save_func)
+	if (universe->save_func) {
 		(*universe->save_func)(universe, options, oc, ISC_TRUE);
-	else
+		option_state_touch(options);
+	} else
 		log_error("can't store options in %s space.", universe->name);
 }
 
@@ -2762,6 +2970,18 @@ save_hashed_option(struct universe *universe, struct option_state *options,
 	if (oc -> refcnt == 0)
 		abort ();
 
+	/* An option from a parsed buffer that hasn't been looked at yet is
+	   either replaced by this one or must come before it. */
+	if (options -> pending) {
+		if (appendp)
+			materialize_pending (universe, options,
+					     1, oc -> option -> code);
+		else
+			discard_pending (universe, options,
+					 oc -> option -> code);
+		hash = options -> universes [universe -> index];
+	}
+
 	/* Compute the hash. */
 	hashix = compute_option_hash (oc -> option -> code);
 
@@ -2823,9 +3043,10 @@ void delete_option (universe, options, code)
 	struct option_state *options;
 	int code;
 {
-	if (universe -> delete_func)
+	if (universe -> delete_func) {
 		(*universe -> delete_func) (universe, options, code);
-	else
+		option_state_touch (options);
+	} else
 		log_error ("can't delete options from %s space.",
 			   universe -> name);
 }
@@ -2837,7 +3058,11 @@ void delete_hashed_option (universe, options, code)
 {
 	int hashix;
 	pair bptr, prev = (pair)0;
-	pair *hash = options -> universes [universe -> index];
+	pair *hash;
+
+	if (options -> pending)
+		discard_pending (universe, options, code);
+	hash = options -> universes [universe -> index];
 
 	/* There may not be any options in this space. */
 	if (!hash)
@@ -3179,6 +3404,7 @@ int hashed_option_space_encapsulate (result, packet, lease, client_state,
 	if (universe -> index >= cfg_options -> universe_count)
 		return 0;
 
+	materialize_options (universe, cfg_options);
 	hash = cfg_options -> universes [universe -> index];
 	if (!hash)
 		return 0;
@@ -3223,6 +3449,7 @@ int nwip_option_space_encapsulate (result, packet, lease, client_state,
 
 	if (universe -> index >= cfg_options -> universe_count)
 		return 0;
+	materialize_options (&nwip_universe, cfg_options);
 	head = ((struct option_chain_head *)
 		cfg_options -> universes [nwip_universe.index]);
 	if (!head)
@@ -3351,6 +3578,7 @@ int fqdn_option_space_encapsulate (result, packet, lease, client_state,
 	/* If there's no FQDN universe, don't encapsulate. */
 	if (fqdn_universe.index >= cfg_options -> universe_count)
 		return 0;
+	materialize_options (&fqdn_universe, cfg_options);
 	head = ((struct option_chain_head *)
 		cfg_options -> universes [fqdn_universe.index]);
 	if (!head)
@@ -3521,6 +3749,7 @@ fqdn6_option_space_encapsulate(struct data_string *result,
 
 	if (fqdn_universe.index >= cfg_options->universe_count)
 		return 0;
+	materialize_options(&fqdn_universe, cfg_options);
 	head = ((struct option_chain_head *)
 		cfg_options->universes[fqdn_universe.index]);
 	if (head == NULL)
@@ -3768,6 +3997,7 @@ void hashed_option_space_foreach (struct packet *packet, struct lease *lease,
 	if (cfg_options -> universe_count <= u -> index)
 		return;
 
+	materialize_options (u, cfg_options);
 	hash = cfg_options -> universes [u -> index];
 	if (!hash)
 		return;
@@ -3792,6 +4022,14 @@ save_linked_option(struct universe *universe, struct option_state *options,
 
 	if (universe -> index >= options -> universe_count)
 		return;
+	if (options -> pending) {
+		if (appendp)
+			materialize_pending (universe, options,
+					     1, oc -> option -> code);
+		else
+			discard_pending (universe, options,
+					 oc -> option -> code);
+	}
 	head = ((struct option_chain_head *)
 		options -> universes [universe -> index]);
 	if (!head) {
@@ -3844,6 +4082,7 @@ int linked_option_space_encapsulate (result, packet, lease, client_state,
 
 	if (universe -> index >= cfg_options -> universe_count)
 		return status;
+	materialize_options (universe, cfg_options);
 	head = ((struct option_chain_head *)
 		cfg_options -> universes [universe -> index]);
 	if (!head)
@@ -3873,6 +4112,8 @@ void delete_linked_option (universe, options, code)
 
 	if (universe -> index >= options -> universe_count)
 		return;
+	if (options -> pending)
+		discard_pending (universe, options, code);
 	head = ((struct option_chain_head *)
 		options -> universes [universe -> index]);
 	if (!head)
@@ -3902,6 +4143,8 @@ struct option_cache *lookup_linked_option (universe, options, code)
 
 	if (universe -> index >= options -> universe_count)
 		return 0;
+	if (options -> pending)
+		materialize_pending (universe, options, 1, code);
 	head = ((struct option_chain_head *)
 		options -> universes [universe -> index]);
 	if (!head)
@@ -3948,6 +4191,7 @@ void linked_option_space_foreach (struct packet *packet, struct lease *lease,
 
 	if (u -> index >= cfg_options -> universe_count)
 		return;
+	materialize_options (u, cfg_options);
 	head = ((struct option_chain_head *)
 		cfg_options -> universes [u -> index]);
 	if (!head)
@@ -39,42 +39,65 @@
 #include "includes/netinet/if_ether.h"
 #endif /* PACKET_ASSEMBLY || PACKET_DECODING */
 
-/* Compute the easy part of the checksum on a range of bytes. */
+/* Compute the easy part of the checksum on a range of bytes.
+
+   The one's complement sum is independent of byte order (RFC 1071), so
+   the buffer is added up 32 bits at a time in host order into a 64-bit
+   accumulator, which can't overflow for anything we handle, and the
+   carries are folded and the result put into network order only once at
+   the end.   The result is the same as adding up the buffer one network
+   order 16-bit word at a time. */
 
 u_int32_t checksum (buf, nbytes, sum)
 	unsigned char *buf;
 	unsigned nbytes;
 	u_int32_t sum;
 {
-	unsigned i;
+	unsigned i = 0;
+	u_int64_t acc = 0;
+	u_int32_t w0, w1, w2, w3;
+	u_int16_t half;
 
 #ifdef DEBUG_CHECKSUM
 	log_debug ("checksum (%x %d %x)", (unsigned)buf, nbytes, sum);
 #endif
 
-	/* Checksum all the pairs of bytes first... */
-	for (i = 0; i < (nbytes & ~1U); i += 2) {
+	/* The buffer may not be aligned, so words are fetched with memcpy,
+	   which compilers turn into plain loads where that is allowed. */
+	for (; i + 16 <= nbytes; i += 16) {
+		memcpy (&w0, buf + i, 4);
+		memcpy (&w1, buf + i + 4, 4);
+		memcpy (&w2, buf + i + 8, 4);
+		memcpy (&w3, buf + i + 12, 4);
+		acc += (u_int64_t)w0 + w1 + w2 + w3;
+	}
+	for (; i + 4 <= nbytes; i += 4) {
+		memcpy (&w0, buf + i, 4);
+		acc += w0;
+	}
+	if (i + 2 <= nbytes) {
+		memcpy (&half, buf + i, 2);
+		acc += half;
+		i += 2;
+	}
+
+	/* Fold the carries back in. */
+	while (acc >> 16)
+		acc = (acc & 0xFFFF) + (acc >> 16);
 #ifdef DEBUG_CHECKSUM_VERBOSE
-		log_debug ("sum = %x", sum);
+	log_debug ("sum = %x", (unsigned)ntohs ((u_int16_t)acc));
 #endif
-		sum += (u_int16_t) ntohs(*((u_int16_t *)(buf + i)));
-		/* Add carry. */
-		if (sum > 0xFFFF)
-			sum -= 0xFFFF;
-	}	
+	sum += ntohs ((u_int16_t)acc);
 
 	/* If there's a single byte left over, checksum it, too.   Network
 	   byte order is big-endian, so the remaining byte is the high byte. */
-	if (i < nbytes) {
-#ifdef DEBUG_CHECKSUM_VERBOSE
-		log_debug ("sum = %x", sum);
-#endif
+	if (i < nbytes)
 		sum += buf [i] << 8;
-		/* Add carry. */
-		if (sum > 0xFFFF)
-			sum -= 0xFFFF;
-	}
-	
+
+	/* Add carry. */
+	while (sum > 0xFFFF)
+		sum = (sum & 0xFFFF) + (sum >> 16);
+
 	return sum;
 }
 
@@ -2328,10 +2328,9 @@ int parse_executable_statement (result, cfile, lose, case_context)
 		if (!executable_statement_allocate (result, MDL))
 			log_fatal ("no memory for set statement.");
 		(*result) -> op = flag ? define_statement : set_statement;
-		(*result) -> data.set.name = dmalloc (strlen (val) + 1, MDL);
+		(*result) -> data.set.name = binding_name (val);
 		if (!(*result)->data.set.name)
 			log_fatal ("can't allocate variable name");
-		strcpy ((*result) -> data.set.name, val);
 		token = next_token (&val, (unsigned *)0, cfile);
 
 		if (token == LPAREN) {
@@ -2448,10 +2447,9 @@ int parse_executable_statement (result, cfile, lose, case_context)
 		if (!executable_statement_allocate (result, MDL))
 			log_fatal ("no memory for set statement.");
 		(*result) -> op = unset_statement;
-		(*result) -> data.unset = dmalloc (strlen (val) + 1, MDL);
+		(*result) -> data.unset = binding_name (val);
 		if (!(*result)->data.unset)
 			log_fatal ("can't allocate variable name");
-		strcpy ((*result) -> data.unset, val);
 		if (!parse_semi (cfile)) {
 			*lose = 1;
 			executable_statement_dereference (result, MDL);
@@ -3562,7 +3560,7 @@ int parse_non_binary (expr, cfile, lose, context)
 	struct collection *col;
 	struct expression *nexp, **ep;
 	int known;
-	char *cptr;
+	const char *cptr;
 	isc_result_t status;
 	unsigned len;
 
@@ -4318,10 +4316,9 @@ int parse_non_binary (expr, cfile, lose, context)
 		if (!expression_allocate (expr, MDL))
 			log_fatal ("can't allocate expression");
 		(*expr) -> op = expr_variable_exists;
-		(*expr) -> data.variable = dmalloc (strlen (val) + 1, MDL);
+		(*expr) -> data.variable = binding_name (val);
 		if (!(*expr)->data.variable)
 			log_fatal ("can't allocate variable name");
-		strcpy ((*expr) -> data.variable, val);
 		token = next_token (&val, (unsigned *)0, cfile);
 		if (token != RPAREN)
 			goto norparen;
@@ -4403,10 +4400,9 @@ int parse_non_binary (expr, cfile, lose, context)
 		skip_token(&val, (unsigned *)0, cfile);
 
 		/* Save the name of the variable being referenced. */
-		cptr = dmalloc (strlen (val) + 1, MDL);
+		cptr = binding_name (val);
 		if (!cptr)
 			log_fatal ("can't allocate variable name");
-		strcpy (cptr, val);
 
 		/* Simple variable reference, as far as we can tell. */
 		token = peek_token (&val, (unsigned *)0, cfile);
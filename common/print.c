@@ -274,6 +274,8 @@ void dump_packet (tp)
 	if (tp -> options_valid) {
 		int i;
 
+		/* The option tables are walked directly below. */
+		materialize_options (NULL, tp -> options);
 		for (i = 0; i < tp -> options -> universe_count; i++) {
 			if (tp -> options -> universes [i]) {
 				option_space_foreach (tp, (struct lease *)0,
@@ -16,6 +16,7 @@
 
 #include <config.h>
 #include <atf-c.h>
+#include <sys/socket.h>
 #include "dhcpd.h"
 
 struct basic_test {
@@ -217,6 +218,218 @@ ATF_TC_BODY(print_hex_only, tc)
     }
 }
     	
+/* Byte-at-a-time reference for checksum(), as it was originally written. */
+static u_int32_t
+reference_checksum(unsigned char *buf, unsigned nbytes, u_int32_t sum)
+{
+    unsigned i;
+
+    for (i = 0; i < (nbytes & ~1U); i += 2) {
+	sum += (buf[i] << 8) | buf[i + 1];
+	if (sum > 0xFFFF)
+	    sum -= 0xFFFF;
+    }
+    if (i < nbytes) {
+	sum += buf[i] << 8;
+	if (sum > 0xFFFF)
+	    sum -= 0xFFFF;
+    }
+    return (sum);
+}
+
+ATF_TC(checksum_values);
+
+ATF_TC_HEAD(checksum_values, tc)
+{
+    atf_tc_set_md_var(tc, "descr",
+		      "Verify checksum() against a bytewise reference.");
+}
+
+/* Check every length up to a full ethernet frame, at every alignment,
+ * with random data, all-ones data (lots of carries) and a running sum
+ * carried in from a previous call.
+ */
+ATF_TC_BODY(checksum_values, tc)
+{
+    unsigned char buf[1500 + 8];
+    unsigned len, align, i;
+    u_int32_t initial, expect, got;
+
+    srandom(1);
+    for (len = 0; len <= 1500; len++) {
+	for (align = 0; align < 8; align++) {
+	    for (i = 0; i < sizeof(buf); i++) {
+		buf[i] = (len & 1) ? 0xFF : random();
+	    }
+	    initial = (len * 7 + align) & 0xFFFF;
+	    expect = reference_checksum(buf + align, len, initial);
+	    got = checksum(buf + align, len, initial);
+	    if (expect != got) {
+		atf_tc_fail("checksum of %u bytes at offset %u: "
+			    "expected %x, got %x", len, align, expect, got);
+	    }
+	}
+    }
+}
+
+/* The xids of the packets got_one() hands to the server, in order. */
+static u_int32_t rxq_seen[64];
+static int rxq_nseen;
+
+static void
+rxq_handler(struct interface_info *ip, struct dhcp_packet *packet,
+	    unsigned len, unsigned from_port, struct iaddr from,
+	    struct hardware *hfrom)
+{
+    if (rxq_nseen < sizeof(rxq_seen) / sizeof(rxq_seen[0])) {
+	rxq_seen[rxq_nseen++] = ntohl(packet->xid);
+    }
+}
+
+/* Write a DHCP request to fd, framed the way it would arrive on an
+ * Ethernet interface.  A renewing client fills in ciaddr.
+ */
+static void
+rxq_send(struct interface_info *ip, int fd, u_int32_t xid, int type,
+	 int renewing)
+{
+    struct dhcp_packet raw;
+    unsigned char frame[1536];
+    unsigned char *opt;
+    unsigned len, bufix = 0;
+
+    memset(&raw, 0, sizeof(raw));
+    raw.op = BOOTREQUEST;
+    raw.htype = HTYPE_ETHER;
+    raw.hlen = 6;
+    raw.xid = htonl(xid);
+    if (renewing) {
+	raw.ciaddr.s_addr = htonl(0x0a000001);
+    }
+    memcpy(raw.options, DHCP_OPTIONS_COOKIE, 4);
+    opt = &raw.options[4];
+    *opt++ = DHO_DHCP_MESSAGE_TYPE;
+    *opt++ = 1;
+    *opt++ = type;
+    *opt++ = DHO_END;
+    len = DHCP_FIXED_NON_UDP + (opt - raw.options);
+
+    assemble_hw_header(ip, frame, &bufix, NULL);
+    assemble_udp_ip_header(ip, frame, &bufix, htonl(0x0a000001),
+			   htonl(INADDR_BROADCAST), local_port,
+			   (unsigned char *)&raw, len);
+    memcpy(&frame[bufix], &raw, len);
+    bufix += len;
+    if (send(fd, frame, bufix, 0) != bufix) {
+	atf_tc_fail("can't send packet %u: %s", xid, strerror(errno));
+    }
+}
+
+ATF_TC(receive_queue);
+
+ATF_TC_HEAD(receive_queue, tc)
+{
+    atf_tc_set_md_var(tc, "descr",
+		      "Verify the receive queue's length limit and drop "
+		      "policies.");
+}
+
+/* Fill the queue with discovers, leaving four of them queued after the
+ * first batch, then fill it up again and send four renewals.  Dropping
+ * the lowest priority makes room for the renewals by dropping the four
+ * oldest discovers; dropping the newest loses the renewals.
+ */
+ATF_TC_BODY(receive_queue, tc)
+{
+    static const int policies[] = { RXQ_DROP_LOWEST, RXQ_DROP_NEWEST };
+    struct interface_info *ip;
+    u_int32_t xid;
+    int fds[2], p, i, n;
+
+    dhcp_context_create(DHCP_CONTEXT_PRE_DB | DHCP_CONTEXT_POST_DB,
+			NULL, NULL);
+    if (omapi_init() != ISC_R_SUCCESS) {
+	atf_tc_fail("can't initialize OMAPI");
+    }
+    dhcp_common_objects_setup();
+    bootp_packet_handler = rxq_handler;
+    local_port = htons(67);
+
+    for (p = 0; p < sizeof(policies) / sizeof(policies[0]); p++) {
+	ip = NULL;
+	if (interface_allocate(&ip, MDL) != ISC_R_SUCCESS) {
+	    atf_tc_fail("can't allocate interface");
+	}
+	strcpy(ip->name, "rxq");
+	ip->hw_address.hlen = 7;
+	ip->hw_address.hbuf[0] = HTYPE_ETHER;
+	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, fds) < 0) {
+	    atf_tc_fail("socketpair: %s", strerror(errno));
+	}
+	ip->rfdesc = fds[0];
+
+	rx_queue_length = RXQ_SERVICE_BATCH + 4;
+	rx_queue_drop_policy = policies[p];
+	memset(&rx_queue_stats, 0, sizeof(rx_queue_stats));
+
+	/* One batch of discovers is handled, the rest wait. */
+	rxq_nseen = 0;
+	for (xid = 1; xid <= rx_queue_length; xid++) {
+	    rxq_send(ip, fds[1], xid, DHCPDISCOVER, 0);
+	}
+	ATF_CHECK_EQ(got_one((omapi_object_t *)ip), ISC_R_SUCCESS);
+	ATF_REQUIRE_EQ(rxq_nseen, RXQ_SERVICE_BATCH);
+	for (i = 0; i < rxq_nseen; i++) {
+	    ATF_CHECK_EQ(rxq_seen[i], i + 1);
+	}
+	ATF_CHECK_EQ(rx_queue_stats.depth, 4);
+
+	/* Now a full queue meets the renewals. */
+	rxq_nseen = 0;
+	for (xid = 101; xid < 101 + RXQ_SERVICE_BATCH; xid++) {
+	    rxq_send(ip, fds[1], xid, DHCPDISCOVER, 0);
+	}
+	for (xid = 201; xid < 205; xid++) {
+	    rxq_send(ip, fds[1], xid, DHCPREQUEST, 1);
+	}
+	ATF_CHECK_EQ(got_one((omapi_object_t *)ip), ISC_R_SUCCESS);
+	ATF_REQUIRE_EQ(rxq_nseen, RXQ_SERVICE_BATCH);
+
+	n = 0;
+	if (policies[p] == RXQ_DROP_LOWEST) {
+	    /* The renewals go first, and the oldest discovers are gone. */
+	    for (xid = 201; xid < 205; xid++) {
+		ATF_CHECK_EQ(rxq_seen[n++], xid);
+	    }
+	    ATF_CHECK_EQ(rx_queue_stats.dropped[RXQ_LOW], 4);
+	    ATF_CHECK_EQ(rx_queue_stats.dropped[RXQ_HIGH], 0);
+	    ATF_CHECK_EQ(rx_queue_stats.queued[RXQ_HIGH], 4);
+	} else {
+	    /* The renewals are dropped, the discovers wait their turn. */
+	    for (xid = RXQ_SERVICE_BATCH + 1; xid <= RXQ_SERVICE_BATCH + 4;
+		 xid++) {
+		ATF_CHECK_EQ(rxq_seen[n++], xid);
+	    }
+	    ATF_CHECK_EQ(rx_queue_stats.dropped[RXQ_LOW], 0);
+	    ATF_CHECK_EQ(rx_queue_stats.dropped[RXQ_HIGH], 4);
+	    ATF_CHECK_EQ(rx_queue_stats.queued[RXQ_HIGH], 0);
+	}
+	for (xid = 101; n < rxq_nseen; xid++) {
+	    ATF_CHECK_EQ(rxq_seen[n++], xid);
+	}
+	ATF_CHECK_EQ(rx_queue_stats.depth, 4);
+	ATF_CHECK_EQ(rx_queue_stats.high_water, rx_queue_length);
+
+	close(fds[0]);
+	close(fds[1]);
+	ip->rfdesc = -1;
+	interface_dereference(&ip, MDL);
+    }
+
+    rx_queue_length = 0;
+    bootp_packet_handler = NULL;
+}
+
 /* This macro defines main() method that will call specified
    test cases. tp and simple_test_case names can be whatever you want
    as long as it is a valid variable identifier. */
@@ -225,6 +438,8 @@ ATF_TP_ADD_TCS(tp)
     ATF_TP_ADD_TC(tp, find_percent_basic);
     ATF_TP_ADD_TC(tp, find_percent_adv);
     ATF_TP_ADD_TC(tp, print_hex_only);
+    ATF_TP_ADD_TC(tp, checksum_values);
+    ATF_TP_ADD_TC(tp, receive_queue);
 
     return (atf_no_error());
 }
@@ -68,6 +68,555 @@ ATF_TC_BODY(option_refcnt, tc)
     }
 }
 
+ATF_TC(option_lazy_parse);
+
+ATF_TC_HEAD(option_lazy_parse, tc)
+{
+    atf_tc_set_md_var(tc, "descr",
+		      "Verify options are decoded on demand from the parse "
+		      "index.");
+}
+
+/* parse_option_buffer() only records where each option lives; check that
+ * looking an option up builds the cache, that duplicates are concatenated
+ * as RFC 3396 requires, and that deleted options don't come back.
+ */
+ATF_TC_BODY(option_lazy_parse, tc)
+{
+    struct option_state *options;
+    struct option_cache *oc;
+    unsigned char buffer[] = {
+	12, 2, 'a', 'b',		/* host-name "ab" */
+	0,				/* pad */
+	15, 3, 'o', 'r', 'g',		/* domain-name "org" */
+	12, 2, 'c', 'd',		/* host-name "cd" */
+	51, 4, 0, 0, 0x0e, 0x10,	/* dhcp-lease-time 3600 */
+	255
+    };
+
+    initialize_common_option_spaces();
+
+    options = NULL;
+    if (!option_state_allocate(&options, MDL)) {
+	atf_tc_fail("can't allocate option state");
+    }
+
+    if (!parse_option_buffer(options, buffer, sizeof(buffer),
+			     &dhcp_universe)) {
+	atf_tc_fail("parse_option_buffer failed");
+    }
+
+    if (options->pending == NULL) {
+	atf_tc_fail("no pending options after parse");
+    }
+    if (options->universes[dhcp_universe.index] != NULL) {
+	atf_tc_fail("options were decoded eagerly");
+    }
+
+    oc = lookup_option(&dhcp_universe, options, 12);
+    if (oc == NULL) {
+	atf_tc_fail("host-name not found");
+    }
+    if (oc->data.len != 4 || memcmp(oc->data.data, "abcd", 4) != 0) {
+	atf_tc_fail("host-name duplicates were not concatenated");
+    }
+
+    delete_option(&dhcp_universe, options, 15);
+    if (lookup_option(&dhcp_universe, options, 15) != NULL) {
+	atf_tc_fail("deleted domain-name came back");
+    }
+
+    oc = lookup_option(&dhcp_universe, options, 51);
+    if (oc == NULL || oc->data.len != 4) {
+	atf_tc_fail("dhcp-lease-time not found");
+    }
+    if (options->pending != NULL) {
+	atf_tc_fail("pending entries left after all were used");
+    }
+
+    option_state_dereference(&options, MDL);
+}
+
+ATF_TC(expression_bytecode);
+
+ATF_TC_HEAD(expression_bytecode, tc)
+{
+    atf_tc_set_md_var(tc, "descr",
+		      "Verify compiled expressions agree with the tree "
+		      "walker.");
+}
+
+/* Evaluate each expression by walking its tree, then compile it and check
+ * that the program gives the same answer.
+ */
+ATF_TC_BODY(expression_bytecode, tc)
+{
+    static const struct {
+	const char *text;
+	int status;
+	int result;
+    } tests[] = {
+	{ "substring (option host-name, 0, 2) = \"ab\"", 1, 1 },
+	{ "suffix (option host-name, 2) = \"cd\"", 1, 1 },
+	{ "substring (option host-name, 9, 2) = \"\"", 1, 1 },
+	{ "extract-int (option dhcp-lease-time, 32) = 3600", 1, 1 },
+	{ "option domain-name = \"org\" and not exists dhcp-lease-time", 1, 0 },
+	{ "not exists domain-name and exists host-name", 0, 0 },
+	{ "exists host-name or known", 1, 1 },
+	{ "known or exists domain-name", 1, 1 },
+	{ "hardware = 1:2:3:4:5:6:7", 1, 1 },
+	{ "substring (hardware, 1, 3) = 2:3:4", 1, 1 },
+	{ "packet (0, 2) = 1:1", 1, 1 },
+	{ "not (substring (option vendor-class-identifier, 0, 4) = \"MSFT\")",
+	  1, 1 },
+	{ "\"a\" = \"a\" and option host-name = \"zz\"", 1, 0 },
+	{ "\"a\" = \"b\" or substring (\"abc\", 1, 1) = \"b\"", 1, 1 },
+    };
+    unsigned char buffer[] = {
+	12, 4, 'a', 'b', 'c', 'd',	/* host-name "abcd" */
+	15, 3, 'o', 'r', 'g',		/* domain-name "org" */
+	51, 4, 0, 0, 0x0e, 0x10,	/* dhcp-lease-time 3600 */
+	255
+    };
+    struct dhcp_packet raw;
+    struct packet packet;
+    struct option_state *options;
+    struct expression *expr;
+    struct parse *cfile;
+    int i, lose, tree_status, tree_result, vm_status, vm_result;
+
+    initialize_common_option_spaces();
+
+    options = NULL;
+    if (!option_state_allocate(&options, MDL) ||
+	!parse_option_buffer(options, buffer, sizeof(buffer),
+			     &dhcp_universe)) {
+	atf_tc_fail("can't set up options");
+    }
+
+    memset(&raw, 0, sizeof(raw));
+    raw.op = BOOTREQUEST;
+    raw.htype = HTYPE_ETHER;
+    raw.hlen = 6;
+    raw.chaddr[0] = 2; raw.chaddr[1] = 3; raw.chaddr[2] = 4;
+    raw.chaddr[3] = 5; raw.chaddr[4] = 6; raw.chaddr[5] = 7;
+
+    memset(&packet, 0, sizeof(packet));
+    packet.raw = &raw;
+    packet.packet_length = DHCP_FIXED_NON_UDP;
+    packet.options = options;
+
+    for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+	cfile = NULL;
+	expr = NULL;
+	lose = 0;
+	if (new_parse(&cfile, -1, (char *)tests[i].text,
+		      strlen(tests[i].text), "test", 0) != ISC_R_SUCCESS ||
+	    !parse_boolean_expression(&expr, cfile, &lose)) {
+	    atf_tc_fail("can't parse %s", tests[i].text);
+	}
+	end_parse(&cfile);
+
+	tree_result = vm_result = -1;
+	tree_status = evaluate_boolean_expression(&tree_result, &packet,
+						  NULL, NULL, options, NULL,
+						  NULL, expr);
+	if (tree_status != tests[i].status ||
+	    (tree_status && tree_result != tests[i].result)) {
+	    atf_tc_fail("%s: tree walker returned %d/%d", tests[i].text,
+			tree_status, tree_result);
+	}
+
+	expression_compile(expr);
+	if (expr->program == NULL) {
+	    atf_tc_fail("%s was not compiled", tests[i].text);
+	}
+	vm_status = evaluate_boolean_expression(&vm_result, &packet,
+						NULL, NULL, options, NULL,
+						NULL, expr);
+	if (vm_status != tree_status ||
+	    (vm_status && vm_result != tree_result)) {
+	    atf_tc_fail("%s: program returned %d/%d, tree %d/%d",
+			tests[i].text, vm_status, vm_result,
+			tree_status, tree_result);
+	}
+
+	expression_dereference(&expr, MDL);
+    }
+
+    if (packet.memo != NULL) {
+	expr_memo_free(&packet.memo);
+    }
+    option_state_dereference(&options, MDL);
+}
+
+ATF_TC(expression_memo);
+
+ATF_TC_HEAD(expression_memo, tc)
+{
+    atf_tc_set_md_var(tc, "descr",
+		      "Verify values of expressions are remembered per packet "
+		      "until its options change.");
+}
+
+ATF_TC_BODY(expression_memo, tc)
+{
+    unsigned char buffer[] = {
+	12, 4, 'a', 'b', 'c', 'd',	/* host-name "abcd" */
+	255
+    };
+    const char *text = "substring (option host-name, 0, 2)";
+    struct dhcp_packet raw;
+    struct packet packet;
+    struct expression *expr = NULL;
+    struct parse *cfile = NULL;
+    struct data_string data;
+    u_int32_t hits, misses;
+    int lose = 0;
+    int pass;
+
+    initialize_common_option_spaces();
+
+    memset(&raw, 0, sizeof(raw));
+    memset(&packet, 0, sizeof(packet));
+    packet.raw = &raw;
+    if (!option_state_allocate(&packet.options, MDL) ||
+	!parse_option_buffer(packet.options, buffer, sizeof(buffer),
+			     &dhcp_universe)) {
+	atf_tc_fail("can't set up options");
+    }
+
+    if (new_parse(&cfile, -1, (char *)text, strlen(text), "test", 0)
+	!= ISC_R_SUCCESS ||
+	!parse_data_expression(&expr, cfile, &lose)) {
+	atf_tc_fail("can't parse %s", text);
+    }
+    end_parse(&cfile);
+
+    /* The first evaluation computes the value, the second remembers it. */
+    for (pass = 0; pass < 2; pass++) {
+	hits = expr_memo_stats.hits;
+	misses = expr_memo_stats.misses;
+	memset(&data, 0, sizeof(data));
+	if (!evaluate_data_expression(&data, &packet, NULL, NULL,
+				      packet.options, NULL, NULL, expr, MDL) ||
+	    data.len != 2 || memcmp(data.data, "ab", 2) != 0) {
+	    atf_tc_fail("pass %d: wrong value", pass);
+	}
+	data_string_forget(&data, MDL);
+	if (pass == 0 && expr_memo_stats.misses == misses) {
+	    atf_tc_fail("first evaluation wasn't a miss");
+	}
+	if (pass == 1 && (expr_memo_stats.hits != hits + 1 ||
+			  expr_memo_stats.misses != misses)) {
+	    atf_tc_fail("second evaluation wasn't a hit");
+	}
+    }
+
+    /* Changing the options must not leave the old value behind. */
+    delete_option(&dhcp_universe, packet.options, DHO_HOST_NAME);
+    memset(&data, 0, sizeof(data));
+    if (evaluate_data_expression(&data, &packet, NULL, NULL,
+				 packet.options, NULL, NULL, expr, MDL)) {
+	atf_tc_fail("value survived deleting the option");
+    }
+
+    expression_dereference(&expr, MDL);
+    expr_memo_free(&packet.memo);
+    option_state_dereference(&packet.options, MDL);
+}
+
+ATF_TC(option_state_ops);
+
+ATF_TC_HEAD(option_state_ops, tc)
+{
+    atf_tc_set_md_var(tc, "descr",
+		      "Verify looking up, saving, deleting and walking the "
+		      "options of a parsed option state.");
+}
+
+/* Count the options option_space_foreach() visits and the bytes in them. */
+struct option_walk {
+    int count;
+    unsigned bytes;
+    unsigned char seen[256];
+};
+
+static void
+option_walk_func(struct option_cache *oc, struct packet *packet,
+		 struct lease *lease, struct client_state *client_state,
+		 struct option_state *in_options,
+		 struct option_state *cfg_options,
+		 struct binding_scope **scope,
+		 struct universe *universe, void *stuff)
+{
+    struct option_walk *walk = stuff;
+
+    walk->count++;
+    walk->bytes += oc->data.len;
+    walk->seen[oc->option->code]++;
+}
+
+/* Parse a typical request, with one option split in two, and check what
+ * lookups find in it.  Then replace, append to and delete options and
+ * check that lookups and option_space_foreach() see the changes, both
+ * before and after the rest of the buffer has been looked at.
+ */
+ATF_TC_BODY(option_state_ops, tc)
+{
+    unsigned char buffer[] = {
+	1, 4, 255, 255, 255, 0,			/* subnet-mask */
+	4, 4, 10, 0, 0, 1,			/* time-servers */
+	42, 4, 10, 0, 0, 3,			/* ntp-servers */
+	55, 6, 1, 3, 6, 15, 28, 42,		/* parameter-request-list */
+	61, 7, 1, 0, 1, 2, 3, 4, 5,		/* dhcp-client-identifier */
+	12, 2, 'h', 'o',			/* host-name, in two */
+	60, 8, 'M', 'S', 'F', 'T', ' ', '5', '.', '0',
+	12, 2, 's', 't',
+	255
+    };
+    static const unsigned present[] = { 1, 4, 12, 42, 55, 60, 61 };
+    struct option_state *options = NULL, *other = NULL;
+    struct option_cache *oc, *mask, *host;
+    struct option_walk walk;
+    unsigned code, i;
+
+    initialize_common_option_spaces();
+
+    if (!option_state_allocate(&options, MDL) ||
+	!parse_option_buffer(options, buffer, sizeof(buffer),
+			     &dhcp_universe)) {
+	atf_tc_fail("can't parse options");
+    }
+
+    /* Every option is found, with the split one put back together, and
+     * nothing else is. */
+    for (code = 0, i = 0; code < 256; code++) {
+	oc = lookup_option(&dhcp_universe, options, code);
+	if (i < sizeof(present) / sizeof(present[0]) && code == present[i]) {
+	    if (oc == NULL || oc->option->code != code) {
+		atf_tc_fail("option %u not found", code);
+	    }
+	    i++;
+	} else if (oc != NULL) {
+	    atf_tc_fail("option %u found but not sent", code);
+	}
+    }
+    host = lookup_option(&dhcp_universe, options, DHO_HOST_NAME);
+    ATF_REQUIRE_EQ(host->data.len, 4);
+    ATF_CHECK(memcmp(host->data.data, "host", 4) == 0);
+    mask = lookup_option(&dhcp_universe, options, DHO_SUBNET_MASK);
+    ATF_REQUIRE_EQ(mask->data.len, 4);
+    ATF_CHECK_EQ(mask->data.data[3], 0);
+
+    memset(&walk, 0, sizeof(walk));
+    option_space_foreach(NULL, NULL, NULL, NULL, options, NULL,
+			 &dhcp_universe, &walk, option_walk_func);
+    ATF_CHECK_EQ(walk.count, sizeof(present) / sizeof(present[0]));
+    ATF_CHECK_EQ(walk.bytes, 4 + 4 + 4 + 6 + 7 + 4 + 8);
+    for (i = 0; i < sizeof(present) / sizeof(present[0]); i++) {
+	ATF_CHECK_EQ(walk.seen[present[i]], 1);
+    }
+
+    /* Saving replaces, also saving appends and deleting removes. */
+    option_cache_reference(&oc, host, MDL);
+    save_option(&dhcp_universe, options, oc);
+    also_save_option(&dhcp_universe, options, mask);
+    option_cache_dereference(&oc, MDL);
+    ATF_CHECK(lookup_option(&dhcp_universe, options,
+			    DHO_HOST_NAME) == host);
+    oc = lookup_option(&dhcp_universe, options, DHO_SUBNET_MASK);
+    ATF_REQUIRE(oc != NULL);
+    ATF_CHECK(oc->next == mask);
+    delete_option(&dhcp_universe, options, DHO_NTP_SERVERS);
+    ATF_CHECK(lookup_option(&dhcp_universe, options,
+			    DHO_NTP_SERVERS) == NULL);
+
+    memset(&walk, 0, sizeof(walk));
+    option_space_foreach(NULL, NULL, NULL, NULL, options, NULL,
+			 &dhcp_universe, &walk, option_walk_func);
+    ATF_CHECK_EQ(walk.count, sizeof(present) / sizeof(present[0]) - 1);
+    ATF_CHECK_EQ(walk.seen[DHO_NTP_SERVERS], 0);
+
+    /* The same changes made before anything else in the buffer has been
+     * looked at leave the same options behind. */
+    if (!option_state_allocate(&other, MDL) ||
+	!parse_option_buffer(other, buffer, sizeof(buffer),
+			     &dhcp_universe)) {
+	atf_tc_fail("can't parse options");
+    }
+    delete_option(&dhcp_universe, other, DHO_NTP_SERVERS);
+    for (code = 0; code < 256; code++) {
+	oc = lookup_option(&dhcp_universe, options, code);
+	mask = lookup_option(&dhcp_universe, other, code);
+	if ((oc == NULL) != (mask == NULL) ||
+	    (oc != NULL && (oc->data.len != mask->data.len ||
+			    memcmp(oc->data.data, mask->data.data,
+				   oc->data.len) != 0))) {
+	    atf_tc_fail("option %u differs", code);
+	}
+    }
+
+    option_state_dereference(&other, MDL);
+    option_state_dereference(&options, MDL);
+}
+
+/* How many times cons_options() builds the same reply below. */
+#define REPEAT_ROUNDS 100
+
+ATF_TC(cons_options);
+
+ATF_TC_HEAD(cons_options, tc)
+{
+    atf_tc_set_md_var(tc, "descr",
+		      "Verify that cons_options splits and overloads options "
+		      "and builds the same reply each time.");
+}
+
+/* Build a reply whose options don't fit in a minimum-size packet: the
+ * routers option is longer than 255 bytes and has to be split, and the
+ * part of it and the options after it that don't fit in the options field
+ * go into the file field.  Parse the result back and check that nothing
+ * was lost, then check that REPEAT_ROUNDS more replies come out the same.
+ * Without overloading, the routers option doesn't fit at all and nothing
+ * of it may be left in the packet.
+ */
+ATF_TC_BODY(cons_options, tc)
+{
+    unsigned char config[3 + 6 + 6 + 6 + 13 + 2 + 255 + 2 + 65];
+    unsigned char routers[320];
+    unsigned char prl_codes[] = { 3, 1, 6, 6, 15, 3 };
+    static const unsigned codes[] = { 53, 54, 1, 3, 6, 15 };
+    struct option_state *cfg = NULL, *parsed = NULL;
+    struct option_cache *want, *got;
+    struct dhcp_packet outpacket, first;
+    struct data_string prl;
+    unsigned char *cp, *file;
+    unsigned i;
+    int len, flen, round;
+
+    initialize_common_option_spaces();
+
+    for (i = 0; i < sizeof(routers); i++) {
+	routers[i] = (unsigned char)i;
+    }
+    cp = config;
+    memcpy(cp, "\065\001\005", 3);			/* dhcp-message-type */
+    cp += 3;
+    memcpy(cp, "\066\004\012\000\000\001", 6);	/* server identifier */
+    cp += 6;
+    memcpy(cp, "\001\004\377\377\377\000", 6);	/* subnet-mask */
+    cp += 6;
+    memcpy(cp, "\006\004\012\000\000\002", 6);	/* domain-name-servers */
+    cp += 6;
+    memcpy(cp, "\017\013example.com", 13);		/* domain-name */
+    cp += 13;
+    *cp++ = 3;					/* routers, in two */
+    *cp++ = 255;
+    memcpy(cp, routers, 255);
+    cp += 255;
+    *cp++ = 3;
+    *cp++ = 65;
+    memcpy(cp, routers + 255, 65);
+    cp += 65;
+
+    if (!option_state_allocate(&cfg, MDL) ||
+	!parse_option_buffer(cfg, config, cp - config, &dhcp_universe)) {
+	atf_tc_fail("can't set up options");
+    }
+
+    /* The duplicates are dropped and the subnet mask goes first. */
+    memset(&prl, 0, sizeof(prl));
+    prl.data = prl_codes;
+    prl.len = sizeof(prl_codes);
+
+    memset(&outpacket, 0, sizeof(outpacket));
+    len = cons_options(NULL, &outpacket, NULL, NULL, DHCP_MTU_MIN, NULL,
+		       cfg, NULL, 3, 0, 0, &prl, NULL);
+    if (len == 0) {
+	atf_tc_fail("cons_options failed");
+    }
+    len -= DHCP_FIXED_NON_UDP;
+    ATF_REQUIRE(len <= DHCP_MIN_OPTION_LEN);
+    ATF_REQUIRE(memcmp(outpacket.options, DHCP_OPTIONS_COOKIE, 4) == 0);
+
+    /* The options field ends with the overload option. */
+    ATF_REQUIRE(len >= 7);
+    ATF_CHECK_EQ(outpacket.options[len - 3], DHO_DHCP_OPTION_OVERLOAD);
+    ATF_CHECK_EQ(outpacket.options[len - 1], 1);
+    file = (unsigned char *)outpacket.file;
+    for (flen = 0; flen < DHCP_FILE_LEN - 1 && file[flen] != DHO_END; ) {
+	flen += 2 + file[flen + 1];
+    }
+    ATF_REQUIRE(flen < DHCP_FILE_LEN);
+    for (i = flen + 1; i < DHCP_FILE_LEN; i++) {
+	ATF_CHECK_EQ(file[i], DHO_PAD);
+    }
+    for (i = 0; i < DHCP_SNAME_LEN; i++) {
+	ATF_CHECK_EQ(outpacket.sname[i], 0);
+    }
+
+    if (!option_state_allocate(&parsed, MDL) ||
+	!parse_option_buffer(parsed, outpacket.options + 4, len - 4,
+			     &dhcp_universe) ||
+	!parse_option_buffer(parsed, file, flen, &dhcp_universe)) {
+	atf_tc_fail("can't parse reply");
+    }
+    for (i = 0; i < sizeof(codes) / sizeof(codes[0]); i++) {
+	want = lookup_option(&dhcp_universe, cfg, codes[i]);
+	got = lookup_option(&dhcp_universe, parsed, codes[i]);
+	if (got == NULL) {
+	    atf_tc_fail("option %u missing from reply", codes[i]);
+	}
+	if (got->data.len != want->data.len ||
+	    memcmp(got->data.data, want->data.data, got->data.len) != 0) {
+	    atf_tc_fail("option %u changed in reply", codes[i]);
+	}
+    }
+    option_state_dereference(&parsed, MDL);
+
+    /* The subnet mask comes right after the server identifier. */
+    ATF_CHECK_EQ(outpacket.options[4 + 3 + 6], DHO_SUBNET_MASK);
+
+    first = outpacket;
+    for (round = 0; round < REPEAT_ROUNDS; round++) {
+	memset(&outpacket, 0, sizeof(outpacket));
+	if (cons_options(NULL, &outpacket, NULL, NULL, DHCP_MTU_MIN, NULL,
+			 cfg, NULL, 3, 0, 0, &prl, NULL) !=
+	    len + DHCP_FIXED_NON_UDP ||
+	    memcmp(&outpacket, &first, sizeof(outpacket)) != 0) {
+	    atf_tc_fail("round %d: reply changed", round);
+	}
+    }
+
+    memset(&outpacket, 0, sizeof(outpacket));
+    len = cons_options(NULL, &outpacket, NULL, NULL, DHCP_MTU_MIN, NULL,
+		       cfg, NULL, 0, 0, 0, &prl, NULL);
+    if (len == 0) {
+	atf_tc_fail("cons_options failed without overloading");
+    }
+    len -= DHCP_FIXED_NON_UDP;
+    ATF_REQUIRE(len > 4 && len <= DHCP_MIN_OPTION_LEN);
+    ATF_CHECK_EQ(outpacket.options[len - 1], DHO_END);
+    for (i = len; i < DHCP_MAX_OPTION_LEN; i++) {
+	if (outpacket.options[i] != 0) {
+	    atf_tc_fail("byte %u past the end of the options is %u",
+			i, outpacket.options[i]);
+	}
+    }
+    if (!option_state_allocate(&parsed, MDL) ||
+	!parse_option_buffer(parsed, outpacket.options + 4, len - 5,
+			     &dhcp_universe)) {
+	atf_tc_fail("can't parse reply without overloading");
+    }
+    ATF_CHECK(lookup_option(&dhcp_universe, parsed, DHO_ROUTERS) == NULL);
+    ATF_CHECK(lookup_option(&dhcp_universe, parsed,
+			    DHO_SUBNET_MASK) != NULL);
+    option_state_dereference(&parsed, MDL);
+
+    option_state_dereference(&cfg, MDL);
+}
+
 ATF_TC(pretty_print_option);
 
 ATF_TC_HEAD(pretty_print_option, tc)
@@ -136,6 +685,11 @@ ATF_TC_BODY(pretty_print_option, tc)
 ATF_TP_ADD_TCS(tp)
 {
     ATF_TP_ADD_TC(tp, option_refcnt);
+    ATF_TP_ADD_TC(tp, option_lazy_parse);
+    ATF_TP_ADD_TC(tp, expression_bytecode);
+    ATF_TP_ADD_TC(tp, expression_memo);
+    ATF_TP_ADD_TC(tp, option_state_ops);
+    ATF_TP_ADD_TC(tp, cons_options);
     ATF_TP_ADD_TC(tp, pretty_print_option);
 
     return (atf_no_error());
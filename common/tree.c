@@ -382,12 +382,11 @@ int make_let (result, name)
 		return 0;
 	
 	(*result) -> op = let_statement;
-	(*result) -> data.let.name = dmalloc (strlen (name) + 1, MDL);
+	(*result) -> data.let.name = binding_name (name);
 	if (!(*result) -> data.let.name) {
 		executable_statement_dereference (result, MDL);
 		return 0;
 	}
-	strcpy ((*result) -> data.let.name, name);
 	return 1;
 }
 		
@@ -520,7 +519,8 @@ int evaluate_expression (result, packet, lease, client_state,
 		if (!scope || !*scope)
 			return 0;
 
-		binding = find_binding (*scope, expr -> data.variable);
+		binding = find_interned_binding (*scope,
+						 expr -> data.variable);
 
 		if (binding && binding -> value) {
 			if (result)
@@ -542,7 +542,8 @@ int evaluate_expression (result, packet, lease, client_state,
 			return 0;
 		}
 
-		binding = find_binding (*scope, expr -> data.funcall.name);
+		binding = find_interned_binding (*scope,
+						 expr -> data.funcall.name);
 
 		if (!binding || !binding -> value) {
 			log_error ("%s: no such function.",
@@ -567,21 +568,10 @@ int evaluate_expression (result, packet, lease, client_state,
 		arg = expr -> data.funcall.arglist;
 		s = binding -> value -> value.fundef -> args;
 		while (arg && s) {
-			nb = dmalloc (sizeof *nb, MDL);
+			nb = new_binding (s -> string, MDL);
 			if (!nb) {
-			      blb:
 				binding_scope_dereference (&ns, MDL);
 				return 0;
-			} else {
-				memset (nb, 0, sizeof *nb);
-				nb -> name = dmalloc (strlen (s -> string) + 1,
-						      MDL);
-				if (nb -> name)
-					strcpy (nb -> name, s -> string);
-				else {
-					dfree (nb, MDL);
-					goto blb;
-				}
 			}
 			evaluate_expression (&nb -> value, packet, lease,
 					     client_state,
@@ -712,6 +702,17 @@ int evaluate_boolean_expression (result, packet, lease, client_state,
 	regex_t re;
 #endif
 
+	/* If the expression has been compiled, run that instead, unless
+	   it asks us to do the work. */
+	if (expr -> program) {
+		sleft = expression_program_run (expr -> program, result,
+						packet, lease, client_state,
+						in_options, cfg_options,
+						scope);
+		if (sleft >= 0)
+			return sleft;
+	}
+
 	switch (expr -> op) {
 	      case expr_check:
 		*result = check_collection (packet, lease,
@@ -988,7 +989,8 @@ int evaluate_boolean_expression (result, packet, lease, client_state,
 
 	      case expr_variable_exists:
 		if (scope && *scope) {
-			binding = find_binding (*scope, expr -> data.variable);
+			binding = find_interned_binding
+				(*scope, expr -> data.variable);
 
 			if (binding) {
 				if (binding -> value)
@@ -1007,7 +1009,8 @@ int evaluate_boolean_expression (result, packet, lease, client_state,
 
 	      case expr_variable_reference:
 		if (scope && *scope) {
-		    binding = find_binding (*scope, expr -> data.variable);
+		    binding = find_interned_binding (*scope,
+						     expr -> data.variable);
 
 		    if (binding && binding -> value) {
 			if (binding -> value -> type ==
@@ -1123,6 +1126,227 @@ int evaluate_boolean_expression (result, packet, lease, client_state,
 	return 0;
 }
 
+/* Within one packet, the same expressions are evaluated over and over:
+   each class, pool permit and host match may look at the same relay
+   agent or vendor class option.   So the values of expressions that
+   depend only on the packet are remembered, in a small table attached
+   to the packet, until the packet's options change. */
+
+struct expr_memo_stats expr_memo_stats;
+
+/* Counts expressions that have been freed; see expression_dereference(). */
+static u_int32_t expr_memo_freed;
+
+/* Put the subexpressions of an expression that may be remembered in kids,
+   and return how many there are, or -1 if it may not be remembered. */
+
+static int expr_memo_children (struct expression *expr,
+			       struct expression **kids)
+{
+	switch (expr -> op) {
+	      case expr_const_data:
+	      case expr_const_int:
+	      case expr_option:
+	      case expr_hardware:
+		return 0;
+
+	      case expr_packet:
+		kids [0] = expr -> data.packet.offset;
+		kids [1] = expr -> data.packet.len;
+		return 2;
+
+	      case expr_substring:
+		kids [0] = expr -> data.substring.expr;
+		kids [1] = expr -> data.substring.offset;
+		kids [2] = expr -> data.substring.len;
+		return 3;
+
+	      case expr_suffix:
+		kids [0] = expr -> data.suffix.expr;
+		kids [1] = expr -> data.suffix.len;
+		return 2;
+
+	      case expr_lcase:
+		kids [0] = expr -> data.lcase;
+		return 1;
+
+	      case expr_ucase:
+		kids [0] = expr -> data.ucase;
+		return 1;
+
+	      case expr_concat:
+		kids [0] = expr -> data.concat [0];
+		kids [1] = expr -> data.concat [1];
+		return 2;
+
+	      case expr_pick_first_value:
+		kids [0] = expr -> data.pick_first_value.car;
+		kids [1] = expr -> data.pick_first_value.cdr;
+		return 2;
+
+	      case expr_extract_int8:
+	      case expr_extract_int16:
+	      case expr_extract_int32:
+		kids [0] = expr -> data.extract_int;
+		return 1;
+
+	      case expr_encode_int8:
+	      case expr_encode_int16:
+	      case expr_encode_int32:
+		kids [0] = expr -> data.encode_int;
+		return 1;
+
+	      case expr_reverse:
+		kids [0] = expr -> data.reverse.width;
+		kids [1] = expr -> data.reverse.buffer;
+		return 2;
+
+	      case expr_binary_to_ascii:
+		kids [0] = expr -> data.b2a.base;
+		kids [1] = expr -> data.b2a.width;
+		kids [2] = expr -> data.b2a.separator;
+		kids [3] = expr -> data.b2a.buffer;
+		return 4;
+
+	      default:
+		return -1;
+	}
+}
+
+/* Does the value of the expression depend only on the packet?   The answer
+   never changes, so it's kept in the expression's flags. */
+
+static int expr_memo_pure (struct expression *expr)
+{
+	struct expression *kids [4];
+	int i, n, pure;
+
+	if (expr -> flags & EXPR_MEMO_CHECKED)
+		return (expr -> flags & EXPR_MEMO_PURE) != 0;
+
+	n = expr_memo_children (expr, kids);
+	pure = n >= 0;
+	for (i = 0; pure && i < n; i++)
+		if (kids [i] && !expr_memo_pure (kids [i]))
+			pure = 0;
+
+	expr -> flags |= EXPR_MEMO_CHECKED | (pure ? EXPR_MEMO_PURE : 0);
+	return pure;
+}
+
+/* An option in the packet's option state normally just holds the data
+   the client sent, but one that has an expression may be evaluated
+   differently each time; an expression that looks at such an option
+   isn't remembered. */
+
+static int expr_memo_static (struct expression *expr,
+			     struct option_state *options)
+{
+	struct expression *kids [4];
+	struct option_cache *oc;
+	int i, n;
+
+	if (expr -> op == expr_option) {
+		oc = lookup_option (expr -> data.option -> universe, options,
+				    expr -> data.option -> code);
+		return !oc || !oc -> expression;
+	}
+
+	n = expr_memo_children (expr, kids);
+	for (i = 0; i < n; i++)
+		if (kids [i] && !expr_memo_static (kids [i], options))
+			return 0;
+	return 1;
+}
+
+/* Can the boolean expression be left unevaluated without anything but its
+   value being lost?   That's so if it's built only from tests of the
+   packet; anything else, a function call say, may have side effects. */
+
+int expression_side_effect_free (struct expression *expr)
+{
+	struct expression *kids [4];
+	int i, n;
+
+	switch (expr -> op) {
+	      case expr_equal:
+	      case expr_not_equal:
+	      case expr_regex_match:
+	      case expr_iregex_match:
+		kids [0] = expr -> data.equal [0];
+		kids [1] = expr -> data.equal [1];
+		n = 2;
+		break;
+
+	      case expr_and:
+		kids [0] = expr -> data.and [0];
+		kids [1] = expr -> data.and [1];
+		n = 2;
+		break;
+
+	      case expr_or:
+		kids [0] = expr -> data.or [0];
+		kids [1] = expr -> data.or [1];
+		n = 2;
+		break;
+
+	      case expr_not:
+		kids [0] = expr -> data.not;
+		n = 1;
+		break;
+
+	      case expr_exists:
+	      case expr_known:
+	      case expr_static:
+	      case expr_check:
+		return 1;
+
+	      default:
+		n = expr_memo_children (expr, kids);
+		break;
+	}
+
+	if (n < 0)
+		return 0;
+	for (i = 0; i < n; i++)
+		if (kids [i] && !expression_side_effect_free (kids [i]))
+			return 0;
+	return 1;
+}
+
+void expr_memo_free (struct expr_memo **memo)
+{
+	int i;
+
+	for (i = 0; i < EXPR_MEMO_SIZE; i++)
+		if ((*memo) -> entries [i].key)
+			data_string_forget (&(*memo) -> entries [i].value,
+					    MDL);
+	dfree (*memo, MDL);
+	*memo = NULL;
+}
+
+isc_result_t expr_memo_get_value (omapi_data_string_t *name,
+				  omapi_value_t **value)
+{
+	if (!omapi_ds_strcmp (name, "expression-cache-hits"))
+		return omapi_make_uint_value (value, name,
+					      expr_memo_stats.hits, MDL);
+	if (!omapi_ds_strcmp (name, "expression-cache-misses"))
+		return omapi_make_uint_value (value, name,
+					      expr_memo_stats.misses, MDL);
+	return ISC_R_NOTFOUND;
+}
+
+static int do_evaluate_data_expression (struct data_string *,
+					struct packet *, struct lease *,
+					struct client_state *,
+					struct option_state *,
+					struct option_state *,
+					struct binding_scope **,
+					struct expression *,
+					const char *, int);
+
 int evaluate_data_expression (result, packet, lease, client_state,
 			      in_options, cfg_options, scope, expr, file, line)
 	struct data_string *result;
@@ -1135,6 +1359,82 @@ int evaluate_data_expression (result, packet, lease, client_state,
 	struct expression *expr;
 	const char *file;
 	int line;
+{
+	struct expr_memo_entry *entry;
+	const void *key;
+	u_int32_t generation, freed;
+	int status;
+
+	/* Only values computed from the packet's own options are kept;
+	   those last as long as the packet does. */
+	if (!packet || client_state || !in_options ||
+	    in_options != packet -> options ||
+	    expr -> op == expr_const_data || !expr_memo_pure (expr))
+		return do_evaluate_data_expression (result, packet, lease,
+						    client_state, in_options,
+						    cfg_options, scope, expr,
+						    file, line);
+
+	if (!packet -> memo) {
+		packet -> memo = dmalloc (sizeof *packet -> memo, MDL);
+		if (!packet -> memo)
+			return do_evaluate_data_expression
+				(result, packet, lease, client_state,
+				 in_options, cfg_options, scope, expr,
+				 file, line);
+	}
+
+	/* All the expressions that extract the same option share a slot. */
+	key = (expr -> op == expr_option
+	       ? (const void *)expr -> data.option : (const void *)expr);
+	entry = &packet -> memo -> entries [((unsigned long)key >> 4) %
+					    EXPR_MEMO_SIZE];
+	generation = in_options -> generation;
+
+	if (entry -> key == key && entry -> generation == generation &&
+	    entry -> freed == expr_memo_freed) {
+		expr_memo_stats.hits++;
+		if (entry -> status)
+			data_string_copy (result, &entry -> value, file, line);
+		return entry -> status;
+	}
+	expr_memo_stats.misses++;
+
+	freed = expr_memo_freed;
+	status = do_evaluate_data_expression (result, packet, lease,
+					      client_state, in_options,
+					      cfg_options, scope, expr,
+					      file, line);
+
+	if (in_options -> generation != generation ||
+	    expr_memo_freed != freed ||
+	    !expr_memo_static (expr, in_options))
+		return status;
+
+	if (entry -> key)
+		data_string_forget (&entry -> value, MDL);
+	entry -> key = key;
+	entry -> generation = generation;
+	entry -> freed = freed;
+	entry -> status = status;
+	if (status)
+		data_string_copy (&entry -> value, result, MDL);
+	return status;
+}
+
+static int do_evaluate_data_expression (result, packet, lease, client_state,
+					in_options, cfg_options, scope, expr,
+					file, line)
+	struct data_string *result;
+	struct packet *packet;
+	struct lease *lease;
+	struct client_state *client_state;
+	struct option_state *in_options;
+	struct option_state *cfg_options;
+	struct binding_scope **scope;
+	struct expression *expr;
+	const char *file;
+	int line;
 {
 	struct data_string data, other;
 	unsigned long offset, len, i;
@@ -1906,7 +2206,8 @@ int evaluate_data_expression (result, packet, lease, client_state,
 
 	      case expr_variable_reference:
 		if (scope && *scope) {
-		    binding = find_binding (*scope, expr -> data.variable);
+		    binding = find_interned_binding (*scope,
+						     expr -> data.variable);
 
 		    if (binding && binding -> value) {
 			if (binding -> value -> type == binding_data) {
@@ -2380,7 +2681,8 @@ int evaluate_numeric_expression (result, packet, lease, client_state,
  
 	      case expr_variable_reference:
 		if (scope && *scope) {
-		    binding = find_binding (*scope, expr -> data.variable);
+		    binding = find_interned_binding (*scope,
+						     expr -> data.variable);
 
 		    if (binding && binding -> value) {
 			if (binding -> value -> type == binding_numeric) {
@@ -2838,6 +3140,13 @@ void expression_dereference (eptr, file, line)
 #endif
 	}
 
+	if (expr -> program)
+		expression_program_free (&expr -> program);
+
+	/* Its address may be reused for a different expression, so anything
+	   remembered about it must be forgotten. */
+	expr_memo_freed++;
+
 	/* Dereference subexpressions. */
 	switch (expr -> op) {
 		/* All the binary operators can be handled the same way. */
@@ -2970,15 +3279,7 @@ void expression_dereference (eptr, file, line)
 				(&expr -> data.reverse.buffer, file, line);
 		break;
 
-	      case expr_variable_reference:
-	      case expr_variable_exists:
-		if (expr -> data.variable)
-			dfree (expr -> data.variable, file, line);
-		break;
-
 	      case expr_funcall:
-		if (expr -> data.funcall.name)
-			dfree (expr -> data.funcall.name, file, line);
 		if (expr -> data.funcall.arglist)
 			expression_dereference (&expr -> data.funcall.arglist,
 						file, line);
@@ -3752,14 +4053,66 @@ int write_expression (file, expr, col, indent, firstp)
 	return col;
 }
 
-struct binding *find_binding (struct binding_scope *scope, const char *name)
+/* Variable names are interned: every spelling of a name, in whatever
+   case, maps to a single copy of it that is never freed.   Bindings, and
+   the statements and expressions that refer to variables, keep that copy,
+   so finding a variable in a scope is a matter of comparing pointers
+   rather than strings, and a binding doesn't need a copy of its name of
+   its own. */
+
+static struct hash_table *binding_names;
+
+const char *binding_name (const char *name)
+{
+	char *iname = (char *)0;
+	unsigned len;
+
+	if (!binding_names &&
+	    !new_hash (&binding_names, 0, 0, 0, do_case_hash, MDL))
+		return (const char *)0;
+
+	len = strlen (name);
+	if (hash_lookup ((hashed_object_t **)&iname, binding_names,
+			 name, len, MDL))
+		return iname;
+
+	iname = dmalloc (len + 1, MDL);
+	if (!iname)
+		return (const char *)0;
+	memcpy (iname, name, len + 1);
+	add_hash (binding_names, iname, len, (hashed_object_t *)iname, MDL);
+	return iname;
+}
+
+/* Allocate a binding for the named variable, in no scope as yet. */
+
+struct binding *new_binding (const char *name, const char *file, int line)
+{
+	struct binding *bp;
+
+	bp = dmalloc (sizeof *bp, file, line);
+	if (!bp)
+		return (struct binding *)0;
+	memset (bp, 0, sizeof *bp);
+	bp -> name = binding_name (name);
+	if (!bp -> name) {
+		dfree (bp, file, line);
+		return (struct binding *)0;
+	}
+	return bp;
+}
+
+/* Find a variable whose name was returned by binding_name(). */
+
+struct binding *find_interned_binding (struct binding_scope *scope,
+				       const char *name)
 {
 	struct binding *bp;
 	struct binding_scope *s;
 
 	for (s = scope; s; s = s -> outer) {
 		for (bp = s -> bindings; bp; bp = bp -> next) {
-			if (!strcasecmp (name, bp -> name)) {
+			if (bp -> name == name) {
 				return bp;
 			}
 		}
@@ -3767,14 +4120,24 @@ struct binding *find_binding (struct binding_scope *scope, const char *name)
 	return (struct binding *)0;
 }
 
+struct binding *find_binding (struct binding_scope *scope, const char *name)
+{
+	char *iname = (char *)0;
+
+	/* A name that was never interned can't be bound anywhere. */
+	if (!binding_names ||
+	    !hash_lookup ((hashed_object_t **)&iname, binding_names,
+			  name, strlen (name), MDL))
+		return (struct binding *)0;
+	return find_interned_binding (scope, iname);
+}
+
 int free_bindings (struct binding_scope *scope, const char *file, int line)
 {
 	struct binding *bp, *next;
 
 	for (bp = scope -> bindings; bp; bp = next) {
 		next = bp -> next;
-		if (bp -> name)
-			dfree (bp -> name, file, line);
 		if (bp -> value)
 			binding_value_dereference (&bp -> value, file, line);
 		dfree (bp, file, line);
@@ -4057,18 +4420,10 @@ struct binding *create_binding (struct binding_scope **scope, const char *name)
 
 	binding = find_binding (*scope, name);
 	if (!binding) {
-		binding = dmalloc (sizeof *binding, MDL);
+		binding = new_binding (name, MDL);
 		if (!binding)
 			return (struct binding *)0;
 
-		memset (binding, 0, sizeof *binding);
-		binding -> name = dmalloc (strlen (name) + 1, MDL);
-		if (!binding -> name) {
-			dfree (binding, MDL);
-			return (struct binding *)0;
-		}
-		strcpy (binding -> name, name);
-
 		binding -> next = (*scope) -> bindings;
 		(*scope) -> bindings = binding;
 	}
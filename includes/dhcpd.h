@@ -393,11 +393,35 @@ struct option_cache {
 	u_int32_t flags;
 };
 
+/* A lazily decoded option buffer.   parse_option_buffer() makes one
+   copy of the buffer it is handed and records where each option lives
+   in it; option caches are only built from these entries when the
+   option is looked up, modified, or its space is walked. */
+struct option_index_entry {
+	u_int32_t code;
+	unsigned offset;
+	unsigned length;
+};
+
+#define OPTION_INDEX_CONSUMED	((unsigned)~0)
+
+struct option_index {
+	struct option_index *next;
+	struct universe *universe;
+	struct buffer *buffer;
+	unsigned remaining;		/* Entries not yet materialized. */
+	unsigned count;
+	unsigned char filter [32];	/* Bitmap of (code & 0xff). */
+	struct option_index_entry entries [1];
+};
+
 struct option_state {
 	int refcnt;
 	int universe_count;
 	int site_universe;
 	int site_code_min;
+	struct option_index *pending;
+	u_int32_t generation;		/* Changes whenever the options do. */
 	void *universes [1];
 };
 
@@ -447,6 +471,7 @@ struct packet {
 
 	struct shared_network *shared_network;
 	struct option_state *options;
+	struct expr_memo *memo;		/* Values of expressions of options. */
 
 #if !defined (PACKET_MAX_CLASSES)
 # define PACKET_MAX_CLASSES 5
@@ -475,6 +500,12 @@ struct packet {
 
 	/* Relay port check */
 	isc_boolean_t relay_source_port;
+
+	/* Failover load balancing hash of the client identifier or chaddr,
+	 * worked out the first time load_balance_mine() needs it.
+	 */
+	isc_boolean_t loadb_hashed;
+	unsigned char loadb_hash;
 };
 
 /*
@@ -816,6 +847,15 @@ struct lease_state {
 #define SV_LOCAL_ADDRESS6		97
 #define SV_BIND_LOCAL_ADDRESS6		98
 #define SV_PING_CLTT_SECS		99
+#define SV_STRICT_PACKET_FILTER		100
+#define SV_CLIENT_RATE_LIMIT		101
+#define SV_CLIENT_RATE_BURST		102
+#define SV_RELAY_RATE_LIMIT		103
+#define SV_RELAY_RATE_BURST		104
+#define SV_RECEIVE_QUEUE_LENGTH		105
+#define SV_RECEIVE_QUEUE_DROP_POLICY	106
+#define SV_SPAWNED_CLASS_LIMIT		107
+#define SV_FAILOVER_STATE_FILE_NAME	108
 
 #if !defined (DEFAULT_PING_TIMEOUT)
 # define DEFAULT_PING_TIMEOUT 1
@@ -842,6 +882,19 @@ struct lease_state {
 # define DEFAULT_MIN_ACK_DELAY_USECS 10000 /* 1/100 second */
 #endif
 
+/* The most lease state changes pool_timer() makes in one go once the
+   server is running.  When more leases than this are due at once, as
+   when MCLT runs out after entering partner-down, the rest are changed
+   from a new timeout so that packets waiting in the meantime get
+   answered.  The unit tests' pools are small, so their step is too. */
+#if !defined (POOL_TIMER_STEP)
+# if defined (UNIT_TEST)
+#  define POOL_TIMER_STEP	16
+# else
+#  define POOL_TIMER_STEP	1000
+# endif
+#endif
+
 #if !defined (DEFAULT_CACHE_THRESHOLD)
 # define DEFAULT_CACHE_THRESHOLD 25
 #endif
@@ -1073,11 +1126,16 @@ struct subnet {
 	struct group *group;
 };
 
+struct class_index;
+
 struct collection {
 	struct collection *next;
 
 	const char *name;
 	struct class *classes;
+
+	/* Built by check_collection(); discarded when classes change. */
+	struct class_index *index;
 };
 
 /* Used as an argument to parse_clasS_decl() */
@@ -1119,14 +1177,32 @@ struct class {
 	/* Statements to execute if class matches. */
 	struct executable_statement *statements;
 
+	/* Number of packets that have matched the class. */
+	u_int32_t match_count;
+
+	/* Spawned subclasses, most recently matched first. */
+	struct class *lru_prev, *lru_next;
+
 #define CLASS_DECL_DELETED	1
 #define CLASS_DECL_DYNAMIC	2
 #define CLASS_DECL_STATIC	4
 #define CLASS_DECL_SUBCLASS	8
+#define CLASS_DECL_SPAWNED	16
 
 	int flags;
 };
 
+/* Spawned subclass accounting, exported through the OMAPI control
+   object. */
+struct spawned_class_stats {
+	u_int32_t count;	/* Spawned subclasses in existence. */
+	u_int32_t bytes;	/* Memory they take up. */
+	u_int32_t spawned;
+	u_int32_t reclaimed;
+	u_int32_t lookups;	/* Subclass lookups. */
+	u_int32_t hits;
+};
+
 /* DHCP client lease structure... */
 struct client_lease {
 	struct client_lease *next;		      /* Next lease in list. */
@@ -1418,6 +1494,52 @@ struct interface_info {
 	struct hardware dlpi_broadcast_addr;
 # endif /* DLPI_SEND || DLPI_RECEIVE */
 	struct hardware anycast_mac_addr;
+
+	/* Packets read but not yet processed, when receive queueing is
+	   enabled; see got_one(). */
+	struct rx_queue *rx_queue;
+};
+
+/* Receive queue priorities, highest first. */
+#define RXQ_HIGH	0	/* Bound clients: RENEW, RELEASE, DECLINE. */
+#define RXQ_NORMAL	1	/* REQUEST from unbound clients, INFORM. */
+#define RXQ_LOW		2	/* DISCOVER, BOOTP and anything else. */
+#define RXQ_CLASSES	3
+
+/* What to do with a packet that arrives when the queue is full. */
+#define RXQ_DROP_NEWEST		0
+#define RXQ_DROP_LOWEST		1
+
+/* Packets processed from the queues before going back to the dispatcher. */
+#if !defined (RXQ_SERVICE_BATCH)
+# define RXQ_SERVICE_BATCH 16
+#endif
+
+struct rx_entry {
+	struct rx_entry *next;
+	struct interface_info *ip;
+	struct sockaddr_in from;
+	struct hardware hfrom;
+	unsigned len;
+	union {
+		unsigned char packbuf [4095];
+		struct dhcp_packet packet;
+	} u;
+};
+
+struct rx_queue {
+	struct rx_entry *free;
+	struct rx_entry *head [RXQ_CLASSES];
+	struct rx_entry *tail [RXQ_CLASSES];
+	unsigned count;
+	unsigned allocated;
+};
+
+struct rx_queue_stats {
+	u_int32_t queued [RXQ_CLASSES];
+	u_int32_t dropped [RXQ_CLASSES];
+	u_int32_t depth;		/* Now queued, on all interfaces. */
+	u_int32_t high_water;		/* Most ever queued on one interface. */
 };
 
 struct hardware_link {
@@ -1858,6 +1980,9 @@ extern struct option *vendor_cfg_option;
 int parse_options (struct packet *);
 int parse_option_buffer (struct option_state *, const unsigned char *,
 			 unsigned, struct universe *);
+void materialize_options (struct universe *, struct option_state *);
+void forget_pending_options (struct option_state *);
+void option_state_touch (struct option_state *);
 struct universe *find_option_universe (struct option *, const char *);
 int parse_encapsulated_suboptions (struct option_state *, struct option *,
 				   const unsigned char *, unsigned,
@@ -1909,15 +2034,16 @@ int append_option(struct data_string *dst, struct universe *universe,
 		  struct option *option, struct data_string *src);
 int
 store_options(int *ocount,
-	      unsigned char *buffer, unsigned buflen, unsigned index,
+	      unsigned char *buffer, unsigned buflen,
+	      unsigned char *file, unsigned filelen,
+	      unsigned char *sname, unsigned snamelen,
 	      struct packet *packet, struct lease *lease,
 	      struct client_state *client_state,
 	      struct option_state *in_options,
 	      struct option_state *cfg_options,
 	      struct binding_scope **scope,
 	      unsigned *priority_list, int priority_len,
-	      unsigned first_cutoff, int second_cutoff, int terminate,
-	      const char *vuname);
+	      int terminate, const char *vuname);
 int store_options6(char *, int, struct option_state *, struct packet *,
 		   const int *, struct data_string *);
 int format_has_text(const char *);
@@ -2130,6 +2256,7 @@ extern u_int32_t abandon_lease_time;
 extern const char *path_dhcpd_conf;
 extern const char *path_dhcpd_db;
 extern const char *path_dhcpd_pid;
+extern const char *path_dhcpd_failover_state;
 
 extern int dhcp_max_agent_option_packet_length;
 extern struct eventqueue *rw_queue_empty;
@@ -2308,8 +2435,19 @@ int parse_warn (struct parse *, const char *, ...)
 struct expression *parse_domain_list(struct parse *cfile, int);
 
 
+/* bytecode.c */
+void expression_compile (struct expression *);
+int expression_program_run (struct expr_program *, int *, struct packet *,
+			    struct lease *, struct client_state *,
+			    struct option_state *, struct option_state *,
+			    struct binding_scope **);
+void expression_program_free (struct expr_program **);
+
 /* tree.c */
 extern struct binding_scope *global_scope;
+extern struct expr_memo_stats expr_memo_stats;
+void expr_memo_free (struct expr_memo **);
+isc_result_t expr_memo_get_value (omapi_data_string_t *, omapi_value_t **);
 pair cons (caddr_t, pair);
 int make_const_option_cache (struct option_cache **, struct buffer **,
 			     u_int8_t *, unsigned, struct option *,
@@ -2388,6 +2526,9 @@ int op_precedence (enum expr_op, enum expr_op);
 enum expression_context expression_context (struct expression *);
 enum expression_context op_context (enum expr_op);
 int write_expression (FILE *, struct expression *, int, int, int);
+const char *binding_name (const char *);
+struct binding *new_binding (const char *, const char *, int);
+struct binding *find_interned_binding (struct binding_scope *, const char *);
 struct binding *find_binding (struct binding_scope *, const char *);
 int free_bindings (struct binding_scope *, const char *, int);
 int binding_scope_dereference (struct binding_scope **,
@@ -2395,6 +2536,7 @@ int binding_scope_dereference (struct binding_scope **,
 int fundef_dereference (struct fundef **, const char *, int);
 int data_subexpression_length (int *, struct expression *);
 int expr_valid_for_context (struct expression *, enum expression_context);
+int expression_side_effect_free (struct expression *);
 struct binding *create_binding (struct binding_scope **, const char *);
 int bind_ds_value (struct binding_scope **,
 		   const char *, struct data_string *);
@@ -2464,6 +2606,12 @@ void set_server_duid_type(int type);
 isc_result_t generate_new_server_duid(void);
 isc_result_t get_client_id(struct packet *, struct data_string *);
 void dhcpv6(struct packet *);
+#if defined (UNIT_TEST)
+isc_result_t reply_ia_unittest(unsigned char *, unsigned *, u_int16_t,
+			       struct iaddrcidrnet *, int,
+			       u_int32_t, u_int32_t,
+			       struct option_state *, unsigned);
+#endif
 
 /* bootp.c */
 void bootp(struct packet *);
@@ -2834,6 +2982,11 @@ extern struct interface_info *interfaces,
 	*dummy_interfaces, *fallback_interface;
 extern struct protocol *protocols;
 extern int quiet_interface_discovery;
+extern int strict_packet_filter;
+extern int rx_queue_length;
+extern int rx_queue_drop_policy;
+extern struct rx_queue_stats rx_queue_stats;
+isc_result_t rx_queue_get_value (omapi_data_string_t *, omapi_value_t **);
 isc_result_t interface_setup (void);
 void interface_trace_setup (void);
 
@@ -2936,6 +3089,7 @@ extern struct enumeration syslog_enum;
 void initialize_server_option_spaces (void);
 
 extern struct enumeration prefix_length_modes;
+extern struct enumeration rx_queue_drop_policies;
 
 /* inet.c */
 struct iaddr subnet_number (struct iaddr, struct iaddr);
@@ -3072,6 +3226,7 @@ int write_host (struct host_decl *);
 int write_server_duid(void);
 #if defined (FAILOVER_PROTOCOL)
 int write_failover_state (dhcp_failover_state_t *);
+int write_failover_state_file (void);
 #endif
 int db_printable (const unsigned char *);
 int db_printable_len (const unsigned char *, unsigned);
@@ -3238,6 +3393,14 @@ extern struct executable_statement *default_classification_rules;
 void classification_setup (void);
 void classify_client (struct packet *);
 int check_collection (struct packet *, struct lease *, struct collection *);
+void compile_class_expressions (void);
+void discard_class_indexes (void);
+extern u_int32_t spawned_class_limit;
+extern struct spawned_class_stats spawned_class_stats;
+void spawned_class_enter (struct class *);
+void spawned_class_forget (struct class *);
+isc_result_t spawned_class_get_value (omapi_data_string_t *,
+				      omapi_value_t **);
 void classify (struct packet *, struct class *);
 isc_result_t unlink_class (struct class **class);
 isc_result_t find_class (struct class **, const char *,
@@ -3261,6 +3424,18 @@ void execute_statements_in_scope (struct binding_value **result,
 				  struct binding_scope **,
 				  struct group *, struct group *,
 				  struct on_star *);
+extern struct scope_template_stats scope_template_stats;
+void discard_scope_templates (void);
+void execute_statements_in_scope_cached (struct binding_value **result,
+					 struct packet *, struct lease *,
+					 struct client_state *,
+					 struct option_state *,
+					 struct option_state *,
+					 struct binding_scope **,
+					 struct group *, struct group *,
+					 struct on_star *);
+isc_result_t scope_template_get_value (omapi_data_string_t *,
+				       omapi_value_t **);
 int executable_statement_dereference (struct executable_statement **,
 				      const char *, int);
 void write_statements (FILE *, struct executable_statement *, int);
@@ -3272,6 +3447,7 @@ int find_matching_case (struct executable_statement **,
 int executable_statement_foreach (struct executable_statement *,
 				  int (*) (struct executable_statement *,
 					   void *, int), void *, int);
+void executable_statement_optimize (struct executable_statement **);
 
 /* comapi.c */
 extern omapi_object_type_t *dhcp_type_group;
@@ -3279,6 +3455,8 @@ extern omapi_object_type_t *dhcp_type_shared_network;
 extern omapi_object_type_t *dhcp_type_subnet;
 extern omapi_object_type_t *dhcp_type_control;
 extern dhcp_control_object_t *dhcp_control_object;
+extern isc_result_t (*dhcp_control_get_value_hook) (omapi_data_string_t *,
+						    omapi_value_t **);
 
 void dhcp_common_objects_setup (void);
 
@@ -3642,6 +3820,7 @@ isc_result_t dhcp_failover_set_state (dhcp_failover_state_t *,
 isc_result_t dhcp_failover_peer_state_changed (dhcp_failover_state_t *,
 					       failover_message_t *);
 void dhcp_failover_pool_rebalance (void *);
+void dhcp_failover_pool_balance_step (void *);
 void dhcp_failover_pool_check (struct pool *);
 int dhcp_failover_state_pool_check (dhcp_failover_state_t *);
 void dhcp_failover_timeout (void *);
@@ -3651,6 +3830,8 @@ isc_result_t dhcp_failover_send_updates (dhcp_failover_state_t *);
 int dhcp_failover_queue_update (struct lease *, int);
 int dhcp_failover_send_acks (dhcp_failover_state_t *);
 void dhcp_failover_toack_queue_timeout (void *);
+void dhcp_failover_stats_report (void *);
+void dhcp_failover_output_retry (void *);
 int dhcp_failover_queue_ack (dhcp_failover_state_t *, failover_message_t *msg);
 void dhcp_failover_ack_queue_remove (dhcp_failover_state_t *, struct lease *);
 isc_result_t dhcp_failover_state_set_value (omapi_object_t *,
@@ -3707,7 +3888,8 @@ isc_result_t dhcp_failover_send_bind_ack (dhcp_failover_state_t *,
 					  failover_message_t *,
 					  int, const char *);
 isc_result_t dhcp_failover_send_poolreq (dhcp_failover_state_t *);
-isc_result_t dhcp_failover_send_poolresp (dhcp_failover_state_t *, int);
+isc_result_t dhcp_failover_send_poolresp (dhcp_failover_state_t *, int,
+					  u_int32_t);
 isc_result_t dhcp_failover_send_update_request (dhcp_failover_state_t *);
 isc_result_t dhcp_failover_send_update_request_all (dhcp_failover_state_t *);
 isc_result_t dhcp_failover_send_update_done (dhcp_failover_state_t *);
@@ -3715,8 +3897,7 @@ isc_result_t dhcp_failover_process_bind_update (dhcp_failover_state_t *,
 						failover_message_t *);
 isc_result_t dhcp_failover_process_bind_ack (dhcp_failover_state_t *,
 					     failover_message_t *);
-isc_result_t dhcp_failover_generate_update_queue (dhcp_failover_state_t *,
-						  int);
+void dhcp_failover_recovery_start (dhcp_failover_state_t *, int, int);
 isc_result_t dhcp_failover_process_update_request (dhcp_failover_state_t *,
 						   failover_message_t *);
 isc_result_t dhcp_failover_process_update_request_all (dhcp_failover_state_t *,
@@ -3883,6 +4064,35 @@ void lc_init_growth(struct leasechain *lc, size_t growth);
 void lc_delete_all(struct leasechain *lc);
 #endif /* BINARY_LEASES */
 
+/* ratelimit.c */
+#if !defined (RATE_LIMIT_TABLE_SIZE)
+# define RATE_LIMIT_TABLE_SIZE 16384	/* Buckets; a multiple of the ways. */
+#endif
+#define RATE_LIMIT_WAYS 4
+
+#define RATE_LIMIT_CLIENT 0
+#define RATE_LIMIT_RELAY 1
+
+struct rate_limit_stats {
+	u_int32_t passed;
+	u_int32_t client_dropped;
+	u_int32_t relay_dropped;
+	u_int32_t recycled;
+};
+
+extern u_int32_t client_rate_limit;
+extern u_int32_t client_rate_burst;
+extern u_int32_t relay_rate_limit;
+extern u_int32_t relay_rate_burst;
+extern struct rate_limit_stats rate_limit_stats;
+
+isc_boolean_t rate_limit_permit(int, const unsigned char *, unsigned);
+isc_boolean_t rate_limit_permit_packet(struct packet *);
+#if defined (DHCPv6)
+isc_boolean_t rate_limit_permit_packet6(struct packet *);
+#endif
+isc_result_t rate_limit_get_value(omapi_data_string_t *, omapi_value_t **);
+
 #define MAX_ADDRESS_STRING_LEN \
    (sizeof("ffff:ffff:ffff:ffff:ffff:ffff:255.255.255.255"))
 
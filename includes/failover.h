@@ -68,6 +68,39 @@ typedef struct {
 # define DEFAULT_MAX_RESPONSE_DELAY	20
 #endif
 
+/* How many leases a pool rebalance may look at before giving other
+   events a chance to run.  The unit tests' pools are small, so they get
+   a small step, to take more than one. */
+#ifndef  FAILOVER_BALANCE_STEP
+# if defined (UNIT_TEST)
+#  define FAILOVER_BALANCE_STEP		64
+# else
+#  define FAILOVER_BALANCE_STEP		1000
+# endif
+#endif
+
+/* Once this many bytes are waiting to be written to a failover peer, no
+   more binding updates are sent to it until some of them have been; the
+   update queue is looked at again after FAILOVER_OUTPUT_RETRY
+   microseconds.  The unit tests use a low limit, so that their updates
+   do wait. */
+#ifndef  FAILOVER_OUTPUT_LIMIT
+# if defined (UNIT_TEST)
+#  define FAILOVER_OUTPUT_LIMIT		2048
+# else
+#  define FAILOVER_OUTPUT_LIMIT		(256 * 1024)
+# endif
+#endif
+#ifndef  FAILOVER_OUTPUT_RETRY
+# define FAILOVER_OUTPUT_RETRY		100000
+#endif
+
+/* How often, in seconds, the update and ack queue statistics of each
+   failover peer are logged. */
+#ifndef  FAILOVER_STATS_INTERVAL
+# define FAILOVER_STATS_INTERVAL	300
+#endif
+
 /*
  * IANA has assigned ports 647 ("dhcp-failover") and 847 ("dhcp-failover2").
  * Of these, only port 647 is mentioned in the -12 draft revision.  We're not
@@ -163,6 +196,12 @@ typedef struct {
 
 #define FTM_MAX			FTM_DISCONNECT
 
+/* ISC extension: a frame carrying several complete BNDUPD or BNDACK
+   messages back to back.  It is only sent to peers that have advertised
+   FTV_BATCHED_UPDATES, and is numbered well away from the draft's
+   message types. */
+#define FTM_BATCH		253
+
 /* Reject reasons from Section 12.21: */
 #define FTR_ILLEGAL_IP_ADDR	1
 #define FTR_FATAL_CONFLICT	2
@@ -191,6 +230,13 @@ typedef struct {
 #define DHCP_FAILOVER_MIN_MESSAGE_SIZE    12
 #define DHCP_FAILOVER_MAX_MESSAGE_SIZE	2048
 
+/* Largest batch frame we will send or accept, including its header. */
+#define DHCP_FAILOVER_MAX_BATCH_SIZE	16384
+
+/* ISC sub-options carried in FTO_VENDOR_OPTIONS of CONNECT and
+   CONNECTACK; each is a one byte code, a one byte length and the data. */
+#define FTV_BATCHED_UPDATES	1	/* uint16: messages per FTM_BATCH */
+
 /* Failover server flags from Section 12.23: */
 #define FTF_SERVER_STARTUP	1
 
@@ -275,6 +321,12 @@ typedef struct {
 	unsigned imsg_count;
 	u_int8_t imsg_payoff; /* Pay*load* offset. :') */
 	u_int32_t xid;
+	unsigned ibatch_len;	/* Bytes left in the FTM_BATCH being read. */
+	unsigned char *obatch;	/* Buffer for FTM_BATCH frames, kept for
+				   the life of the link. */
+	unsigned obatch_len;
+	unsigned obatch_count;
+	unsigned obatch_max;	/* Nonzero while a frame is assembled. */
 } dhcp_failover_link_t;
 
 typedef struct _dhcp_failover_listener {
@@ -326,11 +378,32 @@ typedef struct _dhcp_failover_config {
 	struct option_cache *address;
 	int port;
 	u_int32_t max_flying_updates;
+	u_int32_t max_batched_updates;
 	enum failover_state state;
 	TIME stos;
 	u_int32_t max_response_delay;
 } dhcp_failover_config_t;
 
+/* What to do when a pool rebalance finishes. */
+#define FAILOVER_BALANCE_POOLREQ	1	/* Send a POOLREQ if needed. */
+#define FAILOVER_BALANCE_POOLRESP	2	/* Answer the peer's POOLREQ. */
+
+/* Send times of recent BNDUPDs, indexed by XID modulo the ring size. */
+#define FAILOVER_SENT_RING		4096
+struct failover_sent {
+	u_int32_t xid;
+	struct timeval when;
+};
+
+/* BNDUPD to BNDACK latencies are counted in buckets of powers of two
+   milliseconds: under 1ms, under 2ms, under 4ms and so on, with the
+   last bucket taking everything from 16 seconds up. */
+#define FAILOVER_LATENCY_BUCKETS	16
+
+/* State changes that can safely be lost are written to the failover
+   state file at most this many seconds after they happen, together. */
+#define FAILOVER_STATE_WRITE_DELAY	2
+
 typedef struct _dhcp_failover_state {
 	OMAPI_OBJECT_PREAMBLE;
 	struct _dhcp_failover_state *next;
@@ -348,6 +421,19 @@ typedef struct _dhcp_failover_state {
 	u_int32_t max_balance, min_balance;
 	TIME last_balance, sched_balance;
 
+					/* Pool rebalance in progress. */
+	int balance_active;
+	int balance_flags;		/* FAILOVER_BALANCE_*. */
+	u_int32_t balance_xid;		/* The POOLREQ to answer. */
+	int balance_sendreq;		/* A pool needs the peer's leases. */
+	struct pool *balance_pool;	/* The pool being balanced, */
+	int balance_pass;		/* which pass over it, */
+	struct lease *balance_lease;	/* and the next lease to look at. */
+	u_int32_t balance_leases;	/* Free and backup leases at start. */
+	u_int32_t balance_examined;
+	u_int32_t balance_moved;
+	TIME balance_start;
+
 	u_int32_t auto_partner_down;
 
 	enum service_state service_state;
@@ -390,6 +476,51 @@ typedef struct _dhcp_failover_state {
 	int curUPD;			/* If an UPDREQ* message is in motion,
 					   this value indicates which one. */
 	u_int32_t updxid;		/* XID of UPDREQ* message in action. */
+	int state_write_pending;	/* A write of the failover state file
+					   is scheduled for this peer. */
+
+					/* Leases the peer needs are found a
+					   lease hash bucket at a time as the
+					   update window opens, rather than
+					   all being queued up front. */
+	int recovery_active;		/* A recovery stream is running. */
+	int recovery_all;		/* It is sending every lease. */
+	int recovery_reply;		/* It ends with an UPDDONE. */
+	unsigned recovery_bucket;	/* Next bucket of lease_ip_addr_hash. */
+	u_int32_t recovery_total;	/* Leases in this peer's pools. */
+	u_int32_t recovery_examined;	/* Leases looked at so far. */
+	u_int32_t recovery_sent;	/* Leases queued for update. */
+	TIME recovery_start;
+
+	u_int32_t cwnd;			/* Updates we allow in flight. */
+	u_int32_t ssthresh;		/* End of slow start. */
+	u_int32_t cwnd_acked;		/* Acks toward the next increase. */
+	u_int32_t rtt_xid;		/* XID of the update being timed. */
+	struct timeval rtt_sent;	/* When it was sent. */
+	struct timeval last_cut;	/* When cwnd was last reduced. */
+	u_int32_t srtt, rttvar, min_rtt; /* Round trip times, in usecs. */
+
+					/* Queue statistics. */
+	struct failover_sent *sent;	/* Ring of recent send times. */
+	u_int32_t update_queue_len;	/* Leases on the update queue. */
+	u_int32_t update_queue_max;	/* High water marks. */
+	u_int32_t unacked_max;
+	u_int32_t updates_sent;
+	u_int32_t acks_received;
+	u_int32_t acks_interval;	/* Acks in the last report
+					   interval. */
+	u_int32_t acks_reported;	/* acks_received at the last report. */
+	TIME last_report;
+	u_int32_t latency [FAILOVER_LATENCY_BUCKETS];
+	u_int32_t output_max;		/* Most bytes waiting to be sent. */
+	u_int32_t output_blocked;	/* Times updates waited for them. */
+
+					/* Partner-down lease reclaim. */
+	u_int32_t reclaim_backlog;	/* Expired leases not yet reclaimed. */
+	u_int32_t reclaimed;		/* Expired leases reclaimed. */
+	u_int32_t reclaimed_interval;	/* Reclaimed in the last report
+					   interval. */
+	u_int32_t reclaimed_reported;	/* reclaimed at the last report. */
 } dhcp_failover_state_t;
 
 extern int check_secs_byte_order; /* check byte order of secs field when true */
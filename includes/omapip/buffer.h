@@ -54,6 +54,10 @@ typedef struct _omapi_buffer {
 					   the buffer data structure. */
 } omapi_buffer_t;	
 
+/* The most pieces of output omapi_connection_writer() hands to one
+   writev() call; POSIX guarantees at least 16. */
+#define OMAPI_WRITEV_MAX 16
+
 #define BUFFER_BYTES_FREE(x)	\
 	((x) -> tail > (x) -> head \
 	  ? sizeof ((x) -> buf) - ((x) -> tail - (x) -> head) \
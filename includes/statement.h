@@ -26,6 +26,8 @@
  *
  */
 
+struct switch_index;
+
 struct executable_statement {
 	int refcnt;
 	struct executable_statement *next;
@@ -78,14 +80,17 @@ struct executable_statement {
 		struct {
 			struct expression *expr;
 			struct executable_statement *statements;
+			/* Built by executable_statement_optimize() when
+			   all the case values are constant. */
+			struct switch_index *index;
 		} s_switch;
 		struct expression *c_case;
 		struct {
-			char *name;
+			const char *name;	/* From binding_name(). */
 			struct expression *expr;
 			struct executable_statement *statements;
 		} set, let;
-		char *unset;
+		const char *unset;		/* From binding_name(). */
 		struct {
 			enum {
 				log_priority_fatal,
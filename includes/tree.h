@@ -116,7 +116,7 @@ struct binding_value {
 
 struct binding {
 	struct binding *next;
-	char *name;
+	const char *name;		/* From binding_name(). */
 	struct binding_value *value;
 };
 
@@ -194,6 +194,8 @@ enum expr_op {
 	expr_concat_dclist
 };
 
+struct expr_program; /* forward */
+
 struct expression {
 	int refcnt;
 	enum expr_op op;
@@ -264,13 +266,13 @@ struct expression {
  			struct expression *rrname;
  			struct expression *rrdata;
  		} ns_delete, ns_exists, ns_not_exists;
-		char *variable;
+		const char *variable;		/* From binding_name(). */
 		struct {
 			struct expression *val;
 			struct expression *next;
 		} arg;
 		struct {
-			char *name;
+			const char *name;	/* From binding_name(). */
 			struct expression *arglist;
 		} funcall;
 		struct fundef *func;
@@ -281,8 +283,41 @@ struct expression {
 	} data;
 	int flags;
 #	define EXPR_EPHEMERAL	1
+#	define EXPR_MEMO_CHECKED 2	/* EXPR_MEMO_PURE has been worked out. */
+#	define EXPR_MEMO_PURE	4	/* Depends only on the packet. */
+	struct expr_program *program;	/* Compiled form, if any. */
 };		
 
+/* Values of expressions that depend only on a packet, remembered while the
+   packet is being processed; see evaluate_data_expression(). */
+#if !defined (EXPR_MEMO_SIZE)
+# define EXPR_MEMO_SIZE	32
+#endif
+
+struct expr_memo_entry {
+	const void *key;		/* Expression, or option for options. */
+	u_int32_t generation;		/* Of the packet's options. */
+	u_int32_t freed;		/* Expressions freed before it. */
+	int status;
+	struct data_string value;
+};
+
+struct expr_memo {
+	struct expr_memo_entry entries [EXPR_MEMO_SIZE];
+};
+
+struct expr_memo_stats {
+	u_int32_t hits;
+	u_int32_t misses;
+};
+
+/* Counters kept by execute_statements_in_scope_cached(). */
+struct scope_template_stats {
+	u_int32_t hits;
+	u_int32_t misses;
+	u_int32_t fallbacks;
+};
+
 /* DNS host entry structure... */
 struct dns_host_entry {
 	int refcnt;
@@ -30,6 +30,7 @@
 
 #include <omapip/omapip_p.h>
 #include <errno.h>
+#include <sys/uio.h>
 
 #if defined (TRACING)
 static void trace_connection_input_input (trace_type_t *, unsigned, char *);
@@ -447,8 +448,9 @@ isc_result_t omapi_connection_copyout (unsigned char *buf,
 
 isc_result_t omapi_connection_writer (omapi_object_t *h)
 {
-	unsigned bytes_this_write;
-	int bytes_written;
+	struct iovec iov [OMAPI_WRITEV_MAX];
+	unsigned bytes_this_write, bytes_left;
+	int bytes_written, iovcnt;
 	unsigned first_byte;
 	omapi_buffer_t *buffer;
 	omapi_connection_object_t *c;
@@ -461,93 +463,139 @@ isc_result_t omapi_connection_writer (omapi_object_t *h)
 	if (!c -> out_bytes)
 		return ISC_R_SUCCESS;
 
-	buffer = c -> outbufs;
-
 	while (c -> out_bytes) {
-		if (!buffer)
-			return ISC_R_UNEXPECTED;
-		if (BYTES_IN_BUFFER (buffer)) {
+		/* Gather as much of what is queued as we can into one
+		   write; a buffer that wraps around contributes two
+		   pieces. */
+		iovcnt = 0;
+		bytes_this_write = 0;
+		for (buffer = c -> outbufs;
+		     buffer && iovcnt < OMAPI_WRITEV_MAX;
+		     buffer = buffer -> next) {
+			if (!BYTES_IN_BUFFER (buffer))
+				continue;
 			if (buffer -> head == (sizeof buffer -> buf) - 1)
 				first_byte = 0;
 			else
 				first_byte = buffer -> head + 1;
 
+			iov [iovcnt].iov_base = &buffer -> buf [first_byte];
 			if (first_byte > buffer -> tail) {
-				bytes_this_write = (sizeof buffer -> buf -
-						   first_byte);
+				iov [iovcnt].iov_len = (sizeof buffer -> buf -
+							first_byte);
+				if (buffer -> tail &&
+				    iovcnt + 1 < OMAPI_WRITEV_MAX) {
+					bytes_this_write +=
+						iov [iovcnt++].iov_len;
+					iov [iovcnt].iov_base = buffer -> buf;
+					iov [iovcnt].iov_len = buffer -> tail;
+				}
 			} else {
-				bytes_this_write =
+				iov [iovcnt].iov_len =
 					buffer -> tail - first_byte;
 			}
-			bytes_written = write (c -> socket,
-					       &buffer -> buf [first_byte],
-					       bytes_this_write);
-			/* If the write failed with EWOULDBLOCK or we wrote
-			   zero bytes, a further write would block, so we have
-			   flushed as much as we can for now.   Other errors
-			   are really errors. */
-			if (bytes_written < 0) {
-				if (errno == EWOULDBLOCK || errno == EAGAIN)
-					return ISC_R_INPROGRESS;
-				else if (errno == EPIPE)
-					return ISC_R_NOCONN;
+			bytes_this_write += iov [iovcnt++].iov_len;
+		}
+		if (!iovcnt)
+			return ISC_R_UNEXPECTED;
+
+		bytes_written = writev (c -> socket, iov, iovcnt);
+		/* If the write failed with EWOULDBLOCK or we wrote
+		   zero bytes, a further write would block, so we have
+		   flushed as much as we can for now.   Other errors
+		   are really errors. */
+		if (bytes_written < 0) {
+			if (errno == EWOULDBLOCK || errno == EAGAIN)
+				return ISC_R_INPROGRESS;
+			else if (errno == EPIPE)
+				return ISC_R_NOCONN;
 #ifdef EDQUOT
-				else if (errno == EFBIG || errno == EDQUOT)
+			else if (errno == EFBIG || errno == EDQUOT)
 #else
-				else if (errno == EFBIG)
+			else if (errno == EFBIG)
 #endif
-					return ISC_R_NORESOURCES;
-				else if (errno == ENOSPC)
-					return ISC_R_NOSPACE;
-				else if (errno == EIO)
-					return ISC_R_IOERROR;
-				else if (errno == EINVAL)
-					return DHCP_R_INVALIDARG;
-				else if (errno == ECONNRESET)
-					return ISC_R_SHUTTINGDOWN;
+				return ISC_R_NORESOURCES;
+			else if (errno == ENOSPC)
+				return ISC_R_NOSPACE;
+			else if (errno == EIO)
+				return ISC_R_IOERROR;
+			else if (errno == EINVAL)
+				return DHCP_R_INVALIDARG;
+			else if (errno == ECONNRESET)
+				return ISC_R_SHUTTINGDOWN;
+			else
+				return ISC_R_UNEXPECTED;
+		}
+		if (bytes_written == 0)
+			return ISC_R_INPROGRESS;
+
+		/* Consume what was written from the buffers, in the same
+		   order it was gathered. */
+		bytes_left = bytes_written;
+		buffer = c -> outbufs;
+		while (bytes_left) {
+			unsigned bytes_this_buffer;
+
+			if (!buffer)
+				return ISC_R_UNEXPECTED;
+			if (BYTES_IN_BUFFER (buffer)) {
+				if (buffer -> head ==
+				    (sizeof buffer -> buf) - 1)
+					first_byte = 0;
 				else
-					return ISC_R_UNEXPECTED;
-			}
-			if (bytes_written == 0)
-				return ISC_R_INPROGRESS;
+					first_byte = buffer -> head + 1;
+
+				if (first_byte > buffer -> tail)
+					bytes_this_buffer =
+						(sizeof buffer -> buf -
+						 first_byte);
+				else
+					bytes_this_buffer =
+						buffer -> tail - first_byte;
+				if (bytes_this_buffer > bytes_left)
+					bytes_this_buffer = bytes_left;
 
 #if defined (TRACING)
-			if (trace_record ()) {
-				isc_result_t status;
-				trace_iov_t iov [2];
-				int32_t connect_index;
-				
-				connect_index = htonl (c -> index);
-				
-				iov [0].buf = (char *)&connect_index;
-				iov [0].len = sizeof connect_index;
-				iov [1].buf = &buffer -> buf [buffer -> tail];
-				iov [1].len = bytes_written;
-				
-				status = (trace_write_packet_iov
-					  (trace_connection_input, 2, iov,
-					   MDL));
-				if (status != ISC_R_SUCCESS) {
-					trace_stop ();
-					log_error ("trace %s output: %s",
-						   "connection",
-						   isc_result_totext (status));
+				if (trace_record ()) {
+					isc_result_t status;
+					trace_iov_t tiov [2];
+					int32_t connect_index;
+
+					connect_index = htonl (c -> index);
+
+					tiov [0].buf = (char *)&connect_index;
+					tiov [0].len = sizeof connect_index;
+					tiov [1].buf =
+						&buffer -> buf [first_byte];
+					tiov [1].len = bytes_this_buffer;
+
+					status = (trace_write_packet_iov
+						  (trace_connection_input,
+						   2, tiov, MDL));
+					if (status != ISC_R_SUCCESS) {
+						trace_stop ();
+						log_error ("trace %s output: %s",
+							   "connection",
+							   isc_result_totext
+							   (status));
+					}
 				}
-			}
 #endif
 
-			buffer -> head = first_byte + bytes_written - 1;
-			c -> out_bytes -= bytes_written;
-
-			/* If we didn't finish out the write, we filled the
-			   O.S. output buffer and a further write would block,
-			   so stop trying to flush now. */
-			if (bytes_written != bytes_this_write)
-				return ISC_R_INPROGRESS;
+				buffer -> head =
+					first_byte + bytes_this_buffer - 1;
+				bytes_left -= bytes_this_buffer;
+			}
+			if (!BYTES_IN_BUFFER (buffer))
+				buffer = buffer -> next;
 		}
-			
-		if (!BYTES_IN_BUFFER (buffer))
-			buffer = buffer -> next;
+		c -> out_bytes -= bytes_written;
+
+		/* If we didn't finish out the write, we filled the
+		   O.S. output buffer and a further write would block,
+		   so stop trying to flush now. */
+		if ((unsigned)bytes_written != bytes_this_write)
+			return ISC_R_INPROGRESS;
 	}
 		
 	/* Get rid of any output buffers we emptied. */
@@ -56,6 +56,13 @@ void bootp (packet)
 	if (packet -> raw -> op != BOOTREQUEST)
 		return;
 
+	/* BOOTP clients are held to the same rate limits as DHCP. */
+	if (!rate_limit_permit_packet (packet))
+		return;
+
+	/* Relay agent options are passed around by their chain head. */
+	materialize_options (&agent_universe, packet -> options);
+
 	/* %Audit% This is log output. %2004.06.17,Safe%
 	 * If we truncate we hope the user can get a hint from the log.
 	 */
@@ -32,6 +32,135 @@ struct executable_statement *default_classification_rules;
 
 int have_billing_classes;
 
+/* A spawning class keyed on something like the relay agent's circuit id
+   spawns a subclass for every subscriber it ever sees, and keeps it for
+   as long as the server runs.   If spawned-class-limit is set, spawned
+   subclasses are kept on a list in the order they were last matched, and
+   once there are that many, the least recently matched ones that have no
+   leases billed to them are dropped to make room for new ones.   A
+   subclass that is dropped is spawned again the next time its client
+   shows up.   Spawned subclasses don't allocate their billing table until
+   the first lease is billed to them. */
+
+#define SPAWNED_CLASS_RECLAIM_SCAN	32
+
+u_int32_t spawned_class_limit = 0;
+struct spawned_class_stats spawned_class_stats;
+
+static struct class *spawned_head, *spawned_tail;
+
+static u_int32_t spawned_class_size (struct class *class)
+{
+	return (sizeof (struct class) + class -> hash_string.len +
+		(class -> billed_leases
+		 ? class -> lease_limit * sizeof (struct lease *) : 0));
+}
+
+static void spawned_class_unlink (struct class *class)
+{
+	if (class -> lru_prev)
+		class -> lru_prev -> lru_next = class -> lru_next;
+	else
+		spawned_head = class -> lru_next;
+	if (class -> lru_next)
+		class -> lru_next -> lru_prev = class -> lru_prev;
+	else
+		spawned_tail = class -> lru_prev;
+	class -> lru_prev = class -> lru_next = (struct class *)0;
+}
+
+static void spawned_class_link (struct class *class)
+{
+	class -> lru_next = spawned_head;
+	if (spawned_head)
+		spawned_head -> lru_prev = class;
+	else
+		spawned_tail = class;
+	spawned_head = class;
+}
+
+/* Count a new subclass of a spawning class as spawned and put it at the
+   head of the list; check_class calls this when it spawns one, and the
+   lease file parser when it reads one back. */
+
+void spawned_class_enter (class)
+	struct class *class;
+{
+	class -> flags |= CLASS_DECL_SPAWNED;
+	spawned_class_link (class);
+	spawned_class_stats.count++;
+	spawned_class_stats.bytes += spawned_class_size (class);
+}
+
+/* Take a spawned subclass off the list; called when it is destroyed. */
+
+void spawned_class_forget (class)
+	struct class *class;
+{
+	if (!(class -> flags & CLASS_DECL_SPAWNED))
+		return;
+	spawned_class_unlink (class);
+	class -> flags &= ~CLASS_DECL_SPAWNED;
+	spawned_class_stats.count--;
+	spawned_class_stats.bytes -= spawned_class_size (class);
+}
+
+/* Drop least recently matched subclasses that have no billed leases
+   until there is room for one more, looking at no more than a few of
+   them so that a list full of billed subclasses doesn't make every spawn
+   expensive. */
+
+static void spawned_class_reclaim ()
+{
+	struct class *class, *prev;
+	int scanned;
+
+	for (class = spawned_tail, scanned = 0;
+	     class && spawned_class_stats.count >= spawned_class_limit &&
+		     scanned < SPAWNED_CLASS_RECLAIM_SCAN;
+	     class = prev, scanned++) {
+		prev = class -> lru_prev;
+		if (class -> leases_consumed || !class -> superclass ||
+		    !class -> superclass -> hash)
+			continue;
+
+		/* Deleting it from the hash drops the last reference
+		   to it unless a packet still holds one. */
+		spawned_class_forget (class);
+		spawned_class_stats.reclaimed++;
+		class_hash_delete (class -> superclass -> hash,
+				   (const char *)class -> hash_string.data,
+				   class -> hash_string.len, MDL);
+	}
+}
+
+isc_result_t spawned_class_get_value (omapi_data_string_t *name,
+				      omapi_value_t **value)
+{
+	if (!omapi_ds_strcmp (name, "spawned-classes"))
+		return omapi_make_uint_value (value, name,
+					      spawned_class_stats.count, MDL);
+	if (!omapi_ds_strcmp (name, "spawned-class-bytes"))
+		return omapi_make_uint_value (value, name,
+					      spawned_class_stats.bytes, MDL);
+	if (!omapi_ds_strcmp (name, "spawned-class-total"))
+		return omapi_make_uint_value (value, name,
+					      spawned_class_stats.spawned,
+					      MDL);
+	if (!omapi_ds_strcmp (name, "spawned-class-reclaimed"))
+		return omapi_make_uint_value (value, name,
+					      spawned_class_stats.reclaimed,
+					      MDL);
+	if (!omapi_ds_strcmp (name, "subclass-lookups"))
+		return omapi_make_uint_value (value, name,
+					      spawned_class_stats.lookups,
+					      MDL);
+	if (!omapi_ds_strcmp (name, "subclass-hits"))
+		return omapi_make_uint_value (value, name,
+					      spawned_class_stats.hits, MDL);
+	return ISC_R_NOTFOUND;
+}
+
 /* Build the default classification rule tree. */
 
 void classification_setup ()
@@ -59,138 +188,540 @@ void classify_client (packet)
 			    &global_scope, default_classification_rules, NULL);
 }
 
-int check_collection (packet, lease, collection)
+/* Check a packet against one class.   If expr is set, it is the class's
+   match expression, or whatever is left of it once the class index has
+   selected the class; if the index selected the class and there is nothing
+   left to evaluate, expr is null and selected is set.   Returns nonzero if
+   the packet was put in the class or one of its subclasses. */
+
+static int check_class (packet, lease, class, expr, selected)
 	struct packet *packet;
 	struct lease *lease;
-	struct collection *collection;
+	struct class *class;
+	struct expression *expr;
+	int selected;
 {
-	struct class *class, *nc;
+	struct class *nc;
 	struct data_string data;
-	int matched = 0;
 	int status;
+	int result;
 	int ignorep;
 	int classfound;
 
-	for (class = collection -> classes; class; class = class -> nic) {
 #if defined (DEBUG_CLASS_MATCHING)
-		log_info ("checking against class %s...", class -> name);
+	log_info ("checking against class %s...", class -> name);
 #endif
-		memset (&data, 0, sizeof data);
-
-		/* If there is a "match if" expression, check it.   If
-		   we get a match, and there's no subclass expression,
-		   it's a match.   If we get a match and there is a subclass
-		   expression, then we check the submatch.   If it's not a
-		   match, that's final - we don't check the submatch. */
-
-		if (class -> expr) {
+	memset (&data, 0, sizeof data);
+
+	/* If there is a "match if" expression, check it.   If
+	   we get a match, and there's no subclass expression,
+	   it's a match.   If we get a match and there is a subclass
+	   expression, then we check the submatch.   If it's not a
+	   match, that's final - we don't check the submatch. */
+
+	if (expr || selected) {
+		if (!expr)
+			status = 1;
+		else if (selected)
+			/* What's left of "a and b" once a is known to be
+			   true: evaluate b as the and would have. */
+			status = (evaluate_boolean_expression
+				  (&result, packet, lease,
+				   (struct client_state *)0,
+				   packet -> options, (struct option_state *)0,
+				   lease ? &lease -> scope : &global_scope,
+				   expr) && result);
+		else
 			status = (evaluate_boolean_expression_result
 				  (&ignorep, packet, lease,
 				   (struct client_state *)0,
 				   packet -> options, (struct option_state *)0,
 				   lease ? &lease -> scope : &global_scope,
-				   class -> expr));
-			if (status) {
-				if (!class -> submatch) {
-					matched = 1;
+				   expr));
+		if (!status)
+			return 0;
+		if (!class -> submatch) {
 #if defined (DEBUG_CLASS_MATCHING)
-					log_info ("matches class.");
+			log_info ("matches class.");
 #endif
-					classify (packet, class);
-					continue;
-				}
-			} else
-				continue;
+			class -> match_count++;
+			classify (packet, class);
+			return 1;
 		}
+	}
 
-		/* Check to see if the client matches an existing subclass.
-		   If it doesn't, and this is a spawning class, spawn a new
-		   subclass and put the client in it. */
-		if (class -> submatch) {
-			status = (evaluate_data_expression
-				  (&data, packet, lease,
-				   (struct client_state *)0,
-				   packet -> options, (struct option_state *)0,
-				   lease ? &lease -> scope : &global_scope,
-				   class -> submatch, MDL));
-			if (status && data.len) {
-				nc = (struct class *)0;
-				classfound = class_hash_lookup (&nc, class -> hash,
-					(const char *)data.data, data.len, MDL);
+	/* Check to see if the client matches an existing subclass.
+	   If it doesn't, and this is a spawning class, spawn a new
+	   subclass and put the client in it. */
+	if (!class -> submatch)
+		return 0;
+
+	status = (evaluate_data_expression
+		  (&data, packet, lease,
+		   (struct client_state *)0,
+		   packet -> options, (struct option_state *)0,
+		   lease ? &lease -> scope : &global_scope,
+		   class -> submatch, MDL));
+	if (!status || !data.len) {
+		if (status)
+			data_string_forget (&data, MDL);
+		return 0;
+	}
+
+	nc = (struct class *)0;
+	spawned_class_stats.lookups++;
+	classfound = class_hash_lookup (&nc, class -> hash,
+		(const char *)data.data, data.len, MDL);
 
 #ifdef LDAP_CONFIGURATION
-				if (!classfound && find_subclass_in_ldap (class, &nc, &data))
-					classfound = 1;
+	if (!classfound && find_subclass_in_ldap (class, &nc, &data))
+		classfound = 1;
 #endif
 
-				if (classfound) {
+	if (classfound) {
 #if defined (DEBUG_CLASS_MATCHING)
-					log_info ("matches subclass %s.",
-					      print_hex_1 (data.len,
-							   data.data, 60));
+		log_info ("matches subclass %s.",
+		      print_hex_1 (data.len, data.data, 60));
 #endif
-					data_string_forget (&data, MDL);
-					classify (packet, nc);
-					matched = 1;
-					class_dereference (&nc, MDL);
-					continue;
-				}
-				if (!class -> spawning) {
-					data_string_forget (&data, MDL);
-					continue;
-				}
-				/* XXX Write out the spawned class? */
+		data_string_forget (&data, MDL);
+		spawned_class_stats.hits++;
+		if ((nc -> flags & CLASS_DECL_SPAWNED) && nc != spawned_head) {
+			spawned_class_unlink (nc);
+			spawned_class_link (nc);
+		}
+		nc -> match_count++;
+		classify (packet, nc);
+		class_dereference (&nc, MDL);
+		return 1;
+	}
+	if (!class -> spawning) {
+		data_string_forget (&data, MDL);
+		return 0;
+	}
+	/* XXX Write out the spawned class? */
 #if defined (DEBUG_CLASS_MATCHING)
-				log_info ("spawning subclass %s.",
-				      print_hex_1 (data.len, data.data, 60));
+	log_info ("spawning subclass %s.",
+	      print_hex_1 (data.len, data.data, 60));
 #endif
-				status = class_allocate (&nc, MDL);
-				group_reference (&nc -> group,
-						 class -> group, MDL);
-				class_reference (&nc -> superclass,
-						 class, MDL);
-				nc -> lease_limit = class -> lease_limit;
-				nc -> dirty = 1;
-				if (nc -> lease_limit) {
-					nc -> billed_leases =
-						(dmalloc
-						 (nc -> lease_limit *
-						  sizeof (struct lease *),
-						  MDL));
-					if (!nc -> billed_leases) {
-						log_error ("no memory for%s",
-							   " billing");
-						data_string_forget
-							(&nc -> hash_string,
-							 MDL);
-						class_dereference (&nc, MDL);
-						data_string_forget (&data,
-								    MDL);
-						continue;
-					}
-					memset (nc -> billed_leases, 0,
-						(nc -> lease_limit *
-						 sizeof (struct lease *)));
-				}
-				data_string_copy (&nc -> hash_string, &data,
-						  MDL);
-				data_string_forget (&data, MDL);
-				if (!class -> hash)
-				    class_new_hash(&class->hash,
-						   SCLASS_HASH_SIZE, MDL);
-				class_hash_add (class -> hash,
-						(const char *)
-						nc -> hash_string.data,
-						nc -> hash_string.len,
-						nc, MDL);
-				classify (packet, nc);
-				class_dereference (&nc, MDL);
+	if (spawned_class_limit &&
+	    spawned_class_stats.count >= spawned_class_limit)
+		spawned_class_reclaim ();
+	status = class_allocate (&nc, MDL);
+	group_reference (&nc -> group, class -> group, MDL);
+	class_reference (&nc -> superclass, class, MDL);
+	nc -> lease_limit = class -> lease_limit;
+	nc -> dirty = 1;
+	data_string_copy (&nc -> hash_string, &data, MDL);
+	data_string_forget (&data, MDL);
+	if (!class -> hash)
+	    class_new_hash(&class->hash, SCLASS_HASH_SIZE, MDL);
+	class_hash_add (class -> hash,
+			(const char *)nc -> hash_string.data,
+			nc -> hash_string.len,
+			nc, MDL);
+	spawned_class_enter (nc);
+	spawned_class_stats.spawned++;
+	nc -> match_count++;
+	classify (packet, nc);
+	class_dereference (&nc, MDL);
+	return 0;
+}
+
+/* With thousands of classes, evaluating every "match if" for every
+   packet is most of what the server does.   But most such expressions
+   are, or begin with, a comparison of an option or the hardware address
+   to a constant:
+
+	match if substring (option vendor-class-identifier, 0, 4) = "MSFT";
+	match if option agent.circuit-id = "port-17" and ...;
+
+   so the first time a collection is checked we index its classes on
+   those comparisons.   For each distinct option (or the hardware
+   address) that classes compare against, there is a hash table of the
+   constants it is compared to in full, and one of the constants its
+   prefix is compared to.   A packet then costs one evaluation of each
+   such option and a few hash lookups to find the classes whose test
+   succeeds; only those classes, and the ones that couldn't be indexed,
+   are looked at further, in the order in which they were declared, and
+   the indexed test isn't repeated. */
+
+struct class_index_hit {
+	struct class_index_hit *next;
+	int ordinal;			/* Position of the class. */
+};
+
+struct class_index_source {
+	struct class_index_source *next;
+	struct expression *expr;	/* Option or hardware expression. */
+	struct hash_table *exact;	/* Whole values. */
+	struct hash_table *prefix;	/* Prefixes of values. */
+	unsigned *lengths;		/* Lengths of the prefixes. */
+	int nlengths;
+};
+
+struct class_index {
+	int count;			/* Classes in the collection. */
+	struct class **classes;		/* In the order they were declared. */
+	struct expression **residual;	/* What's left to check of each. */
+	struct class_index_hit *hits;	/* One for each indexed class. */
+	int *always;			/* Classes that weren't indexed. */
+	int nalways;
+	int *candidates;		/* Per packet scratch space. */
+	unsigned char *seen;
+	struct class_index_source *sources;
+	int busy;			/* Being used by check_collection. */
+	int stale;			/* Discarded while busy. */
+};
+
+/* If expr compares an option or the hardware address, or a prefix of
+   either, to a nonempty constant, return what is compared and the
+   constant. */
+
+static int class_index_test (struct expression *expr,
+			     struct expression **source,
+			     struct data_string **value, int *prefixp)
+{
+	struct expression *arg, *sub;
+
+	if (expr -> op != expr_equal)
+		return 0;
+	if (expr -> data.equal [1] -> op == expr_const_data) {
+		arg = expr -> data.equal [0];
+		*value = &expr -> data.equal [1] -> data.const_data;
+	} else if (expr -> data.equal [0] -> op == expr_const_data) {
+		arg = expr -> data.equal [1];
+		*value = &expr -> data.equal [0] -> data.const_data;
+	} else
+		return 0;
+	if ((*value) -> len == 0)
+		return 0;
+
+	if (arg -> op == expr_option || arg -> op == expr_hardware) {
+		*source = arg;
+		*prefixp = 0;
+		return 1;
+	}
+
+	/* substring (x, 0, n) = c is a test of the prefix of x if c is n
+	   bytes long; if it's shorter, it would be a test of all of x. */
+	if (arg -> op != expr_substring)
+		return 0;
+	sub = arg -> data.substring.expr;
+	if ((sub -> op != expr_option && sub -> op != expr_hardware) ||
+	    arg -> data.substring.offset -> op != expr_const_int ||
+	    arg -> data.substring.offset -> data.const_int != 0 ||
+	    arg -> data.substring.len -> op != expr_const_int ||
+	    arg -> data.substring.len -> data.const_int != (*value) -> len)
+		return 0;
+	*source = sub;
+	*prefixp = 1;
+	return 1;
+}
+
+static int class_index_same_source (struct expression *a,
+				    struct expression *b)
+{
+	if (a -> op != b -> op)
+		return 0;
+	if (a -> op == expr_hardware)
+		return 1;
+	return (a -> data.option -> universe == b -> data.option -> universe &&
+		a -> data.option -> code == b -> data.option -> code);
+}
+
+static void class_index_free (struct class_index *index)
+{
+	struct class_index_source *src, *next;
+
+	for (src = index -> sources; src; src = next) {
+		next = src -> next;
+		expression_dereference (&src -> expr, MDL);
+		if (src -> exact)
+			free_hash_table (&src -> exact, MDL);
+		if (src -> prefix)
+			free_hash_table (&src -> prefix, MDL);
+		if (src -> lengths)
+			dfree (src -> lengths, MDL);
+		dfree (src, MDL);
+	}
+	/* The index doesn't hold references to the classes or their
+	   expressions; it's discarded whenever they change. */
+	if (index -> classes)
+		dfree (index -> classes, MDL);
+	if (index -> residual)
+		dfree (index -> residual, MDL);
+	if (index -> hits)
+		dfree (index -> hits, MDL);
+	if (index -> always)
+		dfree (index -> always, MDL);
+	if (index -> candidates)
+		dfree (index -> candidates, MDL);
+	if (index -> seen)
+		dfree (index -> seen, MDL);
+	dfree (index, MDL);
+}
+
+/* Add a class to the index under the test it starts with. */
+
+static int class_index_add (struct class_index *index, int ordinal,
+			    struct expression *source,
+			    struct data_string *value, int prefixp)
+{
+	struct class_index_source *src;
+	struct class_index_hit *hit, *hp;
+	struct hash_table **table;
+	unsigned *lengths;
+	int i;
+
+	for (src = index -> sources; src; src = src -> next)
+		if (class_index_same_source (src -> expr, source))
+			break;
+	if (!src) {
+		src = dmalloc (sizeof *src, MDL);
+		if (!src)
+			return 0;
+		expression_reference (&src -> expr, source, MDL);
+		src -> next = index -> sources;
+		index -> sources = src;
+	}
+
+	table = prefixp ? &src -> prefix : &src -> exact;
+	if (!*table && !new_hash (table, 0, 0, 0, do_string_hash, MDL))
+		return 0;
+
+	if (prefixp) {
+		for (i = 0; i < src -> nlengths; i++)
+			if (src -> lengths [i] >= value -> len)
+				break;
+		if (i == src -> nlengths || src -> lengths [i] != value -> len) {
+			lengths = dmalloc ((src -> nlengths + 1) *
+					   sizeof *lengths, MDL);
+			if (!lengths)
+				return 0;
+			memcpy (lengths, src -> lengths, i * sizeof *lengths);
+			lengths [i] = value -> len;
+			memcpy (lengths + i + 1, src -> lengths + i,
+				(src -> nlengths - i) * sizeof *lengths);
+			if (src -> lengths)
+				dfree (src -> lengths, MDL);
+			src -> lengths = lengths;
+			src -> nlengths++;
+		}
+	}
+
+	/* The key points into the class's expression, which lives at
+	   least as long as the index does. */
+	hit = &index -> hits [ordinal];
+	hit -> ordinal = ordinal;
+	hp = NULL;
+	if (hash_lookup ((hashed_object_t **)&hp, *table,
+			 value -> data, value -> len, MDL)) {
+		while (hp -> next)
+			hp = hp -> next;
+		hp -> next = hit;
+	} else
+		add_hash (*table, value -> data, value -> len,
+			  (hashed_object_t *)hit, MDL);
+	return 1;
+}
+
+static struct class_index *class_index_build (struct collection *collection)
+{
+	struct class_index *index;
+	struct class *class;
+	struct expression *expr, *source;
+	struct data_string *value;
+	int prefixp, nindexed, nsources, i;
+	struct class_index_source *src;
+
+	index = dmalloc (sizeof *index, MDL);
+	if (!index)
+		return NULL;
+	for (class = collection -> classes; class; class = class -> nic)
+		index -> count++;
+	index -> classes = dmalloc (index -> count * sizeof (struct class *) +
+				    1, MDL);
+	index -> residual = dmalloc (index -> count *
+				     sizeof (struct expression *) + 1, MDL);
+	index -> hits = dmalloc (index -> count *
+				 sizeof (struct class_index_hit) + 1, MDL);
+	index -> always = dmalloc (index -> count * sizeof (int) + 1, MDL);
+	index -> candidates = dmalloc (index -> count * sizeof (int) + 1, MDL);
+	index -> seen = dmalloc (index -> count + 1, MDL);
+	if (!index -> classes || !index -> residual || !index -> hits ||
+	    !index -> always || !index -> candidates || !index -> seen) {
+		log_error ("No memory to index classes in collection %s.",
+			   collection -> name);
+		class_index_free (index);
+		return NULL;
+	}
+
+	nindexed = 0;
+	for (i = 0, class = collection -> classes; class;
+	     i++, class = class -> nic) {
+		index -> classes [i] = class;
+		expr = class -> expr;
+
+		/* "match if a and b" is indexed on a or b, whichever can be;
+		   the other is what's left to check.   A class the index
+		   passes over never has a evaluated, so it's only indexed
+		   on b if a does nothing but test the packet. */
+		if (expr &&
+		    class_index_test (expr, &source, &value, &prefixp)) {
+			index -> residual [i] = NULL;
+		} else if (expr && expr -> op == expr_and &&
+			   class_index_test (expr -> data.and [0],
+					     &source, &value, &prefixp)) {
+			index -> residual [i] = expr -> data.and [1];
+		} else if (expr && expr -> op == expr_and &&
+			   expression_side_effect_free (expr -> data.and [0]) &&
+			   class_index_test (expr -> data.and [1],
+					     &source, &value, &prefixp)) {
+			index -> residual [i] = expr -> data.and [0];
+		} else {
+			index -> always [index -> nalways++] = i;
+			continue;
+		}
+
+		if (!class_index_add (index, i, source, value, prefixp)) {
+			log_error ("No memory to index classes in "
+				   "collection %s.", collection -> name);
+			class_index_free (index);
+			return NULL;
+		}
+		expression_compile (index -> residual [i]);
+		nindexed++;
+	}
+
+	nsources = 0;
+	for (src = index -> sources; src; src = src -> next)
+		nsources++;
+	log_debug ("Indexed %d of %d classes in collection %s on %d %s.",
+		   nindexed, index -> count, collection -> name, nsources,
+		   nsources == 1 ? "value" : "values");
+	return index;
+}
+
+static int class_index_compare (const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+/* Find the indexed classes whose test the packet passes, and put them in
+   candidates in the order they were declared. */
+
+static int class_index_select (struct class_index *index,
+			       struct packet *packet, struct lease *lease)
+{
+	struct class_index_source *src;
+	struct class_index_hit *hit;
+	struct data_string data;
+	int count = 0;
+	int i;
+
+	for (src = index -> sources; src; src = src -> next) {
+		memset (&data, 0, sizeof data);
+		if (!evaluate_data_expression
+		    (&data, packet, lease, (struct client_state *)0,
+		     packet -> options, (struct option_state *)0,
+		     lease ? &lease -> scope : &global_scope,
+		     src -> expr, MDL))
+			continue;
+
+		hit = NULL;
+		if (data.len && src -> exact)
+			hash_lookup ((hashed_object_t **)&hit, src -> exact,
+				     data.data, data.len, MDL);
+		for (i = 0; ; i++) {
+			for (; hit; hit = hit -> next) {
+				if (index -> seen [hit -> ordinal])
+					continue;
+				index -> seen [hit -> ordinal] = 1;
+				index -> candidates [count++] = hit -> ordinal;
 			}
+			if (i >= src -> nlengths ||
+			    src -> lengths [i] > data.len)
+				break;
+			hash_lookup ((hashed_object_t **)&hit, src -> prefix,
+				     data.data, src -> lengths [i], MDL);
+		}
+		data_string_forget (&data, MDL);
+	}
+
+	for (i = 0; i < count; i++)
+		index -> seen [index -> candidates [i]] = 0;
+	if (count > 1)
+		qsort (index -> candidates, count, sizeof (int),
+		       class_index_compare);
+	return count;
+}
+
+int check_collection (packet, lease, collection)
+	struct packet *packet;
+	struct lease *lease;
+	struct collection *collection;
+{
+	struct class_index *index;
+	struct class *class;
+	int matched = 0;
+	int count, c, a, i;
+
+	if (!collection -> index && collection -> classes)
+		collection -> index = class_index_build (collection);
+	index = collection -> index;
+
+	if (!index) {
+		for (class = collection -> classes; class;
+		     class = class -> nic)
+			if (check_class (packet, lease, class,
+					 class -> expr, 0))
+				matched = 1;
+		return matched;
+	}
+
+	/* Go through the selected classes and the ones that weren't
+	   indexed together, in order. */
+	count = class_index_select (index, packet, lease);
+	index -> busy = 1;
+	c = a = 0;
+	while (c < count || a < index -> nalways) {
+		if (a == index -> nalways ||
+		    (c < count &&
+		     index -> candidates [c] < index -> always [a])) {
+			i = index -> candidates [c++];
+			if (check_class (packet, lease, index -> classes [i],
+					 index -> residual [i], 1))
+				matched = 1;
+		} else {
+			i = index -> always [a++];
+			if (check_class (packet, lease, index -> classes [i],
+					 index -> classes [i] -> expr, 0))
+				matched = 1;
 		}
 	}
+	index -> busy = 0;
+	if (index -> stale)
+		class_index_free (index);
 	return matched;
 }
 
+/* Called whenever a class is added, removed or changed. */
+
+void discard_class_indexes ()
+{
+	struct collection *lp;
+
+	for (lp = collections; lp; lp = lp -> next) {
+		if (!lp -> index)
+			continue;
+		if (lp -> index -> busy)
+			lp -> index -> stale = 1;
+		else
+			class_index_free (lp -> index);
+		lp -> index = NULL;
+	}
+}
+
 void classify (packet, class)
 	struct packet *packet;
 	struct class *class;
@@ -206,6 +737,21 @@ void classify (packet, class)
 }
 
 
+/* Compile the match expressions of all the classes we know about, so
+   that check_collection() doesn't have to walk their trees.   Called
+   once the configuration has been read. */
+
+void compile_class_expressions ()
+{
+	struct collection *lp;
+	struct class *cp;
+
+	for (lp = collections; lp; lp = lp -> next)
+		for (cp = lp -> classes; cp; cp = cp -> nic)
+			expression_compile (cp -> expr);
+}
+
+
 isc_result_t unlink_class(struct class **class) {
 	struct collection *lp;
 	struct class *cp, *pp;
@@ -220,6 +766,8 @@ isc_result_t unlink_class(struct class **class) {
 				}
 				cp->nic = 0;
 				class_dereference(class, MDL);
+				discard_class_indexes();
+				discard_scope_templates();
 
 				return ISC_R_SUCCESS;
 			}
@@ -266,9 +814,12 @@ void unbill_class (lease)
 	}
 
 	/* Find the lease in the list of the class's billed leases */
-	for (i = 0; i < class->lease_limit; i++) {
-		if (class->billed_leases[i] == lease)
-			break;
+	i = class->lease_limit;
+	if (class->billed_leases != NULL) {
+		for (i = 0; i < class->lease_limit; i++) {
+			if (class->billed_leases[i] == lease)
+				break;
+		}
 	}
 
 	/* Create guard reference, so class cannot be last reference to lease */
@@ -306,6 +857,20 @@ int bill_class (lease, class)
 	if (class -> leases_consumed == class -> lease_limit)
 		return 0;
 
+	/* Spawned subclasses get their table when it is first needed. */
+	if (!class -> billed_leases) {
+		class -> billed_leases =
+			dmalloc (class -> lease_limit *
+				 sizeof (struct lease *), MDL);
+		if (!class -> billed_leases) {
+			log_error ("no memory for%s", " billing");
+			return 0;
+		}
+		if (class -> flags & CLASS_DECL_SPAWNED)
+			spawned_class_stats.bytes +=
+				class -> lease_limit * sizeof (struct lease *);
+	}
+
 	for (i = 0; i < class -> lease_limit; i++)
 		if (!class -> billed_leases [i])
 			break;
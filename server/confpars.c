@@ -785,6 +785,15 @@ int parse_statement (cfile, group, type, host_decl, declaration)
 		break;
 
 	      case FAILOVER:
+		/* The failover protocol only knows about DHCPv4 leases. */
+		if (local_family == AF_INET6) {
+			parse_warn (cfile, "failover is only supported %s",
+				    "in DHCPv4 mode.");
+			log_error ("DHCPv6 servers can't share a pool6; "
+				   "give each one its own range6 or prefix6.");
+			skip_to_semi (cfile);
+			break;
+		}
 		if (type != ROOT_GROUP && type != SHARED_NET_DECL) {
 			parse_warn (cfile, "failover peers may only be %s",
 				    "defined in shared-network");
@@ -834,6 +843,7 @@ int parse_statement (cfile, group, type, host_decl, declaration)
 			}
 			return declaration;
 		}
+		executable_statement_optimize (&et);
 		if (!et)
 			return declaration;
 	      insert_statement:
@@ -1058,6 +1068,10 @@ void parse_failover_peer (cfile, group, type)
 			tp = &cp -> max_flying_updates;
 			goto parse_idle;
 
+		      case MAX_BATCHED_UPDATES:
+			tp = &cp->max_batched_updates;
+			goto parse_idle;
+
 		      case MCLT:
 			tp = &peer -> mclt;
 			goto parse_idle;
@@ -2225,6 +2239,7 @@ int parse_class_declaration (cp, cfile, group, type)
 	const char *tname;
 	struct executable_statement *stmt = NULL;
 	int new = 1;
+	int created = 0;
 	isc_result_t status = ISC_R_FAILURE;
 	int matchedonce = 0;
 	int submatchedonce = 0;
@@ -2333,11 +2348,15 @@ int parse_class_declaration (cp, cfile, group, type)
 		} else {
 			status = class_allocate (&class, MDL);
 		}
+		created = 1;
 		if (pc) {
 			group_reference (&class -> group, pc -> group, MDL);
 			class_reference (&class -> superclass, pc, MDL);
 			class -> lease_limit = pc -> lease_limit;
-			if (class -> lease_limit) {
+
+			/* Subclasses of a spawning class get their billing
+			   table from bill_class when it is first needed. */
+			if (class -> lease_limit && !pc -> spawning) {
 				class -> billed_leases =
 					dmalloc (class -> lease_limit *
 						 sizeof (struct lease *), MDL);
@@ -2399,6 +2418,12 @@ int parse_class_declaration (cp, cfile, group, type)
 		if (token == SEMI) {
 			skip_token(&val, NULL, cfile);
 
+			/* A bare subclass of a spawning class, such as one
+			   read back from the lease file, is one that was
+			   spawned earlier. */
+			if (created && pc && pc -> spawning)
+				spawned_class_enter (class);
+
 			if (cp)
 				status = class_reference (cp, class, MDL);
 			class_dereference (&class, MDL);
@@ -2578,6 +2603,11 @@ int parse_class_declaration (cp, cfile, group, type)
 		}
 	}
 
+	/* The class, or its match expression, may have changed. */
+	if (type == CLASS_TYPE_CLASS)
+		discard_class_indexes ();
+	discard_scope_templates ();
+
 	if (cp)				/* should always be 0??? */
 		status = class_reference (cp, class, MDL);
 	class_dereference (&class, MDL);
@@ -3553,17 +3583,10 @@ int parse_lease_declaration (struct lease **lp, struct parse *cfile)
 				if (!(binding_scope_allocate
 				      (&lease -> scope, MDL)))
 					log_fatal ("no memory for scope");
-			    binding = dmalloc (sizeof *binding, MDL);
+			    binding = new_binding (val, MDL);
 			    if (!binding)
 				    log_fatal ("No memory for lease %s.",
 					       "binding");
-			    memset (binding, 0, sizeof *binding);
-			    binding -> name =
-				    dmalloc (strlen (val) + 1, MDL);
-			    if (!binding -> name)
-				    log_fatal ("No memory for binding %s.",
-					       "name");
-			    strcpy (binding -> name, val);
 			    newbinding = 1;
 			} else  {
 			    newbinding = 0;
@@ -4944,21 +4967,12 @@ parse_ia_na_declaration(struct parse *cfile) {
 				}
 
 				if (bnd == NULL) {
-					bnd = dmalloc(sizeof(*bnd),
-							  MDL);
+					bnd = new_binding(val, MDL);
 					if (bnd == NULL) {
 						log_fatal("No memory for "
 							  "lease binding.");
 					}
 
-					bnd->name = dmalloc(strlen(val) + 1,
-							    MDL);
-					if (bnd->name == NULL) {
-						log_fatal("No memory for "
-							  "binding name.");
-					}
-					strcpy(bnd->name, val);
-
 					newbinding = ISC_TRUE;
 				} else {
 					newbinding = ISC_FALSE;
@@ -5391,21 +5405,12 @@ parse_ia_ta_declaration(struct parse *cfile) {
 				}
 
 				if (bnd == NULL) {
-					bnd = dmalloc(sizeof(*bnd),
-							  MDL);
+					bnd = new_binding(val, MDL);
 					if (bnd == NULL) {
 						log_fatal("No memory for "
 							  "lease binding.");
 					}
 
-					bnd->name = dmalloc(strlen(val) + 1,
-							    MDL);
-					if (bnd->name == NULL) {
-						log_fatal("No memory for "
-							  "binding name.");
-					}
-					strcpy(bnd->name, val);
-
 					newbinding = ISC_TRUE;
 				} else {
 					newbinding = ISC_FALSE;
@@ -5828,21 +5833,12 @@ parse_ia_pd_declaration(struct parse *cfile) {
 				}
 
 				if (bnd == NULL) {
-					bnd = dmalloc(sizeof(*bnd),
-							  MDL);
+					bnd = new_binding(val, MDL);
 					if (bnd == NULL) {
 						log_fatal("No memory for "
 							  "prefix binding.");
 					}
 
-					bnd->name = dmalloc(strlen(val) + 1,
-							    MDL);
-					if (bnd->name == NULL) {
-						log_fatal("No memory for "
-							  "binding name.");
-					}
-					strcpy(bnd->name, val);
-
 					newbinding = ISC_TRUE;
 				} else {
 					newbinding = ISC_FALSE;
@@ -763,23 +763,21 @@ error_exit:
 #endif /* DHCPv6 */
 
 #if defined (FAILOVER_PROTOCOL)
-int write_failover_state (dhcp_failover_state_t *state)
+/* Print the state record of a failover peer; returns the number of
+   errors. */
+static int print_failover_state (FILE *file, dhcp_failover_state_t *state)
 {
 	int errors = 0;
 	const char *tval;
 
-	if (lease_file_is_corrupt)
-		if (!new_lease_file (0))
-			return 0;
-
 	errno = 0;
-	fprintf (db_file, "\nfailover peer \"%s\" state {", state -> name);
+	fprintf (file, "\nfailover peer \"%s\" state {", state -> name);
 	if (errno)
 		++errors;
 
 	tval = print_time(state->me.stos);
 	if (tval == NULL ||
-	    fprintf(db_file, "\n  my state %s at %s",
+	    fprintf(file, "\n  my state %s at %s",
 		    (state->me.state == startup) ?
 		    dhcp_failover_state_name_print(state->saved_state) :
 		    dhcp_failover_state_name_print(state->me.state),
@@ -788,25 +786,34 @@ int write_failover_state (dhcp_failover_state_t *state)
 
 	tval = print_time(state->partner.stos);
 	if (tval == NULL ||
-	    fprintf(db_file, "\n  partner state %s at %s",
+	    fprintf(file, "\n  partner state %s at %s",
 		    dhcp_failover_state_name_print(state->partner.state),
 		    tval) < 0)
 		++errors;
 
 	if (state -> i_am == secondary) {
 		errno = 0;
-		fprintf (db_file, "\n  mclt %ld;",
+		fprintf (file, "\n  mclt %ld;",
 			 (unsigned long)state -> mclt);
 		if (errno)
 			++errors;
 	}
 
         errno = 0;
-	fprintf (db_file, "\n}\n");
+	fprintf (file, "\n}\n");
 	if (errno)
 		++errors;
 
-	if (errors) {
+	return errors;
+}
+
+int write_failover_state (dhcp_failover_state_t *state)
+{
+	if (lease_file_is_corrupt)
+		if (!new_lease_file (0))
+			return 0;
+
+	if (print_failover_state (db_file, state)) {
 		log_info ("write_failover_state: unable to write state %s",
 			  state -> name);
 		lease_file_is_corrupt = 1;
@@ -816,6 +823,119 @@ int write_failover_state (dhcp_failover_state_t *state)
 	return 1;
 
 }
+
+/* Write the states of all failover peers to the failover state file.
+   They are written to a new file which is then renamed over the old
+   one, so the file always holds a complete set of states. */
+int write_failover_state_file ()
+{
+	dhcp_failover_state_t *state;
+	char newfname [512];
+	FILE *file;
+	int fd;
+	int errors = 0;
+
+	if (snprintf (newfname, sizeof newfname, "%s.new",
+		      path_dhcpd_failover_state) >= sizeof newfname)
+		log_fatal("write_failover_state_file: path too long");
+
+	fd = open (newfname, O_WRONLY | O_TRUNC | O_CREAT, 0664);
+	if (fd < 0) {
+		log_error ("Can't create new failover state file: %m");
+		return 0;
+	}
+
+#if defined (PARANOIA)
+	if ((set_uid != 0) && (geteuid() == 0) &&
+	    (set_gid != 0) && (getegid() == 0)) {
+		if (fchown(fd, set_uid, set_gid)) {
+			log_fatal ("Can't chown new failover state file: %m");
+		}
+	}
+#endif /* PARANOIA */
+
+	if ((file = fdopen(fd, "w")) == NULL) {
+		log_error("Can't fdopen new failover state file: %m");
+		close(fd);
+		(void)unlink (newfname);
+		return 0;
+	}
+
+	errno = 0;
+	fprintf (file, "# The format of this file is documented in the %s",
+		 "dhcpd.leases(5) manual page.\n");
+	if (errno)
+		++errors;
+
+	for (state = failover_states; state; state = state -> next)
+		errors += print_failover_state (file, state);
+
+	if (fflush (file) == EOF ||
+	    ((dont_use_fsync == 0) && (fsync(fileno (file)) < 0)))
+		++errors;
+	if (fclose (file) == EOF)
+		++errors;
+
+	if (errors) {
+		log_error ("Can't write failover state file %s: %m", newfname);
+		(void)unlink (newfname);
+		return 0;
+	}
+
+	if (rename (newfname, path_dhcpd_failover_state) < 0) {
+		log_error ("Can't install new failover state file %s to %s: %m",
+			   newfname, path_dhcpd_failover_state);
+		(void)unlink (newfname);
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Read the failover state file over the states from the lease file.
+   Either may be the newer: while failover-state-file-name was not set,
+   states went to the lease file and the state file was left as it was.
+   So each state, ours and the peer's, is taken from whichever file
+   records the later change. */
+static void read_failover_state_file ()
+{
+	dhcp_failover_state_t *state;
+	dhcp_failover_config_t *saved;
+	int i, count = 0;
+
+	for (state = failover_states; state; state = state -> next)
+		count++;
+	if (count == 0)
+		return;
+
+	saved = dmalloc (2 * count * sizeof *saved, MDL);
+	if (saved == NULL)
+		log_fatal ("No memory to read failover state file.");
+	for (i = 0, state = failover_states; state; state = state -> next) {
+		saved [i++] = state -> me;
+		saved [i++] = state -> partner;
+	}
+
+	(void) read_conf_file (path_dhcpd_failover_state,
+			       (struct group *)0, 0, 1);
+
+	for (i = 0, state = failover_states; state; state = state -> next) {
+		if (saved [i].stos > state -> me.stos) {
+			log_info ("failover peer %s: lease file has a newer "
+				  "state than %s.", state -> name,
+				  path_dhcpd_failover_state);
+			state -> me.state = saved [i].state;
+			state -> me.stos = saved [i].stos;
+		}
+		i++;
+		if (saved [i].stos > state -> partner.stos) {
+			state -> partner.state = saved [i].state;
+			state -> partner.stos = saved [i].stos;
+		}
+		i++;
+	}
+	dfree (saved, MDL);
+}
 #endif
 
 int db_printable (s)
@@ -1089,6 +1209,12 @@ void db_startup (int test_mode)
 			;
 		}
 
+#if defined (FAILOVER_PROTOCOL)
+		if (path_dhcpd_failover_state &&
+		    access (path_dhcpd_failover_state, F_OK) == 0)
+			read_failover_state_file ();
+#endif
+
 #if defined (TRACING)
 	}
 #endif
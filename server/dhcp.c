@@ -101,6 +101,17 @@ dhcp (struct packet *packet) {
 	const char *errmsg;
 	struct data_string data;
 
+	/* Relay agent options are passed around by their chain head, so
+	 * they can't be left for parse_option_buffer()'s lazy decoding.
+	 */
+	materialize_options(&agent_universe, packet->options);
+
+	/* Drop clients and relays that are sending faster than we've
+	 * been told to answer, before spending any effort on them.
+	 */
+	if (!rate_limit_permit_packet(packet))
+		goto out;
+
 	if (!locate_network(packet) &&
 	    packet->packet_type != DHCPREQUEST &&
 	    packet->packet_type != DHCPINFORM &&
@@ -2250,29 +2261,34 @@ void ack_lease (packet, lease, offer, when, msg, ms_nulltp, hp)
 	}
 
 	/* Execute statements in scope starting with the subnet scope. */
-	execute_statements_in_scope (NULL, packet, lease,
-				     NULL, packet->options,
-				     state->options, &lease->scope,
-				     lease->subnet->group, NULL, NULL);
+	execute_statements_in_scope_cached (NULL, packet, lease,
+					    NULL, packet->options,
+					    state->options, &lease->scope,
+					    lease->subnet->group, NULL, NULL);
 
 	/* If the lease is from a pool, run the pool scope. */
 	if (lease->pool)
-		(execute_statements_in_scope(NULL, packet, lease, NULL,
-					     packet->options, state->options,
-					     &lease->scope, lease->pool->group,
-					     lease->pool->
-						shared_network->group,
-					     NULL));
+		execute_statements_in_scope_cached(NULL, packet, lease, NULL,
+						   packet->options,
+						   state->options,
+						   &lease->scope,
+						   lease->pool->group,
+						   lease->pool->
+						      shared_network->group,
+						   NULL);
 
 	/* Execute statements from class scopes. */
 	for (i = packet -> class_count; i > 0; i--) {
-		execute_statements_in_scope(NULL, packet, lease, NULL,
-					    packet->options, state->options,
-					    &lease->scope,
-					    packet->classes[i - 1]->group,
-					    (lease->pool ? lease->pool->group
-					     : lease->subnet->group),
-					    NULL);
+		execute_statements_in_scope_cached(NULL, packet, lease, NULL,
+						   packet->options,
+						   state->options,
+						   &lease->scope,
+						   packet->classes[i - 1]->
+						      group,
+						   (lease->pool
+						    ? lease->pool->group
+						    : lease->subnet->group),
+						   NULL);
 	}
 
 	/* See if the client is only supposed to have one lease at a time,
@@ -2473,13 +2489,14 @@ void ack_lease (packet, lease, offer, when, msg, ms_nulltp, hp)
 	/* If we have a host_decl structure, run the options associated
 	   with its group.  Whether the host decl struct is old or not. */
 	if (host)
-		execute_statements_in_scope (NULL, packet, lease, NULL,
-					     packet->options, state->options,
-					     &lease->scope, host->group,
-					     (lease->pool
-					      ? lease->pool->group
-					      : lease->subnet->group),
-					     NULL);
+		execute_statements_in_scope_cached (NULL, packet, lease,
+						    NULL, packet->options,
+						    state->options,
+						    &lease->scope, host->group,
+						    (lease->pool
+						     ? lease->pool->group
+						     : lease->subnet->group),
+						    NULL);
 
 	/* Drop the request if it's not allowed for this client.   By
 	   default, unknown clients are allowed. */
@@ -97,6 +97,8 @@ u_int32_t abandon_lease_time = DEFAULT_ABANDON_LEASE_TIME;
 const char *path_dhcpd_conf = _PATH_DHCPD_CONF;
 const char *path_dhcpd_db = _PATH_DHCPD_DB;
 const char *path_dhcpd_pid = _PATH_DHCPD_PID;
+/* Failover states go to the lease file unless this is set. */
+const char *path_dhcpd_failover_state = NULL;
 /* False (default) => we write and use a pid file */
 isc_boolean_t no_pid_file = ISC_FALSE;
 
@@ -248,6 +250,35 @@ static void setup_chroot (char *chroot_dir) {
 }
 #endif /* PARANOIA */
 
+/*!
+ *
+ * \brief Print the global and class statements as they will be executed
+ *
+ * Used with -T to show what executable_statement_optimize() made of the
+ * configuration: the branches of conditions that could be decided when
+ * it was read, and nothing that can't be reached.
+ */
+static void
+write_optimized_statements(FILE *file) {
+	struct collection *lp;
+	struct class *cp;
+
+	fprintf(file, "# global statements");
+	write_statements(file, root_group->statements, 0);
+	for (lp = collections; lp != NULL; lp = lp->next) {
+		for (cp = lp->classes; cp != NULL; cp = cp->nic) {
+			if (cp->group == NULL || cp->group == root_group ||
+			    cp->group->statements == NULL)
+				continue;
+			fprintf(file, "\nclass \"%s\" {",
+				cp->name != NULL ? cp->name : "");
+			write_statements(file, cp->group->statements, 2);
+			fprintf(file, "\n}");
+		}
+	}
+	fprintf(file, "\n");
+}
+
 int
 main(int argc, char **argv) {
 	int fd;
@@ -762,6 +793,7 @@ main(int argc, char **argv) {
 	/* Set up various hooks. */
 	dhcp_interface_setup_hook = dhcpd_interface_setup_hook;
 	bootp_packet_handler = do_packet;
+	add_enumeration (&rx_queue_drop_policies);
 #ifdef DHCPv6
 	add_enumeration (&prefix_length_modes);
 	dhcpv6_packet_handler = do_packet6;
@@ -829,6 +861,12 @@ main(int argc, char **argv) {
 
 	postconf_initialization (quiet);
 
+	/* Class matching runs for every packet; compile what we can. */
+	compile_class_expressions ();
+
+	if (lftest)
+		write_optimized_statements(stdout);
+
 #if defined (FAILOVER_PROTOCOL)
 	dhcp_failover_sanity_check();
 #endif
@@ -1114,6 +1152,22 @@ void postconf_initialization (int quiet)
 		path_dhcpd_pid = s;
 	}
 
+#if defined (FAILOVER_PROTOCOL)
+	oc = lookup_option(&server_universe, options,
+			   SV_FAILOVER_STATE_FILE_NAME);
+	if (oc &&
+	    evaluate_option_cache(&db, NULL, NULL, NULL, options, NULL,
+				  &global_scope, oc, MDL)) {
+		s = dmalloc(db.len + 1, MDL);
+		if (!s)
+			log_fatal("no memory for failover state filename.");
+		memcpy(s, db.data, db.len);
+		s[db.len] = 0;
+		data_string_forget(&db, MDL);
+		path_dhcpd_failover_state = s;
+	}
+#endif
+
 #ifdef DHCPv6
         if (local_family == AF_INET6) {
                 /*
@@ -1317,6 +1371,9 @@ void postconf_initialization (int quiet)
 		log_info ("Config file: %s", path_dhcpd_conf);
 		log_info ("Database file: %s", path_dhcpd_db);
 		log_info ("PID file: %s", path_dhcpd_pid);
+		if (path_dhcpd_failover_state)
+			log_info ("Failover state file: %s",
+				  path_dhcpd_failover_state);
 	}
 
 	oc = lookup_option(&server_universe, options, SV_LOG_FACILITY);
@@ -1400,6 +1457,98 @@ void postconf_initialization (int quiet)
 		server_id_check = 1;
 	}
 
+	oc = lookup_option(&server_universe, options, SV_STRICT_PACKET_FILTER);
+	if ((oc != NULL) &&
+	    evaluate_boolean_option_cache(NULL, NULL, NULL, NULL, options, NULL,
+					  &global_scope, oc, MDL)) {
+		strict_packet_filter = 1;
+	}
+
+	oc = lookup_option(&server_universe, options, SV_CLIENT_RATE_LIMIT);
+	if (oc &&
+	    evaluate_option_cache(&db, NULL, NULL, NULL, options, NULL,
+				  &global_scope, oc, MDL)) {
+		if (db.len == 4) {
+			client_rate_limit = getULong(db.data);
+		} else {
+			log_fatal("invalid client-rate-limit");
+		}
+		data_string_forget(&db, MDL);
+	}
+
+	oc = lookup_option(&server_universe, options, SV_CLIENT_RATE_BURST);
+	if (oc &&
+	    evaluate_option_cache(&db, NULL, NULL, NULL, options, NULL,
+				  &global_scope, oc, MDL)) {
+		if (db.len == 4) {
+			client_rate_burst = getULong(db.data);
+		} else {
+			log_fatal("invalid client-rate-burst");
+		}
+		data_string_forget(&db, MDL);
+	}
+
+	oc = lookup_option(&server_universe, options, SV_RELAY_RATE_LIMIT);
+	if (oc &&
+	    evaluate_option_cache(&db, NULL, NULL, NULL, options, NULL,
+				  &global_scope, oc, MDL)) {
+		if (db.len == 4) {
+			relay_rate_limit = getULong(db.data);
+		} else {
+			log_fatal("invalid relay-rate-limit");
+		}
+		data_string_forget(&db, MDL);
+	}
+
+	oc = lookup_option(&server_universe, options, SV_RELAY_RATE_BURST);
+	if (oc &&
+	    evaluate_option_cache(&db, NULL, NULL, NULL, options, NULL,
+				  &global_scope, oc, MDL)) {
+		if (db.len == 4) {
+			relay_rate_burst = getULong(db.data);
+		} else {
+			log_fatal("invalid relay-rate-burst");
+		}
+		data_string_forget(&db, MDL);
+	}
+
+	oc = lookup_option(&server_universe, options, SV_RECEIVE_QUEUE_LENGTH);
+	if (oc &&
+	    evaluate_option_cache(&db, NULL, NULL, NULL, options, NULL,
+				  &global_scope, oc, MDL)) {
+		if (db.len == 4) {
+			rx_queue_length = getULong(db.data);
+		} else {
+			log_fatal("invalid receive-queue-length");
+		}
+		data_string_forget(&db, MDL);
+	}
+
+	oc = lookup_option(&server_universe, options,
+			   SV_RECEIVE_QUEUE_DROP_POLICY);
+	if (oc &&
+	    evaluate_option_cache(&db, NULL, NULL, NULL, options, NULL,
+				  &global_scope, oc, MDL)) {
+		if (db.len == 1) {
+			rx_queue_drop_policy = db.data[0];
+		} else {
+			log_fatal("invalid receive-queue-drop-policy");
+		}
+		data_string_forget(&db, MDL);
+	}
+
+	oc = lookup_option(&server_universe, options, SV_SPAWNED_CLASS_LIMIT);
+	if (oc &&
+	    evaluate_option_cache(&db, NULL, NULL, NULL, options, NULL,
+				  &global_scope, oc, MDL)) {
+		if (db.len == 4) {
+			spawned_class_limit = getULong(db.data);
+		} else {
+			log_fatal("invalid spawned-class-limit");
+		}
+		data_string_forget(&db, MDL);
+	}
+
 #ifdef DHCPv6
 	oc = lookup_option(&server_universe, options, SV_PREFIX_LEN_MODE);
 	if ((oc != NULL) &&
@@ -101,6 +101,12 @@ struct reply_state {
 	/* Index into the data field that has been consumed. */
 	unsigned cursor;
 
+	/*
+	 * Index into the data field where the suboptions of the IA being
+	 * built start, or zero if there is none.
+	 */
+	unsigned ia_data;
+
 	/* Space for the on commit statements for a fixed host */
 	struct on_star on_star;
 
@@ -191,6 +197,10 @@ static int reuse_lease6(struct reply_state *reply, struct iasubopt *lease);
 static void shorten_lifetimes(struct reply_state *reply, struct iasubopt *lease,
 			      time_t age, int threshold);
 static void write_to_packet(struct reply_state *reply, unsigned ia_cursor);
+static unsigned char *reply_ia_suboption(struct reply_state *reply,
+					 unsigned code, unsigned len);
+static isc_boolean_t reply_ia_rewind(struct reply_state *reply);
+static void reply_ia_abandon(struct reply_state *reply);
 static const char *iasubopt_plen_str(struct iasubopt *lease);
 
 #ifdef NSUPDATE
@@ -2113,6 +2123,7 @@ reply_process_ia_na(struct reply_state *reply, struct option_cache *ia) {
 	/* We store the client's t2 for now, and may over-ride it later. */
 	putULong(reply->buf.data + reply->cursor, reply->rebind);
 	reply->cursor += 4;
+	reply->ia_data = reply->cursor;
 
 	/*
 	 * For each address in this IA_NA, decide what to do about it.
@@ -2172,10 +2183,7 @@ reply_process_ia_na(struct reply_state *reply, struct option_cache *ia) {
 				 * Status Code option in the IA containing
 				 * status code NoAddrsAvail.
 				 */
-				option_state_dereference(&reply->reply_ia, MDL);
-				if (!option_state_allocate(&reply->reply_ia,
-							   MDL))
-				{
+				if (!reply_ia_rewind(reply)) {
 					log_error("reply_process_ia_na: No "
 						  "memory for option state "
 						  "wipe.");
@@ -2395,6 +2403,7 @@ reply_process_ia_na(struct reply_state *reply, struct option_cache *ia) {
 	}
 
       cleanup:
+	reply_ia_abandon(reply);
 	if (packet_ia != NULL)
 		option_state_dereference(&packet_ia, MDL);
 	if (reply->reply_ia != NULL)
@@ -2443,6 +2452,7 @@ write_to_packet(struct reply_state *reply, unsigned ia_cursor) {
 	/* Reset the length of this IA to match what was just written. */
 	putUShort(reply->buf.data + ia_cursor + 2,
 		  reply->cursor - (ia_cursor + 4));
+	reply->ia_data = 0;
 
 	if (reply->ia->ia_type != D6O_IA_TA) {
 		/* Calculate T1/T2 and stuff them in the reply */
@@ -2450,6 +2460,58 @@ write_to_packet(struct reply_state *reply, unsigned ia_cursor) {
 	}
 }
 
+/*
+ * IAADDR and IAPREFIX options are written straight into the reply buffer
+ * behind the header of the IA they belong to, so that the IA's option
+ * state only has to hold its status code.  write_to_packet() then appends
+ * the status code after them, which is where store_options6() used to
+ * put it.
+ *
+ * Returns a pointer to the len bytes of option data to fill in, or NULL
+ * if the option does not fit.
+ */
+static unsigned char *
+reply_ia_suboption(struct reply_state *reply, unsigned code, unsigned len) {
+	unsigned char *tmp;
+
+	if (reply->cursor + 4 + len > sizeof(reply->buf)) {
+		log_debug("No space for option %d", code);
+		return (NULL);
+	}
+
+	tmp = reply->buf.data + reply->cursor;
+	putUShort(tmp, code);
+	putUShort(tmp + 2, len);
+	reply->cursor += 4 + len;
+	return (tmp + 4);
+}
+
+/*
+ * Empty the IA being built: drop the suboptions written so far and start
+ * a new option state for it.
+ */
+static isc_boolean_t
+reply_ia_rewind(struct reply_state *reply) {
+	if (reply->ia_data != 0)
+		reply->cursor = reply->ia_data;
+
+	option_state_dereference(&reply->reply_ia, MDL);
+	return (option_state_allocate(&reply->reply_ia, MDL) ?
+		ISC_TRUE : ISC_FALSE);
+}
+
+/*
+ * An IA that is not written out keeps only its header, as it did when
+ * its suboptions were held in its option state until then.
+ */
+static void
+reply_ia_abandon(struct reply_state *reply) {
+	if (reply->ia_data != 0) {
+		reply->cursor = reply->ia_data;
+		reply->ia_data = 0;
+	}
+}
+
 /*
  * Process an IAADDR within a given IA_xA, storing any IAADDR reply contents
  * into the reply's current ia-scoped option cache.  Returns ISC_R_CANCELED
@@ -2577,8 +2639,7 @@ reply_process_addr(struct reply_state *reply, struct option_cache *addr) {
 		 */
 		if (reply->packet->dhcpv6_msg_type == DHCPV6_REQUEST) {
 			/* Rewind the IA_NA to empty. */
-			option_state_dereference(&reply->reply_ia, MDL);
-			if (!option_state_allocate(&reply->reply_ia, MDL)) {
+			if (!reply_ia_rewind(reply)) {
 				log_error("reply_process_addr: No memory for "
 					  "option state wipe.");
 				status = ISC_R_NOMEMORY;
@@ -2674,8 +2735,7 @@ reply_process_addr(struct reply_state *reply, struct option_cache *addr) {
 		 */
 		} else if (reply->packet->dhcpv6_msg_type == DHCPV6_RENEW) {
 			/* Rewind the IA_NA to empty. */
-			option_state_dereference(&reply->reply_ia, MDL);
-			if (!option_state_allocate(&reply->reply_ia, MDL)) {
+			if (!reply_ia_rewind(reply)) {
 				log_error("reply_process_addr: No memory for "
 					  "option state wipe.");
 				status = ISC_R_NOMEMORY;
@@ -2916,6 +2976,7 @@ reply_process_ia_ta(struct reply_state *reply, struct option_cache *ia) {
 	/* Then IA_TA header contents; IAID. */
 	putULong(reply->buf.data + reply->cursor, iaid);
 	reply->cursor += 4;
+	reply->ia_data = reply->cursor;
 
 	/*
 	 * Deal with an IAADDR for lifetimes.
@@ -2970,8 +3031,7 @@ reply_process_ia_ta(struct reply_state *reply, struct option_cache *ia) {
 
 	bad_temp:
 		/* Rewind the IA_TA to empty. */
-		option_state_dereference(&reply->reply_ia, MDL);
-		if (!option_state_allocate(&reply->reply_ia, MDL)) {
+		if (!reply_ia_rewind(reply)) {
 			status = ISC_R_NOMEMORY;
 			goto cleanup;
 		}
@@ -3008,8 +3068,7 @@ reply_process_ia_ta(struct reply_state *reply, struct option_cache *ia) {
 			 * Status Code option in the IA containing
 			 * status code NoAddrsAvail.
 			 */
-			option_state_dereference(&reply->reply_ia, MDL);
-			if (!option_state_allocate(&reply->reply_ia,  MDL)) {
+			if (!reply_ia_rewind(reply)) {
 				log_error("reply_process_ia_ta: No "
 					  "memory for option state wipe.");
 				status = ISC_R_NOMEMORY;
@@ -3177,6 +3236,7 @@ reply_process_ia_ta(struct reply_state *reply, struct option_cache *ia) {
 	}
 
       cleanup:
+	reply_ia_abandon(reply);
 	if (packet_ia != NULL)
 		option_state_dereference(&packet_ia, MDL);
 	if (iaaddr.data != NULL)
@@ -3287,12 +3347,13 @@ reuse_lease6(struct reply_state *reply, struct iasubopt *lease) {
  * Locate the iasubopt by it's address within the reply the reduce both
  * the preferred and valid lifetimes by the given number of seconds.
  *
- * Note that this function, by necessity, works directly with the
- * option_cache data. Sort of a no-no but I don't have any better ideas.
+ * The iasubopts of the IA being built are already in wire format in the
+ * reply buffer, so that is where they are changed.
  */
 void shorten_lifetimes(struct reply_state *reply, struct iasubopt *lease,
 		       time_t age, int threshold) {
-	struct option_cache* oc = NULL;
+	unsigned char *data;
+	unsigned pos, len;
 	int subopt_type;
 	int addr_offset;
 	int pref_offset;
@@ -3314,29 +3375,30 @@ void shorten_lifetimes(struct reply_state *reply, struct iasubopt *lease,
 		exp_length = IASUBOPT_PD_LEN;
 	}
 
+	if (reply->ia_data == 0)
+		return;
+
 	// loop through the iasubopts for the one that matches this lease
-	oc = lookup_option(&dhcpv6_universe, reply->reply_ia, subopt_type);
-        for (; oc != NULL ; oc = oc->next) {
-		if (oc->data.data == NULL || oc->data.len != exp_length) {
+	for (pos = reply->ia_data; pos + 4 <= reply->cursor; pos += 4 + len) {
+		len = getUShort(reply->buf.data + pos + 2);
+		data = reply->buf.data + pos + 4;
+		if (getUShort(reply->buf.data + pos) != subopt_type ||
+		    len != exp_length) {
 			/* shouldn't happen */
 			continue;
 		}
 
 		/* If address matches (and for PDs the prefix len matches)
 		* we assume this is our subopt, so update the lifetimes */
-		if (!memcmp(oc->data.data + addr_offset, &lease->addr, 16) &&
+		if (!memcmp(data + addr_offset, &lease->addr, 16) &&
 		    (subopt_type != D6O_IAPREFIX ||
-		     (oc->data.data[IASUBOPT_PD_PREFLEN_OFFSET] ==
-		      lease->plen))) {
-			u_int32_t pref_life = getULong(oc->data.data +
-						       pref_offset);
-			u_int32_t valid_life = getULong(oc->data.data +
-							val_offset);
+		     (data[IASUBOPT_PD_PREFLEN_OFFSET] == lease->plen))) {
+			u_int32_t pref_life = getULong(data + pref_offset);
+			u_int32_t valid_life = getULong(data + val_offset);
 
 			if (pref_life < MAX_TIME && pref_life > age) {
 				pref_life -= age;
-				putULong((unsigned char*)(oc->data.data) +
-					  pref_offset, pref_life);
+				putULong(data + pref_offset, pref_life);
 
 				if (reply->min_prefer > pref_life) {
 					reply->min_prefer = pref_life;
@@ -3345,8 +3407,7 @@ void shorten_lifetimes(struct reply_state *reply, struct iasubopt *lease,
 
 			if (valid_life < MAX_TIME && valid_life > age) {
 				valid_life -= age;
-				putULong((unsigned char*)(oc->data.data) +
-					 val_offset, valid_life);
+				putULong(data + val_offset, valid_life);
 
 				if (reply->min_valid > reply->send_valid) {
 					reply->min_valid = valid_life;
@@ -3948,41 +4009,22 @@ reply_process_is_addressed(struct reply_state *reply,
 /* Simply send an IAADDR within the IA scope as described. */
 static isc_result_t
 reply_process_send_addr(struct reply_state *reply, struct iaddr *addr) {
-	isc_result_t status = ISC_R_SUCCESS;
-	struct data_string data;
-
-	memset(&data, 0, sizeof(data));
+	unsigned char *data;
 
 	/* Now append the lease. */
-	data.len = IAADDR_OFFSET;
-	if (!buffer_allocate(&data.buffer, data.len, MDL)) {
-		log_error("reply_process_send_addr: out of memory"
-			  "allocating new IAADDR buffer.");
-		status = ISC_R_NOMEMORY;
-		goto cleanup;
-	}
-	data.data = data.buffer->data;
-
-	memcpy(data.buffer->data, addr->iabuf, 16);
-	putULong(data.buffer->data + 16, reply->send_prefer);
-	putULong(data.buffer->data + 20, reply->send_valid);
-
-	if (!append_option_buffer(&dhcpv6_universe, reply->reply_ia,
-				  data.buffer, data.buffer->data,
-				  data.len, D6O_IAADDR, 0)) {
+	data = reply_ia_suboption(reply, D6O_IAADDR, IAADDR_OFFSET);
+	if (data == NULL) {
 		log_error("reply_process_send_addr: unable "
 			  "to save IAADDR option");
-		status = ISC_R_FAILURE;
-		goto cleanup;
+		return ISC_R_FAILURE;
 	}
+	memcpy(data, addr->iabuf, 16);
+	putULong(data + 16, reply->send_prefer);
+	putULong(data + 20, reply->send_valid);
 
 	reply->resources_included = ISC_TRUE;
 
-      cleanup:
-	if (data.data != NULL)
-		data_string_forget(&data, MDL);
-
-	return status;
+	return ISC_R_SUCCESS;
 }
 
 /* Choose the better of two leases. */
@@ -4169,6 +4211,7 @@ reply_process_ia_pd(struct reply_state *reply, struct option_cache *ia) {
 	/* We store the client's t2 for now, and may over-ride it later. */
 	putULong(reply->buf.data + reply->cursor, reply->rebind);
 	reply->cursor += 4;
+	reply->ia_data = reply->cursor;
 
 	/*
 	 * For each prefix in this IA_PD, decide what to do about it.
@@ -4215,10 +4258,7 @@ reply_process_ia_pd(struct reply_state *reply, struct option_cache *ia) {
 
 			      case DHCPV6_REQUEST:
 				/* Same than for addresses. */
-				option_state_dereference(&reply->reply_ia, MDL);
-				if (!option_state_allocate(&reply->reply_ia,
-							   MDL))
-				{
+				if (!reply_ia_rewind(reply)) {
 					log_error("reply_process_ia_pd: No "
 						  "memory for option state "
 						  "wipe.");
@@ -4403,6 +4443,7 @@ reply_process_ia_pd(struct reply_state *reply, struct option_cache *ia) {
 	}
 
       cleanup:
+	reply_ia_abandon(reply);
 	if (packet_ia != NULL)
 		option_state_dereference(&packet_ia, MDL);
 	if (reply->reply_ia != NULL)
@@ -4613,8 +4654,7 @@ reply_process_prefix(struct reply_state *reply, struct option_cache *pref) {
 		 */
 		} else if (reply->packet->dhcpv6_msg_type == DHCPV6_RENEW) {
 			/* Rewind the IA_PD to empty. */
-			option_state_dereference(&reply->reply_ia, MDL);
-			if (!option_state_allocate(&reply->reply_ia, MDL)) {
+			if (!reply_ia_rewind(reply)) {
 				log_error("reply_process_prefix: No memory "
 					  "for option state wipe.");
 				status = ISC_R_NOMEMORY;
@@ -5209,42 +5249,23 @@ reply_process_is_prefixed(struct reply_state *reply,
 static isc_result_t
 reply_process_send_prefix(struct reply_state *reply,
 			  struct iaddrcidrnet *pref) {
-	isc_result_t status = ISC_R_SUCCESS;
-	struct data_string data;
-
-	memset(&data, 0, sizeof(data));
+	unsigned char *data;
 
 	/* Now append the prefix. */
-	data.len = IAPREFIX_OFFSET;
-	if (!buffer_allocate(&data.buffer, data.len, MDL)) {
-		log_error("reply_process_send_prefix: out of memory"
-			  "allocating new IAPREFIX buffer.");
-		status = ISC_R_NOMEMORY;
-		goto cleanup;
-	}
-	data.data = data.buffer->data;
-
-	putULong(data.buffer->data, reply->send_prefer);
-	putULong(data.buffer->data + 4, reply->send_valid);
-	data.buffer->data[8] = pref->bits;
-	memcpy(data.buffer->data + 9, pref->lo_addr.iabuf, 16);
-
-	if (!append_option_buffer(&dhcpv6_universe, reply->reply_ia,
-				  data.buffer, data.buffer->data,
-				  data.len, D6O_IAPREFIX, 0)) {
+	data = reply_ia_suboption(reply, D6O_IAPREFIX, IAPREFIX_OFFSET);
+	if (data == NULL) {
 		log_error("reply_process_send_prefix: unable "
 			  "to save IAPREFIX option");
-		status = ISC_R_FAILURE;
-		goto cleanup;
+		return ISC_R_FAILURE;
 	}
+	putULong(data, reply->send_prefer);
+	putULong(data + 4, reply->send_valid);
+	data[8] = pref->bits;
+	memcpy(data + 9, pref->lo_addr.iabuf, 16);
 
 	reply->resources_included = ISC_TRUE;
 
-      cleanup:
-	if (data.data != NULL)
-		data_string_forget(&data, MDL);
-
-	return status;
+	return ISC_R_SUCCESS;
 }
 
 /* Choose the better of two prefixes. */
@@ -7583,6 +7604,10 @@ static void
 build_dhcpv6_reply(struct data_string *reply, struct packet *packet) {
 	memset(reply, 0, sizeof(*reply));
 
+	/* Don't do any work for clients or relays over their rate limit. */
+	if (!rate_limit_permit_packet6(packet))
+		return;
+
 	/* I would like to classify the client once here, but
 	 * as I don't want to classify all of the incoming packets
 	 * I need to do it before handling specific types.
@@ -8624,4 +8649,78 @@ void ddns_update_static6(struct reply_state* reply) {
 }
 #endif /* NSUPDATE */
 
+#if defined (UNIT_TEST)
+/*
+ * Build an IA of type ia_type with IAID 1 around the given addresses or
+ * prefixes, the way the reply_process_* functions do, and copy it to
+ * buf.  The suboptions in ia_opts, such as a status code, are added by
+ * write_to_packet().  The IA is started room bytes from the end of the
+ * reply buffer, so that a test can run out of space.
+ */
+isc_result_t
+reply_ia_unittest(unsigned char *buf, unsigned *len, u_int16_t ia_type,
+		  struct iaddrcidrnet *res, int count,
+		  u_int32_t prefer, u_int32_t valid,
+		  struct option_state *ia_opts, unsigned room) {
+	struct reply_state *reply;
+	struct ia_xx ia;
+	struct iaddr addr;
+	unsigned ia_cursor;
+	isc_result_t status = ISC_R_SUCCESS;
+	int i;
+
+	reply = dmalloc(sizeof(*reply), MDL);
+	if (reply == NULL)
+		return (ISC_R_NOMEMORY);
+	memset(&ia, 0, sizeof(ia));
+	ia.ia_type = ia_type;
+	reply->ia = &ia;
+	if (!option_state_allocate(&reply->opt_state, MDL) ||
+	    !packet_allocate(&reply->packet, MDL) ||
+	    !option_state_allocate(&reply->packet->options, MDL)) {
+		status = ISC_R_NOMEMORY;
+		goto cleanup;
+	}
+	option_state_reference(&reply->reply_ia, ia_opts, MDL);
+	reply->send_prefer = prefer;
+	reply->send_valid = valid;
+
+	ia_cursor = reply->cursor = sizeof(reply->buf) - room;
+	putUShort(reply->buf.data + reply->cursor, ia_type);
+	putUShort(reply->buf.data + reply->cursor + 2,
+		  ia_type == D6O_IA_TA ? 4 : 12);
+	putULong(reply->buf.data + reply->cursor + 4, 1);
+	reply->cursor += (ia_type == D6O_IA_TA) ? 8 : 16;
+	reply->ia_data = reply->cursor;
+
+	for (i = 0; i < count && status == ISC_R_SUCCESS; i++) {
+		if (ia_type == D6O_IA_PD)
+			status = reply_process_send_prefix(reply, &res[i]);
+		else {
+			addr = res[i].lo_addr;
+			status = reply_process_send_addr(reply, &addr);
+		}
+	}
+	if (status == ISC_R_SUCCESS) {
+		write_to_packet(reply, ia_cursor);
+		*len = reply->cursor - ia_cursor;
+		memcpy(buf, reply->buf.data + ia_cursor, *len);
+	}
+
+      cleanup:
+	if (reply->reply_ia != NULL)
+		option_state_dereference(&reply->reply_ia, MDL);
+	if (reply->packet != NULL) {
+		if (reply->packet->options != NULL)
+			option_state_dereference(&reply->packet->options,
+						 MDL);
+		packet_dereference(&reply->packet, MDL);
+	}
+	if (reply->opt_state != NULL)
+		option_state_dereference(&reply->opt_state, MDL);
+	dfree(reply, MDL);
+	return (status);
+}
+#endif /* UNIT_TEST */
+
 #endif /* DHCPv6 */
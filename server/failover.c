@@ -43,13 +43,55 @@ static isc_result_t failover_message_dereference (failover_message_t **,
 						  const char *file, int line);
 
 static void dhcp_failover_pool_balance(dhcp_failover_state_t *state);
-static void dhcp_failover_pool_reqbalance(dhcp_failover_state_t *state);
-static int dhcp_failover_pool_dobalance(dhcp_failover_state_t *state,
-					isc_boolean_t *sendreq);
+static void dhcp_failover_pool_reqbalance(dhcp_failover_state_t *state,
+					  u_int32_t xid);
+static void dhcp_failover_pool_answer(dhcp_failover_state_t *state,
+				      int queued);
+static void dhcp_failover_pool_dobalance(dhcp_failover_state_t *state,
+					 int flags);
+static void dhcp_failover_balance_next_pool(dhcp_failover_state_t *state);
+static int dhcp_failover_balance_pool(dhcp_failover_state_t *state,
+				      int *budget);
 static inline int secondary_not_hoarding(dhcp_failover_state_t *state,
 					 struct pool *p);
 static void scrub_lease(struct lease* lease, const char *file, int line);
 
+static void dhcp_failover_batch_negotiate(dhcp_failover_state_t *state,
+					  failover_message_t *msg);
+static void dhcp_failover_batch_begin(dhcp_failover_state_t *state,
+				      dhcp_failover_link_t **lp);
+static void dhcp_failover_batch_end(dhcp_failover_link_t **lp);
+static isc_result_t dhcp_failover_batch_flush(dhcp_failover_link_t *link,
+					      omapi_object_t *connection);
+static void dhcp_failover_batch_received(dhcp_failover_link_t *link);
+static void dhcp_failover_schedule_contact(dhcp_failover_link_t *link);
+static void dhcp_failover_note_output(dhcp_failover_link_t *link,
+				      omapi_object_t *connection);
+static u_int32_t dhcp_failover_output_pending(dhcp_failover_state_t *state);
+static u_int32_t dhcp_failover_batch_size(dhcp_failover_state_t *state);
+static void dhcp_failover_window_reset(dhcp_failover_state_t *state);
+static void dhcp_failover_window_ack(dhcp_failover_state_t *state,
+				     u_int32_t xid);
+static void dhcp_failover_recovery_fill(dhcp_failover_state_t *state,
+					u_int32_t room);
+static void dhcp_failover_recovery_stop(dhcp_failover_state_t *state);
+static u_int32_t dhcp_failover_recovery_eta(dhcp_failover_state_t *state);
+static void dhcp_failover_note_sent(dhcp_failover_state_t *state,
+				    u_int32_t xid);
+static void dhcp_failover_note_ack(dhcp_failover_state_t *state,
+				   u_int32_t xid);
+static void dhcp_failover_forget_sent(dhcp_failover_state_t *state,
+				      u_int32_t xid);
+static u_int32_t dhcp_failover_oldest_unacked(dhcp_failover_state_t *state);
+static u_int32_t dhcp_failover_mclt_headroom(dhcp_failover_state_t *state);
+static u_int32_t dhcp_failover_latency_percentile(dhcp_failover_state_t *state,
+						  unsigned percent);
+static void dhcp_failover_latency_print(dhcp_failover_state_t *state,
+					char *buf, size_t len);
+static int dhcp_failover_record_state(dhcp_failover_state_t *state,
+				      int now);
+static void dhcp_failover_state_file_timeout(void *vs);
+
 int check_secs_byte_order = 0; /* enables byte order check of secs field if 1 */
 
 /*!
@@ -100,6 +142,15 @@ void dhcp_failover_startup ()
 
 	for (state = failover_states; state; state = state -> next) {
 		dhcp_failover_state_transition (state, "startup");
+
+		/* Log the queue statistics every so often. */
+		state->last_report = cur_time;
+		tv.tv_sec = cur_time + FAILOVER_STATS_INTERVAL;
+		tv.tv_usec = 0;
+		add_timeout (&tv, dhcp_failover_stats_report, state,
+			     (tvref_t)dhcp_failover_state_reference,
+			     (tvunref_t)dhcp_failover_state_dereference);
+
 		/* In case the peer is already running, immediately try
 		   to establish a connection with it. */
 		status = dhcp_failover_link_initiate ((omapi_object_t *)state);
@@ -148,6 +199,69 @@ int dhcp_failover_write_all_states ()
 	return 1;
 }
 
+/*
+ * Record the state of a failover peer.  Without a failover state file,
+ * the state is appended to the lease file and committed.  With one, the
+ * whole file is rewritten: right away if "now" is set, and otherwise a
+ * little later, together with whatever else changes in the meantime.
+ */
+static int dhcp_failover_record_state (dhcp_failover_state_t *state, int now)
+{
+	dhcp_failover_state_t *s;
+	struct timeval tv;
+
+	if (path_dhcpd_failover_state == NULL)
+		return (write_failover_state (state) && commit_leases ());
+
+	if (now) {
+		/* This write takes care of any that were waiting. */
+		for (s = failover_states; s; s = s -> next) {
+			if (s -> state_write_pending) {
+				cancel_timeout (dhcp_failover_state_file_timeout,
+						s);
+				s -> state_write_pending = 0;
+			}
+		}
+		if (write_failover_state_file ())
+			return 1;
+	}
+
+	if (!state -> state_write_pending) {
+		tv.tv_sec = cur_time + FAILOVER_STATE_WRITE_DELAY;
+		tv.tv_usec = 0;
+		add_timeout (&tv, dhcp_failover_state_file_timeout, state,
+			     (tvref_t)dhcp_failover_state_reference,
+			     (tvunref_t)dhcp_failover_state_dereference);
+		state -> state_write_pending = 1;
+	}
+	return !now;
+}
+
+static void dhcp_failover_state_file_timeout (void *vs)
+{
+	dhcp_failover_state_t *state = vs;
+
+	state -> state_write_pending = 0;
+	if (!write_failover_state_file ()) {
+		log_error ("Unable to record failover states; will retry.");
+		dhcp_failover_record_state (state, 0);
+	}
+}
+
+/*
+ * Whether a move between two recorded states can wait to be written.  It
+ * can if a server that crashes before writing it, and so restarts in the
+ * old state, is no less careful than it would be in the new one.  One
+ * that restarts in normal rather than communications-interrupted acts the
+ * same, and times a new interruption from the start.
+ */
+static int dhcp_failover_state_can_wait (enum failover_state from,
+					 enum failover_state to)
+{
+	return (from == to ||
+		(from == normal && to == communications_interrupted));
+}
+
 isc_result_t enter_failover_peer (peer)
 	dhcp_failover_state_t *peer;
 {
@@ -436,6 +550,7 @@ isc_result_t dhcp_failover_link_signal (omapi_object_t *h,
 				failover_message_dereference (&link->imsg,
 							      MDL);
 			}
+			link->ibatch_len = 0;
 			link -> state = dhcp_flink_disconnected;
 			log_info ("message length wait: %s",
 				  isc_result_totext (status));
@@ -450,9 +565,14 @@ isc_result_t dhcp_failover_link_signal (omapi_object_t *h,
 		omapi_connection_get_uint16 (c, &link -> imsg_len);
 		link -> imsg_count = 0;	/* Bytes read. */
 
-		/* Ensure the message is of valid length. */
+		/* Ensure the message is of valid length.  A batch frame
+		   may be longer than an ordinary message, but the messages
+		   inside it must fit in what is left of it. */
 		if (link->imsg_len < DHCP_FAILOVER_MIN_MESSAGE_SIZE ||
-		    link->imsg_len > DHCP_FAILOVER_MAX_MESSAGE_SIZE) {
+		    link->imsg_len > (link->ibatch_len
+				      ? DHCP_FAILOVER_MAX_MESSAGE_SIZE
+				      : DHCP_FAILOVER_MAX_BATCH_SIZE) ||
+		    (link->ibatch_len && link->imsg_len > link->ibatch_len)) {
 			status = ISC_R_UNEXPECTED;
 			goto dhcp_flink_fail;
 		}
@@ -511,6 +631,39 @@ isc_result_t dhcp_failover_link_signal (omapi_object_t *h,
 			link -> imsg_count = link -> imsg_payoff;
 		}
 
+		/* Only BNDUPD and BNDACK messages may be batched, only
+		   batch frames may exceed the ordinary size limit, and we
+		   only accept batch frames if we offered to. */
+		if (link->ibatch_len
+		    ? (link->imsg->type != FTM_BNDUPD &&
+		       link->imsg->type != FTM_BNDACK)
+		    : (link->imsg->type == FTM_BATCH
+		       ? (!link->state_object ||
+			  !link->state_object->me.max_batched_updates)
+		       : link->imsg_len > DHCP_FAILOVER_MAX_MESSAGE_SIZE)) {
+			log_error ("FAILOVER: unexpected %s message%s.",
+				   dhcp_failover_message_name
+					(link->imsg->type),
+				   link->ibatch_len ? " in batch" : "");
+			status = DHCP_R_PROTOCOLERROR;
+			goto dhcp_flink_fail;
+		}
+
+		/* The body of a batch frame is just the messages in it,
+		   which we read one at a time as if they had arrived on
+		   their own. */
+		if (link->imsg->type == FTM_BATCH) {
+			link->ibatch_len = link->imsg_len - link->imsg_count;
+			failover_message_dereference (&link->imsg, MDL);
+			link->state = dhcp_flink_message_length_wait;
+			if (link->ibatch_len == 0)
+				dhcp_failover_batch_received (link);
+			if ((omapi_connection_require (c, 2)) ==
+			    ISC_R_SUCCESS)
+				goto next_message;
+			break;
+		}
+
 		/* Now start sucking options off the wire. */
 		while (link -> imsg_count < link -> imsg_len) {
 			status = do_a_failover_option (c, link);
@@ -626,6 +779,11 @@ isc_result_t dhcp_failover_link_signal (omapi_object_t *h,
 		link -> state = dhcp_flink_message_length_wait;
 		if (link -> imsg)
 			failover_message_dereference (&link -> imsg, MDL);
+		if (link->ibatch_len) {
+			link->ibatch_len -= link->imsg_len;
+			if (link->ibatch_len == 0)
+				dhcp_failover_batch_received (link);
+		}
 		/* XXX This is dangerous because we could get into a tight
 		   XXX loop reading input without servicing any other stuff.
 		   XXX There needs to be a way to relinquish control but
@@ -955,6 +1113,10 @@ isc_result_t dhcp_failover_link_destroy (omapi_object_t *h,
 		option_cache_dereference (&link -> peer_address, file, line);
 	if (link -> imsg)
 		failover_message_dereference (&link -> imsg, file, line);
+	if (link->obatch) {
+		dfree (link->obatch, file, line);
+		link->obatch = NULL;
+	}
 	if (link -> state_object)
 		dhcp_failover_state_dereference (&link -> state_object,
 						 file, line);
@@ -1359,6 +1521,8 @@ isc_result_t dhcp_failover_state_signal (omapi_object_t *o,
 			if (link -> imsg -> options_present & FTB_RECEIVE_TIMER)
 				state -> partner.max_response_delay =
 					link -> imsg -> receive_timer;
+			dhcp_failover_batch_negotiate (state, link->imsg);
+			dhcp_failover_window_reset (state);
 			state -> mclt = link -> imsg -> mclt;
 			dhcp_failover_send_state (state);
 			cancel_timeout (dhcp_failover_link_startup_timeout,
@@ -1442,6 +1606,8 @@ isc_result_t dhcp_failover_state_signal (omapi_object_t *o,
 		    if (link -> imsg -> options_present & FTB_RECEIVE_TIMER)
 			    state -> partner.max_response_delay =
 				    link -> imsg -> receive_timer;
+		    dhcp_failover_batch_negotiate (state, link->imsg);
+		    dhcp_failover_window_reset (state);
 #if defined (DEBUG_FAILOVER_CONTACT_TIMING)
 		    log_info ("add_timeout +%d %s",
 			      (int)state -> partner.max_response_delay / 3,
@@ -1489,7 +1655,8 @@ isc_result_t dhcp_failover_state_signal (omapi_object_t *o,
 			dhcp_failover_process_update_done (state,
 							   link -> imsg);
 		} else if (link -> imsg -> type == FTM_POOLREQ) {
-			dhcp_failover_pool_reqbalance(state);
+			dhcp_failover_pool_reqbalance(state,
+						      link->imsg->xid);
 		} else if (link -> imsg -> type == FTM_POOLRESP) {
 			log_info ("pool response: %ld leases",
 				  (unsigned long)
@@ -1545,6 +1712,7 @@ isc_result_t dhcp_failover_state_transition (dhcp_failover_state_t *state,
 		cancel_timeout (dhcp_failover_send_contact, state);
 		cancel_timeout (dhcp_failover_timeout, state);
 		cancel_timeout (dhcp_failover_startup_timeout, state);
+		dhcp_failover_recovery_stop (state);
 
 		switch (state -> me.state == startup ?
 			state -> saved_state : state -> me.state) {
@@ -1786,19 +1954,29 @@ void dhcp_failover_rescind_updates (dhcp_failover_state_t *state)
     }
     lease_dereference(&state->ack_queue_tail, MDL);
     lease_dereference(&state->ack_queue_head, MDL);
+    state->update_queue_len += state->cur_unacked_updates;
     state->cur_unacked_updates = 0;
+
+    /* None of the updates in flight will be acked now. */
+    if (state->sent != NULL)
+	    memset(state->sent, 0,
+		   FAILOVER_SENT_RING * sizeof(*state->sent));
 }
 
 isc_result_t dhcp_failover_set_state (dhcp_failover_state_t *state,
 				      enum failover_state new_state)
 {
-    enum failover_state saved_state;
+    enum failover_state saved_state, recorded_state;
     TIME saved_stos;
     struct pool *p;
     struct shared_network *s;
     struct lease *l;
     struct timeval tv;
 
+    /* In startup, the state we'll go back to is what gets recorded. */
+    recorded_state = (state -> me.state == startup ?
+		      state -> saved_state : state -> me.state);
+
     /* If we're in certain states where we're sending updates, and the peer
      * state changes, we need to re-schedule any pending updates just to
      * be on the safe side.  This results in retransmission.
@@ -1843,7 +2021,10 @@ isc_result_t dhcp_failover_set_state (dhcp_failover_state_t *state,
 	state -> saved_state = saved_state;
 
     /* If we can't record the new state, we can't make a state transition. */
-    if (!write_failover_state (state) || !commit_leases ()) {
+    if (!dhcp_failover_record_state
+	(state, !dhcp_failover_state_can_wait
+	 (recorded_state, (state -> me.state == startup ?
+			   state -> saved_state : state -> me.state)))) {
 	    log_error ("Unable to record current failover state for %s",
 		       state -> name);
 	    state -> me.state = saved_state;
@@ -1876,6 +2057,10 @@ isc_result_t dhcp_failover_set_state (dhcp_failover_state_t *state,
     if (state -> link_to_peer)
 	    dhcp_failover_send_state (state);
 
+    /* Expired leases only wait to be reclaimed in partner-down, where
+       they are counted afresh below. */
+    state->reclaim_backlog = 0;
+
     switch (new_state) {
 	  case communications_interrupted:
 	    /*
@@ -1907,12 +2092,11 @@ isc_result_t dhcp_failover_set_state (dhcp_failover_state_t *state,
 	     * which also schedules the next pool rebalance.
 	     */
 	    dhcp_failover_pool_balance(state);
-	    dhcp_failover_generate_update_queue(state, 0);
+	    dhcp_failover_recovery_start(state, 0, 0);
+	    dhcp_failover_send_updates(state);
 
-	    if (state->update_queue_tail != NULL) {
-		dhcp_failover_send_updates(state);
+	    if (state->cur_unacked_updates != 0)
 		log_info("Sending updates to %s.", state->name);
-	    }
 
 	    break;
 
@@ -1980,6 +2164,7 @@ isc_result_t dhcp_failover_set_state (dhcp_failover_state_t *state,
 			for (l = LEASE_GET_FIRST(p->expired);
 			     l != NULL;
 			     l = LEASE_GET_NEXT(p->expired, l)) {
+			    state->reclaim_backlog++;
 			    l->tsfp = state->me.stos + state->mclt;
 			    l->sort_time = (l->tsfp > l->ends) ?
 					   l->tsfp : l->ends;
@@ -2084,7 +2269,8 @@ isc_result_t dhcp_failover_peer_state_changed (dhcp_failover_state_t *state,
 	if ((state->me.state == normal) && (state->partner.state == normal))
 		log_info("failover peer %s: Both servers normal", state->name);
 
-	if (!write_failover_state (state) || !commit_leases ()) {
+	/* The peer will tell us its state again when we reconnect. */
+	if (!dhcp_failover_record_state (state, 0)) {
 		/* This is bad, but it's not fatal.  Of course, if we
 		   can't write to the lease database, we're not going to
 		   get much done anyway. */
@@ -2452,7 +2638,7 @@ dhcp_failover_pool_balance(dhcp_failover_state_t *state)
 	cancel_timeout(dhcp_failover_pool_rebalance, state);
 	state->sched_balance = 0;
 
-	dhcp_failover_pool_dobalance(state, NULL);
+	dhcp_failover_pool_dobalance(state, 0);
 }
 
 /*
@@ -2464,238 +2650,414 @@ void
 dhcp_failover_pool_rebalance(void *failover_state)
 {
 	dhcp_failover_state_t *state;
-	isc_boolean_t sendreq = ISC_FALSE;
 
 	state = (dhcp_failover_state_t *)failover_state;
 
 	/* Clear scheduled event indicator. */
 	state->sched_balance = 0;
 
-	if (dhcp_failover_pool_dobalance(state, &sendreq))
-		dhcp_failover_send_updates(state);
-
-	if (sendreq)
-		dhcp_failover_send_poolreq(state);
+	dhcp_failover_pool_dobalance(state, FAILOVER_BALANCE_POOLREQ);
 }
 
 /*
  * Balance operation entry from POOLREQ protocol message.  Do not permit a
- * POOLREQ to send back a POOLREQ.  Ping pong.
+ * POOLREQ to send back a POOLREQ.  Ping pong.  The POOLRESP is sent when
+ * the rebalance finishes.
  */
 static void
-dhcp_failover_pool_reqbalance(dhcp_failover_state_t *state)
+dhcp_failover_pool_reqbalance(dhcp_failover_state_t *state, u_int32_t xid)
 {
-	int queued;
-
 	/* Cancel pending event. */
 	cancel_timeout(dhcp_failover_pool_rebalance, state);
 	state->sched_balance = 0;
 
-	queued = dhcp_failover_pool_dobalance(state, NULL);
+	/* The answer may go out from a later step, once the POOLREQ
+	   itself is gone. */
+	state->balance_xid = xid;
 
-	dhcp_failover_send_poolresp(state, queued);
-
-	if (queued)
-		dhcp_failover_send_updates(state);
+	if (state->me.state != normal)
+		dhcp_failover_pool_answer(state, 0);
 	else
+		dhcp_failover_pool_dobalance(state, FAILOVER_BALANCE_POOLRESP);
+}
+
+/*
+ * Answer the peer's POOLREQ with the number of leases given to it.
+ */
+static void
+dhcp_failover_pool_answer(dhcp_failover_state_t *state, int queued)
+{
+	dhcp_failover_send_poolresp(state, queued, state->balance_xid);
+
+	if (!queued)
 		log_info("peer %s: Got POOLREQ, answering negatively!  "
 			 "Peer may be out of leases or database inconsistent.",
 			 state->name);
 }
 
 /*
- * Do the meat of the work common to all forms of pool rebalance.  If the
- * caller deems it appropriate to transmit POOLREQ messages, it can use the
- * sendreq pointer to pass in the address of a FALSE value which this function
- * will conditionally turn TRUE if a POOLREQ is determined to be necessary.
- * A NULL value may be passed, in which case no action is taken.
+ * Start a rebalance of all the pools shared with the peer, unless one is
+ * already running, in which case it just takes on the caller's flags.
+ *
+ * A pool with hundreds of thousands of free leases would stall the server
+ * if it were balanced in one go, so the work is done in steps of at most
+ * FAILOVER_BALANCE_STEP leases, each run from its own timer event.  The
+ * leases moved in a step are committed together and sent to the peer
+ * through the update queue, so that they go out in as few BNDUPDs as the
+ * peer accepts.
  */
-static int
-dhcp_failover_pool_dobalance(dhcp_failover_state_t *state,
-			    isc_boolean_t *sendreq)
+static void
+dhcp_failover_pool_dobalance(dhcp_failover_state_t *state, int flags)
 {
-	int lts, total, thresh, hold, panic, pass;
-	int leases_queued = 0;
-	struct lease *lp = NULL;
-	struct lease *next = NULL;
-	struct lease *ltemp = NULL;
 	struct shared_network *s;
 	struct pool *p;
-	binding_state_t peer_lease_state;
-	/* binding_state_t my_lease_state; */
-        /* XXX Why is this my_lease_state never used? */
-	LEASE_STRUCT_PTR lq;
-	int (*log_func)(const char *, ...);
-	const char *result, *reqlog;
 
 	if (state -> me.state != normal)
-		return 0;
+		return;
 
+	state->balance_flags |= flags;
+	if (state->balance_active)
+		return;
+
+	state->balance_active = 1;
+	state->balance_sendreq = 0;
+	state->balance_leases = 0;
+	state->balance_examined = 0;
+	state->balance_moved = 0;
+	state->balance_start = cur_time;
 	state->last_balance = cur_time;
 
 	for (s = shared_networks ; s ; s = s->next) {
 	    for (p = s->pools ; p ; p = p->next) {
-		if (p->failover_peer != state)
-		    continue;
+		if (p->failover_peer == state)
+		    state->balance_leases += (p->free_leases +
+					      p->backup_leases);
+	    }
+	}
 
-		/* Right now we're giving the peer half of the free leases.
-		   If we have more leases than the peer (i.e., more than
-		   half), then the number of leases we have, less the number
-		   of leases the peer has, will be how many more leases we
-		   have than the peer has.   So if we send half that number
-		   to the peer, we should be even. */
-		if (p->failover_peer->i_am == primary) {
-			lts = (p->free_leases - p->backup_leases) / 2;
-			peer_lease_state = FTS_BACKUP;
-			/* my_lease_state = FTS_FREE; */
-			lq = &p->free;
-		} else {
-			lts = (p->backup_leases - p->free_leases) / 2;
-			peer_lease_state = FTS_FREE;
-			/* my_lease_state = FTS_BACKUP; */
-			lq = &p->backup;
-		}
+	dhcp_failover_balance_next_pool(state);
+	dhcp_failover_pool_balance_step(state);
+}
 
-		total = p->backup_leases + p->free_leases;
+/*
+ * Move the rebalance on to the next pool shared with the peer, or clear
+ * the pool pointer if there are no more.
+ */
+static void
+dhcp_failover_balance_next_pool(dhcp_failover_state_t *state)
+{
+	struct shared_network *s;
+	struct pool *p;
+	LEASE_STRUCT_PTR lq;
+	int lts, thresh, panic;
+	const char *reqlog;
 
-		thresh = ((total * state->max_lease_misbalance) + 50) / 100;
-		hold = ((total * state->max_lease_ownership) + 50) / 100;
+	if (state->balance_lease)
+		lease_dereference(&state->balance_lease, MDL);
 
-		/*
-		 * If we need leases (so lts is negative) more than negative
-		 * double the thresh%, panic and send poolreq to hopefully wake
-		 * up the peer (but more likely the db is inconsistent).  But,
-		 * if this comes out zero, switch to -1 so that the POOLREQ is
-		 * sent on lts == -2 rather than right away at -1.
-		 *
-		 * Note that we do not subtract -1 from panic all the time
-		 * because thresh% and hold% may come out to the same number,
-		 * and that is correct operation...where thresh% and hold% are
-		 * both -1, we want to send poolreq when lts reaches -3.  So,
-		 * "-3 < -2", lts < panic.
-		 */
-		panic = thresh * -2;
+	if (state->balance_pool) {
+		s = state->balance_pool->shared_network;
+		p = state->balance_pool->next;
+		pool_dereference(&state->balance_pool, MDL);
+	} else {
+		s = shared_networks;
+		p = s ? s->pools : NULL;
+	}
+
+	while (s) {
+		for (; p ; p = p->next)
+			if (p->failover_peer == state)
+				break;
+		if (p)
+			break;
+		s = s->next;
+		p = s ? s->pools : NULL;
+	}
+	if (!p)
+		return;
 
-		if (panic == 0)
-			panic = -1;
+	pool_reference(&state->balance_pool, p, MDL);
+	state->balance_pass = 0;
+
+	/* Right now we're giving the peer half of the free leases.
+	   If we have more leases than the peer (i.e., more than
+	   half), then the number of leases we have, less the number
+	   of leases the peer has, will be how many more leases we
+	   have than the peer has.   So if we send half that number
+	   to the peer, we should be even. */
+	if (p->failover_peer->i_am == primary) {
+		lts = (p->free_leases - p->backup_leases) / 2;
+		lq = &p->free;
+	} else {
+		lts = (p->backup_leases - p->free_leases) / 2;
+		lq = &p->backup;
+	}
+	lease_reference(&state->balance_lease, LEASE_GET_FIRSTP(lq), MDL);
 
-		if ((sendreq != NULL) && (lts < panic)) {
-			reqlog = "  (requesting peer rebalance!)";
-			*sendreq = ISC_TRUE;
-		} else
-			reqlog = "";
-
-		log_info("balancing pool %lx %s  total %d  free %d  "
-			 "backup %d  lts %d  max-own (+/-)%d%s",
-			 (unsigned long)p,
-			 (p->shared_network ?
-			  p->shared_network->name : ""), p->lease_count,
-			 p->free_leases, p->backup_leases, lts, hold,
-			 reqlog);
-
-		/* In the first pass, try to allocate leases to the
-		 * peer which it would normally be responsible for (if
-		 * the lease has a hardware address or client-identifier,
-		 * and the load-balance-algorithm chooses the peer to
-		 * answer that address), up to a hold% excess in the peer's
-		 * favor.  In the second pass, just send the oldest (first
-		 * on the list) leases up to a hold% excess in our favor.
-		 *
-		 * This could make for additional pool rebalance
-		 * events, but preserving MAC possession should be
-		 * worth it.
-		 */
-		pass = 0;
-		lease_reference(&lp, LEASE_GET_FIRSTP(lq), MDL);
+	thresh = (((p->backup_leases + p->free_leases) *
+		   state->max_lease_misbalance) + 50) / 100;
 
-		while (lp) {
-			if (next)
-			    lease_dereference(&next, MDL);
-			ltemp = LEASE_GET_NEXTP(lq, lp);
-			if (ltemp != NULL)
-			    lease_reference(&next, ltemp, MDL);
+	/*
+	 * If we need leases (so lts is negative) more than negative
+	 * double the thresh%, panic and send poolreq to hopefully wake
+	 * up the peer (but more likely the db is inconsistent).  But,
+	 * if this comes out zero, switch to -1 so that the POOLREQ is
+	 * sent on lts == -2 rather than right away at -1.
+	 *
+	 * Note that we do not subtract -1 from panic all the time
+	 * because thresh% and hold% may come out to the same number,
+	 * and that is correct operation...where thresh% and hold% are
+	 * both -1, we want to send poolreq when lts reaches -3.  So,
+	 * "-3 < -2", lts < panic.
+	 */
+	panic = thresh * -2;
 
-			/*
-			 * Stop if the pool is 'balanced enough.'
-			 *
-			 * The pool is balanced enough if:
-			 *
-			 * 1) We're on the first run through and the peer has
-			 *    its fair share of leases already (lts reaches
-			 *    -hold).
-			 * 2) We're on the second run through, we are shifting
-			 *    never-used leases, and there is a perfectly even
-			 *    balance (lts reaches zero).
-			 * 3) Second run through, we are shifting previously
-			 *    used leases, and the local system has its fair
-			 *    share but no more (lts reaches hold).
-			 *
-			 * Note that this is implemented below in 3,2,1 order.
-			 */
-			if (pass) {
-				if (lp->ends) {
-					if (lts <= hold)
-						break;
-				} else {
-					if (lts <= 0)
-						break;
-				}
-			} else if (lts <= -hold)
-				break;
+	if (panic == 0)
+		panic = -1;
 
-			if (pass || peer_wants_lease(lp)) {
-			    --lts;
-			    ++leases_queued;
-			    lp->next_binding_state = peer_lease_state;
-			    lp->tstp = cur_time;
-			    lp->starts = cur_time;
-
-			    scrub_lease(lp, MDL);
-			    if (!supersede_lease(lp, NULL, 0, 1, 0, 0) ||
-			        !write_lease(lp))
-			    	    log_error("can't commit lease %s on "
-					      "giveaway", piaddr(lp->ip_addr));
-			}
+	if ((state->balance_flags & FAILOVER_BALANCE_POOLREQ) &&
+	    (lts < panic)) {
+		reqlog = "  (requesting peer rebalance!)";
+		state->balance_sendreq = 1;
+	} else
+		reqlog = "";
+
+	log_info("balancing pool %lx %s  total %d  free %d  "
+		 "backup %d  lts %d  max-own (+/-)%d%s",
+		 (unsigned long)p,
+		 (p->shared_network ?
+		  p->shared_network->name : ""), p->lease_count,
+		 p->free_leases, p->backup_leases, lts,
+		 (((p->backup_leases + p->free_leases) *
+		   state->max_lease_ownership) + 50) / 100,
+		 reqlog);
+}
+
+/*
+ * Balance the current pool, looking at no more than *budget leases and
+ * subtracting the number looked at from it.  Returns the number of leases
+ * given away; the pool is finished when state->balance_lease is left
+ * NULL.
+ */
+static int
+dhcp_failover_balance_pool(dhcp_failover_state_t *state, int *budget)
+{
+	int lts, total, thresh, hold;
+	int leases_queued = 0;
+	struct lease *lp = NULL;
+	struct lease *next = NULL;
+	struct lease *ltemp = NULL;
+	struct pool *p = state->balance_pool;
+	binding_state_t peer_lease_state, my_lease_state;
+	LEASE_STRUCT_PTR lq;
+	int (*log_func)(const char *, ...);
+	const char *result;
+
+	/* The counts may have changed since the last step, so work out
+	   where we stand afresh each time. */
+	if (p->failover_peer->i_am == primary) {
+		lts = (p->free_leases - p->backup_leases) / 2;
+		peer_lease_state = FTS_BACKUP;
+		my_lease_state = FTS_FREE;
+		lq = &p->free;
+	} else {
+		lts = (p->backup_leases - p->free_leases) / 2;
+		peer_lease_state = FTS_FREE;
+		my_lease_state = FTS_BACKUP;
+		lq = &p->backup;
+	}
+
+	total = p->backup_leases + p->free_leases;
+
+	thresh = ((total * state->max_lease_misbalance) + 50) / 100;
+	hold = ((total * state->max_lease_ownership) + 50) / 100;
+
+	/* If the lease we stopped at has been handed out since, it is no
+	   longer on the queue, so start this pass over again; the leases
+	   already given away won't be seen a second time. */
+	if (state->balance_lease) {
+		lease_reference(&lp, state->balance_lease, MDL);
+		lease_dereference(&state->balance_lease, MDL);
+		if (lp->pool != p || lp->binding_state != my_lease_state) {
+			lease_dereference(&lp, MDL);
+			lease_reference(&lp, LEASE_GET_FIRSTP(lq), MDL);
+		}
+	}
 
+	/* In the first pass, try to allocate leases to the
+	 * peer which it would normally be responsible for (if
+	 * the lease has a hardware address or client-identifier,
+	 * and the load-balance-algorithm chooses the peer to
+	 * answer that address), up to a hold% excess in the peer's
+	 * favor.  In the second pass, just send the oldest (first
+	 * on the list) leases up to a hold% excess in our favor.
+	 *
+	 * This could make for additional pool rebalance
+	 * events, but preserving MAC possession should be
+	 * worth it.
+	 */
+	while (lp) {
+		if (*budget <= 0) {
+			/* Pick up from here in the next step. */
+			lease_reference(&state->balance_lease, lp, MDL);
 			lease_dereference(&lp, MDL);
 			if (next)
-				lease_reference(&lp, next, MDL);
-			else if (!pass) {
-				pass = 1;
-				lease_reference(&lp, LEASE_GET_FIRSTP(lq), MDL);
-			}
+				lease_dereference(&next, MDL);
+			return leases_queued;
 		}
+		--*budget;
+		state->balance_examined++;
 
 		if (next)
-			lease_dereference(&next, MDL);
-		if (lp)
-			lease_dereference(&lp, MDL);
+		    lease_dereference(&next, MDL);
+		ltemp = LEASE_GET_NEXTP(lq, lp);
+		if (ltemp != NULL)
+		    lease_reference(&next, ltemp, MDL);
 
-		if (lts > thresh) {
-			result = "IMBALANCED";
-			log_func = log_error;
-		} else {
-			result = "balanced";
-			log_func = log_info;
+		/*
+		 * Stop if the pool is 'balanced enough.'
+		 *
+		 * The pool is balanced enough if:
+		 *
+		 * 1) We're on the first run through and the peer has
+		 *    its fair share of leases already (lts reaches
+		 *    -hold).
+		 * 2) We're on the second run through, we are shifting
+		 *    never-used leases, and there is a perfectly even
+		 *    balance (lts reaches zero).
+		 * 3) Second run through, we are shifting previously
+		 *    used leases, and the local system has its fair
+		 *    share but no more (lts reaches hold).
+		 *
+		 * Note that this is implemented below in 3,2,1 order.
+		 */
+		if (state->balance_pass) {
+			if (lp->ends) {
+				if (lts <= hold)
+					break;
+			} else {
+				if (lts <= 0)
+					break;
+			}
+		} else if (lts <= -hold)
+			break;
+
+		if (state->balance_pass || peer_wants_lease(lp)) {
+		    --lts;
+		    ++leases_queued;
+		    lp->next_binding_state = peer_lease_state;
+		    lp->tstp = cur_time;
+		    lp->starts = cur_time;
+
+		    scrub_lease(lp, MDL);
+		    if (!supersede_lease(lp, NULL, 0, 1, 0, 0) ||
+		        !write_lease(lp))
+		    	    log_error("can't commit lease %s on "
+				      "giveaway", piaddr(lp->ip_addr));
+		}
+
+		lease_dereference(&lp, MDL);
+		if (next)
+			lease_reference(&lp, next, MDL);
+		else if (!state->balance_pass) {
+			state->balance_pass = 1;
+			lease_reference(&lp, LEASE_GET_FIRSTP(lq), MDL);
 		}
+	}
 
-		log_func("%s pool %lx %s  total %d  free %d  backup %d  "
-			 "lts %d  max-misbal %d", result, (unsigned long)p,
-			 (p->shared_network ?
-			  p->shared_network->name : ""), p->lease_count,
-			 p->free_leases, p->backup_leases, lts, thresh);
+	if (next)
+		lease_dereference(&next, MDL);
+	if (lp)
+		lease_dereference(&lp, MDL);
 
-		/* Recalculate next rebalance event timer. */
-		dhcp_failover_pool_check(p);
-	    }
+	if (lts > thresh) {
+		result = "IMBALANCED";
+		log_func = log_error;
+	} else {
+		result = "balanced";
+		log_func = log_info;
 	}
 
-	if (leases_queued)
-		commit_leases();
+	log_func("%s pool %lx %s  total %d  free %d  backup %d  "
+		 "lts %d  max-misbal %d", result, (unsigned long)p,
+		 (p->shared_network ?
+		  p->shared_network->name : ""), p->lease_count,
+		 p->free_leases, p->backup_leases, lts, thresh);
+
+	/* Recalculate next rebalance event timer. */
+	dhcp_failover_pool_check(p);
 
 	return leases_queued;
 }
 
+/*
+ * Do one step of the rebalance started by dhcp_failover_pool_dobalance(),
+ * and schedule the next one if there is more to do.
+ */
+void
+dhcp_failover_pool_balance_step(void *failover_state)
+{
+	dhcp_failover_state_t *state;
+	int budget = FAILOVER_BALANCE_STEP;
+	int queued = 0;
+	struct timeval tv;
+
+	state = (dhcp_failover_state_t *)failover_state;
+
+	if (!state->balance_active)
+		return;
+
+	if (state->me.state != normal) {
+		log_info("failover peer %s: pool rebalance abandoned after "
+			 "%lu of %lu leases.", state->name,
+			 (unsigned long)state->balance_examined,
+			 (unsigned long)state->balance_leases);
+		if (state->balance_lease)
+			lease_dereference(&state->balance_lease, MDL);
+		if (state->balance_pool)
+			pool_dereference(&state->balance_pool, MDL);
+		state->balance_active = 0;
+		state->balance_flags = 0;
+		return;
+	}
+
+	while (state->balance_pool && budget > 0) {
+		queued += dhcp_failover_balance_pool(state, &budget);
+		if (!state->balance_lease)
+			dhcp_failover_balance_next_pool(state);
+	}
+
+	if (queued) {
+		state->balance_moved += queued;
+		commit_leases();
+		dhcp_failover_send_updates(state);
+	}
+
+	if (state->balance_pool) {
+		/* Let anything else that is waiting run first. */
+		tv.tv_sec = cur_tv.tv_sec;
+		tv.tv_usec = cur_tv.tv_usec;
+		add_timeout(&tv, dhcp_failover_pool_balance_step, state,
+			    (tvref_t)dhcp_failover_state_reference,
+			    (tvunref_t)dhcp_failover_state_dereference);
+		return;
+	}
+
+	state->balance_active = 0;
+	if (state->balance_examined > FAILOVER_BALANCE_STEP)
+		log_info("failover peer %s: pool rebalance moved %lu "
+			 "leases in %ld seconds.", state->name,
+			 (unsigned long)state->balance_moved,
+			 (long)(cur_time - state->balance_start));
+
+	if (state->balance_flags & FAILOVER_BALANCE_POOLRESP)
+		dhcp_failover_pool_answer(state, state->balance_moved);
+	if (state->balance_sendreq)
+		dhcp_failover_send_poolreq(state);
+	state->balance_flags = 0;
+	state->balance_sendreq = 0;
+}
+
 /* dhcp_failover_pool_check: Called whenever FREE or BACKUP leases change
  * states, on both servers.  Check the scheduled time to rebalance the pool
  * and lower it if applicable.
@@ -2812,7 +3174,9 @@ int dhcp_failover_state_pool_check (dhcp_failover_state_t *state)
 isc_result_t dhcp_failover_send_updates (dhcp_failover_state_t *state)
 {
 	struct lease *lp = (struct lease *)0;
-	isc_result_t status;
+	dhcp_failover_link_t *batch = NULL;
+	u_int32_t window, limit;
+	isc_result_t status = ISC_R_SUCCESS;
 
 	/* Can't update peer if we're not talking to it! */
 	if (!state -> link_to_peer)
@@ -2824,8 +3188,50 @@ isc_result_t dhcp_failover_send_updates (dhcp_failover_state_t *state)
 	if (state->toack_queue_head != NULL)
 		dhcp_failover_send_acks(state);
 
-	while ((state -> partner.max_flying_updates >
-		state -> cur_unacked_updates) && state -> update_queue_head) {
+	/* The peer lets us have max-unacked-updates updates in flight, or
+	   that many batches of them if it takes batches.  Within that, the
+	   congestion window decides how many we actually send. */
+	if (state->update_queue_head || state->recovery_active)
+		dhcp_failover_batch_begin (state, &batch);
+	limit = state->partner.max_flying_updates;
+	if (batch)
+		limit *= batch->obatch_max;
+	window = state->cwnd;
+	if (window < state->partner.max_flying_updates)
+		window = state->partner.max_flying_updates;
+	if (window > limit)
+		window = limit;
+
+	while (window > state -> cur_unacked_updates) {
+		if (!state->update_queue_head && !state->recovery_active)
+			break;
+
+		/* Leave the rest on the queue while the peer is slow to read
+		   what has already been sent to it. */
+		if (dhcp_failover_output_pending (state) >=
+		    FAILOVER_OUTPUT_LIMIT) {
+			struct timeval tv;
+
+			state->output_blocked++;
+			tv.tv_sec = cur_tv.tv_sec;
+			tv.tv_usec = cur_tv.tv_usec + FAILOVER_OUTPUT_RETRY;
+			if (tv.tv_usec >= 1000000) {
+				tv.tv_sec += tv.tv_usec / 1000000;
+				tv.tv_usec %= 1000000;
+			}
+			add_timeout (&tv, dhcp_failover_output_retry, state,
+				     (tvref_t)dhcp_failover_state_reference,
+				     (tvunref_t)dhcp_failover_state_dereference);
+			break;
+		}
+
+		/* Top up the update queue from the recovery stream. */
+		if (!state->update_queue_head && state->recovery_active)
+			dhcp_failover_recovery_fill
+				(state, window - state->cur_unacked_updates);
+		if (!state->update_queue_head)
+			break;
+
 		/* Grab the head of the update queue. */
 		lease_reference (&lp, state -> update_queue_head, MDL);
 
@@ -2833,9 +3239,19 @@ isc_result_t dhcp_failover_send_updates (dhcp_failover_state_t *state)
 		status = dhcp_failover_send_bind_update (state, lp);
 		if (status != ISC_R_SUCCESS) {
 			lease_dereference (&lp, MDL);
-			return status;
+			break;
+		}
+
+		/* Time one update per round trip. */
+		if (!state->rtt_xid ||
+		    (cur_tv.tv_sec - state->rtt_sent.tv_sec >
+		     (long)state->me.max_response_delay)) {
+			state->rtt_xid = lp->last_xid;
+			state->rtt_sent = cur_tv;
 		}
 		lp -> flags &= ~ON_UPDATE_QUEUE;
+		state->update_queue_len--;
+		dhcp_failover_note_sent (state, lp->last_xid);
 
 		/* Take it off the head of the update queue and put the next
 		   item in the update queue at the head. */
@@ -2868,8 +3284,12 @@ isc_result_t dhcp_failover_send_updates (dhcp_failover_state_t *state)
 
 		/* Count the object as an unacked update. */
 		state -> cur_unacked_updates++;
+		if (state->cur_unacked_updates > state->unacked_max)
+			state->unacked_max = state->cur_unacked_updates;
 	}
-	return ISC_R_SUCCESS;
+
+	dhcp_failover_batch_end (&batch);
+	return status;
 }
 
 /* Queue an update for a lease.   Always returns 1 at this point - it's
@@ -2913,6 +3333,8 @@ int dhcp_failover_queue_update (struct lease *lease, int immediate)
 #endif
 	lease_reference (&state -> update_queue_tail, lease, MDL);
 	lease -> flags |= ON_UPDATE_QUEUE;
+	if (++state->update_queue_len > state->update_queue_max)
+		state->update_queue_max = state->update_queue_len;
 	if (immediate)
 		dhcp_failover_send_updates (state);
 	return 1;
@@ -2921,11 +3343,15 @@ int dhcp_failover_queue_update (struct lease *lease, int immediate)
 int dhcp_failover_send_acks (dhcp_failover_state_t *state)
 {
 	failover_message_t *msg = (failover_message_t *)0;
+	dhcp_failover_link_t *batch = NULL;
 
 	/* Must commit all leases prior to acking them. */
 	if (!commit_leases ())
 		return 0;
 
+	if (state->toack_queue_head)
+		dhcp_failover_batch_begin (state, &batch);
+
 	while (state -> toack_queue_head) {
 		failover_message_reference
 			(&msg, state -> toack_queue_head, MDL);
@@ -2940,6 +3366,7 @@ int dhcp_failover_send_acks (dhcp_failover_state_t *state)
 
 		failover_message_dereference (&msg, MDL);
 	}
+	dhcp_failover_batch_end (&batch);
 
 	if (state -> toack_queue_tail)
 		failover_message_dereference (&state -> toack_queue_tail, MDL);
@@ -2980,8 +3407,10 @@ int dhcp_failover_queue_ack (dhcp_failover_state_t *state,
 	state -> pending_acks++;
 
 	/* Flush the toack queue whenever we exceed half the number of
-	   allowed unacked updates. */
-	if (state -> pending_acks >= state -> partner.max_flying_updates / 2) {
+	   allowed unacked updates.  Updates that arrived in a batch are
+	   acked together once the whole batch has been processed. */
+	if (state -> pending_acks >= state -> partner.max_flying_updates / 2 &&
+	    (!state->link_to_peer || !state->link_to_peer->ibatch_len)) {
 		dhcp_failover_send_acks (state);
 	}
 
@@ -3044,6 +3473,7 @@ void dhcp_failover_ack_queue_remove (dhcp_failover_state_t *state,
 	}
 
 	lease -> flags &= ~ON_ACK_QUEUE;
+	dhcp_failover_forget_sent (state, lease->last_xid);
 	/* Multiple acks on one XID is an error and may cause badness. */
 	lease->last_xid = 0;
 	/* XXX: this violates draft-failover.  We can't send another
@@ -3316,6 +3746,97 @@ isc_result_t dhcp_failover_state_get_value (omapi_object_t *h,
 	} else if (!omapi_ds_strcmp (name, "cur-unacked-updates")) {
 		return omapi_make_int_value (value, name,
 					     s -> cur_unacked_updates, MDL);
+	} else if (!omapi_ds_strcmp (name, "update-window")) {
+		return omapi_make_uint_value (value, name, s->cwnd, MDL);
+	} else if (!omapi_ds_strcmp (name, "round-trip-time")) {
+		return omapi_make_uint_value (value, name, s->srtt, MDL);
+	} else if (!omapi_ds_strcmp (name, "recovery-active")) {
+		return omapi_make_int_value (value, name,
+					     s->recovery_active, MDL);
+	} else if (!omapi_ds_strcmp (name, "recovery-leases")) {
+		return omapi_make_uint_value (value, name,
+					      s->recovery_total, MDL);
+	} else if (!omapi_ds_strcmp (name, "recovery-examined")) {
+		return omapi_make_uint_value (value, name,
+					      s->recovery_examined, MDL);
+	} else if (!omapi_ds_strcmp (name, "recovery-sent")) {
+		return omapi_make_uint_value (value, name,
+					      s->recovery_sent, MDL);
+	} else if (!omapi_ds_strcmp (name, "recovery-eta")) {
+		return omapi_make_uint_value (value, name,
+					      dhcp_failover_recovery_eta (s),
+					      MDL);
+	} else if (!omapi_ds_strcmp (name, "balance-active")) {
+		return omapi_make_int_value (value, name,
+					     s->balance_active, MDL);
+	} else if (!omapi_ds_strcmp (name, "balance-leases")) {
+		return omapi_make_uint_value (value, name,
+					      s->balance_leases, MDL);
+	} else if (!omapi_ds_strcmp (name, "balance-examined")) {
+		return omapi_make_uint_value (value, name,
+					      s->balance_examined, MDL);
+	} else if (!omapi_ds_strcmp (name, "balance-moved")) {
+		return omapi_make_uint_value (value, name,
+					      s->balance_moved, MDL);
+	} else if (!omapi_ds_strcmp (name, "output-pending")) {
+		return (omapi_make_uint_value
+			(value, name, dhcp_failover_output_pending (s), MDL));
+	} else if (!omapi_ds_strcmp (name, "output-pending-max")) {
+		return omapi_make_uint_value (value, name,
+					      s->output_max, MDL);
+	} else if (!omapi_ds_strcmp (name, "output-blocked")) {
+		return omapi_make_uint_value (value, name,
+					      s->output_blocked, MDL);
+	} else if (!omapi_ds_strcmp (name, "update-queue-depth")) {
+		return omapi_make_uint_value (value, name,
+					      s->update_queue_len, MDL);
+	} else if (!omapi_ds_strcmp (name, "update-queue-max")) {
+		return omapi_make_uint_value (value, name,
+					      s->update_queue_max, MDL);
+	} else if (!omapi_ds_strcmp (name, "unacked-updates-max")) {
+		return omapi_make_uint_value (value, name,
+					      s->unacked_max, MDL);
+	} else if (!omapi_ds_strcmp (name, "pending-acks")) {
+		return omapi_make_int_value (value, name,
+					     s->pending_acks, MDL);
+	} else if (!omapi_ds_strcmp (name, "oldest-unacked-age")) {
+		return omapi_make_uint_value (value, name,
+					      dhcp_failover_oldest_unacked (s),
+					      MDL);
+	} else if (!omapi_ds_strcmp (name, "mclt-headroom")) {
+		return omapi_make_uint_value (value, name,
+					      dhcp_failover_mclt_headroom (s),
+					      MDL);
+	} else if (!omapi_ds_strcmp (name, "updates-sent")) {
+		return omapi_make_uint_value (value, name,
+					      s->updates_sent, MDL);
+	} else if (!omapi_ds_strcmp (name, "acks-received")) {
+		return omapi_make_uint_value (value, name,
+					      s->acks_received, MDL);
+	} else if (!omapi_ds_strcmp (name, "acks-last-interval")) {
+		return omapi_make_uint_value (value, name, s->acks_interval,
+					      MDL);
+	} else if (!omapi_ds_strcmp (name, "ack-latency-median")) {
+		return (omapi_make_uint_value
+			(value, name,
+			 dhcp_failover_latency_percentile (s, 50), MDL));
+	} else if (!omapi_ds_strcmp (name, "ack-latency-99th")) {
+		return (omapi_make_uint_value
+			(value, name,
+			 dhcp_failover_latency_percentile (s, 99), MDL));
+	} else if (!omapi_ds_strcmp (name, "ack-latency")) {
+		char hist [FAILOVER_LATENCY_BUCKETS * 20];
+
+		dhcp_failover_latency_print (s, hist, sizeof hist);
+		return omapi_make_string_value (value, name, hist, MDL);
+	} else if (!omapi_ds_strcmp (name, "reclaim-backlog")) {
+		return omapi_make_uint_value (value, name,
+					      s->reclaim_backlog, MDL);
+	} else if (!omapi_ds_strcmp (name, "reclaimed")) {
+		return omapi_make_uint_value (value, name, s->reclaimed, MDL);
+	} else if (!omapi_ds_strcmp (name, "reclaimed-last-interval")) {
+		return omapi_make_uint_value (value, name,
+					      s->reclaimed_interval, MDL);
 	}
 
 	if (h -> inner && h -> inner -> type -> get_value)
@@ -3363,9 +3884,34 @@ isc_result_t dhcp_failover_state_destroy (omapi_object_t *h,
 	if (s -> toack_queue_tail)
 		failover_message_dereference (&s -> toack_queue_tail,
 					      file, line);
+	if (s->sent) {
+		dfree (s->sent, file, line);
+		s->sent = NULL;
+	}
+	if (s->balance_lease)
+		lease_dereference (&s->balance_lease, file, line);
+	if (s->balance_pool)
+		pool_dereference (&s->balance_pool, file, line);
 	return ISC_R_SUCCESS;
 }
 
+/* Write a name and a four-byte value for dhcp_failover_state_stuff(). */
+
+static isc_result_t dhcp_failover_put_uint32_value (omapi_object_t *c,
+						    const char *name,
+						    u_int32_t value)
+{
+	isc_result_t status;
+
+	status = omapi_connection_put_name (c, name);
+	if (status != ISC_R_SUCCESS)
+		return status;
+	status = omapi_connection_put_uint32 (c, sizeof (u_int32_t));
+	if (status != ISC_R_SUCCESS)
+		return status;
+	return omapi_connection_put_uint32 (c, value);
+}
+
 /* Write all the published values associated with the object through the
    specified connection. */
 
@@ -3377,6 +3923,7 @@ isc_result_t dhcp_failover_state_stuff (omapi_object_t *c,
 
 	dhcp_failover_state_t *s;
 	isc_result_t status;
+	char hist [FAILOVER_LATENCY_BUCKETS * 20];
 
 	if (c -> type != omapi_type_connection)
 		return DHCP_R_INVALIDARG;
@@ -3584,16 +4131,137 @@ isc_result_t dhcp_failover_state_stuff (omapi_object_t *c,
 	if (status != ISC_R_SUCCESS)
 		return status;
 
-	if (h -> inner && h -> inner -> type -> stuff_values)
-		return (*(h -> inner -> type -> stuff_values)) (c, id,
-								h -> inner);
-	return ISC_R_SUCCESS;
-}
-
-isc_result_t dhcp_failover_state_lookup (omapi_object_t **sp,
-					 omapi_object_t *id,
-					 omapi_object_t *ref)
-{
+	status = dhcp_failover_put_uint32_value (c, "update-window", s->cwnd);
+	if (status != ISC_R_SUCCESS)
+		return status;
+	status = dhcp_failover_put_uint32_value (c, "round-trip-time",
+						 s->srtt);
+	if (status != ISC_R_SUCCESS)
+		return status;
+	status = dhcp_failover_put_uint32_value (c, "recovery-active",
+						 s->recovery_active);
+	if (status != ISC_R_SUCCESS)
+		return status;
+	status = dhcp_failover_put_uint32_value (c, "recovery-leases",
+						 s->recovery_total);
+	if (status != ISC_R_SUCCESS)
+		return status;
+	status = dhcp_failover_put_uint32_value (c, "recovery-examined",
+						 s->recovery_examined);
+	if (status != ISC_R_SUCCESS)
+		return status;
+	status = dhcp_failover_put_uint32_value (c, "recovery-sent",
+						 s->recovery_sent);
+	if (status != ISC_R_SUCCESS)
+		return status;
+	status = (dhcp_failover_put_uint32_value
+		  (c, "recovery-eta", dhcp_failover_recovery_eta (s)));
+	if (status != ISC_R_SUCCESS)
+		return status;
+	status = dhcp_failover_put_uint32_value (c, "balance-active",
+						 (u_int32_t)s->balance_active);
+	if (status != ISC_R_SUCCESS)
+		return status;
+	status = dhcp_failover_put_uint32_value (c, "balance-leases",
+						 s->balance_leases);
+	if (status != ISC_R_SUCCESS)
+		return status;
+	status = dhcp_failover_put_uint32_value (c, "balance-examined",
+						 s->balance_examined);
+	if (status != ISC_R_SUCCESS)
+		return status;
+	status = dhcp_failover_put_uint32_value (c, "balance-moved",
+						 s->balance_moved);
+	if (status != ISC_R_SUCCESS)
+		return status;
+	status = (dhcp_failover_put_uint32_value
+		  (c, "output-pending", dhcp_failover_output_pending (s)));
+	if (status != ISC_R_SUCCESS)
+		return status;
+	status = dhcp_failover_put_uint32_value (c, "output-pending-max",
+						 s->output_max);
+	if (status != ISC_R_SUCCESS)
+		return status;
+	status = dhcp_failover_put_uint32_value (c, "output-blocked",
+						 s->output_blocked);
+	if (status != ISC_R_SUCCESS)
+		return status;
+	status = dhcp_failover_put_uint32_value (c, "update-queue-depth",
+						 s->update_queue_len);
+	if (status != ISC_R_SUCCESS)
+		return status;
+	status = dhcp_failover_put_uint32_value (c, "update-queue-max",
+						 s->update_queue_max);
+	if (status != ISC_R_SUCCESS)
+		return status;
+	status = dhcp_failover_put_uint32_value (c, "unacked-updates-max",
+						 s->unacked_max);
+	if (status != ISC_R_SUCCESS)
+		return status;
+	status = dhcp_failover_put_uint32_value (c, "pending-acks",
+						 (u_int32_t)s->pending_acks);
+	if (status != ISC_R_SUCCESS)
+		return status;
+	status = (dhcp_failover_put_uint32_value
+		  (c, "oldest-unacked-age", dhcp_failover_oldest_unacked (s)));
+	if (status != ISC_R_SUCCESS)
+		return status;
+	status = (dhcp_failover_put_uint32_value
+		  (c, "mclt-headroom", dhcp_failover_mclt_headroom (s)));
+	if (status != ISC_R_SUCCESS)
+		return status;
+	status = dhcp_failover_put_uint32_value (c, "updates-sent",
+						 s->updates_sent);
+	if (status != ISC_R_SUCCESS)
+		return status;
+	status = dhcp_failover_put_uint32_value (c, "acks-received",
+						 s->acks_received);
+	if (status != ISC_R_SUCCESS)
+		return status;
+	status = dhcp_failover_put_uint32_value (c, "acks-last-interval",
+						 s->acks_interval);
+	if (status != ISC_R_SUCCESS)
+		return status;
+	status = (dhcp_failover_put_uint32_value
+		  (c, "ack-latency-median",
+		   dhcp_failover_latency_percentile (s, 50)));
+	if (status != ISC_R_SUCCESS)
+		return status;
+	status = (dhcp_failover_put_uint32_value
+		  (c, "ack-latency-99th",
+		   dhcp_failover_latency_percentile (s, 99)));
+	if (status != ISC_R_SUCCESS)
+		return status;
+	dhcp_failover_latency_print (s, hist, sizeof hist);
+	status = omapi_connection_put_name (c, "ack-latency");
+	if (status != ISC_R_SUCCESS)
+		return status;
+	status = omapi_connection_put_string (c, hist);
+	if (status != ISC_R_SUCCESS)
+		return status;
+	status = dhcp_failover_put_uint32_value (c, "reclaim-backlog",
+						 s->reclaim_backlog);
+	if (status != ISC_R_SUCCESS)
+		return status;
+	status = dhcp_failover_put_uint32_value (c, "reclaimed",
+						 s->reclaimed);
+	if (status != ISC_R_SUCCESS)
+		return status;
+	status = dhcp_failover_put_uint32_value (c, "reclaimed-last-interval",
+						 s->reclaimed_interval);
+	if (status != ISC_R_SUCCESS)
+		return status;
+
+	if (h -> inner && h -> inner -> type -> stuff_values)
+		return (*(h -> inner -> type -> stuff_values)) (c, id,
+								h -> inner);
+	return ISC_R_SUCCESS;
+}
+
+isc_result_t dhcp_failover_state_lookup (omapi_object_t **sp,
+					 omapi_object_t *id,
+					 omapi_object_t *ref)
+{
 	omapi_value_t *tv = (omapi_value_t *)0;
 	isc_result_t status;
 	dhcp_failover_state_t *s;
@@ -3872,6 +4540,9 @@ const char *dhcp_failover_message_name (unsigned type)
 	      case FTM_DISCONNECT:
 		return "disconnect";
 
+	      case FTM_BATCH:
+		return "batch";
+
 	      default:
 		sprintf(messbuf, "unknown-message-%u", type);
 		return messbuf;
@@ -4256,7 +4927,7 @@ isc_result_t dhcp_failover_put_message (dhcp_failover_link_t *link,
 	unsigned char *opbuf;
 	isc_result_t status = ISC_R_SUCCESS;
 	unsigned char cbuf;
-	struct timeval tv;
+	unsigned char *bp;
 
 	/* Run through the argument list once to compute the length of
 	   the option portion of the message. */
@@ -4296,6 +4967,38 @@ isc_result_t dhcp_failover_put_message (dhcp_failover_link_t *link,
 	if (bad_option)
 		return DHCP_R_INVALIDARG;
 
+	/* If a batch frame is being assembled, updates and acks go into
+	   it; anything else has to follow what is already there. */
+	if (link->obatch_max &&
+	    (msg_type == FTM_BNDUPD || msg_type == FTM_BNDACK)) {
+		if (link->obatch_count >= link->obatch_max ||
+		    (link->obatch_len + size + 12 >
+		     DHCP_FAILOVER_MAX_BATCH_SIZE)) {
+			status = dhcp_failover_batch_flush (link, connection);
+			if (status != ISC_R_SUCCESS)
+				goto err;
+		}
+
+		bp = &link->obatch[link->obatch_len];
+		putUShort (bp, size + 12);
+		bp[2] = msg_type;
+		bp[3] = 12;
+		putULong (&bp[4], (u_int32_t)cur_time);
+		putULong (&bp[8], xid);
+		if (opbuf) {
+			memcpy (&bp[12], opbuf, size);
+			dfree (opbuf, MDL);
+		}
+		link->obatch_len += size + 12;
+		link->obatch_count++;
+		return ISC_R_SUCCESS;
+	}
+	if (link->obatch_max) {
+		status = dhcp_failover_batch_flush (link, connection);
+		if (status != ISC_R_SUCCESS)
+			goto err;
+	}
+
 	/* Now send the message header. */
 
 	/* Message length. */
@@ -4332,6 +5035,65 @@ isc_result_t dhcp_failover_put_message (dhcp_failover_link_t *link,
 			goto err;
 		dfree (opbuf, MDL);
 	}
+	dhcp_failover_note_output (link, connection);
+	dhcp_failover_schedule_contact (link);
+	return status;
+
+      err:
+	if (opbuf)
+		dfree (opbuf, MDL);
+	log_info ("dhcp_failover_put_message: something went wrong.");
+	omapi_disconnect (connection, 1);
+	return status;
+}
+
+/* Keep track of how much is waiting to be written to the peer. */
+
+static void dhcp_failover_note_output (dhcp_failover_link_t *link,
+				       omapi_object_t *connection)
+{
+	omapi_connection_object_t *c;
+
+	if (!link->state_object || connection->type != omapi_type_connection)
+		return;
+	c = (omapi_connection_object_t *)connection;
+	if (c->out_bytes > link->state_object->output_max)
+		link->state_object->output_max = c->out_bytes;
+}
+
+/* Return the number of bytes waiting to be written to the peer, including
+   any batch frame being assembled. */
+
+static u_int32_t dhcp_failover_output_pending (dhcp_failover_state_t *state)
+{
+	dhcp_failover_link_t *link = state->link_to_peer;
+	u_int32_t pending = 0;
+
+	if (!link || !link->outer)
+		return 0;
+	if (link->outer->type == omapi_type_connection)
+		pending = ((omapi_connection_object_t *)link->outer)->out_bytes;
+	if (link->obatch_max)
+		pending += link->obatch_len;
+	return pending;
+}
+
+/* Try the update queue again after dhcp_failover_send_updates() stopped to
+   let the output drain. */
+
+void dhcp_failover_output_retry (void *vs)
+{
+	dhcp_failover_state_t *state = vs;
+
+	dhcp_failover_send_updates (state);
+}
+
+/* Having sent something to the peer, put off sending it a CONTACT. */
+
+static void dhcp_failover_schedule_contact (dhcp_failover_link_t *link)
+{
+	struct timeval tv;
+
 	if (link -> state_object &&
 	    link -> state_object -> link_to_peer == link) {
 #if defined (DEBUG_FAILOVER_CONTACT_TIMING)
@@ -4349,16 +5111,183 @@ isc_result_t dhcp_failover_put_message (dhcp_failover_link_t *link,
 			     (tvref_t)dhcp_failover_state_reference,
 			     (tvunref_t)dhcp_failover_state_dereference);
 	}
-	return status;
+}
 
-      err:
-	if (opbuf)
-		dfree (opbuf, MDL);
-	log_info ("dhcp_failover_put_message: something went wrong.");
-	omapi_disconnect (connection, 1);
+/* Batching of BNDUPD and BNDACK messages.
+
+   Peers that both configure max-batched-updates advertise it to each
+   other in the vendor options of CONNECT and CONNECTACK.  Once both
+   have, runs of updates or acks are collected into FTM_BATCH frames of
+   up to the smaller of the two counts, the receiver processes each
+   frame as a whole and answers it with one commit and one batch of
+   acks, and the sender may keep max-unacked-updates frames, rather than
+   messages, in flight.  Peers that don't advertise it (including
+   versions that predate it, which ignore the vendor options) get one
+   message per frame as before. */
+
+static void dhcp_failover_batch_negotiate (dhcp_failover_state_t *state,
+					   failover_message_t *msg)
+{
+	unsigned char *data = msg->vendor_options.data;
+	unsigned count = msg->vendor_options.count;
+	unsigned i, len;
+
+	state->partner.max_batched_updates = 0;
+
+	/* The vendor options are only ours to interpret if the peer is
+	   one of us. */
+	if (!(msg->options_present & FTB_VENDOR_OPTIONS) ||
+	    !(msg->options_present & FTB_VENDOR_CLASS) ||
+	    msg->vendor_class.count < 4 ||
+	    memcmp (msg->vendor_class.data, "isc-", 4))
+		return;
+
+	for (i = 0; i + 2 <= count; i += 2 + len) {
+		len = data[i + 1];
+		if (i + 2 + len > count)
+			break;
+		if (data[i] == FTV_BATCHED_UPDATES && len == 2)
+			state->partner.max_batched_updates =
+				getUShort (&data[i + 2]);
+	}
+
+	if (state->me.max_batched_updates &&
+	    state->partner.max_batched_updates)
+		log_info ("failover peer %s: batching up to %lu updates.",
+			  state->name,
+			  (unsigned long)
+			  (state->me.max_batched_updates <
+			   state->partner.max_batched_updates
+			   ? state->me.max_batched_updates
+			   : state->partner.max_batched_updates));
+}
+
+/* The number of messages we put in a batch frame, or 1 if the peer and
+   we have not both asked for batches. */
+
+static u_int32_t dhcp_failover_batch_size (dhcp_failover_state_t *state)
+{
+	u_int32_t max;
+
+	max = state->me.max_batched_updates;
+	if (max > state->partner.max_batched_updates)
+		max = state->partner.max_batched_updates;
+	if (max > 0xffff)
+		max = 0xffff;
+	return (max < 2 ? 1 : max);
+}
+
+/* Start collecting BNDUPD or BNDACK messages for the peer into a batch
+   frame, if it takes them.  On return *lp holds a reference to the link
+   the batch is being assembled for, or is NULL if messages will be sent
+   one at a time. */
+
+static void dhcp_failover_batch_begin (dhcp_failover_state_t *state,
+				       dhcp_failover_link_t **lp)
+{
+	dhcp_failover_link_t *link = state->link_to_peer;
+	u_int32_t max = dhcp_failover_batch_size (state);
+
+	/* A batch of one is no batch; if one is already being assembled,
+	   it belongs to whoever started it. */
+	if (max < 2 || !link || link->obatch_max ||
+	    !link->outer || link->outer->type != omapi_type_connection)
+		return;
+
+	/* The buffer is allocated the first time, and kept until the link
+	   goes away. */
+	if (!link->obatch) {
+		link->obatch = dmalloc (DHCP_FAILOVER_MAX_BATCH_SIZE, MDL);
+		if (!link->obatch)
+			return;
+	}
+	link->obatch_len = 12;
+	link->obatch_count = 0;
+	link->obatch_max = max;
+	dhcp_failover_link_reference (lp, link, MDL);
+}
+
+/* Send whatever is in the batch frame being assembled. */
+
+static isc_result_t dhcp_failover_batch_flush (dhcp_failover_link_t *link,
+					       omapi_object_t *connection)
+{
+	isc_result_t status;
+	unsigned char *bp;
+	unsigned len;
+
+	if (!link->obatch_max || !link->obatch_count)
+		return ISC_R_SUCCESS;
+
+	if (link->obatch_count == 1) {
+		/* A lone message doesn't need a frame around it. */
+		bp = &link->obatch[12];
+		len = link->obatch_len - 12;
+	} else {
+		bp = link->obatch;
+		len = link->obatch_len;
+		putUShort (bp, len);
+		bp[2] = FTM_BATCH;
+		bp[3] = 12;
+		putULong (&bp[4], (u_int32_t)cur_time);
+		putULong (&bp[8], link->xid++);
+	}
+
+	status = omapi_connection_copyin (connection, bp, len);
+	link->obatch_len = 12;
+	link->obatch_count = 0;
+	if (status == ISC_R_SUCCESS) {
+		dhcp_failover_note_output (link, connection);
+		dhcp_failover_schedule_contact (link);
+	}
 	return status;
 }
 
+/* Send the batch started by dhcp_failover_batch_begin, and go back to
+   sending messages one at a time. */
+
+static void dhcp_failover_batch_end (dhcp_failover_link_t **lp)
+{
+	dhcp_failover_link_t *link = *lp;
+	isc_result_t status;
+
+	if (!link)
+		return;
+
+	if (link->obatch_max) {
+		if (link->state != dhcp_flink_disconnected &&
+		    link->outer &&
+		    link->outer->type == omapi_type_connection) {
+			status = dhcp_failover_batch_flush (link,
+							    link->outer);
+			if (status != ISC_R_SUCCESS) {
+				log_info ("dhcp_failover_batch_end: %s",
+					  isc_result_totext (status));
+				omapi_disconnect (link->outer, 1);
+			}
+		}
+		link->obatch_len = 12;
+		link->obatch_count = 0;
+		link->obatch_max = 0;
+	}
+	dhcp_failover_link_dereference (lp, MDL);
+}
+
+/* Called once every message in a batch frame from the peer has been
+   processed: ack them all at once, and fill whatever room their acks
+   have made for our own updates. */
+
+static void dhcp_failover_batch_received (dhcp_failover_link_t *link)
+{
+	dhcp_failover_state_t *state = link->state_object;
+
+	if (!state || state->link_to_peer != link ||
+	    link->state == dhcp_flink_disconnected)
+		return;
+
+	dhcp_failover_send_updates (state);
+}
+
 void dhcp_failover_timeout (void *vstate)
 {
 	dhcp_failover_state_t *state = vstate;
@@ -4478,6 +5407,18 @@ isc_result_t dhcp_failover_send_state (dhcp_failover_state_t *state)
 	return ISC_R_SUCCESS;
 }
 
+/* Fill in the ISC vendor options we send in CONNECT and CONNECTACK. */
+
+static void dhcp_failover_vendor_options (dhcp_failover_state_t *state,
+					  unsigned char *vopts)
+{
+	u_int32_t max = state->me.max_batched_updates;
+
+	vopts[0] = FTV_BATCHED_UPDATES;
+	vopts[1] = 2;
+	putUShort (&vopts[2], max > 0xffff ? 0xffff : max);
+}
+
 /* Send a connect message. */
 
 isc_result_t dhcp_failover_send_connect (omapi_object_t *l)
@@ -4485,6 +5426,7 @@ isc_result_t dhcp_failover_send_connect (omapi_object_t *l)
 	dhcp_failover_link_t *link;
 	dhcp_failover_state_t *state;
 	isc_result_t status;
+	unsigned char vopts[4];
 #if defined (DEBUG_FAILOVER_MESSAGES)
 	char obuf [64];
 	unsigned obufix = 0;
@@ -4502,6 +5444,8 @@ isc_result_t dhcp_failover_send_connect (omapi_object_t *l)
 	if (!l -> outer || l -> outer -> type != omapi_type_connection)
 		return DHCP_R_INVALIDARG;
 
+	dhcp_failover_vendor_options (state, vopts);
+
 	status =
 	    (dhcp_failover_put_message
 	     (link, l -> outer,
@@ -4523,6 +5467,10 @@ isc_result_t dhcp_failover_send_connect (omapi_object_t *l)
 	      (state -> hba
 	       ? dhcp_failover_make_option (FTO_HBA, FMA, 32, state -> hba)
 	       : &skip_failover_option),
+	      (state->me.max_batched_updates
+	       ? dhcp_failover_make_option (FTO_VENDOR_OPTIONS, FMA,
+					    sizeof vopts, vopts)
+	       : &skip_failover_option),
 	      (failover_option_t *)0));
 
 #if defined (DEBUG_FAILOVER_MESSAGES)
@@ -4542,6 +5490,7 @@ isc_result_t dhcp_failover_send_connectack (omapi_object_t *l,
 {
 	dhcp_failover_link_t *link;
 	isc_result_t status;
+	unsigned char vopts[4];
 #if defined (DEBUG_FAILOVER_MESSAGES)
 	char obuf [64];
 	unsigned obufix = 0;
@@ -4558,6 +5507,9 @@ isc_result_t dhcp_failover_send_connectack (omapi_object_t *l,
 	if (!l -> outer || l -> outer -> type != omapi_type_connection)
 		return DHCP_R_INVALIDARG;
 
+	if (state)
+		dhcp_failover_vendor_options (state, vopts);
+
 	status =
 	    (dhcp_failover_put_message
 	     (link, l -> outer,
@@ -4594,6 +5546,10 @@ isc_result_t dhcp_failover_send_connectack (omapi_object_t *l,
 	       ? dhcp_failover_make_option (FTO_MESSAGE, FMA,
 					    strlen (errmsg), errmsg)
 	       : &skip_failover_option,
+	      (state && !reason && state->me.max_batched_updates)
+	       ? dhcp_failover_make_option (FTO_VENDOR_OPTIONS, FMA,
+					    sizeof vopts, vopts)
+	       : &skip_failover_option,
 	      (failover_option_t *)0));
 
 #if defined (DEBUG_FAILOVER_MESSAGES)
@@ -4909,7 +5865,7 @@ isc_result_t dhcp_failover_send_poolreq (dhcp_failover_state_t *state)
 }
 
 isc_result_t dhcp_failover_send_poolresp (dhcp_failover_state_t *state,
-					  int leases)
+					  int leases, u_int32_t xid)
 {
 	dhcp_failover_link_t *link;
 	isc_result_t status;
@@ -4933,7 +5889,7 @@ isc_result_t dhcp_failover_send_poolresp (dhcp_failover_state_t *state,
 
 	status = (dhcp_failover_put_message
 		  (link, link -> outer,
-		   FTM_POOLRESP, link->imsg->xid,
+		   FTM_POOLRESP, xid,
 		   dhcp_failover_make_option (FTO_ADDRESSES_TRANSFERRED, FMA,
 					      leases),
 		   (failover_option_t *)0));
@@ -5540,6 +6496,9 @@ isc_result_t dhcp_failover_process_bind_ack (dhcp_failover_state_t *state,
 	ia.len = sizeof msg -> assigned_addr;
 	memcpy (ia.iabuf, &msg -> assigned_addr, ia.len);
 
+	dhcp_failover_window_ack (state, msg->xid);
+	dhcp_failover_note_ack (state, msg->xid);
+
 	if (!find_lease_by_ip_addr (&lease, ia, MDL)) {
 		message = "no such lease";
 		goto bad;
@@ -5673,8 +6632,10 @@ isc_result_t dhcp_failover_process_bind_ack (dhcp_failover_state_t *state,
 	}
 
 	/* If there are updates pending, we've created space to send at
-	   least one. */
-	dhcp_failover_send_updates (state);
+	   least one.  If this ack came in a batch, wait for the rest of
+	   it so that the space is filled with a batch too. */
+	if (!state->link_to_peer || !state->link_to_peer->ibatch_len)
+		dhcp_failover_send_updates (state);
 
       out:
 	lease_dereference (&lease, MDL);
@@ -5686,51 +6647,432 @@ isc_result_t dhcp_failover_process_bind_ack (dhcp_failover_state_t *state,
 	goto out;
 }
 
-isc_result_t dhcp_failover_generate_update_queue (dhcp_failover_state_t *state,
-						  int everythingp)
+/* Recovery streams.
+
+   When the peer asks for updates, or we return to normal state, the
+   leases the peer needs are found by walking lease_ip_addr_hash a bucket
+   at a time whenever dhcp_failover_send_updates() runs out of queued
+   updates and still has room in its window, so only about a window's
+   worth of leases is ever queued.  Buckets are stable as leases change
+   state, unlike the pool lease queues a lease moves between.
+
+   Start a stream of the leases whose updates the peer hasn't
+   acknowledged, or if everythingp is set, of all of them.  If reply is
+   set, it answers an UPDREQ or UPDREQALL and ends with an UPDDONE; such a
+   stream isn't replaced by one that doesn't. */
+
+void dhcp_failover_recovery_start (dhcp_failover_state_t *state,
+				   int everythingp, int reply)
 {
 	struct shared_network *s;
 	struct pool *p;
-	struct lease *l;
-	int i;
-#define FREE_LEASES 0
-#define ACTIVE_LEASES 1
-#define EXPIRED_LEASES 2
-#define ABANDONED_LEASES 3
-#define BACKUP_LEASES 4
-#define RESERVED_LEASES 5
-	LEASE_STRUCT_PTR lptr[RESERVED_LEASES+1];
-
-	/* Loop through each pool in each shared network and call the
-	   expiry routine on the pool. */
+
+	if (state->recovery_active && state->recovery_reply && !reply)
+		return;
+
+	state->recovery_active = 1;
+	state->recovery_all = everythingp;
+	state->recovery_reply = reply;
+	state->recovery_bucket = 0;
+	state->recovery_examined = 0;
+	state->recovery_sent = 0;
+	state->recovery_start = cur_time;
+
+	state->recovery_total = 0;
 	for (s = shared_networks; s; s = s -> next) {
-	    for (p = s -> pools; p; p = p -> next) {
-		if (p->failover_peer != state)
-			continue;
+		for (p = s -> pools; p; p = p -> next) {
+			if (p->failover_peer == state)
+				state->recovery_total += p->lease_count;
+		}
+	}
+}
 
-		lptr[FREE_LEASES] = &p->free;
-		lptr[ACTIVE_LEASES] = &p->active;
-		lptr[EXPIRED_LEASES] = &p->expired;
-		lptr[ABANDONED_LEASES] = &p->abandoned;
-		lptr[BACKUP_LEASES] = &p->backup;
-		lptr[RESERVED_LEASES] = &p->reserved;
-
-		for (i = FREE_LEASES; i <= RESERVED_LEASES; i++) {
-		    for (l = LEASE_GET_FIRSTP(lptr[i]);
-			 l != NULL;
-			 l = LEASE_GET_NEXTP(lptr[i], l)) {
+/* Queue at least room more leases from the recovery stream, if it has
+   that many left, and end the stream once it has been through them all. */
+
+static void dhcp_failover_recovery_fill (dhcp_failover_state_t *state,
+					 u_int32_t room)
+{
+	struct hash_table *ht = (struct hash_table *)lease_ip_addr_hash;
+	struct hash_bucket *bp;
+	struct lease *l;
+	u_int32_t queued = 0;
+
+	while (queued < room && ht &&
+	       state->recovery_bucket < ht->hash_count) {
+		for (bp = ht->buckets[state->recovery_bucket++];
+		     bp != NULL; bp = bp->next) {
+			l = (struct lease *)bp->value;
+			if (!l->pool || l->pool->failover_peer != state)
+				continue;
+			state->recovery_examined++;
+
+			/* Leases already on a queue will get to the peer
+			   anyway; otherwise send the ones the peer hasn't
+			   acknowledged, and expired ones, which it may
+			   need to free. */
 			if ((l->flags & ON_QUEUE) == 0 &&
-			    (everythingp ||
+			    (state->recovery_all ||
 			     (l->tstp > l->atsfp) ||
-			     (i == EXPIRED_LEASES))) {
+			     (l->binding_state == FTS_EXPIRED ||
+			      l->binding_state == FTS_RELEASED ||
+			      l->binding_state == FTS_RESET))) {
 				l -> desired_binding_state = l -> binding_state;
 				dhcp_failover_queue_update (l, 0);
+				state->recovery_sent++;
+				queued++;
 			}
-		    }
 		}
-	    }
 	}
-	return ISC_R_SUCCESS;
+	if (ht && state->recovery_bucket < ht->hash_count)
+		return;
+
+	state->recovery_active = 0;
+	log_info ("failover peer %s: %lu of %lu leases queued for update "
+		  "in %ld seconds.", state->name,
+		  (unsigned long)state->recovery_sent,
+		  (unsigned long)state->recovery_examined,
+		  (long)(cur_time - state->recovery_start));
+	if (!state->recovery_reply)
+		return;
+
+	/* Send the UPDDONE when the last of the updates is acked, or now
+	   if there are none. */
+	if (state->send_update_done)
+		lease_dereference (&state->send_update_done, MDL);
+	if (state->update_queue_tail)
+		lease_reference (&state->send_update_done,
+				 state->update_queue_tail, MDL);
+	else if (state->ack_queue_tail)
+		lease_reference (&state->send_update_done,
+				 state->ack_queue_tail, MDL);
+	else
+		dhcp_failover_send_update_done (state);
+}
+
+/* Abandon the recovery stream when the link to the peer goes down.  Its
+   request came over the old connection, and the peer asks again once it
+   is back; an UPDDONE for the old request would answer nothing, and a
+   stream left running would hold off the one the new connection needs. */
+
+static void dhcp_failover_recovery_stop (dhcp_failover_state_t *state)
+{
+	if (state->send_update_done)
+		lease_dereference (&state->send_update_done, MDL);
+	if (!state->recovery_active)
+		return;
+
+	log_info ("failover peer %s: recovery stopped after %lu of %lu "
+		  "leases.", state->name,
+		  (unsigned long)state->recovery_examined,
+		  (unsigned long)state->recovery_total);
+	state->recovery_active = 0;
+	state->recovery_all = 0;
+	state->recovery_reply = 0;
+	state->recovery_bucket = 0;
+	state->recovery_total = 0;
+	state->recovery_examined = 0;
+	state->recovery_sent = 0;
+}
+
+/* Return the number of seconds the current recovery stream has left to
+   run, estimated from how far it has got so far, or 0 if none is
+   running. */
+
+static u_int32_t dhcp_failover_recovery_eta (dhcp_failover_state_t *state)
+{
+	u_int32_t left;
+
+	if (!state->recovery_active || !state->recovery_examined)
+		return 0;
+	if (state->recovery_examined >= state->recovery_total)
+		return 0;
+	left = state->recovery_total - state->recovery_examined;
+	return ((u_int32_t)(((u_int64_t)(cur_time - state->recovery_start) *
+			     left) / state->recovery_examined));
+}
+
+/* Queue statistics.
+
+   The send time of each BNDUPD is kept in a ring indexed by its XID, so
+   that the BNDACK for it can be timed and the age of the oldest update
+   still waiting for one can be found.  An XID that has been overwritten
+   by a later one simply isn't timed. */
+
+static void dhcp_failover_note_sent (dhcp_failover_state_t *state,
+				     u_int32_t xid)
+{
+	struct failover_sent *slot;
+
+	state->updates_sent++;
+	if (!state->sent) {
+		state->sent = dmalloc (FAILOVER_SENT_RING *
+				       sizeof (*state->sent), MDL);
+		if (!state->sent)
+			return;
+	}
+	slot = &state->sent [xid % FAILOVER_SENT_RING];
+	slot->xid = xid;
+	slot->when = cur_tv;
+}
+
+static void dhcp_failover_note_ack (dhcp_failover_state_t *state,
+				    u_int32_t xid)
+{
+	struct failover_sent *slot;
+	long msecs;
+	int i;
+
+	state->acks_received++;
+	if (!state->sent || !xid)
+		return;
+	slot = &state->sent [xid % FAILOVER_SENT_RING];
+	if (slot->xid != xid)
+		return;
+
+	msecs = ((cur_tv.tv_sec - slot->when.tv_sec) * 1000L +
+		 (cur_tv.tv_usec - slot->when.tv_usec) / 1000L);
+	for (i = 0; i < FAILOVER_LATENCY_BUCKETS - 1; i++)
+		if (msecs < (1L << i))
+			break;
+	state->latency [i]++;
+	slot->xid = 0;
+}
+
+static void dhcp_failover_forget_sent (dhcp_failover_state_t *state,
+				       u_int32_t xid)
+{
+	struct failover_sent *slot;
+
+	if (!state->sent || !xid)
+		return;
+	slot = &state->sent [xid % FAILOVER_SENT_RING];
+	if (slot->xid == xid)
+		slot->xid = 0;
+}
+
+/* Return the number of seconds the oldest unacked update has been
+   waiting for its ack, or 0 if there isn't one. */
+
+static u_int32_t dhcp_failover_oldest_unacked (dhcp_failover_state_t *state)
+{
+	struct failover_sent *slot;
+	TIME oldest;
+	int i;
+
+	if (!state->ack_queue_head || !state->sent)
+		return 0;
+
+	/* Updates are acked roughly in order, so the head of the ack queue
+	   is usually the oldest; if its send time has been overwritten,
+	   fall back to the oldest one we still have. */
+	slot = &state->sent [state->ack_queue_head->last_xid %
+			     FAILOVER_SENT_RING];
+	if (slot->xid && slot->xid == state->ack_queue_head->last_xid) {
+		oldest = slot->when.tv_sec;
+	} else {
+		oldest = cur_time;
+		for (i = 0; i < FAILOVER_SENT_RING; i++)
+			if (state->sent [i].xid &&
+			    state->sent [i].when.tv_sec < oldest)
+				oldest = state->sent [i].when.tv_sec;
+	}
+	return oldest < cur_time ? (u_int32_t)(cur_time - oldest) : 0;
+}
+
+/* Return how many seconds are left before the oldest unacked update
+   has been waiting longer than the MCLT. */
+
+static u_int32_t dhcp_failover_mclt_headroom (dhcp_failover_state_t *state)
+{
+	u_int32_t age;
+
+	age = dhcp_failover_oldest_unacked (state);
+	return age < state->mclt ? state->mclt - age : 0;
+}
+
+/* Return the upper bound, in milliseconds, of the latency bucket that
+   holds the given percentile of the acks received, or 0 if there have
+   been none. */
+
+static u_int32_t
+dhcp_failover_latency_percentile (dhcp_failover_state_t *state,
+				  unsigned percent)
+{
+	u_int64_t total, want, seen;
+	int i;
+
+	total = 0;
+	for (i = 0; i < FAILOVER_LATENCY_BUCKETS; i++)
+		total += state->latency [i];
+	if (!total)
+		return 0;
+
+	want = (total * percent + 99) / 100;
+	seen = 0;
+	for (i = 0; i < FAILOVER_LATENCY_BUCKETS - 1; i++) {
+		seen += state->latency [i];
+		if (seen >= want)
+			break;
+	}
+	return 1U << i;
+}
+
+/* Print the latency histogram as "<1ms:n <2ms:n ... >=16384ms:n",
+   leaving out empty buckets. */
+
+static void dhcp_failover_latency_print (dhcp_failover_state_t *state,
+					 char *buf, size_t len)
+{
+	size_t used;
+	int i;
+
+	buf [0] = 0;
+	used = 0;
+	for (i = 0; i < FAILOVER_LATENCY_BUCKETS && used < len; i++) {
+		if (!state->latency [i])
+			continue;
+		if (i < FAILOVER_LATENCY_BUCKETS - 1)
+			used += snprintf (buf + used, len - used,
+					  "%s<%lums:%lu", used ? " " : "",
+					  1UL << i,
+					  (unsigned long)state->latency [i]);
+		else
+			used += snprintf (buf + used, len - used,
+					  "%s>=%lums:%lu", used ? " " : "",
+					  1UL << (i - 1),
+					  (unsigned long)state->latency [i]);
+	}
+}
+
+/* Log the queue statistics of a failover peer, and arrange to do it
+   again in FAILOVER_STATS_INTERVAL seconds. */
+
+void dhcp_failover_stats_report (void *vs)
+{
+	dhcp_failover_state_t *state = vs;
+	struct timeval tv;
+	TIME interval = cur_time - state->last_report;
+
+	state->acks_interval = state->acks_received - state->acks_reported;
+	state->acks_reported = state->acks_received;
+	state->reclaimed_interval = (state->reclaimed -
+				     state->reclaimed_reported);
+	state->reclaimed_reported = state->reclaimed;
+	state->last_report = cur_time;
+
+	if (state->updates_sent || state->update_queue_len)
+		log_info ("failover peer %s: %lu queued (max %lu), "
+			  "%lu unacked (max %lu), %d acks owed, "
+			  "oldest unacked %lus, MCLT headroom %lus, "
+			  "%lu acks in %lds, "
+			  "ack latency median %lums 99th %lums",
+			  state->name,
+			  (unsigned long)state->update_queue_len,
+			  (unsigned long)state->update_queue_max,
+			  (unsigned long)state->cur_unacked_updates,
+			  (unsigned long)state->unacked_max,
+			  state->pending_acks,
+			  (unsigned long)dhcp_failover_oldest_unacked (state),
+			  (unsigned long)dhcp_failover_mclt_headroom (state),
+			  (unsigned long)state->acks_interval,
+			  (long)interval,
+			  (unsigned long)
+			  dhcp_failover_latency_percentile (state, 50),
+			  (unsigned long)
+			  dhcp_failover_latency_percentile (state, 99));
+
+	if (state->reclaim_backlog || state->reclaimed_interval)
+		log_info ("failover peer %s: %lu expired leases to reclaim, "
+			  "%lu reclaimed in %lds",
+			  state->name,
+			  (unsigned long)state->reclaim_backlog,
+			  (unsigned long)state->reclaimed_interval,
+			  (long)interval);
+
+	tv.tv_sec = cur_time + FAILOVER_STATS_INTERVAL;
+	tv.tv_usec = 0;
+	add_timeout (&tv, dhcp_failover_stats_report, state,
+		     (tvref_t)dhcp_failover_state_reference,
+		     (tvunref_t)dhcp_failover_state_dereference);
+}
+
+/* Congestion control.
+
+   The peer's max-unacked-updates, multiplied by the batch size when it
+   takes batches, is a hard limit on the updates we may have in flight.
+   Below it a window grows as acks come back, doubling every round trip
+   until the first sign of congestion and by one update per round trip
+   after that.  One update per round trip is timed, and when a round
+   trip takes more than twice the shortest one seen, which usually means
+   the peer's lease commits are falling behind, the window is halved, at
+   most once per round trip.  It never drops below max-unacked-updates,
+   which is what we would always have used without it. */
+
+static void dhcp_failover_window_reset (dhcp_failover_state_t *state)
+{
+	state->cwnd = state->partner.max_flying_updates;
+	state->ssthresh = 0xffffffff;
+	state->cwnd_acked = 0;
+	state->rtt_xid = 0;
+	state->srtt = state->rttvar = state->min_rtt = 0;
+	state->last_cut.tv_sec = 0;
+	state->last_cut.tv_usec = 0;
+}
+
+static void dhcp_failover_window_ack (dhcp_failover_state_t *state,
+				      u_int32_t xid)
+{
+	u_int32_t floor, limit, sample, delta;
+	long usecs;
+
+	floor = state->partner.max_flying_updates;
+	limit = floor * dhcp_failover_batch_size (state);
+
+	if (state->rtt_xid && state->rtt_xid == xid) {
+		state->rtt_xid = 0;
+		usecs = ((cur_tv.tv_sec - state->rtt_sent.tv_sec) * 1000000L +
+			 (cur_tv.tv_usec - state->rtt_sent.tv_usec));
+		sample = usecs > 0 ? (u_int32_t)usecs : 1;
+
+		if (!state->min_rtt || sample < state->min_rtt)
+			state->min_rtt = sample;
+		if (!state->srtt) {
+			state->srtt = sample;
+			state->rttvar = sample / 2;
+		} else {
+			delta = (sample > state->srtt
+				 ? sample - state->srtt
+				 : state->srtt - sample);
+			state->rttvar = (3 * state->rttvar + delta) / 4;
+			state->srtt = (7 * state->srtt + sample) / 8;
+		}
+
+		usecs = ((cur_tv.tv_sec - state->last_cut.tv_sec) * 1000000L +
+			 (cur_tv.tv_usec - state->last_cut.tv_usec));
+		if (sample > 2 * state->min_rtt &&
+		    sample - state->min_rtt > 1000 &&
+		    usecs > (long)state->srtt) {
+			state->ssthresh = state->cwnd / 2;
+			if (state->ssthresh < floor)
+				state->ssthresh = floor;
+			state->cwnd = state->ssthresh;
+			state->cwnd_acked = 0;
+			state->last_cut = cur_tv;
+			return;
+		}
+	}
+
+	if (state->cwnd < state->ssthresh) {
+		state->cwnd++;
+	} else if (++state->cwnd_acked >= state->cwnd) {
+		state->cwnd_acked = 0;
+		state->cwnd++;
+	}
+	if (state->cwnd > limit)
+		state->cwnd = limit;
+	if (state->cwnd < floor)
+		state->cwnd = floor;
 }
 
 isc_result_t
@@ -5743,27 +7085,14 @@ dhcp_failover_process_update_request (dhcp_failover_state_t *state,
 		lease_dereference(&state->send_update_done, MDL);
 	}
 
-	/* Generate a fresh update queue. */
-	dhcp_failover_generate_update_queue (state, 0);
-
 	state->updxid = msg->xid;
 
-	/* If there's anything on the update queue (there shouldn't be
-	   anything on the ack queue), trigger an update done message
-	   when we get an ack for that lease. */
-	if (state -> update_queue_tail) {
-		lease_reference (&state -> send_update_done,
-				 state -> update_queue_tail, MDL);
-		dhcp_failover_send_updates (state);
-		log_info ("Update request from %s: sending update",
-			   state -> name);
-	} else {
-		/* Otherwise, there are no updates to send, so we can
-		   just send an UPDDONE message immediately. */
-		dhcp_failover_send_update_done (state);
-		log_info ("Update request from %s: nothing pending",
-			   state -> name);
-	}
+	/* Stream the leases the peer hasn't heard about to it; the
+	   stream sends the UPDDONE once they have all been acked. */
+	log_info ("Update request from %s: sending updates",
+		  state -> name);
+	dhcp_failover_recovery_start (state, 0, 1);
+	dhcp_failover_send_updates (state);
 
 	return ISC_R_SUCCESS;
 }
@@ -5778,24 +7107,13 @@ dhcp_failover_process_update_request_all (dhcp_failover_state_t *state,
 		lease_dereference(&state->send_update_done, MDL);
 	}
 
-	/* Generate a fresh update queue that includes every lease. */
-	dhcp_failover_generate_update_queue (state, 1);
-
 	state->updxid = msg->xid;
 
-	if (state -> update_queue_tail) {
-		lease_reference (&state -> send_update_done,
-				 state -> update_queue_tail, MDL);
-		dhcp_failover_send_updates (state);
-		log_info ("Update request all from %s: sending update",
-			   state -> name);
-	} else {
-		/* This should really never happen, but it could happen
-		   on a server that currently has no leases configured. */
-		dhcp_failover_send_update_done (state);
-		log_info ("Update request all from %s: nothing pending",
-			   state -> name);
-	}
+	/* Stream every lease to the peer. */
+	log_info ("Update request all from %s: sending updates",
+		  state -> name);
+	dhcp_failover_recovery_start (state, 1, 1);
+	dhcp_failover_send_updates (state);
 
 	return ISC_R_SUCCESS;
 }
@@ -5955,10 +7273,38 @@ static unsigned char loadb_p_hash (const unsigned char *key, unsigned len)
         return hash;
 }
 
-int load_balance_mine (struct packet *packet, dhcp_failover_state_t *state)
+/* Return the load balancing hash of the client identifier in a packet,
+   or of its chaddr if it has none.  It depends on nothing but the
+   packet, so it is kept there for any later checks of the same packet. */
+static unsigned char loadb_packet_hash (struct packet *packet)
 {
 	struct option_cache *oc;
 	struct data_string ds;
+
+	if (packet->loadb_hashed)
+		return packet->loadb_hash;
+
+	oc = lookup_option(&dhcp_universe, packet->options,
+			   DHO_DHCP_CLIENT_IDENTIFIER);
+	memset(&ds, 0, sizeof ds);
+	if (oc &&
+	    evaluate_option_cache(&ds, packet, NULL, NULL,
+				  packet->options, NULL,
+				  &global_scope, oc, MDL)) {
+		packet->loadb_hash = loadb_p_hash(ds.data, ds.len);
+
+		data_string_forget(&ds, MDL);
+	} else {
+		packet->loadb_hash = loadb_p_hash(packet->raw->chaddr,
+						  packet->raw->hlen);
+	}
+	packet->loadb_hashed = ISC_TRUE;
+
+	return packet->loadb_hash;
+}
+
+int load_balance_mine (struct packet *packet, dhcp_failover_state_t *state)
+{
 	unsigned char hbaix;
 	int hm;
 	u_int16_t ec;
@@ -5986,20 +7332,7 @@ int load_balance_mine (struct packet *packet, dhcp_failover_state_t *state)
 	if (!state->hba)
 		return (0);
 
-	oc = lookup_option(&dhcp_universe, packet->options,
-			   DHO_DHCP_CLIENT_IDENTIFIER);
-	memset(&ds, 0, sizeof ds);
-	if (oc &&
-	    evaluate_option_cache(&ds, packet, NULL, NULL,
-				  packet->options, NULL,
-				  &global_scope, oc, MDL)) {
-		hbaix = loadb_p_hash(ds.data, ds.len);
-
-		data_string_forget(&ds, MDL);
-	} else {
-		hbaix = loadb_p_hash(packet->raw->chaddr,
-				     packet->raw->hlen);
-	}
+	hbaix = loadb_packet_hash(packet);
 
 	hm = state->hba[(hbaix >> 3) & 0x1F] & (1 << (hbaix & 0x07));
 
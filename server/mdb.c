@@ -94,6 +94,8 @@ isc_result_t enter_class(cd, dynamicp, commit)
 			/* nothing */ ;
 		class_reference (&c -> nic, cd, MDL);
 	}
+	discard_class_indexes ();
+	discard_scope_templates ();
 
 	if (dynamicp && commit) {
 		const char *name = cd->name;
@@ -227,6 +229,8 @@ isc_result_t enter_host (hd, dynamicp, commit)
 	struct executable_statement *esp;
 	host_id_info_t *h_id_info;
 
+	discard_scope_templates ();
+
 	if (!host_name_hash) {
 		if (!host_new_hash(&host_name_hash, HOST_HASH_SIZE, MDL))
 			log_fatal ("Can't allocate host name hash");
@@ -479,6 +483,7 @@ isc_result_t delete_host (hd, commit)
 
 	/* But we do need to do it once!   :') */
 	hd -> flags |= HOST_DECL_DELETED;
+	discard_scope_templates ();
 
 	if (hd -> interface.hlen) {
 	    if (host_hw_addr_hash) {
@@ -1129,6 +1134,39 @@ void enter_lease (lease)
    list of leases by expiry time so that we can always find the oldest
    lease. */
 
+#if defined (FAILOVER_PROTOCOL)
+/* Keep count of the expired leases a server in partner-down has still to
+   reclaim, as a lease moves onto or off the expired queue, and of those
+   it has reclaimed: moved to free or backup, not handed to a client. */
+static void reclaim_count (struct lease *lease, binding_state_t from)
+{
+	dhcp_failover_state_t *peer;
+	int was_expired, is_expired;
+
+	if (lease->pool == NULL || lease->pool->failover_peer == NULL)
+		return;
+	peer = lease->pool->failover_peer;
+	if (peer->me.state != partner_down)
+		return;
+
+	was_expired = (from == FTS_EXPIRED || from == FTS_RELEASED ||
+		       from == FTS_RESET);
+	is_expired = (lease->binding_state == FTS_EXPIRED ||
+		      lease->binding_state == FTS_RELEASED ||
+		      lease->binding_state == FTS_RESET);
+
+	if (is_expired && !was_expired)
+		peer->reclaim_backlog++;
+	else if (was_expired && !is_expired) {
+		if (peer->reclaim_backlog)
+			peer->reclaim_backlog--;
+		if (lease->binding_state == FTS_FREE ||
+		    lease->binding_state == FTS_BACKUP)
+			peer->reclaimed++;
+	}
+}
+#endif
+
 int supersede_lease (comp, lease, commit, propogate, pimmediate, from_pool)
 	struct lease *comp, *lease;
 	int commit;
@@ -1392,8 +1430,16 @@ int supersede_lease (comp, lease, commit, propogate, pimmediate, from_pool)
 	}
 
 	/* Make the state transition. */
-	if (commit || !pimmediate)
+	if (commit || !pimmediate) {
+#if defined (FAILOVER_PROTOCOL)
+		binding_state_t from = comp->binding_state;
+#endif
 		make_binding_state_transition (comp);
+#if defined (FAILOVER_PROTOCOL)
+		if (commit)
+			reclaim_count (comp, from);
+#endif
+	}
 
 	/* Put the lease back on the appropriate queue.    If the lease
 	   is corrupt (as detected by lease_enqueue), don't go any farther. */
@@ -1905,9 +1951,21 @@ void pool_timer (vpool)
 	TIME next_expiry = MAX_TIME;
 	int i;
 	struct timeval tv;
+	int changed = 0, more = 0;
+	int bounded, saved_starting;
 
 	pool = (struct pool *)vpool;
 
+	/* At startup every pool is expired in full before anything else
+	   happens; after that, only a step's worth at a time. */
+	bounded = (server_starting == 0);
+
+	/* Write the changed leases as we go, but only commit them, and
+	   then send the updates about them to the failover peer, once
+	   at the end. */
+	saved_starting = server_starting;
+	server_starting |= SS_NOSYNC;
+
 	lptr[FREE_LEASES] = &pool->free;
 	lptr[ACTIVE_LEASES] = &pool->active;
 	lptr[EXPIRED_LEASES] = &pool->expired;
@@ -1915,7 +1973,7 @@ void pool_timer (vpool)
 	lptr[BACKUP_LEASES] = &pool->backup;
 	lptr[RESERVED_LEASES] = &pool->reserved;
 
-	for (i = FREE_LEASES; i <= RESERVED_LEASES; i++) {
+	for (i = FREE_LEASES; i <= RESERVED_LEASES && !more; i++) {
 		/* If there's nothing on the queue, skip it. */
 		if (!(LEASE_NOT_EMPTYP(lptr[i])))
 			continue;
@@ -1975,7 +2033,15 @@ void pool_timer (vpool)
 			{
 #if defined(FAILOVER_PROTOCOL)
 				dhcp_failover_state_t *peer = NULL;
+#endif
+
+				/* Leave the rest for the next step. */
+				if (bounded && changed >= POOL_TIMER_STEP) {
+					more = 1;
+					break;
+				}
 
+#if defined(FAILOVER_PROTOCOL)
 				if (lease->pool != NULL)
 					peer = lease->pool->failover_peer;
 
@@ -1992,7 +2058,8 @@ void pool_timer (vpool)
 					lease->next_binding_state =
 						   lease->rewind_binding_state;
 #endif
-				supersede_lease(lease, NULL, 1, 1, 1, 1);
+				supersede_lease(lease, NULL, 1, 1, 0, 1);
+				changed++;
 			}
 
 			lease_dereference(&lease, MDL);
@@ -2005,12 +2072,30 @@ void pool_timer (vpool)
 			lease_dereference(&lease, MDL);
 	}
 
-	/* If we found something to expire and its expiration time
-	 * is either less than the current expiration time or the
-	 * current expiration time is already expired update the
-	 * timer.
+	server_starting = saved_starting;
+	if (changed) {
+		if ((server_starting & SS_NOSYNC) == 0 && !commit_leases ())
+			changed = 0;
+#if defined (FAILOVER_PROTOCOL)
+		if (changed && pool->failover_peer)
+			dhcp_failover_send_updates (pool->failover_peer);
+#endif
+	}
+
+	/* If there are leases left over from this step, come back for
+	 * them as soon as whatever else is waiting has been done.
+	 * Otherwise, if we found something to expire and its expiration
+	 * time is either less than the current expiration time or the
+	 * current expiration time is already expired update the timer.
 	 */
-	if ((next_expiry != MAX_TIME) &&
+	if (more) {
+		pool->next_event_time = cur_time;
+		tv.tv_sec = cur_tv.tv_sec;
+		tv.tv_usec = cur_tv.tv_usec;
+		add_timeout (&tv, pool_timer, pool,
+			     (tvref_t)pool_reference,
+			     (tvunref_t)pool_dereference);
+	} else if ((next_expiry != MAX_TIME) &&
 	    ((pool->next_event_time > next_expiry) ||
 	     (pool->next_event_time <= cur_time))) {
 		pool->next_event_time = next_expiry;
@@ -43,6 +43,9 @@ static isc_result_t class_lookup (omapi_object_t **,
 static isc_result_t update_lease_flags(struct lease* lease,
 				       omapi_typed_data_t *value);
 
+static isc_result_t dhcp_server_control_get_value (omapi_data_string_t *,
+						   omapi_value_t **);
+
 omapi_object_type_t *dhcp_type_lease;
 omapi_object_type_t *dhcp_type_pool;
 omapi_object_type_t *dhcp_type_class;
@@ -58,6 +61,8 @@ void dhcp_db_objects_setup ()
 {
 	isc_result_t status;
 
+	dhcp_control_get_value_hook = dhcp_server_control_get_value;
+
 	status = omapi_object_type_register (&dhcp_type_lease,
 					     "lease",
 					     dhcp_lease_set_value,
@@ -197,6 +202,24 @@ void dhcp_db_objects_setup ()
 #endif /* FAILOVER_PROTOCOL */
 }
 
+/* Server values reachable through the control object. */
+static isc_result_t dhcp_server_control_get_value (omapi_data_string_t *name,
+						   omapi_value_t **value)
+{
+	isc_result_t status;
+
+	status = rate_limit_get_value (name, value);
+	if (status == ISC_R_NOTFOUND)
+		status = rx_queue_get_value (name, value);
+	if (status == ISC_R_NOTFOUND)
+		status = expr_memo_get_value (name, value);
+	if (status == ISC_R_NOTFOUND)
+		status = scope_template_get_value (name, value);
+	if (status == ISC_R_NOTFOUND)
+		status = spawned_class_get_value (name, value);
+	return status;
+}
+
 isc_result_t dhcp_lease_set_value  (omapi_object_t *h,
 				    omapi_object_t *id,
 				    omapi_data_string_t *name,
@@ -1095,6 +1118,7 @@ isc_result_t dhcp_host_set_value  (omapi_object_t *h,
 				return DHCP_R_BADPARSE;
 			}
 			end_parse (&parse);
+			discard_scope_templates ();
 		} else
 			return DHCP_R_INVALIDARG;
 		return ISC_R_SUCCESS;
@@ -1970,6 +1994,9 @@ isc_result_t dhcp_class_get_value (omapi_object_t *h, omapi_object_t *id,
 	if (!omapi_ds_strcmp (name, "name"))
 		return omapi_make_string_value (value, name, class -> name,
 						MDL);
+	if (!omapi_ds_strcmp (name, "match-count"))
+		return omapi_make_uint_value (value, name,
+					      class -> match_count, MDL);
 
 	/* Try to find some inner object that can provide the value. */
 	if (h -> inner && h -> inner -> type -> get_value) {
@@ -1988,6 +2015,7 @@ isc_result_t dhcp_class_destroy (omapi_object_t *h, const char *file, int line)
 		return DHCP_R_INVALIDARG;
 	struct class *class = (struct class *)h;
 
+	spawned_class_forget (class);
 	if (class -> nic)
 		class_dereference (&class -> nic, file, line);
 	if (class -> superclass)
@@ -2309,7 +2337,9 @@ isc_result_t dhcp_subclass_get_value (omapi_object_t *h, omapi_object_t *id,
 	if (subclass -> name != 0)
 		return DHCP_R_INVALIDARG;
 
-	/* XXXJAB No values to get yet. */
+	if (!omapi_ds_strcmp (name, "match-count"))
+		return omapi_make_uint_value (value, name,
+					      subclass -> match_count, MDL);
 
 	/* Try to find some inner object that can provide the value. */
 	if (h -> inner && h -> inner -> type -> get_value) {
@@ -2448,21 +2478,19 @@ isc_result_t binding_scope_set_value (struct binding_scope *scope, int createp,
 	}
 
 	if (!bp) {
-		bp = dmalloc (sizeof *bp, MDL);
+		bp = new_binding (nname, MDL);
 		if (!bp) {
 			binding_value_dereference (&nv, MDL);
 			dfree (nname, MDL);
 			return ISC_R_NOMEMORY;
 		}
-		memset (bp, 0, sizeof *bp);
-		bp -> name = nname;
 		bp -> next = scope -> bindings;
 		scope -> bindings = bp;
 	} else {
 		if (bp -> value)
 			binding_value_dereference (&bp -> value, MDL);
-		dfree (nname, MDL);
 	}
+	dfree (nname, MDL);
 	binding_value_reference (&bp -> value, nv, MDL);
 	binding_value_dereference (&nv, MDL);
 	return ISC_R_SUCCESS;
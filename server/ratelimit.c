@@ -0,0 +1,295 @@
+/* ratelimit.c
+
+   Per-client and per-relay limits on the rate at which requests are
+   processed */
+
+/*
+ * Copyright (c) 2018 by Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND ISC DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS.  IN NO EVENT SHALL ISC BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+ * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *   Internet Systems Consortium, Inc.
+ *   950 Charter Street
+ *   Redwood City, CA 94063
+ *   <info@isc.org>
+ *   https://www.isc.org/
+ *
+ */
+
+/*! \file server/ratelimit.c
+ *
+ * \page ratelimit rate limiting overview
+ *
+ * A broken client (or a broken modem in front of it) can send hundreds
+ * of DISCOVERs a second, and each of them is classified, matched against
+ * hosts and pools and answered.  To keep such clients from starving
+ * everybody else, each client (keyed by client identifier or hardware
+ * address, or by DUID for DHCPv6) and each relay agent (keyed by giaddr or
+ * by the source of a DHCPv6 RELAY-FORW) gets a token bucket, and packets
+ * that find the bucket empty are dropped before any real work is done.
+ *
+ * The buckets live in a fixed size, set associative table, so the memory
+ * used doesn't depend on the number of clients: a bucket is found by a
+ * hash of its key, and when a new key arrives and all the slots in its set
+ * are in use, the least recently used one is recycled.  Two keys may
+ * occasionally share a bucket, which can only make the limit stricter for
+ * them, never looser.
+ *
+ * Token counts are kept in thousandths of a packet so that the refill
+ * arithmetic can be done in integers with millisecond time stamps.
+ */
+
+#include "dhcpd.h"
+
+/* Configuration; a rate of zero disables that kind of limit. */
+u_int32_t client_rate_limit = 0;
+u_int32_t client_rate_burst = 0;
+u_int32_t relay_rate_limit = 0;
+u_int32_t relay_rate_burst = 0;
+
+/* Statistics, exported through the OMAPI control object. */
+struct rate_limit_stats rate_limit_stats;
+
+struct rate_bucket {
+	u_int32_t tag;		/* Hash of the key; zero if unused. */
+	u_int32_t stamp;	/* Milliseconds, last refill. */
+	u_int64_t tokens;	/* In thousandths of a packet; a burst of
+				   more than four million wouldn't fit in
+				   32 bits. */
+};
+
+static struct rate_bucket *rate_table = NULL;
+
+static u_int32_t
+rate_key_hash(int kind, const unsigned char *key, unsigned len)
+{
+	u_int32_t hash = 2166136261U;	/* FNV-1a */
+	unsigned i;
+
+	hash = (hash ^ (unsigned char)kind) * 16777619U;
+	for (i = 0; i < len; i++)
+		hash = (hash ^ key[i]) * 16777619U;
+
+	/* Zero marks an unused slot. */
+	return (hash != 0 ? hash : 1);
+}
+
+static u_int32_t
+rate_now(void)
+{
+	return ((u_int32_t)cur_tv.tv_sec * 1000 +
+		(u_int32_t)cur_tv.tv_usec / 1000);
+}
+
+/*!
+ * \brief Charge one packet against the bucket for a key
+ *
+ * \param kind  RATE_LIMIT_CLIENT or RATE_LIMIT_RELAY
+ * \param key   the bytes identifying the client or relay
+ * \param len   the length of key
+ *
+ * \return ISC_TRUE if the packet may be processed, ISC_FALSE if it
+ *         should be dropped
+ */
+isc_boolean_t
+rate_limit_permit(int kind, const unsigned char *key, unsigned len)
+{
+	struct rate_bucket *set, *bucket, *victim;
+	u_int32_t rate, burst, tag, now;
+	u_int64_t tokens;
+	int i;
+
+	if (kind == RATE_LIMIT_RELAY) {
+		rate = relay_rate_limit;
+		burst = relay_rate_burst;
+	} else {
+		rate = client_rate_limit;
+		burst = client_rate_burst;
+	}
+	if (rate == 0 || key == NULL || len == 0)
+		return (ISC_TRUE);
+	if (burst == 0)
+		burst = rate;
+
+	if (rate_table == NULL) {
+		rate_table = dmalloc(RATE_LIMIT_TABLE_SIZE *
+				     sizeof(*rate_table), MDL);
+		if (rate_table == NULL) {
+			log_error("No memory for rate limit table.");
+			return (ISC_TRUE);
+		}
+	}
+
+	tag = rate_key_hash(kind, key, len);
+	now = rate_now();
+	set = &rate_table[(tag % (RATE_LIMIT_TABLE_SIZE / RATE_LIMIT_WAYS)) *
+			  RATE_LIMIT_WAYS];
+
+	bucket = NULL;
+	victim = &set[0];
+	for (i = 0; i < RATE_LIMIT_WAYS; i++) {
+		if (set[i].tag == tag) {
+			bucket = &set[i];
+			break;
+		}
+		if (set[i].tag == 0 ||
+		    (victim->tag != 0 &&
+		     now - set[i].stamp > now - victim->stamp))
+			victim = &set[i];
+	}
+
+	if (bucket == NULL) {
+		/* A new key starts with a full bucket. */
+		if (victim->tag != 0)
+			rate_limit_stats.recycled++;
+		bucket = victim;
+		bucket->tag = tag;
+		bucket->tokens = (u_int64_t)burst * 1000;
+	} else {
+		tokens = bucket->tokens +
+			 (u_int64_t)(now - bucket->stamp) * rate;
+		if (tokens > (u_int64_t)burst * 1000)
+			tokens = (u_int64_t)burst * 1000;
+		bucket->tokens = tokens;
+	}
+	bucket->stamp = now;
+
+	if (bucket->tokens < 1000) {
+		if (kind == RATE_LIMIT_RELAY)
+			rate_limit_stats.relay_dropped++;
+		else
+			rate_limit_stats.client_dropped++;
+		return (ISC_FALSE);
+	}
+
+	bucket->tokens -= 1000;
+	rate_limit_stats.passed++;
+	return (ISC_TRUE);
+}
+
+/*!
+ * \brief Check a DHCPv4 packet against the client and relay limits
+ *
+ * The client is identified by its client identifier if it sent one and
+ * by its hardware address otherwise; the relay by giaddr.
+ *
+ * \return ISC_TRUE if the packet may be processed
+ */
+isc_boolean_t
+rate_limit_permit_packet(struct packet *packet)
+{
+	struct option_cache *oc;
+	unsigned char hwkey[2 + sizeof(packet->raw->chaddr)];
+	isc_boolean_t permit = ISC_TRUE;
+	unsigned hlen;
+
+	if (client_rate_limit == 0 && relay_rate_limit == 0)
+		return (ISC_TRUE);
+
+	if (relay_rate_limit != 0 && packet->raw->giaddr.s_addr != 0 &&
+	    !rate_limit_permit(RATE_LIMIT_RELAY,
+			       (unsigned char *)&packet->raw->giaddr,
+			       sizeof(packet->raw->giaddr)))
+		return (ISC_FALSE);
+
+	if (client_rate_limit == 0)
+		return (ISC_TRUE);
+
+	oc = lookup_option(&dhcp_universe, packet->options,
+			   DHO_DHCP_CLIENT_IDENTIFIER);
+	if (oc != NULL && oc->data.len > 0) {
+		permit = rate_limit_permit(RATE_LIMIT_CLIENT,
+					   oc->data.data, oc->data.len);
+	} else {
+		hlen = packet->raw->hlen;
+		if (hlen > sizeof(packet->raw->chaddr))
+			hlen = sizeof(packet->raw->chaddr);
+		hwkey[0] = packet->raw->htype;
+		hwkey[1] = hlen;
+		memcpy(&hwkey[2], packet->raw->chaddr, hlen);
+		permit = rate_limit_permit(RATE_LIMIT_CLIENT, hwkey, hlen + 2);
+	}
+
+	return (permit);
+}
+
+#if defined (DHCPv6)
+/*!
+ * \brief Check a DHCPv6 packet against the client and relay limits
+ *
+ * A RELAY-FORW that arrived on the wire is charged to the relay it came
+ * from; the messages encapsulated in it carry the same source address,
+ * so they are only charged to their client.  Clients are identified by
+ * their DUID; a message without one will be discarded anyway.
+ *
+ * \return ISC_TRUE if the packet may be processed
+ */
+isc_boolean_t
+rate_limit_permit_packet6(struct packet *packet)
+{
+	struct option_cache *oc;
+
+	switch (packet->dhcpv6_msg_type) {
+	      case DHCPV6_RELAY_FORW:
+		if (relay_rate_limit == 0 ||
+		    packet->dhcpv6_container_packet != NULL)
+			return (ISC_TRUE);
+		return (rate_limit_permit(RATE_LIMIT_RELAY,
+					  packet->client_addr.iabuf,
+					  packet->client_addr.len));
+
+	      case DHCPV6_SOLICIT:
+	      case DHCPV6_REQUEST:
+	      case DHCPV6_CONFIRM:
+	      case DHCPV6_RENEW:
+	      case DHCPV6_REBIND:
+	      case DHCPV6_RELEASE:
+	      case DHCPV6_DECLINE:
+	      case DHCPV6_INFORMATION_REQUEST:
+		if (client_rate_limit == 0)
+			return (ISC_TRUE);
+		oc = lookup_option(&dhcpv6_universe, packet->options,
+				   D6O_CLIENTID);
+		if (oc == NULL || oc->data.len == 0)
+			return (ISC_TRUE);
+		return (rate_limit_permit(RATE_LIMIT_CLIENT,
+					  oc->data.data, oc->data.len));
+
+	      default:
+		return (ISC_TRUE);
+	}
+}
+#endif /* DHCPv6 */
+
+/*!
+ * \brief Return a rate limit statistic by name, for OMAPI
+ */
+isc_result_t
+rate_limit_get_value(omapi_data_string_t *name, omapi_value_t **value)
+{
+	if (!omapi_ds_strcmp(name, "rate-limit-passed"))
+		return (omapi_make_uint_value(value, name,
+					      rate_limit_stats.passed, MDL));
+	if (!omapi_ds_strcmp(name, "rate-limit-client-dropped"))
+		return (omapi_make_uint_value(value, name,
+					      rate_limit_stats.client_dropped,
+					      MDL));
+	if (!omapi_ds_strcmp(name, "rate-limit-relay-dropped"))
+		return (omapi_make_uint_value(value, name,
+					      rate_limit_stats.relay_dropped,
+					      MDL));
+	if (!omapi_ds_strcmp(name, "rate-limit-recycled"))
+		return (omapi_make_uint_value(value, name,
+					      rate_limit_stats.recycled, MDL));
+	return (ISC_R_NOTFOUND);
+}
@@ -119,10 +119,10 @@ u_int32_t fto_allowed [] = {
 	 FTB_REPLY_OPTIONS | FTB_REJECT_REASON | FTB_MESSAGE), /* 4 BNDACK */
 	(FTB_RELATIONSHIP_NAME | FTB_MAX_UNACKED | FTB_RECEIVE_TIMER |
 	 FTB_VENDOR_CLASS | FTB_PROTOCOL_VERSION | FTB_TLS_REQUEST |
-	 FTB_MCLT | FTB_HBA), /* 5 CONNECT */
+	 FTB_MCLT | FTB_HBA | FTB_VENDOR_OPTIONS), /* 5 CONNECT */
 	(FTB_RELATIONSHIP_NAME | FTB_MAX_UNACKED | FTB_RECEIVE_TIMER |
 	 FTB_VENDOR_CLASS | FTB_PROTOCOL_VERSION | FTB_TLS_REPLY |
-	 FTB_REJECT_REASON | FTB_MESSAGE), /* CONNECTACK */
+	 FTB_REJECT_REASON | FTB_MESSAGE | FTB_VENDOR_OPTIONS), /* CONNECTACK */
 	0, /* 7 UPDREQALL */
 	0, /* 8 UPDDONE */
 	0, /* 9 UPDREQ */
@@ -292,6 +292,15 @@ static struct option server_options[] = {
 	{ "local-address6", "6",	&server_universe,  SV_LOCAL_ADDRESS6, 1 },
 	{ "bind-local-address6", "f",	&server_universe,  SV_BIND_LOCAL_ADDRESS6, 1 },
 	{ "ping-cltt-secs", "T",	&server_universe,  SV_PING_CLTT_SECS, 1 },
+	{ "strict-packet-filter", "f",	&server_universe,  SV_STRICT_PACKET_FILTER, 1 },
+	{ "client-rate-limit", "L",	&server_universe,  SV_CLIENT_RATE_LIMIT, 1 },
+	{ "client-rate-burst", "L",	&server_universe,  SV_CLIENT_RATE_BURST, 1 },
+	{ "relay-rate-limit", "L",	&server_universe,  SV_RELAY_RATE_LIMIT, 1 },
+	{ "relay-rate-burst", "L",	&server_universe,  SV_RELAY_RATE_BURST, 1 },
+	{ "receive-queue-length", "L",	&server_universe,  SV_RECEIVE_QUEUE_LENGTH, 1 },
+	{ "receive-queue-drop-policy", "Nreceive_queue_drop_policies.",	&server_universe,  SV_RECEIVE_QUEUE_DROP_POLICY, 1 },
+	{ "spawned-class-limit", "L",	&server_universe,  SV_SPAWNED_CLASS_LIMIT, 1 },
+	{ "failover-state-file-name", "t",	&server_universe,  SV_FAILOVER_STATE_FILE_NAME, 1 },
 	{ NULL, NULL, NULL, 0, 0 }
 };
 
@@ -380,6 +389,18 @@ struct enumeration prefix_length_modes = {
         prefix_length_modes_values
 };
 
+struct enumeration_value rx_queue_drop_policies_values[] = {
+	{ "newest", RXQ_DROP_NEWEST },
+	{ "lowest-priority", RXQ_DROP_LOWEST },
+	{ (char *)0, 0 }
+};
+
+struct enumeration rx_queue_drop_policies = {
+	(struct enumeration *)0,
+	"receive_queue_drop_policies", 1,
+	rx_queue_drop_policies_values
+};
+
 struct enumeration_value syslog_values [] = {
 #if defined (LOG_KERN)
 	{ "kern", LOG_KERN },
@@ -0,0 +1,2204 @@
+/*
+ * Copyright (C) 2018 by Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND ISC DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS.  IN NO EVENT SHALL ISC BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <config.h>
+
+#include "dhcpd.h"
+
+#include <atf-c.h>
+
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <signal.h>
+
+/*
+ * A failover simulation.  Two servers, a primary and a secondary, run in
+ * this one process, each with its own copy of the globals that make up a
+ * server: its configuration, its leases, its failover state, its timeouts
+ * and its lease file.  Switching from one server to the other is a matter
+ * of swapping those globals.
+ *
+ * The servers talk to each other the way they would over TCP, except that
+ * the socket of each one's connection is one end of a socketpair, and the
+ * other end belongs to the simulation.  What one server writes is read
+ * back by the simulation, kept on a simulated wire for as long as the link
+ * delay says, and then written to the other server's socket and read by
+ * its connection code.  The link can be cut, which both servers see as a
+ * reset connection, or partitioned, which silently loses everything until
+ * it heals so that the servers only find out through their own timeouts.
+ * A server can also be stopped and started again from its lease file.
+ *
+ * Time is simulated as well.  The timeouts the servers add are never run
+ * by the ISC timer code; the simulation runs them itself, in order, along
+ * with the wire deliveries and the clients' requests, moving cur_tv along
+ * as it goes.  Nothing depends on the real time, so a run with the same
+ * seed always does the same thing.
+ *
+ * Clients are simulated at the level of leases.  A client that wants an
+ * address asks both servers, and one that would answer it under the
+ * failover rules allocates a lease and commits it the way ack_lease()
+ * does.  The client renews with the server it got the lease from, rebinds
+ * with the other one if that fails, and now and then releases its lease.
+ *
+ * Each scenario reports how long the pair took to get back to normal
+ * operation with nothing left to send, how many BNDUPDs that took, and
+ * whether the two servers' leases agree with each other and with what
+ * the clients think they have.
+ */
+
+#if defined (FAILOVER_PROTOCOL)
+
+#define SIM_EPOCH	1500000000	/* Simulated time starts here. */
+#define SIM_FIRST	0x0a000100	/* 10.0.1.0 */
+#define SIM_LEASES	512		/* 10.0.1.0 - 10.0.2.255 */
+#define SIM_LEASE_TIME	600
+#define SIM_CLIENTS	300
+#define SIM_RETRY	4		/* Seconds between DISCOVERs. */
+#define SIM_MAX_EVENTS	5000000
+#define SIM_FRAME_HDR	3		/* Length and message type. */
+
+static const char sim_conf_fmt[] =
+	"failover peer \"sim\" {\n"
+	"	%s;\n"
+	"	address 10.0.0.%d;\n"
+	"	port 647;\n"
+	"	peer address 10.0.0.%d;\n"
+	"	peer port 647;\n"
+	"	max-response-delay 30;\n"
+	"	max-unacked-updates 10;\n"
+	"	load balance max seconds 3;\n"
+	"%s"
+	"}\n"
+	"\n"
+	"subnet 10.0.0.0 netmask 255.255.0.0 {\n"
+	"	pool {\n"
+	"		failover peer \"sim\";\n"
+	"		range 10.0.1.0 10.0.2.255;\n"
+	"	}\n"
+	"}\n";
+
+extern FILE *db_file;
+
+/* Bytes on their way from one server to the other. */
+struct sim_chunk {
+	struct sim_chunk *next;
+	struct timeval when;		/* When they reach the other end. */
+	int close;			/* The sender closed its connection. */
+	unsigned len;
+	unsigned char data [1];
+};
+
+struct sim_server {
+	const char *name;
+	char conf_path [32];
+	char lease_path [32];
+	char state_path [32];
+	int up;
+
+	/* This server's globals, while the other one's are installed. */
+	struct group *root_group;
+	struct shared_network *shared_networks;
+	struct subnet *subnets;
+	lease_id_hash_t *lease_uid_hash;
+	lease_ip_hash_t *lease_ip_addr_hash;
+	lease_id_hash_t *lease_hw_addr_hash;
+	host_hash_t *host_hw_addr_hash;
+	host_hash_t *host_uid_hash;
+	host_hash_t *host_name_hash;
+	dhcp_failover_state_t *failover_states;
+	struct timeout *timeouts;
+	FILE *db_file;
+
+	dhcp_failover_state_t *state;
+
+	/* Its connection to the other server, and our end of it. */
+	omapi_object_t *conn;
+	int fd;
+	int closed;			/* It has closed the connection... */
+	int close_held;			/* ...and a partition hides that. */
+
+	/* What it has sent that the other server hasn't yet read. */
+	struct sim_chunk *wire, *wire_tail;
+	u_int64_t bytes;
+	u_int64_t dropped;
+
+	/* Counters of the server's earlier runs. */
+	u_int32_t updates_sent;
+	u_int32_t acks_received;
+
+	int batch;			/* max-batched-updates, if set. */
+
+	/* The frames it has written on its current connection. */
+	unsigned char frame [24];	/* The start of the one being read. */
+	unsigned frame_have, frame_left;
+	u_int32_t frames, batches;
+	u_int32_t updreqs, upddones;	/* Over all connections. */
+	u_int32_t poolresps;
+	u_int32_t transferred;		/* What the POOLRESPs added up to. */
+
+	u_int32_t pool_steps;		/* Pool timers that left a step for
+					   later. */
+};
+
+struct sim_client {
+	unsigned char mac [6];
+	int bound;
+	int server;			/* The one it got its lease from. */
+	struct iaddr addr;
+	TIME ends;
+	TIME first_try;			/* For the secs field. */
+	struct timeval next;
+};
+
+struct sim {
+	struct sim_server server [2];
+	struct sim_server *current;	/* Whose globals are installed. */
+	int partitioned;
+	int state_files;		/* Failover states have their own
+					   files, not the lease files. */
+	u_int32_t delay, jitter;	/* One way, in microseconds. */
+	u_int32_t seed;
+	u_int32_t events;
+	u_int32_t connects;
+
+	struct sim_client clients [SIM_CLIENTS];
+	int load;			/* The clients are active. */
+	int release_pct;		/* Chance of a release at renewal. */
+
+	/* What the clients saw. */
+	u_int32_t acks, renews, rebinds, retries, releases, expiries;
+};
+
+/* A lease as one server sees it, for comparing the two. */
+struct sim_lease {
+	binding_state_t state;
+	unsigned hlen;
+	unsigned char hbuf [HARDWARE_ADDR_LEN + 1];
+};
+
+static u_int32_t
+sim_random(struct sim *sim, u_int32_t n)
+{
+	sim->seed = sim->seed * 1103515245 + 12345;
+	return ((sim->seed >> 8) % n);
+}
+
+static int
+tv_before(const struct timeval *a, const struct timeval *b)
+{
+	return (a->tv_sec < b->tv_sec ||
+		(a->tv_sec == b->tv_sec && a->tv_usec < b->tv_usec));
+}
+
+static void
+tv_add(struct timeval *tv, u_int32_t usec)
+{
+	tv->tv_usec += usec;
+	tv->tv_sec += tv->tv_usec / 1000000;
+	tv->tv_usec %= 1000000;
+}
+
+/* Install the globals of a server, saving those of the current one. */
+static void
+sim_switch(struct sim *sim, struct sim_server *s)
+{
+	struct sim_server *o = sim->current;
+
+	if (o == s)
+		return;
+	if (o != NULL) {
+		o->root_group = root_group;
+		o->shared_networks = shared_networks;
+		o->subnets = subnets;
+		o->lease_uid_hash = lease_uid_hash;
+		o->lease_ip_addr_hash = lease_ip_addr_hash;
+		o->lease_hw_addr_hash = lease_hw_addr_hash;
+		o->host_hw_addr_hash = host_hw_addr_hash;
+		o->host_uid_hash = host_uid_hash;
+		o->host_name_hash = host_name_hash;
+		o->failover_states = failover_states;
+		o->timeouts = timeouts;
+		o->db_file = db_file;
+	}
+	if (s != NULL) {
+		root_group = s->root_group;
+		shared_networks = s->shared_networks;
+		subnets = s->subnets;
+		lease_uid_hash = s->lease_uid_hash;
+		lease_ip_addr_hash = s->lease_ip_addr_hash;
+		lease_hw_addr_hash = s->lease_hw_addr_hash;
+		host_hw_addr_hash = s->host_hw_addr_hash;
+		host_uid_hash = s->host_uid_hash;
+		host_name_hash = s->host_name_hash;
+		failover_states = s->failover_states;
+		timeouts = s->timeouts;
+		db_file = s->db_file;
+		path_dhcpd_conf = s->conf_path;
+		path_dhcpd_db = s->lease_path;
+		path_dhcpd_failover_state =
+			sim->state_files ? s->state_path : NULL;
+	} else {
+		root_group = NULL;
+		shared_networks = NULL;
+		subnets = NULL;
+		lease_uid_hash = NULL;
+		lease_ip_addr_hash = NULL;
+		lease_hw_addr_hash = NULL;
+		host_hw_addr_hash = NULL;
+		host_uid_hash = NULL;
+		host_name_hash = NULL;
+		failover_states = NULL;
+		timeouts = NULL;
+		db_file = NULL;
+	}
+	sim->current = s;
+}
+
+static void
+sim_init(struct sim *sim, u_int32_t seed, u_int32_t delay, u_int32_t jitter)
+{
+	static const char *names [2] = { "primary", "secondary" };
+	FILE *f;
+	int i, j;
+
+	memset(sim, 0, sizeof *sim);
+	sim->seed = seed;
+	sim->delay = delay;
+	sim->jitter = jitter;
+	sim->release_pct = 10;
+
+	signal(SIGPIPE, SIG_IGN);
+	dhcp_context_create(DHCP_CONTEXT_PRE_DB | DHCP_CONTEXT_POST_DB,
+			    NULL, NULL);
+	if (omapi_init() != ISC_R_SUCCESS)
+		atf_tc_fail("can't initialize OMAPI");
+	dhcp_db_objects_setup();
+	dhcp_common_objects_setup();
+	initialize_common_option_spaces();
+	initialize_server_option_spaces();
+	dont_use_fsync = 1;
+	cur_tv.tv_sec = SIM_EPOCH;
+	cur_tv.tv_usec = 0;
+
+	for (i = 0; i < 2; i++) {
+		struct sim_server *s = &sim->server[i];
+
+		s->name = names[i];
+		s->fd = -1;
+		snprintf(s->conf_path, sizeof s->conf_path,
+			 "sim-%s.conf", s->name);
+		snprintf(s->lease_path, sizeof s->lease_path,
+			 "sim-%s.leases", s->name);
+		snprintf(s->state_path, sizeof s->state_path,
+			 "sim-%s.state", s->name);
+		if ((f = fopen(s->lease_path, "w")) == NULL)
+			atf_tc_fail("can't write %s: %s",
+				    s->lease_path, strerror(errno));
+		fclose(f);
+	}
+
+	for (i = 0; i < SIM_CLIENTS; i++) {
+		struct sim_client *cl = &sim->clients[i];
+
+		cl->mac[0] = 0x02;
+		for (j = 1; j < 4; j++)
+			cl->mac[j] = sim_random(sim, 256);
+		cl->mac[4] = i >> 8;
+		cl->mac[5] = i & 0xff;
+	}
+}
+
+/* Start the clients off, each at some point over the next ramp seconds. */
+static void
+sim_load(struct sim *sim, TIME ramp)
+{
+	int i;
+
+	for (i = 0; i < SIM_CLIENTS; i++) {
+		struct sim_client *cl = &sim->clients[i];
+
+		if (!cl->bound) {
+			cl->next.tv_sec = cur_time + sim_random(sim, ramp);
+			cl->next.tv_usec = sim_random(sim, 1000000);
+			cl->first_try = cl->next.tv_sec;
+		} else if (cl->next.tv_sec < cur_time)
+			cl->next = cur_tv;
+	}
+	sim->load = 1;
+}
+
+/* Add up the addresses a POOLRESP says were given to the peer. */
+static void
+sim_poolresp(struct sim_server *s)
+{
+	unsigned have, off, code, olen;
+
+	have = (s->frame_have < sizeof s->frame
+		? s->frame_have : sizeof s->frame);
+	s->poolresps++;
+	for (off = s->frame[3]; off + 4 <= have; off += 4 + olen) {
+		code = getUShort(&s->frame[off]);
+		olen = getUShort(&s->frame[off + 2]);
+		if (code == FTO_ADDRESSES_TRANSFERRED && olen == 4 &&
+		    off + 8 <= have) {
+			s->transferred += getULong(&s->frame[off + 4]);
+			return;
+		}
+	}
+	atf_tc_fail("%s sent a POOLRESP without a count", s->name);
+}
+
+/*
+ * Count the failover frames, and the batch frames, in what a server
+ * wrote, and add up what its POOLRESPs said.
+ */
+static void
+sim_frames(struct sim_server *s, const unsigned char *data, unsigned len)
+{
+	unsigned n;
+
+	while (len > 0) {
+		if (s->frame_have < SIM_FRAME_HDR) {
+			s->frame[s->frame_have++] = *data++;
+			len--;
+			if (s->frame_have < SIM_FRAME_HDR)
+				continue;
+			s->frame_left = getUShort(s->frame);
+			s->frame_left = (s->frame_left > SIM_FRAME_HDR
+					 ? s->frame_left - SIM_FRAME_HDR
+					 : 0);
+			s->frames++;
+			if (s->frame[2] == FTM_BATCH)
+				s->batches++;
+			else if (s->frame[2] == FTM_UPDREQ ||
+				 s->frame[2] == FTM_UPDREQALL)
+				s->updreqs++;
+			else if (s->frame[2] == FTM_UPDDONE)
+				s->upddones++;
+		} else {
+			n = len < s->frame_left ? len : s->frame_left;
+			if (s->frame_have < sizeof s->frame)
+				memcpy(&s->frame[s->frame_have], data,
+				       (n < sizeof s->frame - s->frame_have
+					? n : sizeof s->frame - s->frame_have));
+			s->frame_have += n;
+			s->frame_left -= n;
+			data += n;
+			len -= n;
+		}
+		if (s->frame_left == 0) {
+			if (s->frame[2] == FTM_POOLRESP)
+				sim_poolresp(s);
+			s->frame_have = 0;
+		}
+	}
+}
+
+/*
+ * Bytes a server wrote to its connection.  A partition loses them, and
+ * hides the news that the connection was closed until it heals.
+ */
+static void
+sim_send(struct sim *sim, int i, const unsigned char *data, unsigned len)
+{
+	struct sim_server *s = &sim->server[i];
+	struct sim_chunk *chunk;
+
+	sim_frames(s, data, len);
+	if (sim->partitioned) {
+		if (len == 0)
+			s->close_held = 1;
+		s->dropped += len;
+		return;
+	}
+
+	chunk = dmalloc(sizeof *chunk + len, MDL);
+	if (chunk == NULL)
+		atf_tc_fail("out of memory");
+	chunk->when = cur_tv;
+	tv_add(&chunk->when, sim->delay +
+	       (sim->jitter ? sim_random(sim, sim->jitter) : 0));
+	/* It's a stream; nothing overtakes what was sent before it. */
+	if (s->wire_tail && tv_before(&chunk->when, &s->wire_tail->when))
+		chunk->when = s->wire_tail->when;
+	chunk->close = (len == 0);
+	chunk->len = len;
+	memcpy(chunk->data, data, len);
+	if (s->wire_tail)
+		s->wire_tail->next = chunk;
+	else
+		s->wire = chunk;
+	s->wire_tail = chunk;
+	s->bytes += len;
+}
+
+static void
+sim_clear_wire(struct sim_server *s)
+{
+	struct sim_chunk *chunk;
+
+	while ((chunk = s->wire) != NULL) {
+		s->wire = chunk->next;
+		if (chunk->close)
+			s->close_held = 1;
+		s->dropped += chunk->len;
+		dfree(chunk, MDL);
+	}
+	s->wire_tail = NULL;
+}
+
+/* Pick up what a server has written, and notice if it has closed. */
+static unsigned
+sim_drain(struct sim *sim, int i)
+{
+	struct sim_server *s = &sim->server[i];
+	unsigned char buf [16384];
+	unsigned total = 0;
+	ssize_t n;
+
+	while (s->fd >= 0 && !s->closed) {
+		n = read(s->fd, buf, sizeof buf);
+		if (n > 0) {
+			sim_send(sim, i, buf, n);
+			total += n;
+		} else if (n == 0 || errno != EAGAIN) {
+			s->closed = 1;
+			sim_send(sim, i, NULL, 0);
+		} else
+			break;
+	}
+	return (total);
+}
+
+/* Once both ends are closed, the connection is gone. */
+static void
+sim_teardown(struct sim *sim)
+{
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		struct sim_server *s = &sim->server[i];
+
+		close(s->fd);
+		s->fd = -1;
+		s->closed = 0;
+		s->close_held = 0;
+		sim_clear_wire(s);
+		s->close_held = 0;
+		omapi_object_dereference(&s->conn, MDL);
+	}
+}
+
+/* Write out whatever the servers have queued on their connections. */
+static void
+sim_flush(struct sim *sim)
+{
+	omapi_connection_object_t *c;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		struct sim_server *s = &sim->server[i];
+
+		if (s->conn == NULL)
+			continue;
+		c = (omapi_connection_object_t *)s->conn;
+		for (;;) {
+			if (s->up && c->state != omapi_connection_closed &&
+			    c->out_bytes) {
+				sim_switch(sim, s);
+				omapi_connection_writer(s->conn);
+			}
+			if (!sim_drain(sim, i) || !s->up ||
+			    c->state == omapi_connection_closed ||
+			    !c->out_bytes)
+				break;
+		}
+		sim_drain(sim, i);
+	}
+
+	if (sim->server[0].conn && sim->server[0].closed &&
+	    sim->server[1].conn && sim->server[1].closed)
+		sim_teardown(sim);
+}
+
+/* Have a server's connection read what has arrived on its socket. */
+static void
+sim_read(struct sim *sim, struct sim_server *s)
+{
+	omapi_connection_object_t *c = (omapi_connection_object_t *)s->conn;
+	int avail, left;
+
+	sim_switch(sim, s);
+	while (c->state != omapi_connection_closed) {
+		if (ioctl(c->socket, FIONREAD, &avail) < 0 || avail == 0)
+			break;
+		omapi_connection_reader(s->conn);
+		if (c->state == omapi_connection_closed ||
+		    ioctl(c->socket, FIONREAD, &left) < 0 || left == avail)
+			break;
+	}
+}
+
+/* Deliver the first thing on a server's wire to the other server. */
+static void
+sim_deliver(struct sim *sim, int i)
+{
+	struct sim_server *s = &sim->server[i];
+	struct sim_server *peer = &sim->server[1 - i];
+	struct sim_chunk *chunk = s->wire;
+	omapi_connection_object_t *c;
+	unsigned off = 0;
+	ssize_t n;
+
+	s->wire = chunk->next;
+	if (s->wire == NULL)
+		s->wire_tail = NULL;
+
+	c = (omapi_connection_object_t *)peer->conn;
+	if (peer->up && c != NULL && c->state != omapi_connection_closed) {
+		if (chunk->close) {
+			sim_switch(sim, peer);
+			omapi_disconnect(peer->conn, 1);
+		}
+		while (off < chunk->len && !peer->closed &&
+		       c->state != omapi_connection_closed) {
+			n = write(peer->fd, chunk->data + off,
+				  chunk->len - off);
+			if (n < 0 && errno != EAGAIN)
+				break;
+			if (n > 0)
+				off += n;
+			sim_read(sim, peer);
+			if (n <= 0 && c->state != omapi_connection_closed &&
+			    ioctl(c->socket, FIONREAD, &n) == 0 && n > 0)
+				atf_tc_fail("%s is not reading its input",
+					    peer->name);
+		}
+	}
+	dfree(chunk, MDL);
+}
+
+static int
+sim_can_connect(struct sim *sim)
+{
+	return (sim->server[0].up && sim->server[1].up &&
+		!sim->partitioned &&
+		sim->server[0].conn == NULL && sim->server[1].conn == NULL);
+}
+
+/*
+ * Connect the two servers.  Each gets a link on a connection, as if it
+ * had connected or accepted a connection, and is told it's connected; the
+ * primary then sends its CONNECT.
+ */
+static void
+sim_connect(struct sim *sim)
+{
+	omapi_connection_object_t *c;
+	dhcp_failover_link_t *link;
+	int i, fds [2];
+
+	for (i = 0; i < 2; i++) {
+		struct sim_server *s = &sim->server[i];
+
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+			atf_tc_fail("socketpair: %s", strerror(errno));
+		fcntl(fds[0], F_SETFL, O_NONBLOCK);
+		fcntl(fds[1], F_SETFL, O_NONBLOCK);
+
+		sim_switch(sim, s);
+		c = NULL;
+		link = NULL;
+		if (omapi_connection_allocate(&c, MDL) != ISC_R_SUCCESS ||
+		    dhcp_failover_link_allocate(&link, MDL) != ISC_R_SUCCESS)
+			atf_tc_fail("can't allocate a connection");
+		c->socket = fds[0];
+		c->state = omapi_connection_connected;
+		option_cache_reference(&link->peer_address,
+				       s->state->partner.address, MDL);
+		link->peer_port = s->state->partner.port;
+		dhcp_failover_state_reference(&link->state_object,
+					      s->state, MDL);
+		omapi_object_reference(&link->outer, (omapi_object_t *)c, MDL);
+		omapi_object_reference(&c->inner, (omapi_object_t *)link, MDL);
+		omapi_object_reference(&s->conn, (omapi_object_t *)c, MDL);
+		dhcp_failover_link_dereference(&link, MDL);
+		omapi_connection_dereference(&c, MDL);
+		s->fd = fds[1];
+		s->closed = 0;
+		s->close_held = 0;
+		s->frame_have = 0;
+		s->frame_left = 0;
+	}
+	sim->connects++;
+
+	for (i = 0; i < 2; i++) {
+		sim_switch(sim, &sim->server[i]);
+		omapi_signal_in(sim->server[i].conn->inner, "connect");
+	}
+	sim_flush(sim);
+}
+
+/*
+ * What dhcp_failover_reconnect() does, with our connections instead of
+ * TCP: if there is no link to the peer, try to make one, and if that
+ * can't be done, try again in five seconds.
+ */
+static void
+sim_reconnect(struct sim *sim, struct sim_server *s)
+{
+	struct timeval tv;
+
+	if (s->state->link_to_peer)
+		return;
+	if (sim_can_connect(sim)) {
+		sim_connect(sim);
+		return;
+	}
+	sim_switch(sim, s);
+	tv.tv_sec = cur_time + 5;
+	tv.tv_usec = 0;
+	add_timeout(&tv, dhcp_failover_reconnect, s->state,
+		    (tvref_t)dhcp_failover_state_reference,
+		    (tvunref_t)dhcp_failover_state_dereference);
+}
+
+/* Start a server from its configuration and lease files. */
+static void
+sim_start(struct sim *sim, int i)
+{
+	struct sim_server *s = &sim->server[i];
+	char extra [80];
+	FILE *f;
+
+	snprintf(extra, sizeof extra, "%s",
+		 i == 0 ? "\tmclt 120;\n\tsplit 128;\n" : "");
+	if (s->batch)
+		snprintf(extra + strlen(extra), sizeof extra - strlen(extra),
+			 "\tmax-batched-updates %d;\n", s->batch);
+	if ((f = fopen(s->conf_path, "w")) == NULL)
+		atf_tc_fail("can't write %s: %s",
+			    s->conf_path, strerror(errno));
+	fprintf(f, sim_conf_fmt, s->name, i + 1, 2 - i, extra);
+	fclose(f);
+
+	sim_switch(sim, s);
+	if (!group_allocate(&root_group, MDL))
+		atf_tc_fail("can't allocate root group");
+	root_group->authoritative = 0;
+	if (readconf() != ISC_R_SUCCESS)
+		atf_tc_fail("%s: configuration errors", s->name);
+	if (failover_states == NULL)
+		atf_tc_fail("%s: no failover peer", s->name);
+	db_startup(0);
+
+	s->state = failover_states;
+	s->up = 1;
+	dhcp_failover_state_transition(s->state, "startup");
+	sim_reconnect(sim, s);
+}
+
+/*
+ * Stop a server as if its process had died: its socket closes, and all
+ * it leaves behind is its lease file.
+ */
+static void
+sim_stop(struct sim *sim, int i)
+{
+	struct sim_server *s = &sim->server[i];
+	omapi_connection_object_t *c;
+
+	if (s->conn != NULL) {
+		c = (omapi_connection_object_t *)s->conn;
+		if (c->state != omapi_connection_closed) {
+			close(c->socket);
+			c->state = omapi_connection_closed;
+		}
+	}
+	s->updates_sent += s->state->updates_sent;
+	s->acks_received += s->state->acks_received;
+
+	if (sim->current == s)
+		sim_switch(sim, NULL);
+	fclose(s->db_file);
+
+	/* Whatever the server had in memory is just left behind. */
+	s->root_group = NULL;
+	s->shared_networks = NULL;
+	s->subnets = NULL;
+	s->lease_uid_hash = NULL;
+	s->lease_ip_addr_hash = NULL;
+	s->lease_hw_addr_hash = NULL;
+	s->host_hw_addr_hash = NULL;
+	s->host_uid_hash = NULL;
+	s->host_name_hash = NULL;
+	s->failover_states = NULL;
+	s->timeouts = NULL;
+	s->db_file = NULL;
+	s->state = NULL;
+	s->up = 0;
+	sim_flush(sim);
+}
+
+/* Cut the link: both servers see their connection reset. */
+static void
+sim_cut(struct sim *sim)
+{
+	omapi_connection_object_t *c;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		struct sim_server *s = &sim->server[i];
+
+		c = (omapi_connection_object_t *)s->conn;
+		if (s->up && c != NULL && c->state != omapi_connection_closed) {
+			sim_switch(sim, s);
+			omapi_disconnect(s->conn, 1);
+		}
+	}
+	sim_flush(sim);
+}
+
+/* Partition the link, or heal it. */
+static void
+sim_partition(struct sim *sim, int on)
+{
+	int i;
+
+	sim->partitioned = on;
+	for (i = 0; i < 2; i++) {
+		struct sim_server *s = &sim->server[i];
+
+		if (on)
+			sim_clear_wire(s);
+		else if (s->close_held) {
+			s->close_held = 0;
+			sim_send(sim, i, NULL, 0);
+		}
+	}
+}
+
+static struct timeout *
+sim_first_timeout(struct sim *sim, struct sim_server **sp)
+{
+	struct timeout *t, *first = NULL;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		struct sim_server *s = &sim->server[i];
+
+		if (!s->up)
+			continue;
+		for (t = sim->current == s ? timeouts : s->timeouts;
+		     t != NULL; t = t->next) {
+			if (first == NULL || tv_before(&t->when, &first->when)) {
+				first = t;
+				*sp = s;
+			}
+		}
+	}
+	return (first);
+}
+
+/*
+ * Run a timeout the way the dispatcher would, except for the ones that
+ * would make real connections.
+ */
+static void
+sim_fire(struct sim *sim, struct sim_server *s, struct timeout *t)
+{
+	void (*func)(void *) = t->func;
+	tvunref_t unref = t->unref;
+	void *what = NULL;
+
+	sim_switch(sim, s);
+	if (t->ref)
+		(*t->ref)(&what, t->what, MDL);
+	else
+		what = t->what;
+	cancel_timeout(func, t->what);
+
+	if (func == dhcp_failover_reconnect)
+		sim_reconnect(sim, s);
+	else if (func != dhcp_failover_listener_restart)
+		(*func)(what);
+
+	/* A pool timer comes straight back when it had more to do. */
+	if (func == pool_timer) {
+		for (t = timeouts; t; t = t->next) {
+			if (t->func == pool_timer && t->what == what &&
+			    !tv_before(&cur_tv, &t->when)) {
+				s->pool_steps++;
+				break;
+			}
+		}
+	}
+
+	if (unref)
+		(*unref)(&what, MDL);
+}
+
+static void
+sim_packet(struct packet *packet, struct dhcp_packet *raw,
+	   struct sim_client *cl, u_int16_t secs)
+{
+	memset(packet, 0, sizeof *packet);
+	memset(raw, 0, sizeof *raw);
+	raw->op = BOOTREQUEST;
+	raw->htype = HTYPE_ETHER;
+	raw->hlen = sizeof cl->mac;
+	raw->secs = htons(secs);
+	memcpy(raw->chaddr, cl->mac, sizeof cl->mac);
+	packet->raw = raw;
+}
+
+static int
+sim_same_client(struct lease *lease, struct sim_client *cl)
+{
+	return (lease->hardware_addr.hlen == 1 + sizeof cl->mac &&
+		lease->hardware_addr.hbuf[0] == HTYPE_ETHER &&
+		!memcmp(&lease->hardware_addr.hbuf[1], cl->mac,
+			sizeof cl->mac));
+}
+
+/* Whether a server is in a state to answer clients at all. */
+static int
+sim_serving(struct sim_server *s)
+{
+	return (s->up &&
+		s->state->service_state != not_responding &&
+		s->state->service_state != service_startup);
+}
+
+/* Commit a lease to a client the way ack_lease() does for a DHCPACK. */
+static void
+sim_ack(struct sim *sim, int i, struct sim_client *cl, struct lease *lease)
+{
+	dhcp_failover_state_t *peer = lease->pool->failover_peer;
+	TIME lease_time = SIM_LEASE_TIME, new_lease_time;
+	struct lease *lt = NULL;
+
+	if (lease_allocate(&lt, MDL) != ISC_R_SUCCESS)
+		atf_tc_fail("can't allocate a lease");
+	lt->ip_addr = lease->ip_addr;
+	lt->starts = cur_time;
+	lt->cltt = cur_time;
+
+	/* No more than the MCLT beyond what the peer has acked. */
+	lt->tsfp = lease->tsfp;
+	lt->atsfp = lease->atsfp;
+	new_lease_time = lease_time;
+	if (lease_time > peer->mclt) {
+		if (lt->tsfp <= cur_time)
+			new_lease_time = peer->mclt;
+		else if (cur_time + lease_time > lt->tsfp + peer->mclt)
+			new_lease_time = (lt->tsfp - cur_time) + peer->mclt;
+	}
+	lt->tstp = cur_time + lease_time + new_lease_time / 2;
+	if (lt->tstp < lt->tsfp)
+		lt->tsfp = lt->tstp;
+	lt->ends = cur_time + new_lease_time;
+	lt->next_binding_state = FTS_ACTIVE;
+
+	lt->hardware_addr.hlen = 1 + sizeof cl->mac;
+	lt->hardware_addr.hbuf[0] = HTYPE_ETHER;
+	memcpy(&lt->hardware_addr.hbuf[1], cl->mac, sizeof cl->mac);
+	lt->flags |= lease->flags & ~PERSISTENT_FLAGS;
+
+	if (!supersede_lease(lease, lt, 1, 1, 1, 0))
+		atf_tc_fail("%s: can't commit %s",
+			    sim->server[i].name, piaddr(lease->ip_addr));
+	lease_dereference(&lt, MDL);
+
+	cl->bound = 1;
+	cl->server = i;
+	cl->addr = lease->ip_addr;
+	cl->ends = lease->ends;
+	sim->acks++;
+}
+
+/*
+ * Find the lease a server would offer a DISCOVER from a client, or
+ * nothing if it wouldn't answer; this follows dhcpdiscover().
+ */
+static struct lease *
+sim_offer(struct sim *sim, int i, struct sim_client *cl, u_int16_t secs)
+{
+	struct sim_server *s = &sim->server[i];
+	struct lease *lease = NULL, *hl = NULL, *l;
+	struct pool *pool;
+	struct packet packet;
+	struct dhcp_packet raw;
+	unsigned char hw [1 + sizeof cl->mac];
+	int peer_has_leases = 0;
+
+	if (!sim_serving(s))
+		return (NULL);
+	sim_switch(sim, s);
+	sim_packet(&packet, &raw, cl, secs);
+	pool = shared_networks->pools;
+
+	hw[0] = HTYPE_ETHER;
+	memcpy(&hw[1], cl->mac, sizeof cl->mac);
+	if (find_lease_by_hw_addr(&hl, hw, sizeof hw, MDL)) {
+		for (l = hl; l != NULL; l = l->n_hw) {
+			if (l->binding_state == FTS_ACTIVE ||
+			    lease_mine_to_reallocate(l)) {
+				lease_reference(&lease, l, MDL);
+				break;
+			}
+		}
+		lease_dereference(&hl, MDL);
+	}
+	if ((s->state->i_am == primary && pool->backup_leases) ||
+	    (s->state->i_am == secondary && pool->free_leases))
+		peer_has_leases = 1;
+	if (lease == NULL &&
+	    !allocate_lease(&lease, &packet, pool, &peer_has_leases))
+		return (NULL);
+
+	if (s->state->service_state == cooperating &&
+	    !load_balance_mine(&packet, s->state) && peer_has_leases) {
+		lease_dereference(&lease, MDL);
+		return (NULL);
+	}
+	return (lease);
+}
+
+/* Ask both servers, in no particular order, for a lease. */
+static int
+sim_discover(struct sim *sim, struct sim_client *cl)
+{
+	struct lease *lease;
+	int first, k, i;
+
+	first = sim_random(sim, 2);
+	for (k = 0; k < 2; k++) {
+		i = first ^ k;
+		lease = sim_offer(sim, i, cl, cur_time - cl->first_try);
+		if (lease != NULL) {
+			sim_ack(sim, i, cl, lease);
+			lease_dereference(&lease, MDL);
+			return (1);
+		}
+	}
+	return (0);
+}
+
+/* Renew, or rebind, a client's lease with one server. */
+static int
+sim_renew(struct sim *sim, int i, struct sim_client *cl)
+{
+	struct sim_server *s = &sim->server[i];
+	struct lease *lease = NULL;
+	int ok;
+
+	if (!sim_serving(s))
+		return (0);
+	sim_switch(sim, s);
+	if (!find_lease_by_ip_addr(&lease, cl->addr, MDL))
+		return (0);
+	ok = lease->binding_state == FTS_ACTIVE &&
+	     sim_same_client(lease, cl);
+	if (ok)
+		sim_ack(sim, i, cl, lease);
+	lease_dereference(&lease, MDL);
+	return (ok);
+}
+
+static void
+sim_release(struct sim *sim, struct sim_client *cl)
+{
+	struct sim_server *s = &sim->server[cl->server];
+	struct lease *lease = NULL;
+	struct packet packet;
+	struct dhcp_packet raw;
+
+	cl->bound = 0;
+	sim->releases++;
+	if (!sim_serving(s))
+		return;
+	sim_switch(sim, s);
+	if (find_lease_by_ip_addr(&lease, cl->addr, MDL)) {
+		if (lease->binding_state == FTS_ACTIVE &&
+		    sim_same_client(lease, cl)) {
+			sim_packet(&packet, &raw, cl, 0);
+			release_lease(lease, &packet);
+		}
+		lease_dereference(&lease, MDL);
+	}
+}
+
+static void
+sim_client(struct sim *sim, struct sim_client *cl)
+{
+	if (cl->bound && cur_time >= cl->ends) {
+		cl->bound = 0;
+		cl->first_try = cur_time;
+		sim->expiries++;
+	}
+
+	if (cl->bound) {
+		if (sim_random(sim, 100) < sim->release_pct) {
+			sim_release(sim, cl);
+			cl->next = cur_tv;
+			cl->next.tv_sec += 60 + sim_random(sim, 600);
+			cl->first_try = cl->next.tv_sec;
+			return;
+		}
+		if (sim_renew(sim, cl->server, cl))
+			sim->renews++;
+		else if (sim_renew(sim, 1 - cl->server, cl))
+			sim->rebinds++;
+		else {
+			cl->bound = 0;
+			cl->first_try = cur_time;
+		}
+	}
+
+	if (!cl->bound && !sim_discover(sim, cl)) {
+		sim->retries++;
+		cl->next = cur_tv;
+		cl->next.tv_sec += SIM_RETRY;
+		return;
+	}
+	cl->next = cur_tv;
+	cl->next.tv_sec += (cl->ends - cur_time) / 2;
+}
+
+/* Both servers in normal state, with nothing left to send. */
+static int
+sim_quiet(struct sim *sim)
+{
+	omapi_connection_object_t *c;
+	dhcp_failover_state_t *state;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		struct sim_server *s = &sim->server[i];
+
+		if (!s->up || s->conn == NULL || s->closed || s->wire)
+			return (0);
+		c = (omapi_connection_object_t *)s->conn;
+		if (c->out_bytes || c->in_bytes)
+			return (0);
+		state = s->state;
+		if (state->me.state != normal ||
+		    state->partner.state != normal ||
+		    state->link_to_peer == NULL ||
+		    state->update_queue_head || state->ack_queue_head ||
+		    state->toack_queue_head || state->balance_active ||
+		    state->recovery_active)
+			return (0);
+	}
+	return (1);
+}
+
+/*
+ * Run the simulation until the given time or, if until_quiet is set,
+ * until the servers are quiet; returns whether they are.
+ */
+static int
+sim_run(struct sim *sim, TIME until, int until_quiet)
+{
+	struct sim_server *ts = NULL;
+	struct sim_client *cl = NULL;
+	struct timeout *t;
+	struct timeval when, end;
+	enum { none, wire, timer, client } kind;
+	int i, which = 0;
+
+	end.tv_sec = until;
+	end.tv_usec = 0;
+	for (;;) {
+		if (until_quiet && sim_quiet(sim))
+			return (1);
+
+		kind = none;
+		when = end;
+		for (i = 0; i < 2; i++) {
+			if (sim->server[i].wire &&
+			    !tv_before(&when, &sim->server[i].wire->when)) {
+				kind = wire;
+				which = i;
+				when = sim->server[i].wire->when;
+			}
+		}
+		t = sim_first_timeout(sim, &ts);
+		if (t && tv_before(&t->when, &when)) {
+			kind = timer;
+			when = t->when;
+		}
+		for (i = 0; sim->load && i < SIM_CLIENTS; i++) {
+			if (tv_before(&sim->clients[i].next, &when)) {
+				kind = client;
+				cl = &sim->clients[i];
+				when = cl->next;
+			}
+		}
+		if (kind == none)
+			break;
+
+		if (tv_before(&cur_tv, &when))
+			cur_tv = when;
+		switch (kind) {
+		      case wire:
+			sim_deliver(sim, which);
+			break;
+		      case timer:
+			sim_fire(sim, ts, t);
+			break;
+		      case client:
+			sim_client(sim, cl);
+			break;
+		      default:
+			break;
+		}
+		sim_flush(sim);
+
+		if (++sim->events > SIM_MAX_EVENTS)
+			atf_tc_fail("the simulation isn't getting anywhere");
+	}
+
+	if (tv_before(&cur_tv, &end))
+		cur_tv = end;
+	return (until_quiet ? sim_quiet(sim) : 0);
+}
+
+/* Run until quiet, failing if that takes more than limit seconds. */
+static TIME
+sim_settle(struct sim *sim, TIME limit, const char *what)
+{
+	TIME start = cur_time;
+
+	if (!sim_run(sim, start + limit, 1))
+		atf_tc_fail("not back to normal %lds after %s",
+			    (long)limit, what);
+	return (cur_time - start);
+}
+
+static void
+sim_snapshot(struct sim *sim, int i, struct sim_lease *out)
+{
+	struct lease *lease;
+	struct iaddr addr;
+	u_int32_t a;
+	int n;
+
+	sim_switch(sim, &sim->server[i]);
+	memset(out, 0, SIM_LEASES * sizeof *out);
+	addr.len = 4;
+	for (n = 0; n < SIM_LEASES; n++) {
+		a = htonl(SIM_FIRST + n);
+		memcpy(addr.iabuf, &a, 4);
+		lease = NULL;
+		if (!find_lease_by_ip_addr(&lease, addr, MDL))
+			atf_tc_fail("%s has no lease for %s",
+				    sim->server[i].name, piaddr(addr));
+		out[n].state = lease->binding_state;
+		out[n].hlen = lease->hardware_addr.hlen;
+		memcpy(out[n].hbuf, lease->hardware_addr.hbuf,
+		       lease->hardware_addr.hlen);
+		lease_dereference(&lease, MDL);
+	}
+}
+
+/*
+ * Count the leases the two servers disagree about, the addresses held by
+ * more than one client, and the clients whose lease either server doesn't
+ * know about.
+ */
+static void
+sim_check(struct sim *sim, u_int32_t *differ, u_int32_t *twice,
+	  u_int32_t *unknown)
+{
+	static struct sim_lease view [2][SIM_LEASES];
+	static int holder [SIM_LEASES];
+	struct sim_client *cl;
+	u_int32_t a;
+	int i, n;
+
+	*differ = *twice = *unknown = 0;
+	sim_snapshot(sim, 0, view[0]);
+	sim_snapshot(sim, 1, view[1]);
+	for (n = 0; n < SIM_LEASES; n++) {
+		if (view[0][n].state != view[1][n].state ||
+		    (view[0][n].state == FTS_ACTIVE &&
+		     (view[0][n].hlen != view[1][n].hlen ||
+		      memcmp(view[0][n].hbuf, view[1][n].hbuf,
+			     view[0][n].hlen))))
+			(*differ)++;
+		holder[n] = -1;
+	}
+
+	for (i = 0; i < SIM_CLIENTS; i++) {
+		cl = &sim->clients[i];
+		if (!cl->bound || cl->ends <= cur_time)
+			continue;
+		memcpy(&a, cl->addr.iabuf, 4);
+		n = ntohl(a) - SIM_FIRST;
+		if (holder[n] >= 0)
+			(*twice)++;
+		holder[n] = i;
+		if (view[0][n].state != FTS_ACTIVE ||
+		    view[1][n].state != FTS_ACTIVE ||
+		    view[0][n].hlen != 1 + sizeof cl->mac ||
+		    memcmp(&view[0][n].hbuf[1], cl->mac, sizeof cl->mac) ||
+		    view[1][n].hlen != 1 + sizeof cl->mac ||
+		    memcmp(&view[1][n].hbuf[1], cl->mac, sizeof cl->mac))
+			(*unknown)++;
+	}
+}
+
+/* Report on a run, and fail if the servers' leases have come apart. */
+static void
+sim_report(struct sim *sim, const char *name, TIME converged)
+{
+	u_int32_t differ, twice, unknown, updates, acks;
+	int i;
+
+	sim_check(sim, &differ, &twice, &unknown);
+	updates = acks = 0;
+	for (i = 0; i < 2; i++) {
+		updates += sim->server[i].updates_sent;
+		acks += sim->server[i].acks_received;
+		if (sim->server[i].up) {
+			updates += sim->server[i].state->updates_sent;
+			acks += sim->server[i].state->acks_received;
+		}
+	}
+
+	printf("%s: back to normal in %lds; %u BNDUPD, %u BNDACK, "
+	       "%llu bytes sent, %llu lost, %u connections; "
+	       "%u acks, %u renewals, %u rebinds, %u retries, "
+	       "%u releases, %u expired; "
+	       "%u leases differ, %u addresses held twice, "
+	       "%u clients unknown\n",
+	       name, (long)converged, updates, acks,
+	       (unsigned long long)(sim->server[0].bytes +
+				    sim->server[1].bytes),
+	       (unsigned long long)(sim->server[0].dropped +
+				    sim->server[1].dropped),
+	       sim->connects, sim->acks, sim->renews, sim->rebinds,
+	       sim->retries, sim->releases, sim->expiries,
+	       differ, twice, unknown);
+
+	if (differ)
+		atf_tc_fail("%s: %u leases differ", name, differ);
+	if (twice)
+		atf_tc_fail("%s: %u addresses held twice", name, twice);
+	if (unknown)
+		atf_tc_fail("%s: %u clients unknown", name, unknown);
+}
+
+/* Look up a failover-state attribute of a server as OMAPI would. */
+static void
+sim_stat(struct sim *sim, int i, const char *name, unsigned long *num,
+	 char *str, unsigned len)
+{
+	omapi_data_string_t *ds = NULL;
+	omapi_value_t *value = NULL;
+	omapi_typed_data_t *t;
+
+	sim_switch(sim, &sim->server[i]);
+	if (omapi_data_string_new(&ds, strlen(name), MDL) != ISC_R_SUCCESS)
+		atf_tc_fail("out of memory");
+	memcpy(ds->value, name, strlen(name));
+	if (dhcp_failover_state_get_value((omapi_object_t *)
+					  sim->server[i].state, NULL, ds,
+					  &value) != ISC_R_SUCCESS ||
+	    value->value == NULL)
+		atf_tc_fail("%s has no %s", sim->server[i].name, name);
+	t = value->value;
+	if (num != NULL && omapi_get_int_value(num, t) != ISC_R_SUCCESS)
+		atf_tc_fail("%s of %s is not a number", name,
+			    sim->server[i].name);
+	if (str != NULL) {
+		if (t->type != omapi_datatype_string ||
+		    t->u.buffer.len >= len)
+			atf_tc_fail("%s of %s is not a string", name,
+				    sim->server[i].name);
+		memcpy(str, t->u.buffer.value, t->u.buffer.len);
+		str[t->u.buffer.len] = 0;
+	}
+	omapi_value_dereference(&value, MDL);
+	omapi_data_string_dereference(&ds, MDL);
+}
+
+/* Start both servers afresh and wait for them to settle. */
+static TIME
+sim_bringup(struct sim *sim)
+{
+	sim_start(sim, 0);
+	sim_start(sim, 1);
+	return (sim_settle(sim, 3600, "startup"));
+}
+
+/* Stop the clients and let the servers catch up with them. */
+static TIME
+sim_finish(struct sim *sim, const char *what)
+{
+	sim->load = 0;
+	return (sim_settle(sim, 600, what));
+}
+#endif /* FAILOVER_PROTOCOL */
+
+ATF_TC(failover_sim_startup);
+
+ATF_TC_HEAD(failover_sim_startup, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Start a failover pair from nothing "
+			  "and check that it balances its pool.");
+}
+
+ATF_TC_BODY(failover_sim_startup, tc)
+{
+#if defined (FAILOVER_PROTOCOL)
+	static struct sim sim;
+	static struct sim_lease view [SIM_LEASES];
+	TIME converged;
+	int n, free_leases = 0, backup_leases = 0;
+
+	sim_init(&sim, 1, 0, 0);
+	converged = sim_bringup(&sim);
+
+	sim_snapshot(&sim, 0, view);
+	for (n = 0; n < SIM_LEASES; n++) {
+		if (view[n].state == FTS_FREE)
+			free_leases++;
+		else if (view[n].state == FTS_BACKUP)
+			backup_leases++;
+	}
+	if (free_leases + backup_leases != SIM_LEASES ||
+	    backup_leases < SIM_LEASES / 4 || free_leases < SIM_LEASES / 4)
+		atf_tc_fail("pool not balanced: %d free, %d backup",
+			    free_leases, backup_leases);
+
+	sim_report(&sim, "startup", converged);
+#else
+	atf_tc_skip("failover is disabled");
+#endif
+}
+
+ATF_TC(failover_sim_load);
+
+ATF_TC_HEAD(failover_sim_load, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Run clients against a failover "
+			  "pair and check that the servers agree.");
+}
+
+ATF_TC_BODY(failover_sim_load, tc)
+{
+#if defined (FAILOVER_PROTOCOL)
+	static struct sim sim;
+	TIME start;
+
+	sim_init(&sim, 2, 0, 0);
+	sim_bringup(&sim);
+
+	start = cur_time;
+	sim_load(&sim, 300);
+	sim_run(&sim, start + 3600, 0);
+	if (sim.acks < SIM_CLIENTS)
+		atf_tc_fail("only %u acks", sim.acks);
+
+	sim_report(&sim, "load", sim_finish(&sim, "load"));
+#else
+	atf_tc_skip("failover is disabled");
+#endif
+}
+
+ATF_TC(failover_sim_delay);
+
+ATF_TC_HEAD(failover_sim_delay, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Run clients against a failover "
+			  "pair over a slow link.");
+}
+
+ATF_TC_BODY(failover_sim_delay, tc)
+{
+#if defined (FAILOVER_PROTOCOL)
+	static struct sim sim;
+	TIME start;
+
+	/* 50ms each way, give or take 20ms. */
+	sim_init(&sim, 3, 40000, 20000);
+	sim_bringup(&sim);
+
+	start = cur_time;
+	sim_load(&sim, 300);
+	sim_run(&sim, start + 3600, 0);
+
+	sim_report(&sim, "delay", sim_finish(&sim, "delay"));
+#else
+	atf_tc_skip("failover is disabled");
+#endif
+}
+
+ATF_TC(failover_sim_cut);
+
+ATF_TC_HEAD(failover_sim_cut, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Reset the connection between two "
+			  "failover peers under load.");
+}
+
+ATF_TC_BODY(failover_sim_cut, tc)
+{
+#if defined (FAILOVER_PROTOCOL)
+	static struct sim sim;
+	TIME start, recovered, worst = 0;
+	int i;
+
+	sim_init(&sim, 4, 1000, 500);
+	sim_bringup(&sim);
+
+	start = cur_time;
+	sim_load(&sim, 300);
+	for (i = 1; i <= 3; i++) {
+		sim_run(&sim, start + i * 900, 0);
+		sim_cut(&sim);
+		recovered = sim_settle(&sim, 600, "a cut");
+		if (recovered > worst)
+			worst = recovered;
+	}
+	sim_run(&sim, start + 3600, 0);
+	sim_finish(&sim, "cut");
+
+	sim_report(&sim, "cut", worst);
+#else
+	atf_tc_skip("failover is disabled");
+#endif
+}
+
+ATF_TC(failover_sim_partition);
+
+ATF_TC_HEAD(failover_sim_partition, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Partition two failover peers under "
+			  "load, then heal the partition.");
+}
+
+ATF_TC_BODY(failover_sim_partition, tc)
+{
+#if defined (FAILOVER_PROTOCOL)
+	static struct sim sim;
+	TIME start, recovered;
+
+	sim_init(&sim, 5, 1000, 500);
+	sim_bringup(&sim);
+
+	start = cur_time;
+	sim_load(&sim, 300);
+	sim_run(&sim, start + 900, 0);
+
+	/* Long enough for both to notice and go it alone. */
+	sim_partition(&sim, 1);
+	sim_run(&sim, start + 1500, 0);
+	if (sim.server[0].state->me.state != communications_interrupted ||
+	    sim.server[1].state->me.state != communications_interrupted)
+		atf_tc_fail("partition not noticed");
+
+	sim_partition(&sim, 0);
+	recovered = sim_settle(&sim, 900, "the partition healed");
+	sim_run(&sim, start + 3600, 0);
+	sim_finish(&sim, "partition");
+
+	sim_report(&sim, "partition", recovered);
+#else
+	atf_tc_skip("failover is disabled");
+#endif
+}
+
+ATF_TC(failover_sim_restart);
+
+ATF_TC_HEAD(failover_sim_restart, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Restart each of two failover peers "
+			  "under load.");
+}
+
+ATF_TC_BODY(failover_sim_restart, tc)
+{
+#if defined (FAILOVER_PROTOCOL)
+	static struct sim sim;
+	TIME start, recovered, worst = 0;
+	int i;
+
+	sim_init(&sim, 6, 1000, 500);
+	sim_bringup(&sim);
+
+	start = cur_time;
+	sim_load(&sim, 300);
+	for (i = 0; i < 2; i++) {
+		sim_run(&sim, start + 900 + i * 1200, 0);
+		sim_stop(&sim, 1 - i);
+		sim_run(&sim, cur_time + 120, 0);
+		sim_start(&sim, 1 - i);
+		recovered = sim_settle(&sim, 900, "a restart");
+		if (recovered > worst)
+			worst = recovered;
+	}
+	sim_run(&sim, start + 3600, 0);
+	sim_finish(&sim, "restart");
+
+	sim_report(&sim, "restart", worst);
+#else
+	atf_tc_skip("failover is disabled");
+#endif
+}
+
+ATF_TC(failover_sim_recovery_cut);
+
+ATF_TC_HEAD(failover_sim_recovery_cut, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Reset the connection while a "
+			  "failover peer is answering an UPDREQALL.");
+}
+
+ATF_TC_BODY(failover_sim_recovery_cut, tc)
+{
+#if defined (FAILOVER_PROTOCOL)
+	static struct sim sim;
+	dhcp_failover_state_t *state;
+	TIME start, recovered;
+	u_int32_t reqs, dones;
+	FILE *f;
+
+	/* 50ms each way, so that answering takes a few round trips. */
+	sim_init(&sim, 11, 50000, 0);
+	sim_bringup(&sim);
+	start = cur_time;
+	sim_load(&sim, 300);
+	sim_run(&sim, start + 600, 0);
+
+	/* The secondary loses its lease file, so it comes back asking for
+	   every lease. */
+	sim_stop(&sim, 1);
+	if ((f = fopen(sim.server[1].lease_path, "w")) == NULL)
+		atf_tc_fail("can't write %s: %s",
+			    sim.server[1].lease_path, strerror(errno));
+	fclose(f);
+	sim_start(&sim, 1);
+
+	state = sim.server[0].state;
+	while (!state->recovery_active || !state->recovery_reply) {
+		if (cur_time > start + 900)
+			atf_tc_fail("primary never answered an UPDREQALL");
+		sim_run(&sim, cur_time + 1, 0);
+	}
+	if (state->recovery_examined >= state->recovery_total)
+		atf_tc_fail("primary answered the UPDREQALL at once");
+
+	sim_cut(&sim);
+	sim_run(&sim, cur_time + 1, 0);
+	if (state->recovery_active || state->recovery_reply ||
+	    state->send_update_done)
+		atf_tc_fail("recovery stream survived the cut");
+
+	/* Each request made after the cut gets exactly one UPDDONE. */
+	reqs = sim.server[1].updreqs;
+	dones = sim.server[0].upddones;
+	recovered = sim_settle(&sim, 900, "a cut during recovery");
+	if (sim.server[0].upddones - dones != sim.server[1].updreqs - reqs)
+		atf_tc_fail("%u UPDDONEs for %u update requests",
+			    sim.server[0].upddones - dones,
+			    sim.server[1].updreqs - reqs);
+
+	sim_run(&sim, cur_time + 600, 0);
+	sim_finish(&sim, "recovery cut");
+
+	sim_report(&sim, "recovery cut", recovered);
+#else
+	atf_tc_skip("failover is disabled");
+#endif
+}
+
+ATF_TC(failover_sim_state_file);
+
+ATF_TC_HEAD(failover_sim_state_file, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Check that a flapping link leaves "
+			  "the lease files alone when failover states have "
+			  "a file of their own.");
+}
+
+ATF_TC_BODY(failover_sim_state_file, tc)
+{
+#if defined (FAILOVER_PROTOCOL)
+	static struct sim sim;
+	struct stat st;
+	off_t size [2];
+	TIME recovered, worst = 0;
+	int i;
+
+	sim_init(&sim, 7, 1000, 500);
+	sim.state_files = 1;
+	sim_bringup(&sim);
+
+	for (i = 0; i < 2; i++) {
+		if (stat(sim.server[i].lease_path, &st) < 0)
+			atf_tc_fail("%s: %s", sim.server[i].lease_path,
+				    strerror(errno));
+		size[i] = st.st_size;
+	}
+
+	for (i = 0; i < 5; i++) {
+		sim_run(&sim, cur_time + 60, 0);
+		sim_cut(&sim);
+		recovered = sim_settle(&sim, 600, "a cut");
+		if (recovered > worst)
+			worst = recovered;
+	}
+
+	fflush(NULL);
+	for (i = 0; i < 2; i++) {
+		if (stat(sim.server[i].lease_path, &st) < 0)
+			atf_tc_fail("%s: %s", sim.server[i].lease_path,
+				    strerror(errno));
+		if (st.st_size != size[i])
+			atf_tc_fail("%s was written to",
+				    sim.server[i].lease_path);
+		if (stat(sim.server[i].state_path, &st) < 0)
+			atf_tc_fail("%s: %s", sim.server[i].state_path,
+				    strerror(errno));
+	}
+
+	/* A restarted server picks its state up from its state file. */
+	sim_stop(&sim, 1);
+	sim_run(&sim, cur_time + 60, 0);
+	sim_start(&sim, 1);
+	if (sim.server[1].state->saved_state != normal &&
+	    sim.server[1].state->me.state != normal)
+		atf_tc_fail("secondary restarted in %s",
+			    dhcp_failover_state_name_print
+			    (sim.server[1].state->saved_state));
+	sim_settle(&sim, 600, "a restart");
+
+	/* Without the state file, a later state goes to the lease file;
+	   that one wins over the older state file when it's back. */
+	sim_stop(&sim, 1);
+	sim.state_files = 0;
+	sim_start(&sim, 1);
+	sim_settle(&sim, 600, "a restart without the state file");
+	sim_stop(&sim, 0);
+	sim_run(&sim, cur_time + 60, 0);
+	if (sim.server[1].state->me.state != communications_interrupted)
+		atf_tc_fail("secondary in %s with the primary down",
+			    dhcp_failover_state_name_print
+			    (sim.server[1].state->me.state));
+	sim_stop(&sim, 1);
+	sim.state_files = 1;
+	sim_start(&sim, 1);
+	if (sim.server[1].state->saved_state != communications_interrupted)
+		atf_tc_fail("secondary restarted in %s, not %s",
+			    dhcp_failover_state_name_print
+			    (sim.server[1].state->saved_state),
+			    dhcp_failover_state_name_print
+			    (communications_interrupted));
+	sim_start(&sim, 0);
+	sim_settle(&sim, 600, "the primary's restart");
+
+	sim_report(&sim, "state file", worst);
+#else
+	atf_tc_skip("failover is disabled");
+#endif
+}
+
+ATF_TC(failover_sim_partner_down);
+
+ATF_TC_HEAD(failover_sim_partner_down, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Put a failover peer in partner-down "
+			  "and check that it reclaims the expired leases.");
+}
+
+ATF_TC_BODY(failover_sim_partner_down, tc)
+{
+#if defined (FAILOVER_PROTOCOL)
+	static struct sim sim;
+	dhcp_failover_state_t *state;
+	struct shared_network *net;
+	struct pool *pool;
+	struct lease *lease;
+	TIME start, recovered;
+	u_int32_t queued, due = 0, steps, reported;
+	unsigned long n;
+
+	sim_init(&sim, 8, 1000, 500);
+	sim.release_pct = 50;
+	sim_bringup(&sim);
+	/* Time the statistics from here, as dhcp_failover_startup() does. */
+	sim.server[0].state->last_report = cur_time;
+
+	start = cur_time;
+	sim_load(&sim, 300);
+	sim_run(&sim, start + 900, 0);
+
+	/* The secondary goes away, and the primary is told it's gone. */
+	sim_stop(&sim, 1);
+	sim_run(&sim, cur_time + 60, 0);
+	state = sim.server[0].state;
+	sim_switch(&sim, &sim.server[0]);
+	dhcp_failover_set_state(state, partner_down);
+	queued = state->reclaim_backlog;
+	if (queued == 0)
+		atf_tc_fail("no expired leases to reclaim");
+
+	/* An expired lease given straight to a client leaves the backlog,
+	   but it isn't one reclaimed. */
+	lease = LEASE_GET_FIRST(shared_networks->pools->expired);
+	lease->next_binding_state = FTS_ACTIVE;
+	lease->ends = cur_time + SIM_LEASE_TIME;
+	if (!supersede_lease(lease, NULL, 1, 1, 0, 0))
+		atf_tc_fail("can't activate %s", piaddr(lease->ip_addr));
+	if (state->reclaim_backlog != queued - 1 || state->reclaimed != 0)
+		atf_tc_fail("activated lease counted: backlog %u, "
+			    "%u reclaimed", state->reclaim_backlog,
+			    state->reclaimed);
+	queued--;
+	steps = sim.server[0].pool_steps;
+
+	/* Once the clients' leases have run out and MCLT has passed,
+	   every expired lease should be free again. */
+	sim.load = 0;
+	sim_run(&sim, cur_time + SIM_LEASE_TIME + state->mclt + 60, 0);
+	if (state->me.state != partner_down)
+		atf_tc_fail("primary left partner-down for %s",
+			    dhcp_failover_state_name_print (state->me.state));
+	sim_switch(&sim, &sim.server[0]);
+	for (net = shared_networks; net != NULL; net = net->next) {
+		for (pool = net->pools; pool != NULL; pool = pool->next) {
+			for (lease = LEASE_GET_FIRST(pool->expired);
+			     lease != NULL;
+			     lease = LEASE_GET_NEXT(pool->expired, lease)) {
+				if (lease->sort_time <= cur_time)
+					due++;
+			}
+		}
+	}
+	if (due)
+		atf_tc_fail("%u expired leases not reclaimed", due);
+	if (state->reclaim_backlog)
+		atf_tc_fail("reclaim backlog of %u left",
+			    state->reclaim_backlog);
+	if (state->reclaimed < queued)
+		atf_tc_fail("%u of %u expired leases reclaimed",
+			    state->reclaimed, queued);
+
+	/* More than a step's worth came due when MCLT ran out. */
+	if (sim.server[0].pool_steps == steps)
+		atf_tc_fail("%u leases reclaimed, never more than %u at once",
+			    state->reclaimed, POOL_TIMER_STEP);
+
+	/* The statistics report counts those reclaimed since the one
+	   before. */
+	sim_switch(&sim, &sim.server[0]);
+	reported = state->reclaimed_reported;
+	dhcp_failover_stats_report(state);
+	sim_stat(&sim, 0, "reclaimed-last-interval", &n, NULL, 0);
+	if (n != state->reclaimed - reported)
+		atf_tc_fail("%lu reclaimed in the last interval, not %lu", n,
+			    (unsigned long)(state->reclaimed - reported));
+
+	sim_start(&sim, 1);
+	recovered = sim_settle(&sim, 900, "the secondary came back");
+	sim_load(&sim, 60);
+	sim_run(&sim, cur_time + 900, 0);
+	sim_finish(&sim, "partner down");
+
+	sim_report(&sim, "partner down", recovered);
+#else
+	atf_tc_skip("failover is disabled");
+#endif
+}
+
+ATF_TC(failover_sim_batch);
+
+ATF_TC_HEAD(failover_sim_batch, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Run clients against a failover "
+			  "pair that batches its updates, and reset the "
+			  "connection under load.");
+}
+
+ATF_TC_BODY(failover_sim_batch, tc)
+{
+#if defined (FAILOVER_PROTOCOL)
+	static struct sim sim;
+	TIME start, recovered, worst = 0;
+	int i;
+
+	sim_init(&sim, 9, 1000, 500);
+	sim.server[0].batch = 8;
+	sim.server[1].batch = 16;
+	sim_bringup(&sim);
+
+	for (i = 0; i < 2; i++) {
+		if (sim.server[i].state->partner.max_batched_updates !=
+		    sim.server[1 - i].batch)
+			atf_tc_fail("%s sees the peer batch %lu updates",
+				    sim.server[i].name, (unsigned long)
+				    sim.server[i].state->
+				    partner.max_batched_updates);
+	}
+
+	start = cur_time;
+	sim_load(&sim, 300);
+	for (i = 1; i <= 2; i++) {
+		sim_run(&sim, start + i * 900, 0);
+		sim_cut(&sim);
+		recovered = sim_settle(&sim, 600, "a cut");
+		if (recovered > worst)
+			worst = recovered;
+	}
+	sim_run(&sim, start + 2700, 0);
+	sim_finish(&sim, "batch");
+
+	/* The updates after each cut go out in batches, and so do the
+	   acks for them. */
+	printf("batch: primary sent %u batches in %u frames, secondary "
+	       "%u in %u\n", sim.server[0].batches, sim.server[0].frames,
+	       sim.server[1].batches, sim.server[1].frames);
+	if (sim.server[0].batches == 0 || sim.server[1].batches == 0)
+		atf_tc_fail("no batch frames sent");
+
+	sim_report(&sim, "batch", worst);
+#else
+	atf_tc_skip("failover is disabled");
+#endif
+}
+
+ATF_TC(failover_sim_batch_mixed);
+
+ATF_TC_HEAD(failover_sim_batch_mixed, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Run clients against a failover "
+			  "pair where only one peer batches its updates.");
+}
+
+ATF_TC_BODY(failover_sim_batch_mixed, tc)
+{
+#if defined (FAILOVER_PROTOCOL)
+	static struct sim sim;
+	TIME start, recovered;
+
+	sim_init(&sim, 10, 1000, 500);
+	sim.server[0].batch = 16;
+	sim_bringup(&sim);
+
+	start = cur_time;
+	sim_load(&sim, 300);
+	sim_run(&sim, start + 900, 0);
+	sim_cut(&sim);
+	recovered = sim_settle(&sim, 600, "a cut");
+	sim_run(&sim, start + 1800, 0);
+	sim_finish(&sim, "mixed batch");
+
+	/* Neither peer sends a batch frame the other didn't ask for. */
+	if (sim.server[0].state->partner.max_batched_updates != 0)
+		atf_tc_fail("primary thinks the secondary batches");
+	if (sim.server[0].frames == 0 || sim.server[1].frames == 0)
+		atf_tc_fail("no frames sent");
+	if (sim.server[0].batches || sim.server[1].batches)
+		atf_tc_fail("%u and %u batch frames sent",
+			    sim.server[0].batches, sim.server[1].batches);
+
+	sim_report(&sim, "mixed batch", recovered);
+#else
+	atf_tc_skip("failover is disabled");
+#endif
+}
+
+ATF_TC(failover_sim_stats);
+
+ATF_TC_HEAD(failover_sim_stats, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Check the failover update queue "
+			  "statistics against a link of known delay.");
+}
+
+ATF_TC_BODY(failover_sim_stats, tc)
+{
+#if defined (FAILOVER_PROTOCOL)
+	static struct sim sim;
+	dhcp_failover_state_t *state;
+	char hist [FAILOVER_LATENCY_BUCKETS * 20], *cp;
+	unsigned long acks, n, median, pct99, age, headroom, count, bound;
+	u_int32_t reported;
+	TIME start, cut;
+	int used;
+
+	/* Exactly 40ms each way: no update can be acked in less than
+	   80ms, which is the <128ms bucket. */
+	sim_init(&sim, 12, 40000, 0);
+	sim_bringup(&sim);
+	state = sim.server[0].state;
+
+	/* Start the statistics reports, as dhcp_failover_startup() does. */
+	sim_switch(&sim, &sim.server[0]);
+	dhcp_failover_stats_report(state);
+
+	start = cur_time;
+	sim_load(&sim, 300);
+	sim_run(&sim, start + 600, 0);
+	sim_finish(&sim, "load");
+
+	/* Every ack is in the histogram, none faster than the link. */
+	sim_stat(&sim, 0, "acks-received", &acks, NULL, 0);
+	sim_stat(&sim, 0, "ack-latency", NULL, hist, sizeof hist);
+	count = 0;
+	for (cp = hist; *cp; cp += used) {
+		if (sscanf(cp, " <%lums:%lu%n", &bound, &n, &used) != 2 &&
+		    sscanf(cp, " >=%lums:%lu%n", &bound, &n, &used) != 2)
+			atf_tc_fail("can't parse histogram \"%s\"", hist);
+		if (bound < 128)
+			atf_tc_fail("acks under %lums: %s", bound, hist);
+		count += n;
+	}
+	if (count == 0 || count != acks)
+		atf_tc_fail("%lu acks in the histogram of %lu: %s",
+			    count, acks, hist);
+
+	sim_stat(&sim, 0, "ack-latency-median", &median, NULL, 0);
+	sim_stat(&sim, 0, "ack-latency-99th", &pct99, NULL, 0);
+	if (median < 128 || pct99 < median)
+		atf_tc_fail("median %lums, 99th percentile %lums",
+			    median, pct99);
+
+	/* Each statistics report counts the acks since the one before,
+	   however few there were. */
+	sim_switch(&sim, &sim.server[0]);
+	reported = state->acks_reported;
+	dhcp_failover_stats_report(state);
+	sim_stat(&sim, 0, "acks-last-interval", &n, NULL, 0);
+	if (n != state->acks_received - reported)
+		atf_tc_fail("%lu acks in the last interval, not %lu", n,
+			    (unsigned long)(state->acks_received - reported));
+
+	/* Nothing sent once the link is partitioned is acked; the oldest
+	   of it is no older than the partition. */
+	sim_stat(&sim, 0, "oldest-unacked-age", &age, NULL, 0);
+	if (age != 0)
+		atf_tc_fail("oldest unacked update is %lus old when quiet",
+			    age);
+	sim_load(&sim, 10);
+	sim_run(&sim, cur_time + 10, 0);
+	sim_partition(&sim, 1);
+	cut = cur_time;
+	sim_run(&sim, cut + 20, 0);
+	sim_stat(&sim, 0, "oldest-unacked-age", &age, NULL, 0);
+	sim_stat(&sim, 0, "mclt-headroom", &headroom, NULL, 0);
+	if (state->ack_queue_head == NULL)
+		atf_tc_fail("no unacked updates after the partition");
+	if (age < 10 || age > (unsigned long)(cur_time - cut) + 1)
+		atf_tc_fail("oldest unacked update %lus old, %lds after "
+			    "the partition", age, (long)(cur_time - cut));
+	if (headroom != state->mclt - age)
+		atf_tc_fail("MCLT headroom %lus with MCLT %lus", headroom,
+			    (unsigned long)state->mclt);
+
+	sim_partition(&sim, 0);
+	sim_settle(&sim, 600, "the partition");
+	sim_report(&sim, "stats", sim_finish(&sim, "stats"));
+#else
+	atf_tc_skip("failover is disabled");
+#endif
+}
+
+ATF_TC(failover_sim_balance);
+
+ATF_TC_HEAD(failover_sim_balance, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Rebalance a pool in more than one "
+			  "step while answering the peer's POOLREQ.");
+}
+
+ATF_TC_BODY(failover_sim_balance, tc)
+{
+#if defined (FAILOVER_PROTOCOL)
+	static struct sim sim;
+	dhcp_failover_state_t *state;
+	struct lease *lease;
+	int i;
+
+	/* No delay, so the POOLREQ arrives while the rebalance it asks for
+	   is still under way. */
+	sim_init(&sim, 13, 0, 0);
+	sim_bringup(&sim);
+	state = sim.server[0].state;
+
+	/* Take back the leases the primary gave away, on both servers and
+	   without an update, as if the pool had never been balanced. */
+	for (i = 0; i < 2; i++) {
+		sim_switch(&sim, &sim.server[i]);
+		while ((lease = LEASE_GET_FIRST(shared_networks->pools->
+						 backup)) != NULL) {
+			lease->next_binding_state = FTS_FREE;
+			if (!supersede_lease(lease, NULL, 0, 0, 0, 0))
+				atf_tc_fail("can't free %s on %s",
+					    piaddr(lease->ip_addr),
+					    sim.server[i].name);
+		}
+	}
+
+	/* The first step stops at the end of its budget, keeping its place;
+	   the rest are left to the timer. */
+	sim_switch(&sim, &sim.server[0]);
+	dhcp_failover_pool_rebalance(state);
+#if FAILOVER_BALANCE_STEP < SIM_LEASES
+	if (!state->balance_active || state->balance_lease == NULL ||
+	    state->balance_examined != FAILOVER_BALANCE_STEP)
+		atf_tc_fail("first step: active %d, examined %lu, %s",
+			    state->balance_active,
+			    (unsigned long)state->balance_examined,
+			    state->balance_lease ? "stopped" : "no cursor");
+#endif
+
+	/* The secondary, with nothing left, asks for leases. */
+	sim_switch(&sim, &sim.server[1]);
+	dhcp_failover_pool_rebalance(sim.server[1].state);
+	sim_flush(&sim);
+	sim_settle(&sim, 600, "the rebalance");
+
+	/* Each step picked up where the one before stopped, no lease was
+	   looked at more than once a pass, and the answer to the POOLREQ
+	   counts the leases moved in every step. */
+	if (state->balance_active)
+		atf_tc_fail("rebalance never finished");
+	if (state->balance_examined >
+	    state->balance_leases + state->balance_moved + 1)
+		atf_tc_fail("examined %lu leases to move %lu of %lu",
+			    (unsigned long)state->balance_examined,
+			    (unsigned long)state->balance_moved,
+			    (unsigned long)state->balance_leases);
+#if FAILOVER_BALANCE_STEP < SIM_LEASES
+	if (state->balance_examined <= FAILOVER_BALANCE_STEP)
+		atf_tc_fail("rebalance done in one step of %lu leases",
+			    (unsigned long)state->balance_examined);
+#endif
+	if (sim.server[0].poolresps != 1)
+		atf_tc_fail("primary sent %u POOLRESPs",
+			    sim.server[0].poolresps);
+	if (state->balance_moved != SIM_LEASES / 2 ||
+	    sim.server[0].transferred != state->balance_moved)
+		atf_tc_fail("moved %lu leases, POOLRESP said %u",
+			    (unsigned long)state->balance_moved,
+			    sim.server[0].transferred);
+
+	sim_report(&sim, "balance", 0);
+#else
+	atf_tc_skip("failover is disabled");
+#endif
+}
+
+ATF_TC(failover_sim_output);
+
+ATF_TC_HEAD(failover_sim_output, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Check that updates wait while the "
+			  "output to the peer is over its limit.");
+}
+
+#if defined (FAILOVER_PROTOCOL)
+/* Whether a server has a retry of its update queue scheduled. */
+static int
+sim_output_retry(struct sim *sim, int i)
+{
+	struct timeout *t;
+
+	sim_switch(sim, &sim->server[i]);
+	for (t = timeouts; t; t = t->next)
+		if (t->func == dhcp_failover_output_retry &&
+		    t->what == sim->server[i].state)
+			return (1);
+	return (0);
+}
+#endif
+
+ATF_TC_BODY(failover_sim_output, tc)
+{
+#if defined (FAILOVER_PROTOCOL)
+	static struct sim sim;
+	dhcp_failover_state_t *state;
+	omapi_connection_object_t *c;
+	struct lease *lease = NULL;
+	struct iaddr addr;
+	u_int32_t blocked, a;
+
+	sim_init(&sim, 14, 1000, 0);
+	sim_bringup(&sim);
+	state = sim.server[0].state;
+
+	/* Fill the primary's output with CONTACTs, which go around the
+	   update queue. */
+	sim_switch(&sim, &sim.server[0]);
+	c = (omapi_connection_object_t *)sim.server[0].conn;
+	while (c->out_bytes < FAILOVER_OUTPUT_LIMIT)
+		dhcp_failover_send_contact(state);
+
+	/* With nothing to send, nothing waits. */
+	blocked = state->output_blocked;
+	dhcp_failover_send_updates(state);
+	if (state->output_blocked != blocked || sim_output_retry(&sim, 0))
+		atf_tc_fail("blocked with no updates queued");
+
+	/* An update waits, and goes out once the output has drained. */
+	sim_switch(&sim, &sim.server[0]);
+	addr.len = 4;
+	a = htonl(SIM_FIRST);
+	memcpy(addr.iabuf, &a, 4);
+	if (!find_lease_by_ip_addr(&lease, addr, MDL))
+		atf_tc_fail("no lease for %s", piaddr(addr));
+	dhcp_failover_queue_update(lease, 1);
+	lease_dereference(&lease, MDL);
+	if (state->output_blocked != blocked + 1 ||
+	    state->update_queue_head == NULL || !sim_output_retry(&sim, 0))
+		atf_tc_fail("update sent over the output limit");
+
+	sim_settle(&sim, 60, "the output limit");
+	if (state->update_queue_head != NULL)
+		atf_tc_fail("update never sent");
+
+	sim_report(&sim, "output", 0);
+#else
+	atf_tc_skip("failover is disabled");
+#endif
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+	ATF_TP_ADD_TC(tp, failover_sim_startup);
+	ATF_TP_ADD_TC(tp, failover_sim_load);
+	ATF_TP_ADD_TC(tp, failover_sim_delay);
+	ATF_TP_ADD_TC(tp, failover_sim_cut);
+	ATF_TP_ADD_TC(tp, failover_sim_partition);
+	ATF_TP_ADD_TC(tp, failover_sim_restart);
+	ATF_TP_ADD_TC(tp, failover_sim_recovery_cut);
+	ATF_TP_ADD_TC(tp, failover_sim_state_file);
+	ATF_TP_ADD_TC(tp, failover_sim_partner_down);
+	ATF_TP_ADD_TC(tp, failover_sim_batch);
+	ATF_TP_ADD_TC(tp, failover_sim_batch_mixed);
+	ATF_TP_ADD_TC(tp, failover_sim_stats);
+	ATF_TP_ADD_TC(tp, failover_sim_balance);
+	ATF_TP_ADD_TC(tp, failover_sim_output);
+
+	return (atf_no_error());
+}
@@ -186,10 +186,197 @@ ATF_TC_BODY(load_balance_swap, tc)
 }
 
 
+#if defined(FAILOVER_PROTOCOL)
+/*
+ * Ask whether the primary should answer a client with the given chaddr,
+ * starting from a packet that hasn't been hashed yet.  Returns 1 or 0;
+ * load_balance_mine() itself returns any non-zero value for yes.
+ */
+static int
+primary_answers(struct packet *packet, dhcp_failover_state_t *state,
+		const unsigned char *mac, unsigned len)
+{
+	packet->loadb_hashed = ISC_FALSE;
+	packet->raw->hlen = len;
+	memmove(packet->raw->chaddr, mac, len);
+	return (load_balance_mine(packet, state) ? 1 : 0);
+}
+
+/*
+ * Addresses from a few common vendors: each OUI with a run of sequential
+ * NIC specific parts, as handed out to a batch of devices, followed by a
+ * run of scattered ones.
+ */
+static const unsigned char test_ouis[][3] = {
+	{ 0x00, 0x50, 0x56 },	/* VMware */
+	{ 0x52, 0x54, 0x00 },	/* QEMU/KVM */
+	{ 0x00, 0x1b, 0x21 },	/* Intel */
+	{ 0xf0, 0x18, 0x98 },	/* Apple */
+	{ 0xb8, 0x27, 0xeb },	/* Raspberry Pi */
+	{ 0x3c, 0xd9, 0x2b },	/* HP */
+	{ 0x00, 0x1d, 0xd8 },	/* Microsoft */
+	{ 0x00, 0x26, 0x5a },	/* D-Link */
+};
+#define TEST_OUIS (sizeof(test_ouis) / sizeof(test_ouis[0]))
+#define TEST_MACS_PER_OUI 4096
+
+static void
+test_mac(unsigned n, unsigned char *mac)
+{
+	static u_int32_t seed;
+	u_int32_t nic;
+
+	if (n == 0)
+		seed = 12345;
+	memcpy(mac, test_ouis[n / TEST_MACS_PER_OUI], 3);
+	if (n % TEST_MACS_PER_OUI < TEST_MACS_PER_OUI / 2) {
+		nic = 0x1000 + n % TEST_MACS_PER_OUI;
+	} else {
+		seed = seed * 1103515245 + 12345;
+		nic = seed >> 8;
+	}
+	mac[3] = nic >> 16;
+	mac[4] = nic >> 8;
+	mac[5] = nic;
+}
+#endif
+
+ATF_TC(load_balance_hash_cached);
+
+ATF_TC_HEAD(load_balance_hash_cached, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "This test case checks that the "
+			  "load balancing hash is worked out once per packet.");
+}
+
+ATF_TC_BODY(load_balance_hash_cached, tc)
+{
+#if defined(FAILOVER_PROTOCOL)
+	struct packet packet;
+	struct dhcp_packet raw;
+	dhcp_failover_state_t pstate;
+	u_int8_t hba[256];
+	unsigned char mine = 0, theirs = 0;
+	int found_mine = 0, found_theirs = 0;
+	unsigned i;
+
+	memset(&packet, 0, sizeof(struct packet));
+	memset(&raw, 0, sizeof(struct dhcp_packet));
+	packet.raw = &raw;
+
+	/* The primary takes the first half of the buckets. */
+	memset(hba, 0, 256);
+	memset(hba, 0xFF, 16);
+
+	memset(&pstate, 0, sizeof(dhcp_failover_state_t));
+	pstate.i_am = primary;
+	pstate.load_balance_max_secs = 5;
+	pstate.hba = hba;
+
+	for (i = 0; i < 256 && (!found_mine || !found_theirs); i++) {
+		raw.chaddr[0] = i;
+		if (primary_answers(&packet, &pstate, raw.chaddr, 1)) {
+			mine = i;
+			found_mine = 1;
+		} else {
+			theirs = i;
+			found_theirs = 1;
+		}
+	}
+	if (!found_mine || !found_theirs) {
+		atf_tc_fail("ERROR: one byte addresses all hash to one "
+			    "peer %s:%d", MDL);
+	}
+
+	/* The first answer sticks to the packet... */
+	if (primary_answers(&packet, &pstate, &mine, 1) != 1) {
+		atf_tc_fail("ERROR: primary not accepted %s:%d", MDL);
+	}
+	raw.chaddr[0] = theirs;
+	if (!load_balance_mine(&packet, &pstate)) {
+		atf_tc_fail("ERROR: hash not kept in packet %s:%d", MDL);
+	}
+
+	/* ...until it is worked out again. */
+	packet.loadb_hashed = ISC_FALSE;
+	if (load_balance_mine(&packet, &pstate) != 0) {
+		atf_tc_fail("ERROR: primary accepted %s:%d", MDL);
+	}
+#else
+	atf_tc_skip("failover is disabled");
+#endif
+}
+
+ATF_TC(load_balance_uniform);
+
+ATF_TC_HEAD(load_balance_uniform, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "This test case checks that real "
+			  "looking MAC addresses are spread evenly over the "
+			  "hash buckets.");
+}
+
+/*
+ * Split the buckets into eight slices and count how many of the test
+ * addresses fall in each, by giving the primary one slice at a time.  A
+ * chi-squared value over 24.32 (7 degrees of freedom, p = 0.001) means the
+ * hash is sending noticeably more clients to some buckets than others.
+ */
+ATF_TC_BODY(load_balance_uniform, tc)
+{
+#if defined(FAILOVER_PROTOCOL)
+	struct packet packet;
+	struct dhcp_packet raw;
+	dhcp_failover_state_t pstate;
+	u_int8_t hba[256];
+	unsigned char mac[6];
+	unsigned count[8];
+	unsigned slice, n, total;
+	double expected, chi2;
+
+	memset(&packet, 0, sizeof(struct packet));
+	memset(&raw, 0, sizeof(struct dhcp_packet));
+	packet.raw = &raw;
+
+	memset(&pstate, 0, sizeof(dhcp_failover_state_t));
+	pstate.i_am = primary;
+	pstate.load_balance_max_secs = 5;
+	pstate.hba = hba;
+
+	total = TEST_OUIS * TEST_MACS_PER_OUI;
+	for (slice = 0; slice < 8; slice++) {
+		memset(hba, 0, 256);
+		memset(hba + slice * 4, 0xFF, 4);
+
+		count[slice] = 0;
+		for (n = 0; n < total; n++) {
+			test_mac(n, mac);
+			count[slice] += primary_answers(&packet, &pstate,
+							mac, 6);
+		}
+	}
+
+	expected = total / 8.0;
+	chi2 = 0;
+	for (slice = 0; slice < 8; slice++) {
+		chi2 += ((count[slice] - expected) *
+			 (count[slice] - expected)) / expected;
+	}
+	if (chi2 > 24.32) {
+		atf_tc_fail("ERROR: uneven hash, chi-squared %.2f %s:%d",
+			    chi2, MDL);
+	}
+#else
+	atf_tc_skip("failover is disabled");
+#endif
+}
+
 ATF_TP_ADD_TCS(tp)
 {
 	ATF_TP_ADD_TC(tp, load_balance);
 	ATF_TP_ADD_TC(tp, load_balance_swap);
+	ATF_TP_ADD_TC(tp, load_balance_hash_cached);
+	ATF_TP_ADD_TC(tp, load_balance_uniform);
 
 	return (atf_no_error());
 }
@@ -112,14 +112,947 @@ ATF_TC_BODY(parse_byte_order, tc)
 }
 #endif /*  DHCPv6 */
 
+ATF_TC(class_index);
+
+ATF_TC_HEAD(class_index, tc)
+{
+    atf_tc_set_md_var(tc, "descr", "Tests check_collection's class index.");
+}
+
+ATF_TC_BODY(class_index, tc)
+{
+    static const char *exprs[] = {
+        "substring (option vendor-class-identifier, 0, 4) = \"MSFT\"",
+        "option vendor-class-identifier = \"MSFT 5.0\"",
+        "option host-name = \"abc\" and exists vendor-class-identifier",
+        "exists host-name",
+        "substring (option vendor-class-identifier, 0, 4) = \"PXEC\"",
+        "option vendor-class-identifier = \"MSFT\" and exists host-name",
+        "not exists dhcp-client-identifier and \"ab\" = option host-name",
+        "substring (hardware, 0, 2) = 1:2",
+        "option host-name = \"xyz\"",
+    };
+    static const int expected[] = { 0, 1, 2, 3, 7 };
+    unsigned char buffer[] = {
+        60, 8, 'M', 'S', 'F', 'T', ' ', '5', '.', '0',
+        12, 3, 'a', 'b', 'c',
+        255
+    };
+    struct collection collection;
+    struct class *classes[sizeof(exprs) / sizeof(exprs[0])];
+    struct class **tail;
+    struct dhcp_packet raw;
+    struct packet packet;
+    struct parse *cfile;
+    int i, pass, lose;
+
+    initialize_common_option_spaces();
+    dhcp_db_objects_setup();
+
+    memset(&collection, 0, sizeof(collection));
+    collection.name = "test";
+    tail = &collection.classes;
+    for (i = 0; i < sizeof(exprs) / sizeof(exprs[0]); i++) {
+        classes[i] = NULL;
+        if (class_allocate(&classes[i], MDL) != ISC_R_SUCCESS) {
+            atf_tc_fail("can't allocate class");
+        }
+        cfile = NULL;
+        lose = 0;
+        if (new_parse(&cfile, -1, (char *)exprs[i], strlen(exprs[i]),
+                      "test", 0) != ISC_R_SUCCESS ||
+            !parse_boolean_expression(&classes[i]->expr, cfile, &lose)) {
+            atf_tc_fail("can't parse %s", exprs[i]);
+        }
+        end_parse(&cfile);
+        class_reference(tail, classes[i], MDL);
+        tail = &classes[i]->nic;
+    }
+
+    memset(&raw, 0, sizeof(raw));
+    raw.op = BOOTREQUEST;
+    raw.htype = HTYPE_ETHER;
+    raw.hlen = 6;
+    raw.chaddr[0] = 2;
+
+    memset(&packet, 0, sizeof(packet));
+    packet.raw = &raw;
+    packet.packet_length = DHCP_FIXED_NON_UDP;
+    if (!option_state_allocate(&packet.options, MDL) ||
+        !parse_option_buffer(packet.options, buffer, sizeof(buffer),
+                             &dhcp_universe)) {
+        atf_tc_fail("can't set up options");
+    }
+
+    /* The first pass builds the index, the second uses it again. */
+    for (pass = 0; pass < 2; pass++) {
+        if (!check_collection(&packet, NULL, &collection)) {
+            atf_tc_fail("no classes matched");
+        }
+        if (collection.index == NULL) {
+            atf_tc_fail("collection wasn't indexed");
+        }
+        ATF_REQUIRE_EQ(packet.class_count,
+                       sizeof(expected) / sizeof(expected[0]));
+        for (i = 0; i < packet.class_count; i++) {
+            if (packet.classes[i] != classes[expected[i]]) {
+                atf_tc_fail("pass %d: class %d is \"%s\"", pass, i,
+                            exprs[expected[i]]);
+            }
+            class_dereference(&packet.classes[i], MDL);
+        }
+        packet.class_count = 0;
+    }
+
+    for (i = 0; i < sizeof(exprs) / sizeof(exprs[0]); i++) {
+        ATF_CHECK_EQ(classes[i]->match_count,
+                     (i == 0 || i == 1 || i == 2 || i == 3 || i == 7)
+                     ? 2 : 0);
+    }
+
+    /* Our collection isn't on the list, so discard it by hand. */
+    collection.next = collections;
+    collections = &collection;
+    discard_class_indexes();
+    collections = collection.next;
+    ATF_CHECK(collection.index == NULL);
+
+    option_state_dereference(&packet.options, MDL);
+    class_dereference(&collection.classes, MDL);
+    for (i = 0; i < sizeof(exprs) / sizeof(exprs[0]); i++) {
+        class_dereference(&classes[i], MDL);
+    }
+}
+
+ATF_TC(class_index_side_effect);
+
+ATF_TC_HEAD(class_index_side_effect, tc)
+{
+    atf_tc_set_md_var(tc, "descr",
+                      "Tests that the class index doesn't skip a conjunct "
+                      "with side effects.");
+}
+
+ATF_TC_BODY(class_index_side_effect, tc)
+{
+    static const char *text =
+        "set called = \"no\";"
+        "define mark (val) { set called = val; return val; }";
+    static const char *expr =
+        "mark (\"yes\") = \"yes\" and option host-name = \"abc\"";
+    unsigned char buffer[] = { 12, 3, 'x', 'y', 'z', 255 };
+    struct executable_statement *statements;
+    struct collection collection;
+    struct class *class;
+    struct dhcp_packet raw;
+    struct packet packet;
+    struct data_string ds;
+    struct parse *cfile;
+    int lose;
+
+    initialize_common_option_spaces();
+    dhcp_db_objects_setup();
+
+    statements = NULL;
+    cfile = NULL;
+    lose = 0;
+    if (new_parse(&cfile, -1, (char *)text, strlen(text), "test", 0)
+        != ISC_R_SUCCESS ||
+        !parse_executable_statements(&statements, cfile, &lose,
+                                     context_any)) {
+        atf_tc_fail("can't parse statements");
+    }
+    end_parse(&cfile);
+    execute_statements(NULL, NULL, NULL, NULL, NULL, NULL, &global_scope,
+                       statements, NULL);
+
+    class = NULL;
+    if (class_allocate(&class, MDL) != ISC_R_SUCCESS) {
+        atf_tc_fail("can't allocate class");
+    }
+    cfile = NULL;
+    lose = 0;
+    if (new_parse(&cfile, -1, (char *)expr, strlen(expr), "test", 0)
+        != ISC_R_SUCCESS ||
+        !parse_boolean_expression(&class->expr, cfile, &lose)) {
+        atf_tc_fail("can't parse %s", expr);
+    }
+    end_parse(&cfile);
+
+    memset(&collection, 0, sizeof(collection));
+    collection.name = "test";
+    class_reference(&collection.classes, class, MDL);
+
+    memset(&raw, 0, sizeof(raw));
+    raw.op = BOOTREQUEST;
+    memset(&packet, 0, sizeof(packet));
+    packet.raw = &raw;
+    packet.packet_length = DHCP_FIXED_NON_UDP;
+    if (!option_state_allocate(&packet.options, MDL) ||
+        !parse_option_buffer(packet.options, buffer, sizeof(buffer),
+                             &dhcp_universe)) {
+        atf_tc_fail("can't set up options");
+    }
+
+    /* The host-name test fails, but mark is still called first. */
+    ATF_CHECK(!check_collection(&packet, NULL, &collection));
+    memset(&ds, 0, sizeof(ds));
+    ATF_REQUIRE(find_bound_string(&ds, global_scope, "called"));
+    ATF_CHECK(ds.len == 3 && memcmp(ds.data, "yes", 3) == 0);
+    data_string_forget(&ds, MDL);
+
+    /* Our collection isn't on the list, so discard it by hand. */
+    collection.next = collections;
+    collections = &collection;
+    discard_class_indexes();
+    collections = collection.next;
+
+    option_state_dereference(&packet.options, MDL);
+    class_dereference(&collection.classes, MDL);
+    class_dereference(&class, MDL);
+    executable_statement_dereference(&statements, MDL);
+}
+
+ATF_TC(scope_template);
+
+ATF_TC_HEAD(scope_template, tc)
+{
+    atf_tc_set_md_var(tc, "descr", "Tests option templates for scopes.");
+}
+
+ATF_TC_BODY(scope_template, tc)
+{
+    static const char *statements[] = {
+        "option domain-name \"outer\"; default host-name \"d\";"
+        "option domain-name-servers 1.1.1.1; option routers 10.0.0.1;",
+        "append domain-name-servers 2.2.2.2; "
+        "option domain-name \"inner\"; default host-name \"x\";",
+        "if exists host-name { option domain-name \"if\"; }",
+    };
+    static const unsigned codes[] = {
+        DHO_DOMAIN_NAME, DHO_HOST_NAME, DHO_DOMAIN_NAME_SERVERS, DHO_ROUTERS
+    };
+    struct group *groups[3];
+    struct option_state *plain, *cached;
+    struct option_cache *a, *b;
+    struct data_string da, db;
+    struct parse *cfile;
+    int i, pass, lose;
+
+    initialize_common_option_spaces();
+
+    for (i = 0; i < 3; i++) {
+        groups[i] = NULL;
+        if (!group_allocate(&groups[i], MDL)) {
+            atf_tc_fail("can't allocate group");
+        }
+        if (i > 0) {
+            group_reference(&groups[i]->next, groups[i - 1], MDL);
+        }
+        cfile = NULL;
+        lose = 0;
+        if (new_parse(&cfile, -1, (char *)statements[i],
+                      strlen(statements[i]), "test", 0) != ISC_R_SUCCESS ||
+            !parse_executable_statements(&groups[i]->statements, cfile,
+                                         &lose, context_any)) {
+            atf_tc_fail("can't parse %s", statements[i]);
+        }
+        end_parse(&cfile);
+    }
+
+    memset(&scope_template_stats, 0, sizeof(scope_template_stats));
+
+    /* The first pass builds the templates, the second replays them. */
+    for (pass = 0; pass < 2; pass++) {
+        plain = cached = NULL;
+        if (!option_state_allocate(&plain, MDL) ||
+            !option_state_allocate(&cached, MDL)) {
+            atf_tc_fail("can't allocate option states");
+        }
+        execute_statements_in_scope(NULL, NULL, NULL, NULL, NULL, plain,
+                                    NULL, groups[1], NULL, NULL);
+        execute_statements_in_scope_cached(NULL, NULL, NULL, NULL, NULL,
+                                           cached, NULL, groups[1], NULL,
+                                           NULL);
+
+        for (i = 0; i < sizeof(codes) / sizeof(codes[0]); i++) {
+            a = lookup_option(&dhcp_universe, plain, codes[i]);
+            b = lookup_option(&dhcp_universe, cached, codes[i]);
+            if (a == NULL || b == NULL) {
+                atf_tc_fail("pass %d: option %u missing", pass, codes[i]);
+            }
+            memset(&da, 0, sizeof(da));
+            memset(&db, 0, sizeof(db));
+            if (!evaluate_option_cache(&da, NULL, NULL, NULL, NULL, plain,
+                                       NULL, a, MDL) ||
+                !evaluate_option_cache(&db, NULL, NULL, NULL, NULL, cached,
+                                       NULL, b, MDL) ||
+                da.len != db.len || memcmp(da.data, db.data, da.len) != 0) {
+                atf_tc_fail("pass %d: option %u differs", pass, codes[i]);
+            }
+            data_string_forget(&da, MDL);
+            data_string_forget(&db, MDL);
+        }
+        option_state_dereference(&plain, MDL);
+        option_state_dereference(&cached, MDL);
+    }
+    ATF_CHECK_EQ(scope_template_stats.misses, 1);
+    ATF_CHECK_EQ(scope_template_stats.hits, 1);
+
+    /* A chain with an if statement is executed the usual way. */
+    cached = NULL;
+    if (!option_state_allocate(&cached, MDL)) {
+        atf_tc_fail("can't allocate option state");
+    }
+    execute_statements_in_scope_cached(NULL, NULL, NULL, NULL, NULL, cached,
+                                       NULL, groups[2], groups[0], NULL);
+    ATF_CHECK_EQ(scope_template_stats.fallbacks, 1);
+    ATF_CHECK(lookup_option(&dhcp_universe, cached,
+                            DHO_DOMAIN_NAME_SERVERS) != NULL);
+    ATF_CHECK(lookup_option(&dhcp_universe, cached, DHO_ROUTERS) == NULL);
+    option_state_dereference(&cached, MDL);
+
+    discard_scope_templates();
+    for (i = 0; i < 3; i++) {
+        group_dereference(&groups[i], MDL);
+    }
+}
+
+ATF_TC(spawned_class_limit);
+
+ATF_TC_HEAD(spawned_class_limit, tc)
+{
+    atf_tc_set_md_var(tc, "descr", "Tests reclaiming spawned subclasses.");
+}
+
+/* Run a packet with the given host name through a collection. */
+static void
+spawn_host_name(struct collection *collection, const char *name)
+{
+    unsigned char buffer[64];
+    struct dhcp_packet raw;
+    struct packet packet;
+    int i, len;
+
+    len = strlen(name);
+    buffer[0] = DHO_HOST_NAME;
+    buffer[1] = len;
+    memcpy(&buffer[2], name, len);
+    buffer[len + 2] = DHO_END;
+
+    memset(&raw, 0, sizeof(raw));
+    raw.op = BOOTREQUEST;
+    raw.htype = HTYPE_ETHER;
+    raw.hlen = 6;
+
+    memset(&packet, 0, sizeof(packet));
+    packet.raw = &raw;
+    packet.packet_length = DHCP_FIXED_NON_UDP;
+    if (!option_state_allocate(&packet.options, MDL) ||
+        !parse_option_buffer(packet.options, buffer, len + 3,
+                             &dhcp_universe)) {
+        atf_tc_fail("can't set up options");
+    }
+    /* A spawned subclass isn't counted as a match, but the packet is
+       still put in it. */
+    check_collection(&packet, NULL, collection);
+    if (packet.class_count != 1) {
+        atf_tc_fail("%s wasn't classified", name);
+    }
+    for (i = 0; i < packet.class_count; i++) {
+        class_dereference(&packet.classes[i], MDL);
+    }
+    option_state_dereference(&packet.options, MDL);
+}
+
+ATF_TC_BODY(spawned_class_limit, tc)
+{
+    static const char *submatch = "option host-name";
+    static const char *subclass = "\"spawner\" \"e\";";
+    struct collection collection;
+    struct class *class, *sub;
+    struct parse *cfile;
+    int lose, i;
+
+    initialize_common_option_spaces();
+    dhcp_db_objects_setup();
+
+    class = NULL;
+    if (class_allocate(&class, MDL) != ISC_R_SUCCESS ||
+        !group_allocate(&class->group, MDL)) {
+        atf_tc_fail("can't allocate class");
+    }
+    cfile = NULL;
+    lose = 0;
+    if (new_parse(&cfile, -1, (char *)submatch, strlen(submatch),
+                  "test", 0) != ISC_R_SUCCESS ||
+        !parse_data_expression(&class->submatch, cfile, &lose)) {
+        atf_tc_fail("can't parse %s", submatch);
+    }
+    end_parse(&cfile);
+    class->spawning = 1;
+
+    memset(&collection, 0, sizeof(collection));
+    collection.name = "test";
+    class_reference(&collection.classes, class, MDL);
+
+    memset(&spawned_class_stats, 0, sizeof(spawned_class_stats));
+    spawned_class_limit = 2;
+
+    /* The third subclass pushes out the first. */
+    spawn_host_name(&collection, "a");
+    spawn_host_name(&collection, "b");
+    spawn_host_name(&collection, "c");
+    ATF_CHECK_EQ(spawned_class_stats.count, 2);
+    ATF_CHECK_EQ(spawned_class_stats.spawned, 3);
+    ATF_CHECK_EQ(spawned_class_stats.reclaimed, 1);
+    sub = NULL;
+    ATF_CHECK(!class_hash_lookup(&sub, class->hash, "a", 1, MDL));
+
+    /* A subclass with leases billed to it is passed over. */
+    if (!class_hash_lookup(&sub, class->hash, "b", 1, MDL)) {
+        atf_tc_fail("subclass b is missing");
+    }
+    sub->leases_consumed = 1;
+    spawn_host_name(&collection, "d");
+    ATF_CHECK_EQ(spawned_class_stats.count, 2);
+    ATF_CHECK_EQ(spawned_class_stats.reclaimed, 2);
+    sub->leases_consumed = 0;
+    class_dereference(&sub, MDL);
+    ATF_CHECK(class_hash_lookup(&sub, class->hash, "b", 1, MDL));
+    if (sub != NULL) {
+        class_dereference(&sub, MDL);
+    }
+    ATF_CHECK(!class_hash_lookup(&sub, class->hash, "c", 1, MDL));
+
+    /* Matching an existing subclass is a hit. */
+    spawn_host_name(&collection, "d");
+    ATF_CHECK_EQ(spawned_class_stats.lookups, 5);
+    ATF_CHECK_EQ(spawned_class_stats.hits, 1);
+    ATF_CHECK(spawned_class_stats.bytes > 0);
+
+    /* A subclass read back from the lease file counts as spawned, once,
+       and gets its billing table only when a lease is billed to it. */
+    class->name = dmalloc(strlen("spawner") + 1, MDL);
+    strcpy(class->name, "spawner");
+    class->lease_limit = 4;
+    collection.next = collections;
+    collections = &collection;
+    for (i = 0; i < 2; i++) {
+        cfile = NULL;
+        if (new_parse(&cfile, -1, (char *)subclass, strlen(subclass),
+                      "test", 0) != ISC_R_SUCCESS ||
+            !parse_class_declaration(&sub, cfile, NULL,
+                                     CLASS_TYPE_SUBCLASS)) {
+            atf_tc_fail("can't parse %s", subclass);
+        }
+        end_parse(&cfile);
+        ATF_CHECK(sub->flags & CLASS_DECL_SPAWNED);
+        ATF_CHECK(sub->billed_leases == NULL);
+        class_dereference(&sub, MDL);
+    }
+    collections = collection.next;
+    ATF_CHECK_EQ(spawned_class_stats.count, 3);
+    ATF_CHECK_EQ(spawned_class_stats.spawned, 4);
+
+    /* The subclasses refer to the class, so drop them by hand. */
+    class_hash_delete(class->hash, "b", 1, MDL);
+    class_hash_delete(class->hash, "d", 1, MDL);
+    class_hash_delete(class->hash, "e", 1, MDL);
+    ATF_CHECK_EQ(spawned_class_stats.count, 0);
+    ATF_CHECK_EQ(spawned_class_stats.bytes, 0);
+
+    spawned_class_limit = 0;
+    class_dereference(&collection.classes, MDL);
+    class_dereference(&class, MDL);
+}
+
+ATF_TC(statement_optimize);
+
+ATF_TC_HEAD(statement_optimize, tc)
+{
+    atf_tc_set_md_var(tc, "descr", "Tests folding of constant conditions.");
+}
+
+ATF_TC_BODY(statement_optimize, tc)
+{
+    static const char *text =
+        "if \"a\" = \"a\" and exists host-name {"
+        "  option domain-name \"true\";"
+        "} else {"
+        "  option domain-name \"false\";"
+        "}"
+        "if 1 = 2 { option routers 10.0.0.1; }"
+        "switch (substring (\"abc\", 0, 2)) {"
+        "  case \"xy\": option time-offset 1; break;"
+        "  case \"ab\": option time-offset 2; break;"
+        "  default: option time-offset 3;"
+        "}"
+        "switch (option host-name) {"
+        "  case \"a\": option domain-name-servers 1.1.1.1; break;"
+        "  case concat (\"b\", \"c\"):"
+        "    option domain-name-servers 2.2.2.2; break;"
+        "    option log-servers 3.3.3.3;"
+        "  default: option domain-name-servers 4.4.4.4;"
+        "}";
+    unsigned char buffer[] = { DHO_HOST_NAME, 2, 'b', 'c', DHO_END };
+    struct executable_statement *statements, *s;
+    struct option_state *out;
+    struct option_cache *oc;
+    struct dhcp_packet raw;
+    struct packet packet;
+    struct data_string ds;
+    struct parse *cfile;
+    int lose;
+
+    initialize_common_option_spaces();
+
+    statements = NULL;
+    cfile = NULL;
+    lose = 0;
+    if (new_parse(&cfile, -1, (char *)text, strlen(text), "test", 0)
+        != ISC_R_SUCCESS ||
+        !parse_executable_statements(&statements, cfile, &lose,
+                                     context_any)) {
+        atf_tc_fail("can't parse statements");
+    }
+    end_parse(&cfile);
+
+    executable_statement_optimize(&statements);
+
+    /* The constant half of the first condition is gone. */
+    s = statements;
+    ATF_REQUIRE(s != NULL && s->op == if_statement);
+    ATF_CHECK_EQ(s->data.ie.expr->op, expr_exists);
+
+    /* The second if is gone, and the first switch is replaced by the
+       statements of the case it always selects. */
+    s = s->next;
+    ATF_REQUIRE(s != NULL && s->op == statements_statement);
+    ATF_CHECK_EQ(s->data.statements->op, supersede_option_statement);
+
+    /* The last switch has an index, and nothing after a break. */
+    s = s->next;
+    ATF_REQUIRE(s != NULL && s->op == switch_statement);
+    ATF_CHECK(s->data.s_switch.index != NULL);
+    ATF_CHECK(s->next == NULL);
+    for (s = s->data.s_switch.statements; s != NULL; s = s->next) {
+        if (s->op == case_statement) {
+            ATF_CHECK_EQ(s->data.c_case->op, expr_const_data);
+        }
+        ATF_CHECK(s->op != supersede_option_statement ||
+                  s->data.option->option->code != DHO_LOG_SERVERS);
+    }
+
+    /* And they still do what they did. */
+    memset(&raw, 0, sizeof(raw));
+    memset(&packet, 0, sizeof(packet));
+    packet.raw = &raw;
+    out = NULL;
+    if (!option_state_allocate(&packet.options, MDL) ||
+        !parse_option_buffer(packet.options, buffer, sizeof(buffer),
+                             &dhcp_universe) ||
+        !option_state_allocate(&out, MDL)) {
+        atf_tc_fail("can't set up options");
+    }
+    execute_statements(NULL, &packet, NULL, NULL, packet.options, out,
+                       NULL, statements, NULL);
+
+    memset(&ds, 0, sizeof(ds));
+    oc = lookup_option(&dhcp_universe, out, DHO_DOMAIN_NAME);
+    ATF_REQUIRE(oc != NULL &&
+                evaluate_option_cache(&ds, NULL, NULL, NULL, NULL, out,
+                                      NULL, oc, MDL));
+    ATF_CHECK(ds.len == 4 && memcmp(ds.data, "true", 4) == 0);
+    data_string_forget(&ds, MDL);
+
+    ATF_CHECK(lookup_option(&dhcp_universe, out, DHO_ROUTERS) == NULL);
+    ATF_CHECK(lookup_option(&dhcp_universe, out, DHO_LOG_SERVERS) == NULL);
+
+    oc = lookup_option(&dhcp_universe, out, DHO_TIME_OFFSET);
+    ATF_REQUIRE(oc != NULL &&
+                evaluate_option_cache(&ds, NULL, NULL, NULL, NULL, out,
+                                      NULL, oc, MDL));
+    ATF_CHECK(ds.len == 4 && getULong(ds.data) == 2);
+    data_string_forget(&ds, MDL);
+
+    oc = lookup_option(&dhcp_universe, out, DHO_DOMAIN_NAME_SERVERS);
+    ATF_REQUIRE(oc != NULL &&
+                evaluate_option_cache(&ds, NULL, NULL, NULL, NULL, out,
+                                      NULL, oc, MDL));
+    ATF_CHECK(ds.len == 4 && ds.data[0] == 2);
+    data_string_forget(&ds, MDL);
+
+    option_state_dereference(&out, MDL);
+    option_state_dereference(&packet.options, MDL);
+    executable_statement_dereference(&statements, MDL);
+}
+
+ATF_TC(binding_names);
+
+ATF_TC_HEAD(binding_names, tc)
+{
+    atf_tc_set_md_var(tc, "descr", "Tests interned variable names.");
+}
+
+ATF_TC_BODY(binding_names, tc)
+{
+    static const char *text =
+        "set Foo = \"x\";"
+        "if defined (FOO) { set bar = concat (foo, \"y\"); }"
+        "unset fOO;";
+    struct executable_statement *statements;
+    struct binding_scope *scope;
+    struct binding *binding;
+    struct data_string ds;
+    struct parse *cfile;
+    int lose;
+
+    /* Every spelling of a name is the same name. */
+    ATF_CHECK(binding_name("foo") == binding_name("FOO"));
+    ATF_CHECK(binding_name("foo") != binding_name("bar"));
+
+    statements = NULL;
+    cfile = NULL;
+    lose = 0;
+    if (new_parse(&cfile, -1, (char *)text, strlen(text), "test", 0)
+        != ISC_R_SUCCESS ||
+        !parse_executable_statements(&statements, cfile, &lose,
+                                     context_any)) {
+        atf_tc_fail("can't parse statements");
+    }
+    end_parse(&cfile);
+    ATF_CHECK(statements->data.set.name == binding_name("foo"));
+
+    scope = NULL;
+    if (!binding_scope_allocate(&scope, MDL)) {
+        atf_tc_fail("can't allocate scope");
+    }
+    execute_statements(NULL, NULL, NULL, NULL, NULL, NULL, &scope,
+                       statements, NULL);
+
+    binding = find_binding(scope, "foo");
+    ATF_REQUIRE(binding != NULL);
+    ATF_CHECK(binding->name == binding_name("Foo"));
+    ATF_CHECK(binding->value == NULL);
+
+    memset(&ds, 0, sizeof(ds));
+    ATF_REQUIRE(find_bound_string(&ds, scope, "BAR"));
+    ATF_CHECK(ds.len == 2 && memcmp(ds.data, "xy", 2) == 0);
+    data_string_forget(&ds, MDL);
+
+    ATF_CHECK(find_binding(scope, "never-mentioned") == NULL);
+
+    binding_scope_dereference(&scope, MDL);
+    executable_statement_dereference(&statements, MDL);
+}
+
+ATF_TC(rate_limit);
+
+ATF_TC_HEAD(rate_limit, tc)
+{
+    atf_tc_set_md_var(tc, "descr", "Tests the rate limit token buckets.");
+}
+
+/* Count how many of tries packets from a client get through. */
+static int
+rate_limit_passes(const char *key, int tries)
+{
+    int passed = 0;
+
+    while (tries-- > 0) {
+        if (rate_limit_permit(RATE_LIMIT_CLIENT,
+                              (const unsigned char *)key, strlen(key))) {
+            passed++;
+        }
+    }
+    return (passed);
+}
+
+ATF_TC_BODY(rate_limit, tc)
+{
+    struct dhcp_packet raw;
+    struct packet packet;
+    unsigned char key[5];
+    u_int32_t i;
+
+    memset(&rate_limit_stats, 0, sizeof(rate_limit_stats));
+    cur_tv.tv_sec = 1000;
+    cur_tv.tv_usec = 0;
+    client_rate_limit = 2;
+    client_rate_burst = 4;
+
+    /* A new client starts with a full bucket. */
+    ATF_CHECK_EQ(rate_limit_passes("a", 10), 4);
+
+    /* Half a second at two a second refills one token. */
+    cur_tv.tv_usec = 500000;
+    ATF_CHECK_EQ(rate_limit_passes("a", 10), 1);
+
+    /* However long it waits, the bucket holds no more than the burst. */
+    cur_tv.tv_sec += 3600;
+    ATF_CHECK_EQ(rate_limit_passes("a", 10), 4);
+    ATF_CHECK_EQ(rate_limit_stats.passed, 9);
+    ATF_CHECK_EQ(rate_limit_stats.client_dropped, 21);
+
+    /* Relays are counted apart from clients. */
+    relay_rate_limit = 1;
+    relay_rate_burst = 1;
+    ATF_CHECK(rate_limit_permit(RATE_LIMIT_RELAY,
+                                (const unsigned char *)"a", 1));
+    ATF_CHECK(!rate_limit_permit(RATE_LIMIT_RELAY,
+                                 (const unsigned char *)"a", 1));
+    ATF_CHECK_EQ(rate_limit_stats.relay_dropped, 1);
+    relay_rate_limit = 0;
+    relay_rate_burst = 0;
+
+    /* A burst of more than 2^32 thousandths of a packet. */
+    client_rate_limit = 1;
+    client_rate_burst = 5000000;
+    ATF_CHECK_EQ(rate_limit_passes("b", 5000001), 5000000);
+
+    /* Once a client has been pushed out of its set by newer ones, it
+       comes back with a full bucket. */
+    client_rate_burst = 1;
+    ATF_CHECK_EQ(rate_limit_passes("c", 2), 1);
+    cur_tv.tv_usec += 1000;
+    rate_limit_stats.recycled = 0;
+    key[0] = 'x';
+    for (i = 0; i < 8 * RATE_LIMIT_TABLE_SIZE; i++) {
+        memcpy(&key[1], &i, sizeof(i));
+        if (!rate_limit_permit(RATE_LIMIT_CLIENT, key, sizeof(key))) {
+            atf_tc_fail("new client %u was dropped", i);
+        }
+    }
+    ATF_CHECK(rate_limit_stats.recycled >= 7 * RATE_LIMIT_TABLE_SIZE);
+    cur_tv.tv_usec += 1000;
+    ATF_CHECK_EQ(rate_limit_passes("c", 2), 1);
+
+    /* BOOTP requests are held to the same limit as DHCP ones. */
+    initialize_common_option_spaces();
+    memset(&raw, 0, sizeof(raw));
+    raw.op = BOOTREQUEST;
+    raw.htype = HTYPE_ETHER;
+    raw.hlen = 6;
+    raw.chaddr[0] = 2;
+    raw.giaddr.s_addr = htonl(0x0a090909);
+    memset(&packet, 0, sizeof(packet));
+    packet.raw = &raw;
+    packet.packet_length = DHCP_FIXED_NON_UDP;
+    if (!option_state_allocate(&packet.options, MDL)) {
+        atf_tc_fail("can't allocate options");
+    }
+    cur_tv.tv_sec += 3600;
+    memset(&rate_limit_stats, 0, sizeof(rate_limit_stats));
+    for (i = 0; i < 3; i++) {
+        bootp(&packet);
+    }
+    ATF_CHECK_EQ(rate_limit_stats.passed, 1);
+    ATF_CHECK_EQ(rate_limit_stats.client_dropped, 2);
+    option_state_dereference(&packet.options, MDL);
+
+    client_rate_limit = 0;
+    client_rate_burst = 0;
+}
+
+#ifdef DHCPv6
+ATF_TC(failover_v6_rejected);
+
+ATF_TC_HEAD(failover_v6_rejected, tc)
+{
+    atf_tc_set_md_var(tc, "descr", "Tests that failover peers are refused "
+                      "in DHCPv6 mode.");
+}
+
+ATF_TC_BODY(failover_v6_rejected, tc)
+{
+    static const char *text =
+        "failover peer \"foo\" {"
+        "  primary;"
+        "  address 10.0.0.1;"
+        "  peer address 10.0.0.2;"
+        "}"
+        "option dhcp6.preference 7;";
+    struct option_cache *oc;
+    struct parse *cfile;
+    isc_result_t status;
+
+    initialize_common_option_spaces();
+    initialize_server_option_spaces();
+    local_family = AF_INET6;
+
+    ATF_REQUIRE(group_allocate(&root_group, MDL));
+    cfile = NULL;
+    if (new_parse(&cfile, -1, (char *)text, strlen(text), "test", 0)
+        != ISC_R_SUCCESS) {
+        atf_tc_fail("can't start parse");
+    }
+    status = conf_file_subparse(cfile, root_group, ROOT_GROUP);
+    end_parse(&cfile);
+    ATF_CHECK_EQ(status, DHCP_R_BADPARSE);
+
+#if defined (FAILOVER_PROTOCOL)
+    ATF_CHECK(failover_states == NULL);
+#endif
+
+    /* The statement after the failover peer is still parsed. */
+    ATF_REQUIRE(root_group->statements != NULL);
+    ATF_REQUIRE_EQ(root_group->statements->op, supersede_option_statement);
+    oc = root_group->statements->data.option;
+    ATF_CHECK_EQ(oc->option->universe, &dhcpv6_universe);
+    ATF_CHECK_EQ(oc->option->code, D6O_PREFERENCE);
+
+    local_family = AF_INET;
+    group_dereference(&root_group, MDL);
+}
+
+ATF_TC(reply_ia_layout);
+
+ATF_TC_HEAD(reply_ia_layout, tc)
+{
+    atf_tc_set_md_var(tc, "descr", "Tests that IAADDR and IAPREFIX options "
+                      "written into the reply are laid out as "
+                      "store_options6() lays them out.");
+}
+
+/* Lay out an IA the way the server did before its addresses and prefixes
+ * were written straight into the reply: each one is appended to the IA's
+ * option state and store_options6() writes them after the header.
+ */
+static unsigned
+reply_ia_store_options6(unsigned char *buf, u_int16_t ia_type,
+                        struct iaddrcidrnet *res, int count,
+                        u_int32_t prefer, u_int32_t valid,
+                        struct option_state *ia_opts)
+{
+    static const int required_opts_IA[] = {
+        D6O_IAADDR, D6O_STATUS_CODE, 0
+    };
+    static const int required_opts_IA_PD[] = {
+        D6O_IAPREFIX, D6O_STATUS_CODE, 0
+    };
+    struct option_state *opts = NULL;
+    struct option_cache *oc;
+    struct buffer *bp;
+    unsigned hdr, len, i;
+    int n;
+
+    ATF_REQUIRE(option_state_allocate(&opts, MDL));
+    for (n = 0; n < count; n++) {
+        bp = NULL;
+        if (ia_type == D6O_IA_PD) {
+            ATF_REQUIRE(buffer_allocate(&bp, IAPREFIX_OFFSET, MDL));
+            putULong(bp->data, prefer);
+            putULong(bp->data + 4, valid);
+            bp->data[8] = res[n].bits;
+            memcpy(bp->data + 9, res[n].lo_addr.iabuf, 16);
+            ATF_REQUIRE(append_option_buffer(&dhcpv6_universe, opts, bp,
+                                             bp->data, IAPREFIX_OFFSET,
+                                             D6O_IAPREFIX, 0));
+        } else {
+            ATF_REQUIRE(buffer_allocate(&bp, IAADDR_OFFSET, MDL));
+            memcpy(bp->data, res[n].lo_addr.iabuf, 16);
+            putULong(bp->data + 16, prefer);
+            putULong(bp->data + 20, valid);
+            ATF_REQUIRE(append_option_buffer(&dhcpv6_universe, opts, bp,
+                                             bp->data, IAADDR_OFFSET,
+                                             D6O_IAADDR, 0));
+        }
+        buffer_dereference(&bp, MDL);
+    }
+    for (i = 1; i < 256; i++) {
+        oc = lookup_option(&dhcpv6_universe, ia_opts, i);
+        if (oc != NULL) {
+            save_option(&dhcpv6_universe, opts, oc);
+        }
+    }
+
+    hdr = (ia_type == D6O_IA_TA) ? 8 : 16;
+    memset(buf, 0, hdr);
+    putUShort(buf, ia_type);
+    putULong(buf + 4, 1);
+    len = store_options6((char *)buf + hdr, 65536 - hdr, opts, NULL,
+                         ia_type == D6O_IA_PD ?
+                         required_opts_IA_PD : required_opts_IA, NULL);
+    putUShort(buf + 2, hdr - 4 + len);
+
+    option_state_dereference(&opts, MDL);
+    return (hdr + len);
+}
+
+ATF_TC_BODY(reply_ia_layout, tc)
+{
+    static const u_int16_t ia_types[] = { D6O_IA_NA, D6O_IA_TA, D6O_IA_PD };
+    static unsigned char want[65536], got[65536];
+    struct iaddrcidrnet res[3];
+    struct option_state *ia_opts = NULL;
+    struct buffer *bp = NULL;
+    unsigned want_len, got_len;
+    int t, n, i;
+
+    initialize_common_option_spaces();
+
+    memset(res, 0, sizeof(res));
+    for (i = 0; i < 3; i++) {
+        res[i].lo_addr.len = 16;
+        res[i].lo_addr.iabuf[0] = 0x20;
+        res[i].lo_addr.iabuf[1] = 0x01;
+        res[i].lo_addr.iabuf[7] = i + 1;
+        res[i].bits = 56 + 8 * i;
+    }
+
+    /* A status code to follow the addresses. */
+    ATF_REQUIRE(option_state_allocate(&ia_opts, MDL));
+    ATF_REQUIRE(buffer_allocate(&bp, 4, MDL));
+    putUShort(bp->data, STATUS_Success);
+    memcpy(bp->data + 2, "ok", 2);
+    ATF_REQUIRE(save_option_buffer(&dhcpv6_universe, ia_opts, bp, bp->data,
+                                   4, D6O_STATUS_CODE, 0));
+    buffer_dereference(&bp, MDL);
+
+    for (t = 0; t < 3; t++) {
+        for (n = 0; n <= 3; n++) {
+            want_len = reply_ia_store_options6(want, ia_types[t], res, n,
+                                               3600, 7200, ia_opts);
+            ATF_REQUIRE_EQ(reply_ia_unittest(got, &got_len, ia_types[t],
+                                             res, n, 3600, 7200, ia_opts,
+                                             1024), ISC_R_SUCCESS);
+            if (got_len != want_len || memcmp(got, want, want_len) != 0) {
+                atf_tc_fail("IA type %u with %d resources differs",
+                            ia_types[t], n);
+            }
+        }
+    }
+
+    /* Running out of room for an address or prefix is a failure. */
+    ATF_CHECK_EQ(reply_ia_unittest(got, &got_len, D6O_IA_NA, res, 3,
+                                   3600, 7200, ia_opts, 16 + 2 * 28 + 10),
+                 ISC_R_FAILURE);
+    ATF_CHECK_EQ(reply_ia_unittest(got, &got_len, D6O_IA_PD, res, 3,
+                                   3600, 7200, ia_opts, 16 + 29 + 10),
+                 ISC_R_FAILURE);
+
+    option_state_dereference(&ia_opts, MDL);
+}
+#endif
+
 /* This macro defines main() method that will call specified
    test cases. tp and simple_test_case names can be whatever you want
    as long as it is a valid variable identifier. */
 ATF_TP_ADD_TCS(tp)
 {
     ATF_TP_ADD_TC(tp, simple_test_case);
+    ATF_TP_ADD_TC(tp, class_index);
+    ATF_TP_ADD_TC(tp, class_index_side_effect);
+    ATF_TP_ADD_TC(tp, scope_template);
+    ATF_TP_ADD_TC(tp, spawned_class_limit);
+    ATF_TP_ADD_TC(tp, statement_optimize);
+    ATF_TP_ADD_TC(tp, binding_names);
+    ATF_TP_ADD_TC(tp, rate_limit);
 #ifdef DHCPv6
     ATF_TP_ADD_TC(tp, parse_byte_order);
+    ATF_TP_ADD_TC(tp, failover_v6_rejected);
+    ATF_TP_ADD_TC(tp, reply_ia_layout);
 #endif
     return (atf_no_error());
 }